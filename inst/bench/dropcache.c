@@ -0,0 +1,44 @@
+/* Copyright 2013 UT MD Anderson Cancer Center.
+ *
+ * Author : Bradley Broom
+ */
+
+/* Evict the given files from the operating system's page cache, so that the next read of
+ * each file comes from disk.  Used by the benchmarks to measure cold-cache reads without
+ * needing the privileges required to drop the entire cache.
+ *
+ * Usage: dropcache file...
+ *
+ * Only clean pages can be evicted, so each file is flushed first.  Exits with status 1 if
+ * any file could not be opened or eviction is not supported on this platform.
+ */
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+int
+main (int argc, char *argv[])
+{
+    int ii, fd, status = 0;
+
+    for (ii = 1; ii < argc; ii++) {
+	if ((fd = open (argv[ii], O_RDONLY)) < 0) {
+	    perror (argv[ii]);
+	    status = 1;
+	    continue;
+	}
+#ifdef POSIX_FADV_DONTNEED
+	fdatasync (fd);
+	if (posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED) != 0) {
+	    fprintf (stderr, "dropcache: %s: unable to evict from page cache\n", argv[ii]);
+	    status = 1;
+	}
+#else
+	fprintf (stderr, "dropcache: %s: page cache eviction is not supported\n", argv[ii]);
+	status = 1;
+#endif
+	close (fd);
+    }
+    return status;
+}
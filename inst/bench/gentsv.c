@@ -0,0 +1,172 @@
+/* Copyright 2013 UT MD Anderson Cancer Center.
+ *
+ * Author : Bradley Broom
+ */
+
+/* Generate a synthetic TSV data file for benchmarking tsvio.
+ *
+ * The file has an R-style header line of column labels, followed by one line per row
+ * consisting of a row key and one field per column.  The contents are determined entirely
+ * by the options (including the seed), so that benchmark results are reproducible.
+ *
+ * Usage: gentsv [options] file	(file "-" writes to standard output)
+ *   -r rows	Number of data rows (default 10000).
+ *   -c cols	Number of data columns (default 100).
+ *   -k len	Length of each row key (default 12).  Keys are unique and ascending.
+ *   -o first	Number of the first row (default 0).  Files with disjoint ranges have disjoint keys.
+ *   -f format	Format of numeric fields: fixed, sci, int, or mixed (default fixed).
+ *   -d digits	Digits after the decimal point of fixed and sci fields (default 4).
+ *   -n frac	Fraction of fields that are NA (default 0).
+ *   -s seed	Seed of the random number generator (default 1).
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define FMT_FIXED	0
+#define FMT_SCI		1
+#define FMT_INT		2
+#define FMT_MIXED	3
+
+static const char *formatNames[] = { "fixed", "sci", "int", "mixed", NULL };
+
+/* State of a splitmix64 generator: small, fast, and identical on every platform. */
+static uint64_t rngState;
+
+static uint64_t
+next_random (void)
+{
+    uint64_t z;
+
+    z = (rngState += UINT64_C(0x9E3779B97F4A7C15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+    return z ^ (z >> 31);
+}
+
+/* Returns a random double uniformly distributed in [0,1). */
+static double
+next_uniform (void)
+{
+    return (next_random () >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Returns the number of decimal digits in n. */
+static int
+num_digits (long n)
+{
+    int digits = 1;
+
+    while (n >= 10) {
+	n /= 10;
+	digits++;
+    }
+    return digits;
+}
+
+/* Write the key of row ii, keylen characters long (longer if needed to keep keys unique).
+ * Keys are a letter followed by the zero-padded row number, so they sort in row order.
+ */
+static void
+write_key (FILE *op, long ii, int keylen, int mindigits)
+{
+    int digits, jj;
+
+    digits = keylen - 1;
+    if (digits < mindigits) digits = mindigits;
+    for (jj = 0; jj < keylen - digits; jj++)
+	putc ("ROWKEY"[jj % 6], op);
+    fprintf (op, "%0*ld", digits, ii);
+}
+
+static void
+write_field (FILE *op, int format, int decimals, double nafrac)
+{
+    double value;
+
+    if (nafrac > 0.0 && next_uniform () < nafrac) {
+	fputs ("NA", op);
+	return;
+    }
+    if (format == FMT_MIXED)
+	format = (int)(next_random () % 3);
+    value = next_uniform () * 2000.0 - 1000.0;
+    switch (format) {
+    case FMT_INT:
+	fprintf (op, "%ld", (long)(value * 100.0));
+	break;
+    case FMT_SCI:
+	fprintf (op, "%.*e", decimals, value * 1e-3);
+	break;
+    default:
+	fprintf (op, "%.*f", decimals, value);
+	break;
+    }
+}
+
+static void
+usage (void)
+{
+    fprintf (stderr, "usage: gentsv [-r rows] [-c cols] [-k keylen] [-o first] [-f fixed|sci|int|mixed] [-d digits] [-n nafrac] [-s seed] file\n");
+    exit (2);
+}
+
+int
+main (int argc, char *argv[])
+{
+    long rows = 10000L, cols = 100L, first = 0L, ii, jj;
+    int keylen = 12, format = FMT_FIXED, decimals = 4, ch, mindigits;
+    double nafrac = 0.0;
+    FILE *op;
+
+    rngState = 1;
+    while ((ch = getopt (argc, argv, "r:c:k:o:f:d:n:s:")) != -1) {
+	switch (ch) {
+	case 'r': rows = atol (optarg); break;
+	case 'c': cols = atol (optarg); break;
+	case 'k': keylen = atoi (optarg); break;
+	case 'o': first = atol (optarg); break;
+	case 'd': decimals = atoi (optarg); break;
+	case 'n': nafrac = atof (optarg); break;
+	case 's': rngState = strtoull (optarg, NULL, 10); break;
+	case 'f':
+	    for (format = 0; formatNames[format] != NULL; format++)
+		if (strcmp (optarg, formatNames[format]) == 0) break;
+	    if (formatNames[format] == NULL) usage ();
+	    break;
+	default:
+	    usage ();
+	}
+    }
+    if (optind != argc - 1 || rows < 0 || first < 0 || cols < 1 || keylen < 1 || decimals < 0 || nafrac < 0.0 || nafrac > 1.0)
+	usage ();
+
+    if (strcmp (argv[optind], "-") == 0) {
+	op = stdout;
+    } else if ((op = fopen (argv[optind], "w")) == NULL) {
+	perror (argv[optind]);
+	return 1;
+    }
+
+    for (jj = 0; jj < cols; jj++)
+	fprintf (op, "%sC%0*ld", jj == 0 ? "" : "\t", num_digits (cols - 1), jj);
+    putc ('\n', op);
+
+    mindigits = num_digits (first + rows);
+    for (ii = first; ii < first + rows; ii++) {
+	write_key (op, ii, keylen, mindigits);
+	for (jj = 0; jj < cols; jj++) {
+	    putc ('\t', op);
+	    write_field (op, format, decimals, nafrac);
+	}
+	putc ('\n', op);
+    }
+
+    if (fflush (op) != 0 || ferror (op) || (op != stdout && fclose (op) != 0)) {
+	perror (argv[optind]);
+	return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,597 @@
+/* Copyright 2013 UT MD Anderson Cancer Center.
+ *
+ * Author : Bradley Broom
+ */
+
+/* Microbenchmarks of the stages of the tsvio read path.
+ *
+ * Each stage is run repeatedly on a data file (usually one created by gentsv) and the
+ * elapsed times are written as JSON, so that results can be compared between versions.
+ * The stages measured are:
+ *   generate_index	Creating text, binary, and checkpointed binary indexes.
+ *   scan_index_file	Loading each kind of index into a dynHashTab.
+ *   dht		Inserting the row keys into, and looking them up in, a dynHashTab.
+ *   get_tsv_fields	Extracting all rows, mapped and via stdio, for several column selections.
+ *   set_result_num	Converting the fields of the data file to doubles.
+ *   set_result_int	Converting the fields of an integer data file to ints.
+ *
+ * The package sources are compiled into this program (tsvlib.c is included below), so that its
+ * internal functions can be called directly.  R is embedded only so that the R API used by
+ * tsvlib.c, such as NA_REAL, is initialized: run the program via "R CMD microbench ...".
+ *
+ * Usage: microbench [options] datafile
+ *   -i file	Integer data file for set_result_int (e.g. gentsv -f int).  Skipped if absent.
+ *   -o file	Write results to file instead of standard output.
+ *   -n reps	Number of timed repetitions of each benchmark (default 5).
+ *   -c stride	Column stride of checkpointed indexes (default 64).
+ *   -t threads	Number of threads used to generate checkpointed indexes (default 1).
+ *   -g tag	Free-form tag recorded in the results (e.g. a git commit).
+ *   -b name	Run only the benchmarks of stage name (may be repeated).
+ */
+#include <time.h>
+#include <unistd.h>
+#include <Rembedded.h>
+
+#include "../../src/tsvlib.c"
+
+#define MAX_SETTER_FIELDS (4L*1024*1024)	/* Most fields converted by the setter benchmarks. */
+#define MAX_TIMED_REPS 1000
+
+/* The data file and everything derived from it that the benchmarks share. */
+typedef struct {
+    const char *dataName;	/* Name of the data file. */
+    FILE *tsvp;			/* The data file. */
+    mappedFile data;		/* Its contents. */
+    mappedFile unmapped;	/* Stand-in for data when reading via stdio. */
+    long ncols;			/* Number of data columns. */
+    long colstride;		/* Column stride of ckptIndexp. */
+    int threads;		/* Threads used to generate ckptIndexp. */
+    FILE *textIndexp;		/* Text index of the data file. */
+    FILE *binIndexp;		/* Binary index without checkpoints. */
+    FILE *ckptIndexp;		/* Binary index with checkpoints every colstride columns. */
+    binIndex *idx;		/* Opened ckptIndexp. */
+    long nrows;			/* Number of data rows. */
+    const char **keys;		/* Row keys (in idx). */
+    long *keylens;
+    char **missKeys;		/* Keys of no row. */
+    long *rowPosn;		/* Offset of each row, in file order. */
+    long *rowLen;		/* Length of each row excluding its newline, in file order. */
+    const uint32_t **rowCkpt;	/* Checkpoints of each row, in file order. */
+    long *rowNckpt;
+    char *buffer;		/* Line buffer for get_tsv_fields. */
+    const char **numField;	/* Fields of the data file, for set_result_num. */
+    long *numFieldLen;
+    long nnumField;
+    const char *intName;	/* Name of the integer data file, or NULL. */
+    mappedFile intData;
+    const char **intField;	/* Fields of the integer data file, for set_result_int. */
+    long *intFieldLen;
+    long nintField;
+} benchData;
+
+/* A benchmark runs one variant of a stage once.  It sets *elapsed to the time taken by the part
+ * being measured, and *items and *bytes to the amount of work done (0 if not meaningful).
+ * Returns 0 on success.
+ */
+typedef int (*benchFunction) (benchData *bd, int variant, double *elapsed, long *items, long *bytes);
+
+typedef struct {
+    const char *stage;
+    const char *variant;
+    benchFunction run;
+    int arg;
+} benchmark;
+
+static double
+now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+fail (const char *what, const char *name)
+{
+    fprintf (stderr, "microbench: %s: %s\n", name, what);
+    exit (1);
+}
+
+/* Returns a new temporary file containing an index of bd's data file in the given format. */
+static FILE *
+make_index (benchData *bd, int format, long colstride)
+{
+    FILE *op;
+    enum status res;
+
+    if ((op = tmpfile ()) == NULL)
+	fail ("unable to create temporary index file", bd->dataName);
+    generate_indexes (1, &bd->tsvp, &op, format, colstride, bd->threads, &res);
+    if (res != OK)
+	fail ("unable to index data file", bd->dataName);
+    return op;
+}
+
+static int
+compare_posn (const void *a, const void *b)
+{
+    long pa = **(const long * const *)a, pb = **(const long * const *)b;
+
+    return pa < pb ? -1 : pa > pb;
+}
+
+/* Record the start and length of up to MAX_SETTER_FIELDS data fields (not row keys) of data. */
+static long
+collect_fields (const mappedFile *data, const char ***fieldp, long **lenp)
+{
+    const char *p, *end, *f;
+    long n = 0;
+
+    *fieldp = (const char **)malloc (MAX_SETTER_FIELDS * sizeof(char *));
+    *lenp = (long *)malloc (MAX_SETTER_FIELDS * sizeof(long));
+    if (*fieldp == NULL || *lenp == NULL)
+	fail ("out of memory", "collect_fields");
+
+    p = data->addr;
+    end = data->addr + data->size;
+    p = memchr (p, '\n', end - p);	/* Skip header. */
+    while (p != NULL && ++p < end && n < MAX_SETTER_FIELDS) {
+	while (p < end && *p != '\t' && *p != '\n') p++;	/* Skip key. */
+	while (p < end && *p == '\t' && n < MAX_SETTER_FIELDS) {
+	    f = ++p;
+	    while (p < end && *p != '\t' && *p != '\n') p++;
+	    (*fieldp)[n] = f;
+	    (*lenp)[n++] = p - f;
+	}
+	p = memchr (p, '\n', end - p);
+    }
+    return n;
+}
+
+static void
+load_bench_data (benchData *bd)
+{
+    const char *eol, *p;
+    long ii, pos, *offset, **order;
+
+    if ((bd->tsvp = fopen (bd->dataName, "rb")) == NULL)
+	fail ("unable to open data file", bd->dataName);
+    if (map_file (bd->tsvp, &bd->data) != OK || bd->data.size == 0)
+	fail ("unable to read data file", bd->dataName);
+    memset (&bd->unmapped, 0, sizeof(bd->unmapped));
+    bd->unmapped.how = MAPPED_EMPTY;
+
+    eol = memchr (bd->data.addr, '\n', bd->data.size);
+    bd->ncols = 1;
+    for (p = bd->data.addr; p < eol; p++)
+	if (*p == '\t') bd->ncols++;
+
+    bd->textIndexp = make_index (bd, INDEX_TEXT, 0L);
+    bd->binIndexp = make_index (bd, INDEX_BINARY, 0L);
+    bd->ckptIndexp = make_index (bd, INDEX_BINARY, bd->colstride);
+    if (open_binary_index (bd->ckptIndexp, &bd->idx) != OK)
+	fail ("unable to open binary index", bd->dataName);
+    bd->nrows = binary_index_num_rows (bd->idx);
+
+    bd->keys = (const char **)malloc ((bd->nrows + 1) * sizeof(char *));
+    bd->keylens = (long *)malloc ((bd->nrows + 1) * sizeof(long));
+    bd->missKeys = (char **)malloc ((bd->nrows + 1) * sizeof(char *));
+    bd->rowPosn = (long *)malloc ((bd->nrows + 1) * sizeof(long));
+    bd->rowLen = (long *)malloc ((bd->nrows + 1) * sizeof(long));
+    bd->rowCkpt = (const uint32_t **)malloc ((bd->nrows + 1) * sizeof(uint32_t *));
+    bd->rowNckpt = (long *)malloc ((bd->nrows + 1) * sizeof(long));
+    offset = (long *)malloc ((bd->nrows + 1) * sizeof(long));
+    order = (long **)malloc ((bd->nrows + 1) * sizeof(long *));
+    if (bd->keys == NULL || bd->keylens == NULL || bd->missKeys == NULL || bd->rowPosn == NULL ||
+	bd->rowLen == NULL || bd->rowCkpt == NULL || bd->rowNckpt == NULL || offset == NULL || order == NULL)
+	fail ("out of memory", bd->dataName);
+
+    for (ii = 0; ii < bd->nrows; ii++) {
+	binary_index_label (bd->idx, ii, &bd->keys[ii], &bd->keylens[ii]);
+	if ((bd->missKeys[ii] = (char *)malloc (bd->keylens[ii] + 2)) == NULL)
+	    fail ("out of memory", bd->dataName);
+	bd->missKeys[ii][0] = '~';
+	memcpy (bd->missKeys[ii] + 1, bd->keys[ii], bd->keylens[ii]);
+	bd->missKeys[ii][bd->keylens[ii]+1] = '\0';
+	offset[ii] = binary_index_offset (bd->idx, ii);
+	order[ii] = &offset[ii];
+    }
+
+    /* Extract rows in file order, as tsvGetData does. */
+    qsort (order, bd->nrows, sizeof(long *), compare_posn);
+    for (ii = 0; ii < bd->nrows; ii++) {
+	pos = order[ii] - offset;
+	bd->rowPosn[ii] = offset[pos];
+	bd->rowLen[ii] = binary_index_row_length (bd->idx, pos);
+	bd->rowNckpt[ii] = binary_index_checkpoints (bd->idx, pos, &bd->rowCkpt[ii]);
+    }
+    free (order);
+    free (offset);
+
+    if ((bd->buffer = (char *)malloc (LINEBUFFERSIZE)) == NULL)
+	fail ("out of memory", bd->dataName);
+
+    bd->nnumField = collect_fields (&bd->data, &bd->numField, &bd->numFieldLen);
+    bd->nintField = 0;
+    if (bd->intName != NULL) {
+	FILE *fp;
+
+	if ((fp = fopen (bd->intName, "rb")) == NULL || map_file (fp, &bd->intData) != OK)
+	    fail ("unable to read integer data file", bd->intName);
+	fclose (fp);
+	bd->nintField = collect_fields (&bd->intData, &bd->intField, &bd->intFieldLen);
+    }
+}
+
+/* generate_index: create an index of the data file. */
+static int
+bench_generate_index (benchData *bd, int variant, double *elapsed, long *items, long *bytes)
+{
+    FILE *op;
+    enum status res;
+    double start;
+
+    if ((op = tmpfile ()) == NULL)
+	return 1;
+    fseek (bd->tsvp, 0L, SEEK_SET);
+    start = now ();
+    if (variant == 0) {
+	res = generate_index (bd->tsvp, op);
+    } else if (variant == 1) {
+	res = generate_binary_index (bd->tsvp, op);
+    } else {
+	generate_indexes (1, &bd->tsvp, &op, INDEX_BINARY, bd->colstride, bd->threads, &res);
+    }
+    fflush (op);
+    *elapsed = now () - start;
+    fclose (op);
+    *items = bd->nrows;
+    *bytes = (long)bd->data.size;
+    return res != OK;
+}
+
+/* scan_index_file: load an index into a new dynHashTab, as tsvOpen does. */
+static int
+bench_scan_index_file (benchData *bd, int variant, double *elapsed, long *items, long *bytes)
+{
+    FILE *indexp;
+    dynHashTab *dht;
+    enum status res;
+    double start;
+
+    indexp = variant == 0 ? bd->textIndexp : variant == 1 ? bd->binIndexp : bd->ckptIndexp;
+    start = now ();
+    if ((dht = newDynHashTab (1024, DHT_STRDUP)) == NULL)
+	return 1;
+    res = scan_index_file (indexp, dht, 1);
+    *elapsed = now () - start;
+    freeDynHashTab (dht);
+    fseek (indexp, 0L, SEEK_END);
+    *items = bd->nrows;
+    *bytes = ftell (indexp);
+    return res != OK;
+}
+
+/* dht: insert all row keys into a new table (variants 0-2), or look up all row keys (variant 3)
+ * or keys of no row (variant 4) in a table containing the row keys.
+ */
+static int
+bench_dht (benchData *bd, int variant, double *elapsed, long *items, long *bytes)
+{
+    dynHashTab *dht;
+    double start;
+    long ii, sum = 0;
+
+    if (variant >= 3) {
+	if ((dht = newDynHashTab (1024, DHT_STRDUP)) == NULL)
+	    return 1;
+	for (ii = 0; ii < bd->nrows; ii++)
+	    insertStrVal (dht, bd->keys[ii], bd->keylens[ii], ii);
+	start = now ();
+	if (variant == 3) {
+	    for (ii = 0; ii < bd->nrows; ii++)
+		sum += getStringValue (dht, bd->keys[ii], bd->keylens[ii]);
+	} else {
+	    for (ii = 0; ii < bd->nrows; ii++)
+		sum += getStringValue (dht, bd->missKeys[ii], bd->keylens[ii] + 1);
+	}
+	*elapsed = now () - start;
+	if (variant == 4 && sum != -bd->nrows)
+	    fail ("lookup of missing key succeeded", "dht");
+    } else {
+	start = now ();
+	if ((dht = newDynHashTab (1024, variant == 2 ? 0 : DHT_STRDUP)) == NULL)
+	    return 1;
+	if (variant == 1)
+	    dhtReserve (dht, bd->nrows);
+	for (ii = 0; ii < bd->nrows; ii++)
+	    insertStrVal (dht, bd->keys[ii], bd->keylens[ii], ii);
+	*elapsed = now () - start;
+    }
+    freeDynHashTab (dht);
+    *items = bd->nrows;
+    *bytes = 0;
+    return 0;
+}
+
+/* Column selections and access methods of the get_tsv_fields benchmark. */
+#define SELECT_ALL	0	/* Every column. */
+#define SELECT_SPARSE	1	/* Every 16th column. */
+#define SELECT_FIRST	2	/* The first 8 columns. */
+
+typedef struct {
+    const char *name;
+    int select;
+    int checkpoints;
+    int mapped;
+} fieldsVariant;
+
+static const fieldsVariant fieldsVariants[] = {
+    { "mapped_all",		SELECT_ALL,	0, 1 },
+    { "mapped_sparse",		SELECT_SPARSE,	0, 1 },
+    { "mapped_first",		SELECT_FIRST,	0, 1 },
+    { "mapped_sparse_ckpt",	SELECT_SPARSE,	1, 1 },
+    { "stdio_all",		SELECT_ALL,	0, 0 },
+    { "stdio_sparse",		SELECT_SPARSE,	0, 0 },
+    { "stdio_sparse_ckpt",	SELECT_SPARSE,	1, 0 },
+};
+
+/* get_tsv_fields: extract the selected columns of every row, in file order, into a numeric matrix. */
+static int
+bench_get_tsv_fields (benchData *bd, int variant, double *elapsed, long *items, long *bytes)
+{
+    const fieldsVariant *fv = &fieldsVariants[variant];
+    resultDest dest;
+    parseProblem prob;
+    long *columnMap, maxColumn, ncolsOut, ii, nckpt;
+    char *blockWanted;
+    double start;
+    int code = FIELD_OK;
+
+    columnMap = (long *)malloc (bd->ncols * sizeof(long));
+    blockWanted = (char *)calloc (bd->ncols / bd->colstride + 1, sizeof(char));
+    if (columnMap == NULL || blockWanted == NULL)
+	return 1;
+    ncolsOut = 0;
+    maxColumn = -1;
+    for (ii = 0; ii < bd->ncols; ii++) {
+	int wanted = fv->select == SELECT_ALL || (fv->select == SELECT_SPARSE ? ii % 16 == 0 : ii < 8);
+	columnMap[ii] = wanted ? ncolsOut++ : -1L;
+	if (wanted) {
+	    maxColumn = ii;
+	    blockWanted[ii / bd->colstride] = 1;
+	}
+    }
+
+    memset (&dest, 0, sizeof(dest));
+    dest.result = R_NilValue;
+    dest.rowstep = 1;
+    dest.colstep = bd->nrows;
+    dest.set = set_result_num;
+    dest.parallel = 1;
+    if ((dest.dvec = (double *)malloc ((bd->nrows * ncolsOut + 1) * sizeof(double))) == NULL)
+	return 1;
+    init_parse_problem (&prob);
+
+    start = now ();
+    for (ii = 0; ii < bd->nrows && code == FIELD_OK; ii++) {
+	nckpt = fv->checkpoints ? bd->rowNckpt[ii] : 0;
+	code = get_tsv_fields (&dest, ii, bd->tsvp, fv->mapped ? &bd->data : &bd->unmapped, NULL, bd->rowPosn[ii],
+			       bd->rowLen[ii], maxColumn, columnMap, bd->rowCkpt[ii], nckpt, bd->colstride, blockWanted,
+			       bd->buffer, LINEBUFFERSIZE, &prob);
+    }
+    *elapsed = now () - start;
+
+    free (dest.dvec);
+    free (blockWanted);
+    free (columnMap);
+    *items = bd->nrows * ncolsOut;
+    *bytes = (long)bd->data.size;
+    return code != FIELD_OK;
+}
+
+/* set_result_num (variant 0) or set_result_int (variant 1): convert the collected fields. */
+static int
+bench_setter (benchData *bd, int variant, double *elapsed, long *items, long *bytes)
+{
+    const char **field = variant == 0 ? bd->numField : bd->intField;
+    const long *len = variant == 0 ? bd->numFieldLen : bd->intFieldLen;
+    long nfield = variant == 0 ? bd->nnumField : bd->nintField;
+    resultDest dest;
+    double start;
+    long ii, failed = 0;
+
+    if (nfield == 0)
+	return -1;
+    memset (&dest, 0, sizeof(dest));
+    dest.result = R_NilValue;
+    dest.rowstep = 1;
+    dest.colstep = nfield;
+    dest.parallel = 1;
+    if (variant == 0) {
+	dest.set = set_result_num;
+	dest.dvec = (double *)malloc (nfield * sizeof(double));
+    } else {
+	dest.set = set_result_int;
+	dest.ivec = (int *)malloc (nfield * sizeof(int));
+    }
+    if (dest.dvec == NULL && dest.ivec == NULL)
+	return 1;
+
+    start = now ();
+    for (ii = 0; ii < nfield; ii++)
+	failed += dest.set (&dest, ii, field[ii], len[ii]) != FIELD_OK;
+    *elapsed = now () - start;
+
+    free (dest.dvec);
+    free (dest.ivec);
+    *items = nfield;
+    *bytes = 0;
+    for (ii = 0; ii < nfield; ii++)
+	*bytes += len[ii];
+    return failed != 0;
+}
+
+static const benchmark benchmarks[] = {
+    { "generate_index",		"text",			bench_generate_index,	0 },
+    { "generate_index",		"binary",		bench_generate_index,	1 },
+    { "generate_index",		"binary_ckpt",		bench_generate_index,	2 },
+    { "scan_index_file",	"text",			bench_scan_index_file,	0 },
+    { "scan_index_file",	"binary",		bench_scan_index_file,	1 },
+    { "scan_index_file",	"binary_ckpt",		bench_scan_index_file,	2 },
+    { "dht",			"insert",		bench_dht,		0 },
+    { "dht",			"insert_reserved",	bench_dht,		1 },
+    { "dht",			"insert_nodup",		bench_dht,		2 },
+    { "dht",			"lookup_hit",		bench_dht,		3 },
+    { "dht",			"lookup_miss",		bench_dht,		4 },
+    { "get_tsv_fields",		"mapped_all",		bench_get_tsv_fields,	0 },
+    { "get_tsv_fields",		"mapped_sparse",	bench_get_tsv_fields,	1 },
+    { "get_tsv_fields",		"mapped_first",		bench_get_tsv_fields,	2 },
+    { "get_tsv_fields",		"mapped_sparse_ckpt",	bench_get_tsv_fields,	3 },
+    { "get_tsv_fields",		"stdio_all",		bench_get_tsv_fields,	4 },
+    { "get_tsv_fields",		"stdio_sparse",		bench_get_tsv_fields,	5 },
+    { "get_tsv_fields",		"stdio_sparse_ckpt",	bench_get_tsv_fields,	6 },
+    { "set_result_num",		"fields",		bench_setter,		0 },
+    { "set_result_int",		"fields",		bench_setter,		1 },
+};
+
+/* Write str to op as a JSON string. */
+static void
+json_string (FILE *op, const char *str)
+{
+    putc ('"', op);
+    for (; *str != '\0'; str++) {
+	if (*str == '"' || *str == '\\')
+	    fprintf (op, "\\%c", *str);
+	else if ((unsigned char)*str < 0x20)
+	    fprintf (op, "\\u%04x", (unsigned char)*str);
+	else
+	    putc (*str, op);
+    }
+    putc ('"', op);
+}
+
+static int
+compare_double (const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+
+    return da < db ? -1 : da > db;
+}
+
+/* Run benchmark b reps times, after one untimed warm-up run, and write its results to op.
+ * Returns 1 if results were written.
+ */
+static int
+run_benchmark (FILE *op, benchData *bd, const benchmark *b, int reps, int first)
+{
+    double times[MAX_TIMED_REPS], sum = 0.0, median;
+    long items = 0, bytes = 0;
+    int ii, res;
+
+    res = b->run (bd, b->arg, &times[0], &items, &bytes);
+    for (ii = 0; ii < reps && res == 0; ii++) {
+	res = b->run (bd, b->arg, &times[ii], &items, &bytes);
+	sum += times[ii];
+    }
+    if (res != 0) {
+	fprintf (stderr, "microbench: %s/%s: %s\n", b->stage, b->variant, res < 0 ? "skipped" : "failed");
+	return 0;
+    }
+    qsort (times, reps, sizeof(double), compare_double);
+    median = reps % 2 ? times[reps/2] : (times[reps/2-1] + times[reps/2]) / 2.0;
+
+    fprintf (op, "%s\n    {\"stage\": ", first ? "" : ",");
+    json_string (op, b->stage);
+    fprintf (op, ", \"variant\": ");
+    json_string (op, b->variant);
+    fprintf (op, ", \"reps\": %d, \"items\": %ld, \"bytes\": %ld,\n", reps, items, bytes);
+    fprintf (op, "     \"min_s\": %.9f, \"median_s\": %.9f, \"mean_s\": %.9f, \"max_s\": %.9f",
+	     times[0], median, sum / reps, times[reps-1]);
+    if (median > 0.0) {
+	fprintf (op, ",\n     \"items_per_s\": %.1f", items / median);
+	if (bytes > 0) fprintf (op, ", \"mb_per_s\": %.3f", bytes / median / 1e6);
+    }
+    putc ('}', op);
+    fflush (op);
+    return 1;
+}
+
+static void
+usage (void)
+{
+    fprintf (stderr, "usage: microbench [-i intfile] [-o out.json] [-n reps] [-c colstride] [-t threads] [-g tag] [-b stage]... datafile\n");
+    exit (2);
+}
+
+int
+main (int argc, char *argv[])
+{
+    static char *rargv[] = { "microbench", "--vanilla", "--silent" };
+    const char *outName = NULL, *tag = "", *only[32];
+    benchData bd;
+    FILE *op = stdout;
+    char host[256], stamp[64];
+    time_t t;
+    int ch, reps = 5, nonly = 0, first = 1, ii, jj;
+    long nb;
+
+    memset (&bd, 0, sizeof(bd));
+    bd.colstride = 64;
+    bd.threads = 1;
+    while ((ch = getopt (argc, argv, "i:o:n:c:t:g:b:")) != -1) {
+	switch (ch) {
+	case 'i': bd.intName = optarg; break;
+	case 'o': outName = optarg; break;
+	case 'n': reps = atoi (optarg); break;
+	case 'c': bd.colstride = atol (optarg); break;
+	case 't': bd.threads = atoi (optarg); break;
+	case 'g': tag = optarg; break;
+	case 'b':
+	    if (nonly == sizeof(only)/sizeof(only[0])) usage ();
+	    only[nonly++] = optarg;
+	    break;
+	default:
+	    usage ();
+	}
+    }
+    if (optind != argc - 1 || reps < 1 || reps > MAX_TIMED_REPS || bd.colstride < 1)
+	usage ();
+    bd.dataName = argv[optind];
+
+    Rf_initEmbeddedR (sizeof(rargv)/sizeof(rargv[0]), rargv);
+    load_bench_data (&bd);
+
+    if (outName != NULL && (op = fopen (outName, "w")) == NULL)
+	fail ("unable to create results file", outName);
+    if (gethostname (host, sizeof(host)) != 0) strcpy (host, "unknown");
+    host[sizeof(host)-1] = '\0';
+    t = time (NULL);
+    strftime (stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime (&t));
+
+    fprintf (op, "{\n  \"suite\": \"microbench\",\n  \"tag\": ");
+    json_string (op, tag);
+    fprintf (op, ",\n  \"timestamp\": \"%s\",\n  \"host\": ", stamp);
+    json_string (op, host);
+    fprintf (op, ",\n  \"data\": {\"file\": ");
+    json_string (op, bd.dataName);
+    fprintf (op, ", \"bytes\": %ld, \"rows\": %ld, \"cols\": %ld, \"colstride\": %ld, \"threads\": %d},\n",
+	     (long)bd.data.size, bd.nrows, bd.ncols, bd.colstride, bd.threads);
+    fprintf (op, "  \"results\": [");
+
+    nb = sizeof(benchmarks)/sizeof(benchmarks[0]);
+    for (ii = 0; ii < nb; ii++) {
+	for (jj = 0; jj < nonly; jj++)
+	    if (strcmp (only[jj], benchmarks[ii].stage) == 0) break;
+	if (nonly > 0 && jj == nonly) continue;
+	fprintf (stderr, "microbench: %s/%s\n", benchmarks[ii].stage, benchmarks[ii].variant);
+	if (run_benchmark (op, &bd, &benchmarks[ii], reps, first))
+	    first = 0;
+    }
+    fprintf (op, "\n  ]\n}\n");
+    if (op != stdout) fclose (op);
+
+    Rf_endEmbeddedR (0);
+    return 0;
+}
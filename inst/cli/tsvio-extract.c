@@ -0,0 +1,360 @@
+/* Copyright 2013 UT MD Anderson Cancer Center.
+ *
+ * Author : Bradley Broom
+ */
+
+/* Extract a submatrix of a TSV data file without R.
+ *
+ * The data file is opened with its index, as by tsvGetData, using the query engine in
+ * src/dataset.c, and the selected rows and columns are written to standard output, a chunk
+ * of rows at a time.  Row and column labels that are not in the data file are skipped.
+ *
+ * Usage: tsvio-extract [options] datafile
+ *   -i index	Index file of the data file (default datafile.idx).  It is created if it does not exist.
+ *   -r file	File of the row labels to extract, one per line (default all rows, in index order).
+ *   -c file	File of the column labels to extract, one per line (default all columns).
+ *   -f format	Output format (default tsv):
+ *		  tsv	  A TSV file in the same format as the data file: a header line of column
+ *			  labels, then one line per row consisting of its label and its fields.
+ *		  binary  The fields as native doubles, one row after another, with no labels.
+ *			  Fields that are not numbers are an error; NA fields are R's NA_real_.
+ *   -t threads	Number of threads used (default 0: as many as OpenMP allows).
+ *   -n rows	Number of rows extracted at a time (default 10000).
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "dht.h"
+#include "tsvio.h"
+#include "binindex.h"
+#include "mapfile.h"
+#include "bgzf.h"
+#include "numcache.h"
+#include "dataset.h"
+
+#define FORMAT_TSV	0
+#define FORMAT_BINARY	1
+
+static const char *progName = "tsvio-extract";
+
+static void
+usage (void)
+{
+    fprintf (stderr, "usage: %s [-i index] [-r rowfile] [-c colfile] [-f tsv|binary] [-t threads] [-n chunkrows] datafile\n", progName);
+    exit (2);
+}
+
+/* Report a failure and exit. */
+static void
+fail (const char *what, const char *name, const char *why)
+{
+    fprintf (stderr, "%s: %s '%s': %s\n", progName, what, name, why);
+    exit (1);
+}
+
+/* Report a failure to allocate memory and exit. */
+static void
+out_of_memory (void)
+{
+    fprintf (stderr, "%s: %s\n", progName, status_message (OUT_OF_MEMORY));
+    exit (1);
+}
+
+/* Returns a table of the distinct labels in fileName, one per line, in order of first occurrence. */
+static dynHashTab *
+read_labels (const char *fileName)
+{
+    dynHashTab *dht;
+    FILE *fp;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    if ((fp = fopen (fileName, "r")) == NULL)
+	fail ("unable to open label file", fileName, "cannot open file");
+    if ((dht = newDynHashTab (1024, DHT_STRDUP)) == NULL)
+	out_of_memory ();
+    while ((len = getline (&line, &size, fp)) >= 0) {
+	while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+	    len--;
+	if (len > 0)
+	    insertStr (dht, line, len);
+    }
+    free (line);
+    if (ferror (fp))
+	fail ("unable to read label file", fileName, status_message (READ_ERROR));
+    fclose (fp);
+    if (dhtFailed (dht))
+	out_of_memory ();
+    return dht;
+}
+
+/* Returns a table of the labels in wanted that are in the dataset ds (rows if byrow, else columns).
+ * The labels are not copied, so wanted must outlive the result.
+ */
+static dynHashTab *
+present_labels (const dynHashTab *wanted, const tsvDataset *ds, int byrow)
+{
+    dynHashTab *dht;
+    const char *str;
+    long iter, len, missing = 0;
+
+    if ((dht = newDynHashTab (dhtNumStrings (wanted) + 1, 0)) == NULL)
+	out_of_memory ();
+    initIterator (wanted, &iter);
+    while (getNextStr (wanted, &iter, &str, &len, NULL, NULL)) {
+	if (byrow ? dataset_has_row (ds, str, len) : getStringIndex (ds->cols, str, len) >= 0)
+	    insertStr (dht, str, len);
+	else
+	    missing++;
+    }
+    if (dhtFailed (dht))
+	out_of_memory ();
+    if (missing > 0)
+	fprintf (stderr, "%s: %ld %s labels not in the data file were skipped\n", progName, missing, byrow ? "row" : "column");
+    return dht;
+}
+
+/* Open the data file and its index as a dataset, reporting any problems. */
+static tsvDataset *
+open_data (const char *dataName, const char *indexName, int nthreads)
+{
+    tsvDataset *ds;
+    fileLoad load;
+    long failed;
+    enum status res;
+
+    res = open_dataset (1, &dataName, &indexName, nthreads, &ds, &load, &failed);
+    if (res != OK && failed < 0)
+	out_of_memory ();
+    if (load.created)
+	fprintf (stderr, "%s: creating indexfile '%s'\n", progName, indexName);
+    if (load.temporary)
+	fprintf (stderr, "%s: unable to create indexfile '%s': using a temporary index\n", progName, indexName);
+    if (load.openres != OK)
+	fail ("unable to open datafile", dataName, status_message (load.openres));
+    if (load.generate && is_fatal_error (load.genres))
+	fail ("unable to index datafile", dataName, status_message (load.genres));
+    if (load.grown)
+	fprintf (stderr, "%s: datafile '%s' has grown: updated indexfile '%s'\n", progName, dataName, indexName);
+    if (load.verres != OK)
+	fail ("unable to use indexfile", indexName, status_message (load.verres));
+    if (load.idxres != OK)
+	fail ("unable to load indexfile", indexName, status_message (load.idxres));
+    if (load.hdrres != OK)
+	fail ("unable to read header of datafile", dataName, status_message (load.hdrres));
+    if (res != OK)
+	fail ("unable to open datafile", dataName, status_message (res));
+    return ds;
+}
+
+/* Store a field of a TSV chunk: dest->result is an array of copies of the fields. */
+static int
+set_text (const resultDest *dest, long idx, const char *s, long n)
+{
+    char **cells = (char **)dest->result;
+    char *copy;
+
+    if ((copy = (char *)malloc (n + 1)) == NULL)
+	return FIELD_NO_MEMORY;
+    memcpy (copy, s, n);
+    copy[n] = '\0';
+    free (cells[idx]);
+    cells[idx] = copy;
+    return FIELD_OK;
+}
+
+/* Returns the length of a label of at most len bytes, which is NUL-terminated if shorter. */
+static size_t
+label_length (const char *str, long len)
+{
+    const char *end = (const char *)memchr (str, '\0', len);
+
+    return end == NULL ? (size_t)len : (size_t)(end - str);
+}
+
+/* Write the labels in dht, each preceded by a tab except the first, followed by a newline. */
+static void
+write_header (FILE *op, const dynHashTab *dht)
+{
+    const char *str;
+    long iter, len, order;
+
+    initIterator (dht, &iter);
+    while (getNextStr (dht, &iter, &str, &len, &order, NULL)) {
+	if (order > 0) putc ('\t', op);
+	fwrite (str, 1, label_length (str, len), op);
+    }
+    putc ('\n', op);
+}
+
+/* Write the rows in rowdht of a chunk of TSV output, freeing its fields. */
+static void
+write_tsv_chunk (FILE *op, const dynHashTab *rowdht, long ncols, char **cells)
+{
+    const char *str;
+    long iter, len, row, jj;
+    char *cell;
+
+    initIterator (rowdht, &iter);
+    while (getNextStr (rowdht, &iter, &str, &len, &row, NULL)) {
+	fwrite (str, 1, label_length (str, len), op);
+	for (jj = 0; jj < ncols; jj++) {
+	    cell = cells[row*ncols + jj];
+	    putc ('\t', op);
+	    fputs (cell == NULL ? "NA" : cell, op);
+	    free (cell);
+	    cells[row*ncols + jj] = NULL;
+	}
+	putc ('\n', op);
+    }
+}
+
+/* Extract the rows in rows and columns in cols of ds and write them to op, chunkRows rows at a time. */
+static void
+extract (FILE *op, tsvDataset *ds, const dynHashTab *rows, const dynHashTab *cols, int format, long chunkRows, int nthreads)
+{
+    dynHashTab *rowdht;
+    resultDest dest;
+    parseProblem prob;
+    char **cells = NULL, msg[512];
+    double *values = NULL;
+    const char *str;
+    long iter, len, nrows, ncols, jj, failed;
+    char skipped;
+    enum status res;
+
+    ncols = dhtNumStrings (cols);
+    memset (&dest, 0, sizeof(dest));
+    dest.rowstep = ncols;
+    dest.colstep = 1;
+    dest.parallel = 1;
+    if (format == FORMAT_TSV) {
+	if ((cells = (char **)calloc (chunkRows * ncols + 1, sizeof(char *))) == NULL)
+	    out_of_memory ();
+	dest.result = cells;
+	dest.set = set_text;
+	write_header (op, cols);
+    } else {
+	if ((values = (double *)malloc ((chunkRows * ncols + 1) * sizeof(double))) == NULL)
+	    out_of_memory ();
+	dest.dvec = values;
+	dest.set = set_result_num;
+    }
+
+    initIterator (rows, &iter);
+    do {
+	/* Collect the next chunk of rows. */
+	if ((rowdht = newDynHashTab (chunkRows, 0)) == NULL)
+	    out_of_memory ();
+	nrows = 0;
+	while (nrows < chunkRows && getNextStr (rows, &iter, &str, &len, NULL, NULL)) {
+	    insertStr (rowdht, str, len);
+	    nrows++;
+	}
+	if (dhtFailed (rowdht))
+	    out_of_memory ();
+
+	if (nrows > 0 && ncols > 0) {
+	    if (values != NULL) {
+		for (jj = 0; jj < nrows * ncols; jj++) values[jj] = na_double ();
+	    }
+	    res = query_dataset (&dest, ds, rowdht, cols, nthreads, READ_GAP, &skipped, &prob, &failed);
+	    if (prob.eofRow >= 0)
+		fprintf (stderr, "%s: line starting at %ld is prematurely terminated by EOF\n", progName, prob.eofRow);
+	    if (res == OUT_OF_MEMORY)
+		out_of_memory ();
+	    if (res != OK) {
+		parse_problem_message (&prob, msg, sizeof(msg));
+		fprintf (stderr, "%s: %.*s\n", progName, (int)strcspn (msg, "\n"), msg);
+		exit (1);
+	    }
+	}
+	if (format == FORMAT_TSV)
+	    write_tsv_chunk (op, rowdht, ncols, cells);
+	else if (nrows > 0 && ncols > 0)
+	    fwrite (values, sizeof(double), nrows * ncols, op);
+	freeDynHashTab (rowdht);
+    } while (nrows == chunkRows);
+
+    free (cells);
+    free (values);
+}
+
+int
+main (int argc, char *argv[])
+{
+    const char *dataName, *indexName = NULL, *rowFile = NULL, *colFile = NULL;
+    char *defaultIndex = NULL;
+    dynHashTab *wantedRows, *wantedCols, *rows, *cols;
+    tsvDataset *ds;
+    long chunkRows = 10000L, failed;
+    int format = FORMAT_TSV, nthreads = 0, ch;
+    enum status res;
+
+    while ((ch = getopt (argc, argv, "i:r:c:f:t:n:")) != -1) {
+	switch (ch) {
+	case 'i': indexName = optarg; break;
+	case 'r': rowFile = optarg; break;
+	case 'c': colFile = optarg; break;
+	case 't': nthreads = atoi (optarg); break;
+	case 'n': chunkRows = atol (optarg); break;
+	case 'f':
+	    if (strcmp (optarg, "tsv") == 0) format = FORMAT_TSV;
+	    else if (strcmp (optarg, "binary") == 0) format = FORMAT_BINARY;
+	    else usage ();
+	    break;
+	default:
+	    usage ();
+	}
+    }
+    if (optind != argc - 1 || chunkRows < 1)
+	usage ();
+    dataName = argv[optind];
+    if (indexName == NULL) {
+	if ((defaultIndex = (char *)malloc (strlen (dataName) + 5)) == NULL)
+	    out_of_memory ();
+	sprintf (defaultIndex, "%s.idx", dataName);
+	indexName = defaultIndex;
+    }
+
+    ds = open_data (dataName, indexName, nthreads);
+
+    if (rowFile != NULL) {
+	wantedRows = read_labels (rowFile);
+	rows = present_labels (wantedRows, ds, 1);
+    } else {
+	wantedRows = NULL;
+	if ((res = dataset_all_rows (ds, &rows, &failed)) != OK)
+	    fail ("unable to read indexfile", indexName, status_message (res));
+    }
+    if (colFile != NULL) {
+	wantedCols = read_labels (colFile);
+	cols = present_labels (wantedCols, ds, 0);
+    } else {
+	wantedCols = NULL;
+	cols = ds->cols;
+    }
+
+    extract (stdout, ds, rows, cols, format, chunkRows, nthreads);
+    if (fflush (stdout) != 0 || ferror (stdout)) {
+	perror (progName);
+	return 1;
+    }
+
+    if (wantedRows != NULL) {
+	freeDynHashTab (rows);
+	freeDynHashTab (wantedRows);
+    }
+    if (wantedCols != NULL) {
+	freeDynHashTab (cols);
+	freeDynHashTab (wantedCols);
+    }
+    close_dataset (ds);
+    free (defaultIndex);
+    return 0;
+}
@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <zlib.h>
+
+#include "dht.h"
+#include "tsvio.h"
+#include "bgzf.h"
+#include "stats.h"
+
+/* Layout of a BGZF block:
+ *   gzip header (12 bytes): 1f 8b 08 04, MTIME (4), XFL, OS, XLEN (2)
+ *   extra field (XLEN bytes), containing a 'BC' subfield whose 2 byte value is the total block size - 1
+ *   raw deflate data
+ *   CRC32 (4), ISIZE (4) of the uncompressed data
+ * All integers are little-endian.
+ */
+#define BGZF_HEADER_SIZE	12
+#define BGZF_TRAILER_SIZE	8
+#define BGZF_MAX_BLOCK		65536
+
+/* Number of decompressed blocks cached by each handle. */
+#define BGZF_CACHE_SIZE		16
+
+typedef struct {
+    long coffset;	/* Offset of block in compressed file, or -1L if the entry is unused. */
+    long next;		/* Offset of the following block in the compressed file. */
+    size_t len;		/* Number of bytes of uncompressed data. */
+    unsigned long lastUse;
+    char data[BGZF_MAX_BLOCK];
+} bgzfBlock;
+
+struct _bgzffile {
+    FILE *fp;
+    unsigned long clock;	/* Incremented on every cache lookup. */
+    unsigned char cdata[BGZF_MAX_BLOCK];
+    bgzfBlock cache[BGZF_CACHE_SIZE];
+};
+
+static unsigned
+get16 (const unsigned char *p)
+{
+    return (unsigned)p[0] | ((unsigned)p[1] << 8);
+}
+
+static unsigned long
+get32 (const unsigned char *p)
+{
+    return (unsigned long)get16 (p) | ((unsigned long)get16 (p+2) << 16);
+}
+
+/* Returns the total size of the block whose extra field of xlen bytes is extra,
+ * or 0 if the extra field has no BC subfield.
+ */
+static unsigned long
+bgzf_block_size (const unsigned char *extra, unsigned xlen)
+{
+    unsigned ii, slen;
+
+    for (ii = 0; ii + 4 <= xlen; ii += 4 + slen) {
+	slen = get16 (extra + ii + 2);
+	if (extra[ii] == 'B' && extra[ii+1] == 'C' && slen == 2 && ii + 6 <= xlen)
+	    return get16 (extra + ii + 4) + 1UL;
+    }
+    return 0;
+}
+
+int
+gzip_format (FILE *fp)
+{
+    unsigned char hdr[BGZF_HEADER_SIZE], extra[256];
+    fpos_t saved;
+    unsigned xlen;
+    int format = GZIP_NONE;
+
+    if (fgetpos (fp, &saved) != 0)
+	return GZIP_NONE;
+    rewind (fp);
+    if (fread (hdr, 1, 3, fp) == 3 && hdr[0] == 0x1f && hdr[1] == 0x8b && hdr[2] == 8) {
+	format = GZIP_PLAIN;
+	if (fread (hdr + 3, 1, BGZF_HEADER_SIZE - 3, fp) == BGZF_HEADER_SIZE - 3 && (hdr[3] & 4) != 0) {
+	    xlen = get16 (hdr + 10);
+	    if (xlen <= sizeof(extra) && fread (extra, 1, xlen, fp) == xlen && bgzf_block_size (extra, xlen) > 0)
+		format = GZIP_BGZF;
+	}
+    }
+    fsetpos (fp, &saved);
+    return format;
+}
+
+/* Read and decompress the block at offset coffset of fp into out, which must have room for
+ * BGZF_MAX_BLOCK bytes.  Cdata is a work area of BGZF_MAX_BLOCK bytes.  Sets *lenp to the number
+ * of uncompressed bytes and *nextp to the offset of the following block.
+ * Returns EMPTY_FILE if coffset is the end of the file.
+ */
+static enum status
+read_block (FILE *fp, long coffset, unsigned char *cdata, char *out, size_t *lenp, long *nextp)
+{
+    z_stream zs;
+    unsigned long bsize, isize;
+    unsigned xlen;
+    size_t got, clen;
+    int zres;
+
+    STATS_COUNT (STAT_SEEKS, 1);
+    if (fseek (fp, coffset, SEEK_SET) < 0)
+	return SEEK_FAILED;
+    got = fread (cdata, 1, BGZF_HEADER_SIZE, fp);
+    if (got == 0)
+	return EMPTY_FILE;
+    if (got != BGZF_HEADER_SIZE || cdata[0] != 0x1f || cdata[1] != 0x8b || cdata[2] != 8 || (cdata[3] & 4) == 0)
+	return BAD_COMPRESSION;
+    xlen = get16 (cdata + 10);
+    if (BGZF_HEADER_SIZE + xlen + BGZF_TRAILER_SIZE > BGZF_MAX_BLOCK ||
+	fread (cdata + BGZF_HEADER_SIZE, 1, xlen, fp) != xlen)
+	return BAD_COMPRESSION;
+    bsize = bgzf_block_size (cdata + BGZF_HEADER_SIZE, xlen);
+    if (bsize < BGZF_HEADER_SIZE + xlen + BGZF_TRAILER_SIZE || bsize > BGZF_MAX_BLOCK)
+	return BAD_COMPRESSION;
+    clen = bsize - BGZF_HEADER_SIZE - xlen;
+    if (fread (cdata, 1, clen, fp) != clen)
+	return READ_ERROR;
+    STATS_COUNT (STAT_BYTES_READ, bsize);
+    clen -= BGZF_TRAILER_SIZE;
+    isize = get32 (cdata + clen + 4);
+    if (isize > BGZF_MAX_BLOCK)
+	return BAD_COMPRESSION;
+
+    memset (&zs, 0, sizeof(zs));
+    if (inflateInit2 (&zs, -15) != Z_OK)
+	return OUT_OF_MEMORY;
+    zs.next_in = cdata;
+    zs.avail_in = (uInt)clen;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = BGZF_MAX_BLOCK;
+    zres = inflate (&zs, Z_FINISH);
+    inflateEnd (&zs);
+    if (zres != Z_STREAM_END || zs.total_out != isize ||
+	crc32 (crc32 (0L, Z_NULL, 0), (const Bytef *)out, (uInt)isize) != get32 (cdata + clen))
+	return BAD_COMPRESSION;
+
+    *lenp = (size_t)isize;
+    *nextp = coffset + (long)bsize;
+    return OK;
+}
+
+enum status
+bgzf_open (FILE *fp, bgzfFile **bfp)
+{
+    bgzfFile *bf;
+    int ii;
+
+    if ((bf = malloc (sizeof(bgzfFile))) == NULL)
+	return OUT_OF_MEMORY;
+    bf->fp = fp;
+    bf->clock = 0;
+    for (ii = 0; ii < BGZF_CACHE_SIZE; ii++) {
+	bf->cache[ii].coffset = -1L;
+	bf->cache[ii].lastUse = 0;
+    }
+    *bfp = bf;
+    return OK;
+}
+
+void
+bgzf_close (bgzfFile *bf)
+{
+    free (bf);
+}
+
+/* Return the decompressed block at offset coffset, reading it into the least recently
+ * used cache entry if it is not already cached.
+ */
+static enum status
+get_block (bgzfFile *bf, long coffset, const bgzfBlock **blockp)
+{
+    bgzfBlock *victim = &bf->cache[0];
+    enum status res;
+    int ii;
+
+    bf->clock++;
+    for (ii = 0; ii < BGZF_CACHE_SIZE; ii++) {
+	if (bf->cache[ii].coffset == coffset) {
+	    bf->cache[ii].lastUse = bf->clock;
+	    *blockp = &bf->cache[ii];
+	    return OK;
+	}
+	if (bf->cache[ii].lastUse < victim->lastUse)
+	    victim = &bf->cache[ii];
+    }
+
+    victim->coffset = -1L;
+    if ((res = read_block (bf->fp, coffset, bf->cdata, victim->data, &victim->len, &victim->next)) != OK)
+	return res;
+    victim->coffset = coffset;
+    victim->lastUse = bf->clock;
+    *blockp = victim;
+    return OK;
+}
+
+enum status
+bgzf_read_line (bgzfFile *bf, long voffset, char *buffer, size_t bufsize, size_t *lenp, long *nextp)
+{
+    const bgzfBlock *block;
+    const char *start, *nl;
+    long coffset = voffset >> 16;
+    size_t uoffset = (size_t)(voffset & 0xffff);
+    size_t len = 0, n;
+    enum status res;
+
+    if (voffset < 0 || bufsize == 0)
+	return SEEK_FAILED;
+    for (;;) {
+	res = get_block (bf, coffset, &block);
+	if (res == EMPTY_FILE) {
+	    /* End of file: supply the missing newline. */
+	    if (len == 0)
+		return EMPTY_FILE;
+	    buffer[len++] = '\n';
+	    *lenp = len;
+	    *nextp = coffset << 16;
+	    return INCOMPLETE_LAST_LINE;
+	}
+	if (res != OK)
+	    return res;
+	if (uoffset > block->len)
+	    return SEEK_FAILED;
+
+	start = block->data + uoffset;
+	n = block->len - uoffset;
+	nl = memchr (start, '\n', n);
+	if (nl != NULL)
+	    n = (size_t)(nl - start) + 1;
+	if (len + n + (nl == NULL) > bufsize)
+	    return LINE_TOO_LONG;
+	memcpy (buffer + len, start, n);
+	len += n;
+
+	if (nl != NULL) {
+	    *lenp = len;
+	    uoffset += n;
+	    /* A line ending a block is followed by the start of the next block. */
+	    *nextp = uoffset < block->len ? (coffset << 16) | (long)uoffset : block->next << 16;
+	    return OK;
+	}
+	coffset = block->next;
+	uoffset = 0;
+    }
+}
+
+enum status
+bgzf_read_line_copy (bgzfFile *bf, long voffset, long rowlen, char *buffer, size_t bufsize, char **linep, size_t *lenp,
+		     long *nextp, char **copyp)
+{
+    char *copy = NULL, *newcopy;
+    size_t size = bufsize;
+    enum status res;
+
+    *linep = NULL;
+    *copyp = NULL;
+    if (rowlen >= 0 && (size_t)rowlen + 1 > bufsize) {
+	/* Read the line directly into a copy of exactly its size. */
+	size = (size_t)rowlen + 1;
+	if ((copy = malloc (size)) == NULL)
+	    return OUT_OF_MEMORY;
+	res = bgzf_read_line (bf, voffset, copy, size, lenp, nextp);
+    } else {
+	res = bgzf_read_line (bf, voffset, buffer, bufsize, lenp, nextp);
+    }
+    while (res == LINE_TOO_LONG) {
+	size = size < 1024 ? 1024 : 2 * size;
+	if ((newcopy = realloc (copy, size)) == NULL) {
+	    free (copy);
+	    return OUT_OF_MEMORY;
+	}
+	copy = newcopy;
+	res = bgzf_read_line (bf, voffset, copy, size, lenp, nextp);
+    }
+    if (res != OK && res != INCOMPLETE_LAST_LINE) {
+	free (copy);
+	return res;
+    }
+    *linep = copy != NULL ? copy : buffer;
+    *copyp = copy;
+    return res;
+}
+
+enum status
+bgzf_decompress_file (FILE *fp, bgzfContents *bc)
+{
+    unsigned char *cdata;
+    char *newdata;
+    size_t *newustart, alloc = 0, len;
+    long *newcstart, blockAlloc = 0, coffset = 0, next;
+    enum status res;
+
+    bc->data = NULL;
+    bc->size = 0;
+    bc->nblocks = 0;
+    bc->ustart = NULL;
+    bc->cstart = NULL;
+    if ((cdata = malloc (BGZF_MAX_BLOCK)) == NULL)
+	return OUT_OF_MEMORY;
+
+    for (;;) {
+	if (bc->size + BGZF_MAX_BLOCK > alloc) {
+	    alloc = alloc == 0 ? 16 * BGZF_MAX_BLOCK : alloc * 2;
+	    if ((newdata = realloc (bc->data, alloc)) == NULL) {
+		res = OUT_OF_MEMORY;
+		break;
+	    }
+	    bc->data = newdata;
+	}
+	if (bc->nblocks == blockAlloc) {
+	    blockAlloc = blockAlloc == 0 ? 1024 : blockAlloc * 2;
+	    newustart = realloc (bc->ustart, blockAlloc * sizeof(size_t));
+	    if (newustart != NULL) bc->ustart = newustart;
+	    newcstart = realloc (bc->cstart, blockAlloc * sizeof(long));
+	    if (newcstart != NULL) bc->cstart = newcstart;
+	    if (newustart == NULL || newcstart == NULL) {
+		res = OUT_OF_MEMORY;
+		break;
+	    }
+	}
+
+	res = read_block (fp, coffset, cdata, bc->data + bc->size, &len, &next);
+	if (res == EMPTY_FILE) {
+	    res = OK;
+	    break;
+	}
+	if (res != OK)
+	    break;
+	/* Empty blocks (such as the end of file marker) contain no lines. */
+	if (len > 0) {
+	    bc->ustart[bc->nblocks] = bc->size;
+	    bc->cstart[bc->nblocks] = coffset;
+	    bc->nblocks++;
+	    bc->size += len;
+	}
+	coffset = next;
+    }
+
+    free (cdata);
+    if (res != OK)
+	bgzf_free_contents (bc);
+    return res;
+}
+
+long
+bgzf_virtual_offset (const bgzfContents *bc, size_t offset)
+{
+    long lo = 0, hi = bc->nblocks - 1, mid;
+
+    if (bc->nblocks == 0)
+	return -1L;
+    /* Find the last block starting at or before offset. */
+    while (lo < hi) {
+	mid = lo + (hi - lo + 1) / 2;
+	if (bc->ustart[mid] <= offset)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+    if (bc->cstart[lo] > (LONG_MAX >> 16))
+	return -1L;
+    return (bc->cstart[lo] << 16) | (long)(offset - bc->ustart[lo]);
+}
+
+void
+bgzf_free_contents (bgzfContents *bc)
+{
+    free (bc->data);
+    free (bc->ustart);
+    free (bc->cstart);
+    bc->data = NULL;
+    bc->size = 0;
+    bc->nblocks = 0;
+    bc->ustart = NULL;
+    bc->cstart = NULL;
+}
@@ -0,0 +1,64 @@
+/* This module provides random access to data files compressed in the BGZF format.
+ *
+ * A BGZF file (as written by bgzip from htslib) is a series of gzip members ("blocks"), each
+ * holding at most 64 KB of uncompressed data and recording its own compressed size, so that
+ * any block can be decompressed without reading the blocks before it.  A position within
+ * the uncompressed data is identified by a virtual offset: the byte offset in the compressed
+ * file of the start of the block, shifted left 16 bits, plus the offset within the block's
+ * uncompressed data.  Virtual offsets increase with the uncompressed position, and are used
+ * in place of byte offsets in the indexes of BGZF files.
+ *
+ * Summary of operations:
+ */
+
+typedef struct _bgzffile bgzfFile;
+
+/* Uncompressed contents of an entire BGZF file, and the location of each of its blocks. */
+typedef struct {
+    char *data;		/* Uncompressed contents of the file. */
+    size_t size;	/* Number of bytes in data. */
+    long nblocks;	/* Number of non-empty blocks. */
+    size_t *ustart;	/* Offset in data of the start of each block. */
+    long *cstart;	/* Offset in the compressed file of the start of each block. */
+} bgzfContents;
+
+#define GZIP_NONE	0	/* File is not gzip compressed. */
+#define GZIP_BGZF	1	/* File is BGZF compressed. */
+#define GZIP_PLAIN	2	/* File is gzip compressed, but not in BGZF format, so cannot be read randomly. */
+
+/* Returns the compression format (GZIP_*) of the open file fp.  The file position of fp is not changed. */
+extern int gzip_format (FILE *fp);
+
+/* Prepare to read lines at random from the BGZF file fp.  On success, *bfp is set to the new handle. */
+extern enum status bgzf_open (FILE *fp, bgzfFile **bfp);
+
+/* Release a handle created by bgzf_open.  The file itself is not closed. */
+extern void bgzf_close (bgzfFile *bf);
+
+/* Read the line at virtual offset voffset into buffer, including its terminating newline, which is
+ * supplied if the file ends without one (and INCOMPLETE_LAST_LINE is returned).  *lenp is set to the
+ * length of the line and *nextp to the virtual offset of the following line.  Returns EMPTY_FILE if
+ * there is no data at voffset, and LINE_TOO_LONG if the line does not fit in bufsize bytes.
+ * Recently used blocks are cached, so reading nearby lines decompresses each block only once.
+ */
+extern enum status bgzf_read_line (bgzfFile *bf, long voffset, char *buffer, size_t bufsize, size_t *lenp, long *nextp);
+
+/* As bgzf_read_line, but a line that does not fit in buffer is read into a copy allocated with malloc,
+ * which is returned in *copyp (else NULL) and must be freed by the caller.  *linep is set to the line.
+ * If rowlen is not negative, it is the length of the line excluding its newline, and the copy is
+ * allocated at exactly the right size; otherwise it is grown until the line fits.  Returns as
+ * bgzf_read_line (but never LINE_TOO_LONG), or OUT_OF_MEMORY.
+ */
+extern enum status bgzf_read_line_copy (bgzfFile *bf, long voffset, long rowlen, char *buffer, size_t bufsize, char **linep,
+					size_t *lenp, long *nextp, char **copyp);
+
+/* Decompress the entire BGZF file fp into bc. */
+extern enum status bgzf_decompress_file (FILE *fp, bgzfContents *bc);
+
+/* Returns the virtual offset of the byte at offset in the uncompressed contents bc, or -1L if
+ * the virtual offset cannot be represented.
+ */
+extern long bgzf_virtual_offset (const bgzfContents *bc, size_t offset);
+
+/* Release the memory obtained by bgzf_decompress_file. */
+extern void bgzf_free_contents (bgzfContents *bc);
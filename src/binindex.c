@@ -0,0 +1,1011 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "dht.h"
+#include "tsvio.h"
+#include "mapfile.h"
+#include "binindex.h"
+
+/* On-disk layout of a binary index.
+ *
+ * The file starts with a fixed size header, followed by a number of sections.  Each section
+ * is aligned on an 8 byte boundary and described by an entry in the header's section table.
+ * Readers ignore sections of unknown type, so new sections can be added without changing
+ * the format version.  All integers are stored in the byte order of the writing machine,
+ * which is recorded in the header.
+ *
+ * Sections present in every version 1 index (numRows is the number of distinct labels):
+ *   SECT_KEYS      concatenation of all labels, in ascending (memcmp) order.
+ *   SECT_KEYSTART  uint64_t[numRows+1]: offset in SECT_KEYS of the start of each label.
+ *   SECT_OFFSETS   uint64_t[numRows]: byte offset in the data file of each label's row (virtual
+ *                  offset if the BGZF flag is set: see bgzf.h).
+ *   SECT_ORDER     uint64_t[numRows]: sorted position of each label, in data file order.
+ *
+ * Optional sections:
+ *   SECT_CKPTINFO  uint64_t[1]: column checkpoint stride (see tsvio.h).
+ *   SECT_CKPTSTART uint64_t[numRows+1]: index in SECT_CKPT of each label's first checkpoint.
+ *   SECT_CKPT      uint32_t[]: column checkpoints of all labels, in sorted order.
+ *   SECT_FINGERPRINT binIndexFingerprint: hashes of the start and end of the data file, and the
+ *                  offset at which indexing stopped, used to detect changes to the data file.
+ *   SECT_ROWLEN    uint64_t[numRows]: length in bytes of each label's row, excluding its newline
+ *                  (uncompressed length if the BGZF flag is set), so that it can be read exactly.
+ *
+ * Optional sections describing the header line (the schema), present only if the header labels
+ * every data column (numNames is the number of distinct column labels):
+ *   SECT_SCHEMA    binIndexSchema: number of data columns and labels, and the style of header.
+ *   SECT_COLKEYS   concatenation of the column labels, in order of first occurrence.
+ *   SECT_COLKEYSTART uint64_t[numNames+1]: offset in SECT_COLKEYS of the start of each label.
+ *   SECT_COLNUMBER uint64_t[numNames]: data column number of each label (of its last column, if
+ *                  the label occurs more than once).
+ *   SECT_COLSORTED uint64_t[numNames]: position of each label, in ascending (memcmp) label order.
+ */
+#define BININDEX_MAGIC		"\211TSVIDX\n"
+#define BININDEX_VERSION	1
+#define BININDEX_BYTEORDER	0x01020304
+#define BININDEX_MAX_SECTIONS	16
+
+#define SECT_KEYS	1
+#define SECT_KEYSTART	2
+#define SECT_OFFSETS	3
+#define SECT_ORDER	4
+#define SECT_CKPTINFO	5
+#define SECT_CKPTSTART	6
+#define SECT_CKPT	7
+#define SECT_FINGERPRINT 8
+#define SECT_SCHEMA	9
+#define SECT_COLKEYS	10
+#define SECT_COLKEYSTART 11
+#define SECT_COLNUMBER	12
+#define SECT_COLSORTED	13
+#define SECT_ROWLEN	14
+
+/* Header flags. */
+#define BININDEX_FLAG_BGZF	1	/* Data file is BGZF compressed, and row offsets are virtual offsets. */
+
+/* Schema flags. */
+#define SCHEMA_FLAG_RSTYLE	1	/* Header does not label the column of row labels. */
+
+/* Number of bytes at the start and end of the data file included in its fingerprint. */
+#define FINGERPRINT_BYTES	(64*1024)
+
+typedef struct {
+    uint32_t type;	/* Section type (SECT_*). */
+    uint32_t reserved;
+    uint64_t offset;	/* Byte offset of section from start of index file. */
+    uint64_t size;	/* Number of bytes in section. */
+} binIndexSection;
+
+typedef struct {
+    char magic[8];	/* BININDEX_MAGIC. */
+    uint32_t version;	/* BININDEX_VERSION of writer. */
+    uint32_t byteorder;	/* BININDEX_BYTEORDER in writer's byte order. */
+    uint64_t numRows;	/* Number of distinct row labels. */
+    uint64_t dataSize;	/* Fingerprint: size in bytes of the indexed data file. */
+    int64_t dataMtime;	/* Fingerprint: modification time of the indexed data file. */
+    uint32_t numSections;
+    uint32_t flags;
+    binIndexSection section[BININDEX_MAX_SECTIONS];
+} binIndexHeader;
+
+typedef struct {
+    uint64_t hashBytes;	/* Maximum number of bytes hashed at each end of the data file. */
+    uint64_t headHash;	/* Hash of the first min(hashBytes,dataSize) bytes of the data file. */
+    uint64_t tailHash;	/* Hash of the last min(hashBytes,dataSize) bytes of the data file. */
+    uint64_t scanEnd;	/* Offset just past the last complete line of the data file. */
+} binIndexFingerprint;
+
+typedef struct {
+    uint64_t numColumns;	/* Number of data columns (excluding the column of row labels). */
+    uint64_t numNames;		/* Number of distinct column labels. */
+    uint32_t flags;		/* SCHEMA_FLAG_*. */
+    uint32_t reserved;
+    uint64_t headerLen;		/* Length in bytes of the header line, including its newline. */
+} binIndexSchema;
+
+/* In-memory representation of an open binary index. */
+struct _binindex {
+    mappedFile map;		/* Contents of the index file. */
+    const binIndexHeader *hdr;
+    long numRows;
+    const char *keys;
+    const uint64_t *keyStart;
+    const uint64_t *offsets;
+    const uint64_t *order;
+    const uint64_t *rowLen;	/* NULL if the index does not record row lengths. */
+    long colstride;		/* Column checkpoint stride, or 0 if no checkpoints. */
+    const uint64_t *ckptStart;
+    const uint32_t *ckpt;
+    const binIndexFingerprint *fp;	/* NULL if the index has no fingerprint section. */
+    const binIndexSchema *schema;	/* NULL if the index has no schema sections. */
+    const char *colKeys;
+    const uint64_t *colKeyStart;
+    const uint64_t *colNumber;
+    const uint64_t *colSorted;
+};
+
+/* #### #### #### #### #### #### ####
+ *
+ * Index construction.
+ *
+ * #### #### #### #### #### #### ####
+ */
+
+/* 64-bit FNV-1a hash. */
+static uint64_t
+hash_bytes (const char *data, size_t len, uint64_t h)
+{
+    size_t ii;
+
+    for (ii = 0; ii < len; ii++) {
+	h ^= (unsigned char)data[ii];
+	h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define HASH_INIT	0xcbf29ce484222325ULL
+
+static void
+compute_fingerprint (const char *data, size_t size, binIndexFingerprint *fp)
+{
+    size_t nbytes = size < FINGERPRINT_BYTES ? size : FINGERPRINT_BYTES;
+    size_t posn = size;
+
+    fp->hashBytes = FINGERPRINT_BYTES;
+    fp->headHash = hash_bytes (data, nbytes, HASH_INIT);
+    fp->tailHash = hash_bytes (data + size - nbytes, nbytes, HASH_INIT);
+    while (posn > 0 && data[posn-1] != '\n')
+	posn--;
+    fp->scanEnd = (uint64_t)posn;
+}
+
+/* Compute the hash of nbytes of fp starting at offset start. */
+static enum status
+hash_file_range (FILE *fp, long start, size_t nbytes, uint64_t *hashp)
+{
+    char buffer[8192];
+    size_t chunk;
+    uint64_t h = HASH_INIT;
+
+    if (fseek (fp, start, SEEK_SET) < 0)
+	return SEEK_FAILED;
+    while (nbytes > 0) {
+	chunk = nbytes < sizeof(buffer) ? nbytes : sizeof(buffer);
+	if (fread (buffer, 1, chunk, fp) != chunk)
+	    return READ_ERROR;
+	h = hash_bytes (buffer, chunk, h);
+	nbytes -= chunk;
+    }
+    *hashp = h;
+    return OK;
+}
+
+/* As compute_fingerprint, but hashes the size bytes of the file ip directly.  Used for compressed
+ * data files, whose row offsets do not refer to the file's bytes, so that no scan end is recorded.
+ */
+static enum status
+compute_file_fingerprint (FILE *ip, size_t size, binIndexFingerprint *fp)
+{
+    size_t nbytes = size < FINGERPRINT_BYTES ? size : FINGERPRINT_BYTES;
+    enum status res;
+
+    fp->hashBytes = FINGERPRINT_BYTES;
+    fp->scanEnd = 0;
+    if ((res = hash_file_range (ip, 0L, nbytes, &fp->headHash)) != OK)
+	return res;
+    return hash_file_range (ip, (long)(size - nbytes), nbytes, &fp->tailHash);
+}
+
+enum status
+stamp_file (FILE *fp, fileStamp *stamp)
+{
+    binIndexFingerprint fprint;
+    struct stat sb;
+    enum status res;
+
+    fflush (fp);
+    if (fstat (fileno (fp), &sb) < 0)
+	return READ_ERROR;
+    if ((res = compute_file_fingerprint (fp, (size_t)sb.st_size, &fprint)) != OK)
+	return res;
+    stamp->size = (uint64_t)sb.st_size;
+    stamp->mtime = (int64_t)sb.st_mtime;
+    stamp->hashBytes = fprint.hashBytes;
+    stamp->headHash = fprint.headHash;
+    stamp->tailHash = fprint.tailHash;
+    return OK;
+}
+
+int
+stamps_equal (const fileStamp *a, const fileStamp *b)
+{
+    return a->size == b->size && a->mtime == b->mtime && a->hashBytes == b->hashBytes &&
+	a->headHash == b->headHash && a->tailHash == b->tailHash;
+}
+
+int
+compare_labels (const char *a, long alen, const char *b, long blen)
+{
+    int cmp = memcmp (a, b, alen < blen ? alen : blen);
+    if (cmp != 0) return cmp;
+    if (alen < blen) return -1;
+    if (alen > blen) return 1;
+    return 0;
+}
+
+/* Order rows by label, then by position in the data file. */
+static int
+compare_rowEntry (const void *a, const void *b)
+{
+    const rowEntry *ap = (const rowEntry *)a;
+    const rowEntry *bp = (const rowEntry *)b;
+    int cmp = compare_labels (ap->key, ap->keylen, bp->key, bp->keylen);
+
+    if (cmp != 0) return cmp;
+    if (ap->offset < bp->offset) return -1;
+    if (ap->offset > bp->offset) return 1;
+    return 0;
+}
+
+/* A distinct column label of a header line. */
+typedef struct {
+    const char *key;
+    long keylen;
+    long pos;		/* Number of distinct labels preceding this one in the header line. */
+} colEntry;
+
+static int
+compare_colEntry (const void *a, const void *b)
+{
+    const colEntry *ap = (const colEntry *)a;
+    const colEntry *bp = (const colEntry *)b;
+
+    return compare_labels (ap->key, ap->keylen, bp->key, bp->keylen);
+}
+
+/* The schema sections of an index, as built by collect_schema. */
+typedef struct {
+    binIndexSchema info;
+    char *keys;
+    uint64_t *keyStart;
+    uint64_t *number;
+    uint64_t *sorted;
+} schemaTable;
+
+static void
+free_schema (schemaTable *sch)
+{
+    free (sch->keys);
+    free (sch->keyStart);
+    free (sch->number);
+    free (sch->sorted);
+}
+
+/* Parse the header line of the data of job into sch, following the rules of scan_header_line:
+ * the header is R-style if it has one field fewer than the first data line, and it must label
+ * every data column.  Returns OK, OUT_OF_MEMORY, or NO_LABEL_ERROR if the data has no schema to
+ * record (no complete header line followed by a data line, or a header that does not label
+ * every data column), in which case readers scan the header line of the data file instead.
+ */
+static enum status
+collect_schema (const indexJob *job, schemaTable *sch)
+{
+    const char *data = job->data;
+    const char *nl, *str;
+    size_t hdrlen, rowlen;
+    long headercols, rowcols, nnames, ii, iter, len, value;
+    uint64_t keybytes;
+    dynHashTab *dht;
+    colEntry *cols = NULL;
+    enum status res;
+
+    memset (sch, 0, sizeof(*sch));
+    if ((nl = memchr (data, '\n', job->size)) == NULL)
+	return NO_LABEL_ERROR;
+    hdrlen = (size_t)(nl - data) + 1;
+    if (hdrlen == job->size)
+	return NO_LABEL_ERROR;
+    nl = memchr (data + hdrlen, '\n', job->size - hdrlen);
+    rowlen = nl == NULL ? job->size - hdrlen : (size_t)(nl - data) + 1 - hdrlen;
+    headercols = num_columns (data, (long)hdrlen);
+    rowcols = num_columns (data + hdrlen, (long)rowlen);
+
+    /* Labels point into the data, which outlives the table. */
+    if ((dht = newDynHashTab (1024, 0)) == NULL)
+	return OUT_OF_MEMORY;
+    if (scan_header_fields (dht, data, (long)hdrlen, rowcols == headercols, 1) != rowcols - 1) {
+	res = NO_LABEL_ERROR;
+	goto done;
+    }
+    res = OUT_OF_MEMORY;
+    if (dhtFailed (dht))
+	goto done;
+    nnames = dhtNumStrings (dht);
+    cols = malloc ((nnames + 1) * sizeof(colEntry));
+    sch->keyStart = malloc ((nnames + 1) * sizeof(uint64_t));
+    sch->number = malloc ((nnames + 1) * sizeof(uint64_t));
+    sch->sorted = malloc ((nnames + 1) * sizeof(uint64_t));
+    if (cols == NULL || sch->keyStart == NULL || sch->number == NULL || sch->sorted == NULL)
+	goto done;
+
+    keybytes = 0;
+    ii = 0;
+    initIterator (dht, &iter);
+    while (getNextStr (dht, &iter, &str, &len, NULL, &value)) {
+	cols[ii].key = str;
+	cols[ii].keylen = len;
+	cols[ii].pos = ii;
+	sch->keyStart[ii] = keybytes;
+	sch->number[ii] = (uint64_t)value;
+	keybytes += len;
+	ii++;
+    }
+    sch->keyStart[nnames] = keybytes;
+    if ((sch->keys = malloc (keybytes + 1)) == NULL)
+	goto done;
+    for (ii = 0; ii < nnames; ii++) {
+	memcpy (sch->keys + sch->keyStart[ii], cols[ii].key, cols[ii].keylen);
+    }
+
+    /* Labels are distinct, so the sorted order is unique. */
+    qsort (cols, nnames, sizeof(colEntry), compare_colEntry);
+    for (ii = 0; ii < nnames; ii++) {
+	sch->sorted[ii] = (uint64_t)cols[ii].pos;
+    }
+
+    sch->info.numColumns = (uint64_t)(rowcols - 1);
+    sch->info.numNames = (uint64_t)nnames;
+    sch->info.flags = rowcols != headercols ? SCHEMA_FLAG_RSTYLE : 0;
+    sch->info.headerLen = (uint64_t)hdrlen;
+    res = OK;
+
+done:
+    free (cols);
+    freeDynHashTab (dht);
+    if (res != OK) {
+	free_schema (sch);
+	memset (sch, 0, sizeof(*sch));
+    }
+    return res;
+}
+
+long
+align_output (FILE *op)
+{
+    static const char padding[8] = { 0 };
+    long posn = ftell (op);
+
+    if (posn >= 0 && posn % 8 != 0) {
+	size_t pad = (size_t)(8 - posn % 8);
+
+	if (fwrite (padding, 1, pad, op) != pad)
+	    return -1L;
+	posn += 8 - posn % 8;
+    }
+    return posn;
+}
+
+static enum status
+write_section (FILE *op, binIndexHeader *hdr, uint32_t type, const void *data, size_t size)
+{
+    long posn;
+    binIndexSection *sect;
+
+    if ((posn = align_output (op)) < 0)
+	return WRITE_ERROR;
+    if (size > 0 && fwrite (data, 1, size, op) != size)
+	return WRITE_ERROR;
+
+    sect = &hdr->section[hdr->numSections++];
+    sect->type = type;
+    sect->reserved = 0;
+    sect->offset = (uint64_t)posn;
+    sect->size = (uint64_t)size;
+    return OK;
+}
+
+/* Sort rows by label, merge rows with duplicate labels, and write the result to op.
+ * As with the text index, the offset of the last row with a given label is retained, but the
+ * label is considered to occur in the data file at the position of its first row.
+ * A fingerprint of the data file ip (its size, modification time, and hashes of its first and
+ * last bytes) is recorded in the index, as are the rows' column checkpoints if job->colstride
+ * is positive, and the column labels of the header line if it labels every data column.
+ * The job's data must be the entire contents of ip.
+ * The job's rows array is reordered.
+ */
+enum status
+write_binary_index (FILE *op, FILE *ip, indexJob *job)
+{
+    binIndexHeader hdr;
+    binIndexFingerprint fp;
+    schemaTable sch;
+    enum status schres;
+    struct stat sb;
+    rowEntry *rows = job->row;
+    long nrows = job->count;
+    long *sortedPosn = NULL;
+    uint64_t *keyStart = NULL, *offsets = NULL, *order = NULL, *rowLen = NULL, *ckptStart = NULL;
+    uint32_t *ckpt = NULL;
+    uint64_t colstride = (uint64_t)job->colstride;
+    char *keys = NULL;
+    uint64_t keybytes, nckpt;
+    long ii, nkeys, norder;
+    enum status res = OUT_OF_MEMORY;
+
+    if (fstat (fileno (ip), &sb) < 0)
+	return READ_ERROR;
+    if ((schres = collect_schema (job, &sch)) == OUT_OF_MEMORY)
+	return OUT_OF_MEMORY;
+
+    qsort (rows, nrows, sizeof(rowEntry), compare_rowEntry);
+
+    /* Merge duplicates.  Within a run of equal labels, the first row has the smallest ordinal
+     * and the last row has the largest offset.
+     */
+    nkeys = 0;
+    for (ii = 0; ii < nrows; ii++) {
+	if (nkeys > 0 && compare_labels (rows[nkeys-1].key, rows[nkeys-1].keylen, rows[ii].key, rows[ii].keylen) == 0) {
+	    rows[nkeys-1].offset = rows[ii].offset;
+	    rows[nkeys-1].length = rows[ii].length;
+	    rows[nkeys-1].ckpt = rows[ii].ckpt;
+	    rows[nkeys-1].nckpt = rows[ii].nckpt;
+	} else {
+	    rows[nkeys++] = rows[ii];
+	}
+    }
+
+    keyStart = malloc ((nkeys + 1) * sizeof(uint64_t));
+    offsets = malloc ((nkeys + 1) * sizeof(uint64_t));
+    order = malloc ((nkeys + 1) * sizeof(uint64_t));
+    rowLen = malloc ((nkeys + 1) * sizeof(uint64_t));
+    sortedPosn = malloc ((nrows + 1) * sizeof(long));
+    if (keyStart == NULL || offsets == NULL || order == NULL || rowLen == NULL || sortedPosn == NULL)
+	goto done;
+
+    keybytes = 0;
+    for (ii = 0; ii < nkeys; ii++) {
+	keyStart[ii] = keybytes;
+	keybytes += rows[ii].keylen;
+	offsets[ii] = (uint64_t)rows[ii].offset;
+	rowLen[ii] = (uint64_t)rows[ii].length;
+    }
+    keyStart[nkeys] = keybytes;
+
+    if ((keys = malloc (keybytes + 1)) == NULL)
+	goto done;
+    for (ii = 0; ii < nkeys; ii++) {
+	memcpy (keys + keyStart[ii], rows[ii].key, rows[ii].keylen);
+    }
+
+    /* Ordinals are dense in [0,nrows), so the data file order of the surviving labels
+     * can be recovered without sorting.
+     */
+    for (ii = 0; ii < nrows; ii++) sortedPosn[ii] = -1L;
+    for (ii = 0; ii < nkeys; ii++) sortedPosn[rows[ii].ordinal] = ii;
+    norder = 0;
+    for (ii = 0; ii < nrows; ii++) {
+	if (sortedPosn[ii] >= 0)
+	    order[norder++] = (uint64_t)sortedPosn[ii];
+    }
+
+    if (colstride > 0) {
+	ckptStart = malloc ((nkeys + 1) * sizeof(uint64_t));
+	if (ckptStart == NULL)
+	    goto done;
+	nckpt = 0;
+	for (ii = 0; ii < nkeys; ii++) {
+	    ckptStart[ii] = nckpt;
+	    nckpt += rows[ii].nckpt;
+	}
+	ckptStart[nkeys] = nckpt;
+	if ((ckpt = malloc ((nckpt + 1) * sizeof(uint32_t))) == NULL)
+	    goto done;
+	for (ii = 0; ii < nkeys; ii++) {
+	    memcpy (ckpt + ckptStart[ii], job->ckpt + rows[ii].ckpt, rows[ii].nckpt * sizeof(uint32_t));
+	}
+    }
+
+    memset (&hdr, 0, sizeof(hdr));
+    memcpy (hdr.magic, BININDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version = BININDEX_VERSION;
+    hdr.byteorder = BININDEX_BYTEORDER;
+    hdr.numRows = (uint64_t)nkeys;
+    hdr.dataSize = (uint64_t)sb.st_size;
+    hdr.dataMtime = (int64_t)sb.st_mtime;
+    if (job->bgzf) {
+	hdr.flags |= BININDEX_FLAG_BGZF;
+	if ((res = compute_file_fingerprint (ip, (size_t)sb.st_size, &fp)) != OK)
+	    goto done;
+    } else {
+	compute_fingerprint (job->data, job->size, &fp);
+    }
+
+    res = WRITE_ERROR;
+    if (fseek (op, 0L, SEEK_SET) < 0 || fwrite (&hdr, sizeof(hdr), 1, op) != 1)
+	goto done;
+    if ((res = write_section (op, &hdr, SECT_KEYS, keys, keybytes)) != OK ||
+	(res = write_section (op, &hdr, SECT_KEYSTART, keyStart, (nkeys + 1) * sizeof(uint64_t))) != OK ||
+	(res = write_section (op, &hdr, SECT_OFFSETS, offsets, nkeys * sizeof(uint64_t))) != OK ||
+	(res = write_section (op, &hdr, SECT_ORDER, order, nkeys * sizeof(uint64_t))) != OK ||
+	(res = write_section (op, &hdr, SECT_FINGERPRINT, &fp, sizeof(fp))) != OK ||
+	(res = write_section (op, &hdr, SECT_ROWLEN, rowLen, nkeys * sizeof(uint64_t))) != OK)
+	goto done;
+    if (colstride > 0) {
+	if ((res = write_section (op, &hdr, SECT_CKPTINFO, &colstride, sizeof(uint64_t))) != OK ||
+	    (res = write_section (op, &hdr, SECT_CKPTSTART, ckptStart, (nkeys + 1) * sizeof(uint64_t))) != OK ||
+	    (res = write_section (op, &hdr, SECT_CKPT, ckpt, ckptStart[nkeys] * sizeof(uint32_t))) != OK)
+	    goto done;
+    }
+    if (schres == OK) {
+	uint64_t nnames = sch.info.numNames;
+	if ((res = write_section (op, &hdr, SECT_SCHEMA, &sch.info, sizeof(sch.info))) != OK ||
+	    (res = write_section (op, &hdr, SECT_COLKEYS, sch.keys, sch.keyStart[nnames])) != OK ||
+	    (res = write_section (op, &hdr, SECT_COLKEYSTART, sch.keyStart, (nnames + 1) * sizeof(uint64_t))) != OK ||
+	    (res = write_section (op, &hdr, SECT_COLNUMBER, sch.number, nnames * sizeof(uint64_t))) != OK ||
+	    (res = write_section (op, &hdr, SECT_COLSORTED, sch.sorted, nnames * sizeof(uint64_t))) != OK)
+	    goto done;
+    }
+
+    /* Rewrite header now that the section table is complete. */
+    res = WRITE_ERROR;
+    if (fseek (op, 0L, SEEK_SET) < 0 || fwrite (&hdr, sizeof(hdr), 1, op) != 1 || fflush (op) != 0)
+	goto done;
+    res = OK;
+
+done:
+    free (keys);
+    free (keyStart);
+    free (offsets);
+    free (order);
+    free (rowLen);
+    free (sortedPosn);
+    free (ckptStart);
+    free (ckpt);
+    free_schema (&sch);
+    return res;
+}
+
+/* #### #### #### #### #### #### ####
+ *
+ * Index access.
+ *
+ * #### #### #### #### #### #### ####
+ */
+
+int
+is_binary_index (FILE *indexp)
+{
+    char magic[8];
+    int isbin;
+
+    rewind (indexp);
+    isbin = fread (magic, 1, sizeof(magic), indexp) == sizeof(magic) &&
+	    memcmp (magic, BININDEX_MAGIC, sizeof(magic)) == 0;
+    rewind (indexp);
+    return isbin;
+}
+
+/* Return the address of section type in idx and check that it contains size bytes. */
+static const void *
+find_section (const binIndex *idx, uint32_t type, uint64_t size)
+{
+    uint32_t ii;
+
+    for (ii = 0; ii < idx->hdr->numSections; ii++) {
+	const binIndexSection *sect = &idx->hdr->section[ii];
+	if (sect->type == type) {
+	    if (sect->size != size || !mapped_range_fits (&idx->map, sect->offset, sect->size))
+		return NULL;
+	    return idx->map.addr + sect->offset;
+	}
+    }
+    return NULL;
+}
+
+static uint64_t
+section_size (const binIndex *idx, uint32_t type)
+{
+    uint32_t ii;
+
+    for (ii = 0; ii < idx->hdr->numSections; ii++) {
+	if (idx->hdr->section[ii].type == type)
+	    return idx->hdr->section[ii].size;
+    }
+    return 0;
+}
+
+enum status
+open_binary_index (FILE *indexp, binIndex **idxp)
+{
+    binIndex *idx;
+    uint64_t nrows;
+    enum status res;
+
+    if ((idx = malloc (sizeof(*idx))) == NULL)
+	return OUT_OF_MEMORY;
+    res = map_file (indexp, &idx->map);
+    if (res != OK) {
+	free (idx);
+	return res;
+    }
+
+    res = BAD_INDEX_FORMAT;
+    idx->hdr = (const binIndexHeader *)idx->map.addr;
+    if (idx->map.size < sizeof(binIndexHeader) ||
+	memcmp (idx->hdr->magic, BININDEX_MAGIC, sizeof(idx->hdr->magic)) != 0 ||
+	idx->hdr->byteorder != BININDEX_BYTEORDER ||
+	idx->hdr->version > BININDEX_VERSION ||
+	idx->hdr->numSections > BININDEX_MAX_SECTIONS)
+	goto fail;
+
+    nrows = idx->hdr->numRows;
+    idx->numRows = (long)nrows;
+    idx->keys = find_section (idx, SECT_KEYS, section_size (idx, SECT_KEYS));
+    idx->keyStart = find_section (idx, SECT_KEYSTART, (nrows + 1) * sizeof(uint64_t));
+    idx->offsets = find_section (idx, SECT_OFFSETS, nrows * sizeof(uint64_t));
+    idx->order = find_section (idx, SECT_ORDER, nrows * sizeof(uint64_t));
+    if (idx->keys == NULL || idx->keyStart == NULL || idx->offsets == NULL || idx->order == NULL ||
+	idx->keyStart[nrows] > section_size (idx, SECT_KEYS))
+	goto fail;
+
+    /* Row lengths are optional. */
+    idx->rowLen = find_section (idx, SECT_ROWLEN, nrows * sizeof(uint64_t));
+
+    /* Column checkpoints are optional. */
+    idx->colstride = 0;
+    idx->ckptStart = NULL;
+    idx->ckpt = NULL;
+    if (section_size (idx, SECT_CKPTINFO) == sizeof(uint64_t)) {
+	const uint64_t *info = find_section (idx, SECT_CKPTINFO, sizeof(uint64_t));
+	idx->ckptStart = find_section (idx, SECT_CKPTSTART, (nrows + 1) * sizeof(uint64_t));
+	if (info == NULL || idx->ckptStart == NULL || info[0] == 0)
+	    goto fail;
+	idx->ckpt = find_section (idx, SECT_CKPT, idx->ckptStart[nrows] * sizeof(uint32_t));
+	if (idx->ckpt == NULL)
+	    goto fail;
+	idx->colstride = (long)info[0];
+    }
+
+    idx->fp = find_section (idx, SECT_FINGERPRINT, sizeof(binIndexFingerprint));
+
+    /* So is the schema. */
+    idx->colKeys = NULL;
+    idx->colKeyStart = idx->colNumber = idx->colSorted = NULL;
+    if ((idx->schema = find_section (idx, SECT_SCHEMA, sizeof(binIndexSchema))) != NULL) {
+	uint64_t nnames = idx->schema->numNames;
+	uint64_t ii;
+	idx->colKeys = find_section (idx, SECT_COLKEYS, section_size (idx, SECT_COLKEYS));
+	idx->colKeyStart = find_section (idx, SECT_COLKEYSTART, (nnames + 1) * sizeof(uint64_t));
+	idx->colNumber = find_section (idx, SECT_COLNUMBER, nnames * sizeof(uint64_t));
+	idx->colSorted = find_section (idx, SECT_COLSORTED, nnames * sizeof(uint64_t));
+	if (idx->colKeys == NULL || idx->colKeyStart == NULL || idx->colNumber == NULL || idx->colSorted == NULL ||
+	    idx->colKeyStart[nnames] > section_size (idx, SECT_COLKEYS))
+	    goto fail;
+	for (ii = 0; ii < nnames; ii++) {
+	    if (idx->colSorted[ii] >= nnames)
+		goto fail;
+	}
+    }
+
+    *idxp = idx;
+    return OK;
+
+fail:
+    unmap_file (&idx->map);
+    free (idx);
+    return res;
+}
+
+void
+close_binary_index (binIndex *idx)
+{
+    unmap_file (&idx->map);
+    free (idx);
+}
+
+long
+binary_index_num_rows (const binIndex *idx)
+{
+    return idx->numRows;
+}
+
+long
+binary_index_lower_bound (const binIndex *idx, const char *str, long len)
+{
+    long lo = 0, hi = idx->numRows;
+    long mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (compare_labels (idx->keys + idx->keyStart[mid], (long)(idx->keyStart[mid+1] - idx->keyStart[mid]), str, len) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+long
+binary_index_find (const binIndex *idx, const char *str, long len)
+{
+    long pos = binary_index_lower_bound (idx, str, len);
+
+    if (pos < idx->numRows &&
+	compare_labels (idx->keys + idx->keyStart[pos], (long)(idx->keyStart[pos+1] - idx->keyStart[pos]), str, len) == 0)
+	return pos;
+    return -1L;
+}
+
+void
+binary_index_label (const binIndex *idx, long pos, const char **strp, long *lenp)
+{
+    *strp = idx->keys + idx->keyStart[pos];
+    *lenp = (long)(idx->keyStart[pos+1] - idx->keyStart[pos]);
+}
+
+long
+binary_index_offset (const binIndex *idx, long pos)
+{
+    return (long)idx->offsets[pos];
+}
+
+long
+binary_index_lookup (const binIndex *idx, const char *str, long len)
+{
+    long pos = binary_index_find (idx, str, len);
+    return pos < 0 ? -1L : (long)idx->offsets[pos];
+}
+
+long
+binary_index_row_length (const binIndex *idx, long pos)
+{
+    return idx->rowLen == NULL ? -1L : (long)idx->rowLen[pos];
+}
+
+long
+binary_index_colstride (const binIndex *idx)
+{
+    return idx->colstride;
+}
+
+long
+binary_index_checkpoints (const binIndex *idx, long pos, const uint32_t **ckptp)
+{
+    if (idx->colstride == 0) {
+	*ckptp = NULL;
+	return 0;
+    }
+    *ckptp = idx->ckpt + idx->ckptStart[pos];
+    return (long)(idx->ckptStart[pos+1] - idx->ckptStart[pos]);
+}
+
+long
+binary_index_num_columns (const binIndex *idx)
+{
+    return idx->schema == NULL ? -1L : (long)idx->schema->numNames;
+}
+
+long
+binary_index_find_column (const binIndex *idx, const char *str, long len)
+{
+    long lo = 0, hi = (long)idx->schema->numNames;
+    long mid, pos;
+    int cmp;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	pos = (long)idx->colSorted[mid];
+	cmp = compare_labels (idx->colKeys + idx->colKeyStart[pos], (long)(idx->colKeyStart[pos+1] - idx->colKeyStart[pos]), str, len);
+	if (cmp == 0)
+	    return pos;
+	if (cmp < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return -1L;
+}
+
+void
+binary_index_column_label (const binIndex *idx, long pos, const char **strp, long *lenp)
+{
+    *strp = idx->colKeys + idx->colKeyStart[pos];
+    *lenp = (long)(idx->colKeyStart[pos+1] - idx->colKeyStart[pos]);
+}
+
+long
+binary_index_column_number (const binIndex *idx, long pos)
+{
+    return (long)idx->colNumber[pos];
+}
+
+enum status
+scan_binary_index (const binIndex *idx, dynHashTab *dht, long insertall)
+{
+    long ii, iter, len, posn;
+    uint64_t sp;
+    const char *str;
+
+    if (insertall) {
+	dhtReserve (dht, dhtNumStrings (dht) + idx->numRows);
+	for (ii = 0; ii < idx->numRows; ii++) {
+	    sp = idx->order[ii];
+	    if (sp >= (uint64_t)idx->numRows)
+		return BAD_INDEX_FORMAT;
+	    insertStrVal (dht, idx->keys + idx->keyStart[sp], (long)(idx->keyStart[sp+1] - idx->keyStart[sp]), (long)idx->offsets[sp]);
+	}
+    } else {
+	/* Look up only the labels we want. */
+	initIterator (dht, &iter);
+	while (getNextStr (dht, &iter, &str, &len, NULL, NULL)) {
+	    if ((posn = binary_index_lookup (idx, str, len)) >= 0)
+		changeStrVal (dht, str, len, posn);
+	}
+    }
+    return OK;
+}
+
+/* #### #### #### #### #### #### ####
+ *
+ * Index maintenance.
+ *
+ * #### #### #### #### #### #### ####
+ */
+
+enum status
+check_binary_index (const binIndex *idx, FILE *tsvp)
+{
+    struct stat sb;
+    uint64_t oldSize = idx->hdr->dataSize;
+    uint64_t size, nbytes, h;
+    enum status res;
+
+    fflush (tsvp);
+    if (fstat (fileno (tsvp), &sb) < 0)
+	return READ_ERROR;
+    size = (uint64_t)sb.st_size;
+
+    if (size < oldSize)
+	return STALE_INDEX;
+    if (size == oldSize && (int64_t)sb.st_mtime != idx->hdr->dataMtime)
+	return STALE_INDEX;
+    if (idx->fp == NULL)
+	/* Index predates fingerprints: size and modification time are all we can check. */
+	return size == oldSize ? OK : STALE_INDEX;
+
+    /* The start of the file, including the header line, must be unchanged. */
+    nbytes = oldSize < idx->fp->hashBytes ? oldSize : idx->fp->hashBytes;
+    if ((res = hash_file_range (tsvp, 0L, (size_t)nbytes, &h)) != OK)
+	return res;
+    if (h != idx->fp->headHash)
+	return STALE_INDEX;
+
+    /* So must the bytes that were at the end of the file. */
+    if ((res = hash_file_range (tsvp, (long)(oldSize - nbytes), (size_t)nbytes, &h)) != OK)
+	return res;
+    if (h != idx->fp->tailHash)
+	return STALE_INDEX;
+
+    /* Appending to a compressed file rewrites its end of file marker, so it is reindexed. */
+    if (size != oldSize && (idx->hdr->flags & BININDEX_FLAG_BGZF))
+	return STALE_INDEX;
+    return size == oldSize ? OK : GROWN_DATA;
+}
+
+enum status
+update_binary_index (const binIndex *idx, FILE *ip, FILE *op, int nthreads)
+{
+    mappedFile data;
+    indexJob tail, job;
+    long ii, nold, sp, last, first;
+    uint64_t scanEnd, oldckpts;
+    enum status res;
+
+    if (idx->fp == NULL)
+	return STALE_INDEX;
+    scanEnd = idx->fp->scanEnd;
+    if ((res = map_file (ip, &data)) != OK)
+	return res;
+
+    /* Index lines that follow the last complete line seen previously. */
+    tail.data = data.addr;
+    tail.size = data.size;
+    tail.start = (size_t)scanEnd;
+    tail.colstride = idx->colstride;
+    tail.bgzf = 0;
+    collect_rows (&tail, 1, nthreads);
+    res = tail.res;
+    if (res != OK && res != INCOMPLETE_LAST_LINE && res != EMPTY_FILE)
+	goto done;
+
+    /* A previously incomplete last line has been indexed again, as the first row of the tail.
+     * If its label was itself incomplete, the position of the last complete row with the old
+     * label is not recorded, so the whole file is indexed again.
+     */
+    last = -1L;
+    for (ii = 0; ii < idx->numRows; ii++) {
+	if (idx->offsets[ii] >= scanEnd)
+	    last = ii;
+    }
+    if (last >= 0 && (tail.count == 0 || (uint64_t)tail.row[0].offset != idx->offsets[last] ||
+		      compare_labels (tail.row[0].key, tail.row[0].keylen, idx->keys + idx->keyStart[last],
+				      (long)(idx->keyStart[last+1] - idx->keyStart[last])) != 0)) {
+	free (tail.row);
+	free (tail.ckpt);
+	tail.start = 0;
+	collect_rows (&tail, 1, nthreads);
+	res = tail.res;
+	if ((res == OK || res == INCOMPLETE_LAST_LINE) && (res = write_binary_index (op, ip, &tail)) == OK)
+	    res = tail.res;
+	goto done;
+    }
+
+    /* Combine previously indexed rows (in data file order) with the new rows.  The label of a
+     * previously incomplete last line keeps its place in data file order, but takes the position,
+     * length and checkpoints of the line from the tail.
+     */
+    oldckpts = idx->colstride > 0 ? idx->ckptStart[idx->numRows] : 0;
+    job.data = data.addr;
+    job.size = data.size;
+    job.start = 0;
+    job.colstride = idx->colstride;
+    job.bgzf = 0;
+    job.row = malloc ((idx->numRows + tail.count + 1) * sizeof(rowEntry));
+    job.ckpt = malloc ((oldckpts + tail.nckpt + 1) * sizeof(uint32_t));
+    job.res = OK;
+    if (job.row == NULL || job.ckpt == NULL) {
+	res = OUT_OF_MEMORY;
+	goto done2;
+    }
+    if (oldckpts > 0)
+	memcpy (job.ckpt, idx->ckpt, oldckpts * sizeof(uint32_t));
+    if (tail.nckpt > 0)
+	memcpy (job.ckpt + oldckpts, tail.ckpt, tail.nckpt * sizeof(uint32_t));
+    job.nckpt = (long)oldckpts + tail.nckpt;
+
+    nold = 0;
+    for (ii = 0; ii < idx->numRows; ii++) {
+	sp = (long)idx->order[ii];
+	if (sp == last) {
+	    job.row[nold] = tail.row[0];
+	    job.row[nold].ckpt += (long)oldckpts;
+	} else {
+	    job.row[nold].key = idx->keys + idx->keyStart[sp];
+	    job.row[nold].keylen = (long)(idx->keyStart[sp+1] - idx->keyStart[sp]);
+	    job.row[nold].offset = (long)idx->offsets[sp];
+	    if (idx->rowLen != NULL) {
+		job.row[nold].length = (long)idx->rowLen[sp];
+	    } else {
+		const char *nl = memchr (data.addr + idx->offsets[sp], '\n', data.size - idx->offsets[sp]);
+		job.row[nold].length = nl == NULL ? (long)(data.size - idx->offsets[sp]) : (long)(nl - (data.addr + idx->offsets[sp]));
+	    }
+	    job.row[nold].ckpt = idx->colstride > 0 ? (long)idx->ckptStart[sp] : 0;
+	    job.row[nold].nckpt = idx->colstride > 0 ? (long)(idx->ckptStart[sp+1] - idx->ckptStart[sp]) : 0;
+	}
+	job.row[nold].ordinal = nold;
+	nold++;
+    }
+    first = last >= 0 ? 1 : 0;
+    for (ii = first; ii < tail.count; ii++) {
+	job.row[nold+ii-first] = tail.row[ii];
+	job.row[nold+ii-first].ordinal = nold + ii - first;
+	job.row[nold+ii-first].ckpt += (long)oldckpts;
+    }
+    job.count = nold + tail.count - first;
+
+    if ((res = write_binary_index (op, ip, &job)) == OK)
+	res = tail.res;
+
+done2:
+    free (job.row);
+    free (job.ckpt);
+done:
+    free (tail.row);
+    free (tail.ckpt);
+    unmap_file (&data);
+    return res;
+}
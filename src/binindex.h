@@ -0,0 +1,133 @@
+
+/* This module implements a binary, memory-mappable row index for TSV files.
+ *
+ * A binary index records, for each distinct row label in a TSV file, the byte offset and length
+ * of the last data line with that label.  The labels are stored in sorted order, so
+ * that individual labels can be located by binary search without reading the entire index.
+ * The index also records the order in which the labels first occur in the data file, and a
+ * fingerprint (size, modification time, and hashes of the first and last bytes) of the data
+ * file it was created from, so that changes to the data file can be detected.
+ *
+ * If the header line of the data file labels every data column, its labels are also recorded, so
+ * that columns can be located without reading the data file.
+ *
+ * The legacy text index format ("label\toffset\n" per line) is implemented by generate_index
+ * and scan_index_file.  Scan_index_file accepts either format.
+ *
+ * Summary of operations:
+ */
+
+typedef struct _binindex binIndex;
+
+/* Write a binary index of the rows found by collect_rows in the TSV file ip to op.
+ * The job's rows array is reordered.
+ */
+extern enum status write_binary_index (FILE *op, FILE *ip, indexJob *job);
+
+/* Returns 1 iff the index file indexp is in binary format. The file is rewound. */
+extern int is_binary_index (FILE *indexp);
+
+/* Map the binary index file indexp into memory.  On success, *idxp is set to the new index. */
+extern enum status open_binary_index (FILE *indexp, binIndex **idxp);
+
+/* Release an index opened by open_binary_index.  The index file itself is not closed. */
+extern void close_binary_index (binIndex *idx);
+
+/* Returns the number of distinct row labels in idx. */
+extern long binary_index_num_rows (const binIndex *idx);
+
+/* Returns the byte offset of the row with label str in the data file.
+ * Returns -1L if the label is not in the index.
+ */
+extern long binary_index_lookup (const binIndex *idx, const char *str, long len);
+
+/* Returns the position of label str in the sorted label table of idx.
+ * Returns -1L if the label is not in the index.
+ */
+extern long binary_index_find (const binIndex *idx, const char *str, long len);
+
+/* Returns the first position in the sorted label table of idx whose label is not less than str
+ * (in memcmp order), or the number of rows if there is no such label.
+ */
+extern long binary_index_lower_bound (const binIndex *idx, const char *str, long len);
+
+/* Sets *strp and *lenp to the label at sorted position pos of idx. */
+extern void binary_index_label (const binIndex *idx, long pos, const char **strp, long *lenp);
+
+/* Returns the byte offset in the data file of the row at sorted position pos. */
+extern long binary_index_offset (const binIndex *idx, long pos);
+
+/* Returns the length in bytes (excluding its newline) of the row at sorted position pos, or -1L if
+ * idx does not record row lengths.
+ */
+extern long binary_index_row_length (const binIndex *idx, long pos);
+
+/* Returns the column checkpoint stride of idx, or 0 if idx has no column checkpoints. */
+extern long binary_index_colstride (const binIndex *idx);
+
+/* Sets *ckptp to the column checkpoints of the row at sorted position pos and returns
+ * the number of checkpoints (0 if the row has none).
+ */
+extern long binary_index_checkpoints (const binIndex *idx, long pos, const uint32_t **ckptp);
+
+/* Returns the number of distinct column labels recorded in idx, or -1L if idx has no schema (the
+ * index predates schemas, or the header line of the data file does not label every data column),
+ * in which case the header line must be read from the data file.  The column labels are numbered
+ * in order of their first occurrence in the header line.
+ */
+extern long binary_index_num_columns (const binIndex *idx);
+
+/* Returns the number of the column label str in idx, which must have a schema, or -1L if the
+ * data file has no column with that label.
+ */
+extern long binary_index_find_column (const binIndex *idx, const char *str, long len);
+
+/* Sets *strp and *lenp to column label pos of idx. */
+extern void binary_index_column_label (const binIndex *idx, long pos, const char **strp, long *lenp);
+
+/* Returns the data column number of column label pos of idx (the last such column, if the label
+ * occurs more than once).
+ */
+extern long binary_index_column_number (const binIndex *idx, long pos);
+
+/* Equivalent of scan_index_file for a binary index:
+ * If insertall, all labels in idx are inserted into dht in data file order.
+ * Otherwise, each label already in dht that is also in idx has its value set to the row offset.
+ */
+extern enum status scan_binary_index (const binIndex *idx, dynHashTab *dht, long insertall);
+
+/* Check whether the data file tsvp still matches the fingerprint recorded in idx.
+ * Returns OK if it does, GROWN_DATA if data has only been appended to the file since the
+ * index was created, and STALE_INDEX if the file has otherwise changed.
+ */
+extern enum status check_binary_index (const binIndex *idx, FILE *tsvp);
+
+/* Write to op an index for the data file ip, which has grown since idx was created from it.
+ * Only the lines added to ip are scanned; the rest of the new index is copied from idx.
+ */
+extern enum status update_binary_index (const binIndex *idx, FILE *ip, FILE *op, int nthreads);
+
+/* Identifies the contents of a data file, for files derived from it other than its index. */
+typedef struct {
+    uint64_t size;	/* Size of the file in bytes. */
+    int64_t mtime;	/* Modification time of the file. */
+    uint64_t hashBytes;	/* Maximum number of bytes hashed at each end of the file. */
+    uint64_t headHash;	/* Hash of the first bytes of the file. */
+    uint64_t tailHash;	/* Hash of the last bytes of the file. */
+} fileStamp;
+
+/* Record the size, modification time, and hashes of the first and last bytes of the file fp. */
+extern enum status stamp_file (FILE *fp, fileStamp *stamp);
+
+/* Returns 1 iff the stamps a and b identify the same file contents. */
+extern int stamps_equal (const fileStamp *a, const fileStamp *b);
+
+/* Compare the labels a and b (of lengths alen and blen) in memcmp order, as strcmp does.
+ * This is the order in which sorted labels are stored.
+ */
+extern int compare_labels (const char *a, long alen, const char *b, long blen);
+
+/* Pad the file op to a multiple of 8 bytes, on which the sections of binary indexes and the files
+ * derived from data files are aligned.  Returns the resulting offset, or -1L on error.
+ */
+extern long align_output (FILE *op);
@@ -0,0 +1,1906 @@
+/* Copyright 2013 UT MD Anderson Cancer Center.
+ *
+ * Author : Bradley Broom
+ */
+
+/* The query engine of tsvio (see dataset.h).  Nothing in this file calls R.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <share.h>
+#else
+#include <unistd.h>  /* For unlink */
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "dht.h"
+#include "tsvio.h"
+#include "binindex.h"
+#include "mapfile.h"
+#include "parsenum.h"
+#include "bgzf.h"
+#include "numcache.h"
+#include "dataset.h"
+#include "stats.h"
+
+/* Wanted rows separated by fewer bytes than this are prefetched as a single range. */
+#define PREFETCH_GAP	(64*1024)
+
+/* Maximum number of bytes of wanted rows read from an unmapped data file at once. */
+#define MAX_READ_RUN	(4*1024*1024)
+
+/* Minimum number of bytes read from an unmapped data file at once (beyond the wanted rows). */
+#define MIN_READ	4096
+
+/* Wanted rows up to this many bytes beyond those being read are prefetched from an unmapped data file. */
+#define READ_AHEAD	(32*1024*1024)
+
+/* The bits of R's NA_real_: a NaN with low word 1954. */
+#define NA_DOUBLE_BITS	UINT64_C(0x7FF00000000007A2)
+
+double
+na_double (void)
+{
+    uint64_t bits = NA_DOUBLE_BITS;
+    double value;
+
+    memcpy (&value, &bits, sizeof(value));
+    return value;
+}
+
+int
+is_fatal_error (enum status res)
+{
+    return (res != OK) && (res != EMPTY_FILE) && (res != INCOMPLETE_LAST_LINE);
+}
+
+const char *
+status_message (enum status res)
+{
+    switch (res) {
+    case OK:			return "success";
+    case EMPTY_FILE:		return "file is empty";
+    case WRITE_ERROR:		return "error writing file";
+    case INCOMPLETE_LAST_LINE:	return "last line of file is incomplete";
+    case NO_LABEL_ERROR:	return "line does not contain a label";
+    case LABEL_NOT_FOUND:	return "label not found";
+    case NO_INDEX:		return "no index";
+    case LABEL_TOO_LONG:	return "label is too long";
+    case INDEX_TOO_LONG:	return "file is too large to index on this platform";
+    case NON_NUMERIC_IN_INDEX:	return "non-numeric offset in index";
+    case SEEK_FAILED:		return "error seeking in file";
+    case READ_ERROR:		return "error reading file";
+    case BAD_INDEX_FORMAT:	return "index file is corrupt or not an index";
+    case OUT_OF_MEMORY:		return "unable to allocate memory";
+    case STALE_INDEX:		return "index does not match data file";
+    case GROWN_DATA:		return "data file has grown since it was indexed";
+    case BAD_COMPRESSION:	return "file is corrupt or is not compressed in BGZF format";
+    case LINE_TOO_LONG:		return "line does not fit in the buffer given to bgzf_read_line (bgzf_read_line_copy grows it)";
+    case OPEN_FAILED:		return "unable to open file";
+    case NOT_BGZF:		return "file is not compressed in BGZF format (use bgzip)";
+    case PARSE_ERROR:		return "unable to parse field";
+    }
+    return "unknown error";
+}
+
+enum status
+build_index (const char *dataName, const char *indexName, int format, long colstride, int nthreads)
+{
+    FILE *ip, *op;
+    enum status res;
+
+    if ((ip = fopen (dataName, "rb")) == NULL)
+	return OPEN_FAILED;
+    if ((op = fopen (indexName, "wb")) == NULL) {
+	fclose (ip);
+	return WRITE_ERROR;
+    }
+    generate_indexes (1, &ip, &op, format, colstride, nthreads, &res);
+    fclose (ip);
+    if (fclose (op) != 0 && !is_fatal_error (res))
+	res = WRITE_ERROR;
+    if (is_fatal_error (res))
+	remove (indexName);
+    return res;
+}
+
+/* Replace the binary index indexName, open as *indexpp, with an updated index for the data
+ * file tsvp, which has grown since the index was created.  Only the new lines are scanned.
+ * On return, *indexpp is the updated index file open for reading, or NULL if it could not be opened.
+ */
+enum status
+update_index_file (FILE *tsvp, FILE **indexpp, const char *indexName, int nthreads)
+{
+    binIndex *idx;
+    FILE *newp;
+    char *newName;
+    enum status res;
+
+    if ((newName = (char *)malloc (strlen (indexName) + 5)) == NULL)
+	return OUT_OF_MEMORY;
+    sprintf (newName, "%s.new", indexName);
+
+    if ((res = open_binary_index (*indexpp, &idx)) != OK)
+	goto done;
+    if ((newp = fopen (newName, "wb")) == NULL) {
+	close_binary_index (idx);
+	res = WRITE_ERROR;
+	goto done;
+    }
+    res = update_binary_index (idx, tsvp, newp, nthreads);
+    close_binary_index (idx);
+    if (fclose (newp) != 0 && !is_fatal_error (res))
+	res = WRITE_ERROR;
+    if (is_fatal_error (res)) {
+	remove (newName);
+	goto done;
+    }
+
+    fclose (*indexpp);
+    *indexpp = NULL;
+#ifdef _WIN32
+    remove (indexName);
+#endif
+    if (rename (newName, indexName) != 0) {
+	remove (newName);
+	res = WRITE_ERROR;
+	goto done;
+    }
+    *indexpp = fopen (indexName, "rb");
+    if (*indexpp == NULL)
+	res = READ_ERROR;
+
+done:
+    free (newName);
+    return res;
+}
+
+/* Check that the index file, open as *indexpp, was created from the current contents of
+ * the data file tsvp.  If lines have only been appended to the data file, the index is
+ * updated in place and *grownp is set.  Text indexes contain no fingerprint of the data file
+ * and are not checked.
+ */
+enum status
+verify_index_file (FILE *tsvp, FILE **indexpp, const char *indexName, int *grownp)
+{
+    binIndex *idx;
+    enum status res;
+
+    *grownp = 0;
+    if (!is_binary_index (*indexpp))
+	return OK;
+    if ((res = open_binary_index (*indexpp, &idx)) != OK)
+	return res;
+    res = check_binary_index (idx, tsvp);
+    close_binary_index (idx);
+    if (res == GROWN_DATA) {
+	res = update_index_file (tsvp, indexpp, indexName, 0);
+	if (!is_fatal_error (res)) {
+	    *grownp = 1;
+	    res = OK;
+	}
+    }
+    return res;
+}
+
+
+void
+init_parse_problem (parseProblem *prob)
+{
+    prob->code = FIELD_OK;
+    prob->rowposn = -1L;
+    prob->len = 0;
+    prob->eofRow = -1L;
+}
+
+int
+record_parse_problem (parseProblem *prob, int code, long rowposn, const char *s, long n)
+{
+    if (prob->code == FIELD_OK) {
+	prob->code = code;
+	prob->rowposn = rowposn;
+	prob->len = n < (long)sizeof(prob->text) ? (int)n : (int)sizeof(prob->text);
+	memcpy (prob->text, s, prob->len);
+    }
+    return code;
+}
+
+void
+parse_problem_message (const parseProblem *prob, char *msg, size_t size)
+{
+    switch (prob->code) {
+    case FIELD_OK:
+	snprintf (msg, size, "no problem");
+	break;
+    case FIELD_NON_INTEGER:
+	snprintf (msg, size, "Non-integer field '%.*s' encountered", prob->len, prob->text);
+	break;
+    case FIELD_INTEGER_TRAILING:
+	snprintf (msg, size, "unexpected non-numeric data following integer field: '%.*s'", prob->len, prob->text);
+	break;
+    case FIELD_NON_NUMERIC:
+	snprintf (msg, size, "Non-numeric field '%.*s' encountered", prob->len, prob->text);
+	break;
+    case FIELD_NUMERIC_TRAILING:
+	snprintf (msg, size, "unexpected non-numeric data following numeric field: '%.*s'", prob->len, prob->text);
+	break;
+    case FIELD_INTEGER_OVERFLOW:
+	snprintf (msg, size, "integer field '%.*s' is too large for the result type: use a numeric or integer64 dtype", prob->len, prob->text);
+	break;
+    case FIELD_READ_ERROR:
+	snprintf (msg, size, "get_tsv_line: error reading line starting at %ld\n", prob->rowposn);
+	break;
+    case FIELD_NO_MEMORY:
+	snprintf (msg, size, "get_tsv_line: unable to allocate memory to read line starting at %ld\n", prob->rowposn);
+	break;
+    default:
+	snprintf (msg, size, "get_tsv_fields: line starting at %ld is beyond end of file\n", prob->rowposn);
+	break;
+    }
+}
+
+int set_result_int (const resultDest *dest, long idx, const char *s, long n)
+{
+    int64_t value;
+
+    switch (parse_int64 (s, n, &value)) {
+    case NUM_OK:
+	/* INT_MIN is NA_INT32, so is not a valid integer. */
+	if (value <= INT_MIN || value > INT_MAX)
+	    return FIELD_INTEGER_OVERFLOW;
+	dest->ivec[idx] = (int)value;
+	return FIELD_OK;
+    case NUM_NA:
+	dest->ivec[idx] = NA_INT32;
+	return FIELD_OK;
+    case NUM_TRAILING:
+	return FIELD_INTEGER_TRAILING;
+    case NUM_OVERFLOW:
+	return FIELD_INTEGER_OVERFLOW;
+    default:
+	return FIELD_NON_INTEGER;
+    }
+}
+
+/* Store an integer in a bit64 integer64 matrix: the int64_t is stored in the bits of a double.
+ * INT64_MIN is integer64's NA.
+ */
+int set_result_int64 (const resultDest *dest, long idx, const char *s, long n)
+{
+    int64_t value;
+
+    switch (parse_int64 (s, n, &value)) {
+    case NUM_OK:
+	if (value == INT64_MIN)
+	    return FIELD_INTEGER_OVERFLOW;
+	dest->lvec[idx] = value;
+	return FIELD_OK;
+    case NUM_NA:
+	dest->lvec[idx] = INT64_MIN;
+	return FIELD_OK;
+    case NUM_TRAILING:
+	return FIELD_INTEGER_TRAILING;
+    case NUM_OVERFLOW:
+	return FIELD_INTEGER_OVERFLOW;
+    default:
+	return FIELD_NON_INTEGER;
+    }
+}
+
+int set_result_num (const resultDest *dest, long idx, const char *s, long n)
+{
+    switch (parse_double (s, n, &dest->dvec[idx])) {
+    case NUM_OK:
+	return FIELD_OK;
+    case NUM_NA:
+	dest->dvec[idx] = na_double ();
+	return FIELD_OK;
+    case NUM_TRAILING:
+	return FIELD_NUMERIC_TRAILING;
+    default:
+	return FIELD_NON_NUMERIC;
+    }
+}
+
+/* Store a number in a cache of floats.  NA is stored as NUMCACHE_FLOAT_NA. */
+int set_cache_float (const resultDest *dest, long idx, const char *s, long n)
+{
+    static const uint32_t na = NUMCACHE_FLOAT_NA;
+    double value;
+
+    switch (parse_double (s, n, &value)) {
+    case NUM_OK:
+	dest->fvec[idx] = (float)value;
+	return FIELD_OK;
+    case NUM_NA:
+	memcpy (&dest->fvec[idx], &na, sizeof(float));
+	return FIELD_OK;
+    case NUM_TRAILING:
+	return FIELD_NUMERIC_TRAILING;
+    default:
+	return FIELD_NON_NUMERIC;
+    }
+}
+
+int
+field_column_type (const char *s, long n)
+{
+    int64_t ivalue;
+    double dvalue;
+    int lvalue;
+
+    if (parse_logical (s, n, &lvalue) != NUM_INVALID)
+	return COLTYPE_LOGICAL;
+    if (parse_int64 (s, n, &ivalue) == NUM_OK && ivalue > INT_MIN && ivalue <= INT_MAX)
+	return COLTYPE_INTEGER;
+    if (parse_double (s, n, &dvalue) == NUM_OK)
+	return COLTYPE_DOUBLE;
+    return COLTYPE_CHARACTER;
+}
+
+/* Widen the type of the column of the field to hold it.  The types are in dest->ivec. */
+int set_column_type (const resultDest *dest, long idx, const char *s, long n)
+{
+    int *type = &dest->ivec[idx / dest->colstep];
+    int ftype;
+
+    if (*type < COLTYPE_CHARACTER && (ftype = field_column_type (s, n)) > *type)
+	*type = ftype;
+    return FIELD_OK;
+}
+
+
+/* Save the tab-separated fields in buffer into the destination matrix.
+ * The first field in buffer is input column firstColumn.  Fields after lastColumn are ignored.
+ * An R matrix is laid out in column-major order (dest->colstep is the number of rows).
+ * Returns FIELD_OK, or the problem (recorded in prob) with the first field that could not be stored.
+ */
+int
+parse_tsv_fields (const resultDest *dest, /* Destination matrix. */
+		  long rowid,	     /* Row of result in which to save fields from this line. */
+		  const char *buffer, /* Fields to parse. */
+		  long buflen,	     /* Number of bytes in buffer. */
+		  long firstColumn,  /* Input column of first field in buffer. */
+		  long lastColumn,   /* Largest column we need. */
+		  const long *columnMap, /* Col of result in which to save field, or -1L if not wanted. */
+		  long rowposn,	     /* Offset of row in data file (for reporting problems). */
+		  parseProblem *prob)/* Records the first problem found. */
+{
+    long indexp;
+    long fstart;
+    long inputColumn, outputColumn, ncells = 0;
+    int code;
+    double t;
+
+    STATS_START (t);
+    indexp = 0;
+    inputColumn = firstColumn;
+    /* Assert: indexp is positioned at start of a field or immediately following buffer contents. */
+    while ((inputColumn <= lastColumn) && (indexp < buflen)) {
+
+	/* Read field. */
+	fstart = indexp;
+	while ((indexp < buflen) && buffer[indexp] != '\t' && buffer[indexp] != '\n') {
+	    indexp++;
+	}
+
+	/* Insert inputColumn into output matrix if required. */
+	outputColumn = columnMap[inputColumn];
+	if (outputColumn >= 0) {
+	    code = dest->set (dest, outputColumn*dest->colstep + rowid*dest->rowstep, buffer+fstart, indexp-fstart);
+	    if (code != FIELD_OK)
+		return record_parse_problem (prob, code, rowposn, buffer+fstart, indexp-fstart);
+	    ncells++;
+	}
+
+	if (indexp < buflen) indexp++; /* Advance over field-terminator, if any. */
+	inputColumn++;
+    }
+    STATS_COUNT (STAT_CELLS, ncells);
+    STATS_STOP (PHASE_PARSE, t);
+    return FIELD_OK;
+}
+
+/* Locate the line of the data file starting at rowposn.  *Linep is set to the line and *linelenp to
+ * its length, which includes its terminating newline.  A mapped line is not copied, unless its newline
+ * is missing, in which case it is supplied in a copy (*copyp) that must be freed by the caller.
+ * A line of a compressed data file is decompressed into buffer.  A line of an uncompressed, unmapped
+ * file is read into buffer if it has no column checkpoints (nckpt is 0); otherwise *linep is set to
+ * NULL, since only the wanted checkpoint blocks need be read.  A line that does not fit in buffer is
+ * read into a copy (*copyp) instead.  If the length of the line is known (rowlen is not negative),
+ * it is read by a single read of that size, and a mapped line is not searched for its newline.
+ * Returns FIELD_OK, or the problem (recorded in prob) that prevented the line being located.
+ * Read errors are recorded rather than signalled.
+ */
+int
+get_data_line (FILE *tsvp,		/* Open file from which to read data. */
+	       const mappedFile *data,	/* Contents of tsvp, if memory mapped. */
+	       bgzfFile *bgzf,		/* Handle for reading tsvp, if BGZF compressed (else NULL). */
+	       long rowposn,		/* Offset in bytes from start of file to this row's data. */
+	       long rowlen,		/* Length of the row excluding its newline, or -1L if unknown. */
+	       const uint32_t *ckpt,	/* Column checkpoints of this row (see tsvio.h). */
+	       long nckpt,		/* Number of column checkpoints (0 if none). */
+	       char *buffer,		/* Line buffer for (re-)use by this function. */
+	       long buffer_size,	/* Number of bytes in buffer. */
+	       const char **linep,	/* Set to the start of the line. */
+	       long *linelenp,		/* Set to the length of the line. */
+	       char **copyp,		/* Set to the copy of the line to be freed, or NULL. */
+	       parseProblem *prob)	/* Records the first problem found. */
+{
+    const char *line;
+    char *copy = NULL;
+    long linelen;
+
+    /* Locate the line in the mapped file.  As when reading via stdio, the parsed line
+     * includes its terminating newline, which is supplied (in a copy) if it is missing.
+     */
+    *copyp = NULL;
+    if (data->how == MAPPED_MMAP) {
+	const char *eol;
+
+	if (rowposn < 0 || (size_t)rowposn >= data->size) {
+	    return record_parse_problem (prob, FIELD_BEYOND_EOF, rowposn, "", 0);
+	}
+	line = data->addr + rowposn;
+	if (nckpt > 0) {
+	    linelen = (long)ckpt[nckpt-1];
+	    if ((size_t)linelen > data->size - rowposn) {
+		return record_parse_problem (prob, FIELD_BEYOND_EOF, rowposn, "", 0);
+	    }
+	    eol = (size_t)linelen < data->size - rowposn ? line + linelen : NULL;
+	} else if (rowlen >= 0 && (size_t)rowlen < data->size - rowposn && line[rowlen] == '\n') {
+	    eol = line + rowlen;
+	    linelen = rowlen;
+	} else {
+	    eol = memchr (line, '\n', data->size - rowposn);
+	    if (eol == NULL) prob->eofRow = rowposn;
+	    linelen = eol != NULL ? (long)(eol - line) : (long)(data->size - rowposn);
+	}
+	if (eol == NULL) {
+	    if ((copy = (char *)malloc (linelen + 1)) == NULL) {
+		return record_parse_problem (prob, FIELD_NO_MEMORY, rowposn, "", 0);
+	    }
+	    memcpy (copy, line, linelen);
+	    copy[linelen] = '\n';
+	    line = copy;
+	}
+	linelen++;
+	if (tsvp != NULL) /* Lines of a line reader were counted when read. */
+	    STATS_COUNT (STAT_BYTES_MAPPED, linelen);
+    } else if (bgzf != NULL || nckpt == 0) {
+	char *text;
+	size_t len;
+	long next;
+	enum status res;
+
+	/* Decompress or read the line into buffer, or into a copy if it is longer. */
+	if (bgzf != NULL)
+	    res = bgzf_read_line_copy (bgzf, rowposn, rowlen, buffer, (size_t)buffer_size, &text, &len, &next, &copy);
+	else
+	    res = read_tsv_line (tsvp, rowposn, rowlen, buffer, (size_t)buffer_size, &text, &len, &copy);
+	if (res == OUT_OF_MEMORY) {
+	    return record_parse_problem (prob, FIELD_NO_MEMORY, rowposn, "", 0);
+	} else if (res == INCOMPLETE_LAST_LINE) {
+	    prob->eofRow = rowposn;
+	} else if (res != OK) {
+	    return record_parse_problem (prob, FIELD_READ_ERROR, rowposn, "", 0);
+	}
+	line = text;
+	linelen = (long)len;
+	if (nckpt > 0 && (long)ckpt[nckpt-1] >= linelen) {
+	    free (copy);
+	    return record_parse_problem (prob, FIELD_BEYOND_EOF, rowposn, "", 0);
+	}
+    } else {
+	line = NULL;
+	linelen = 0;
+    }
+    *linep = line;
+    *linelenp = linelen;
+    *copyp = copy;
+    return FIELD_OK;
+}
+
+/* Read the fields of one row of the data file and store them in the destination matrix.
+ * If the row has column checkpoints, only the checkpoint blocks containing wanted columns are
+ * read and parsed.  Otherwise the entire line is read and parsed up to maxColumnWanted.
+ * If the data file is memory mapped, fields are parsed in place; otherwise they are read into buffer
+ * (or into a copy, if they do not fit).
+ * The entire line of a compressed data file is decompressed into buffer.  I/O errors are recorded in prob.
+ * Returns FIELD_OK, or the problem (recorded in prob) that stopped the row being stored.
+ */
+int
+get_tsv_fields (const resultDest *dest, /* Destination matrix. */
+		long rowid,	     /* Row of result in which to save fields from this line. */
+		FILE *tsvp,	     /* Open file from which to read data. */
+		const mappedFile *data, /* Contents of tsvp, if memory mapped. */
+		bgzfFile *bgzf,	     /* Handle for reading tsvp, if BGZF compressed (else NULL). */
+		long rowposn,	     /* Offset in bytes from start of file to this row's data. */
+		long rowlen,	     /* Length of the row excluding its newline, or -1L if unknown. */
+		long maxColumnWanted,/* Largest column we need. */
+		const long *columnMap, /* Col of result in which to save field, or -1L if not wanted. */
+		const uint32_t *ckpt,/* Column checkpoints of this row (see tsvio.h). */
+		long nckpt,	     /* Number of column checkpoints (0 if none). */
+		long colstride,	     /* Number of columns between checkpoints. */
+		const char *blockWanted, /* blockWanted[b] iff a column in checkpoint block b is wanted. */
+		char *buffer,	     /* Line buffer for (re-)use by this function. */
+		long buffer_size,    /* Number of bytes in buffer. */
+		parseProblem *prob)  /* Records the first problem found. */
+{
+    const char *line;
+    char *copy, *block;
+    long linelen;
+    long indexp;
+    long lastBlock, bb, ee, len;
+    int code;
+    double t;
+
+    STATS_START (t);
+    code = get_data_line (tsvp, data, bgzf, rowposn, rowlen, ckpt, nckpt, buffer, buffer_size, &line, &linelen, &copy, prob);
+    STATS_STOP (PHASE_READ, t);
+    if (code != FIELD_OK)
+	return code;
+    STATS_COUNT (STAT_ROWS, 1);
+
+    if (nckpt == 0) {
+	indexp = 0;
+	/* Advance over first column (row header) and its terminator. */
+	while ((indexp < linelen) && line[indexp] != '\t' && line[indexp] != '\n') {
+	    indexp++;
+	}
+	if (indexp < linelen) indexp++; /* Advance over field-terminator, if any. */
+
+	code = parse_tsv_fields (dest, rowid, line+indexp, linelen-indexp, 0L, maxColumnWanted, columnMap, rowposn, prob);
+	free (copy);
+	return code;
+    }
+
+    /* The row has nckpt-1 checkpoint blocks.  Read each run of consecutive wanted blocks. */
+    lastBlock = maxColumnWanted / colstride;
+    if (lastBlock > nckpt - 2) lastBlock = nckpt - 2;
+    for (bb = 0; bb <= lastBlock; bb = ee + 1) {
+	ee = bb;
+	if (!blockWanted[bb]) continue;
+	while (ee < lastBlock && blockWanted[ee+1]) ee++;
+
+	len = (long)(ckpt[ee+1] - ckpt[bb]);
+	if (line != NULL) {
+	    if (ee == nckpt - 2) len++; /* Block ends the line: include the newline. */
+	    code = parse_tsv_fields (dest, rowid, line + ckpt[bb], len, bb*colstride, maxColumnWanted, columnMap, rowposn, prob);
+	    if (code != FIELD_OK) {
+		free (copy);
+		return code;
+	    }
+	    continue;
+	}
+	block = buffer;
+	if (len >= buffer_size) {
+	    /* The blocks do not fit in buffer: read them into a copy. */
+	    free (copy);
+	    if ((copy = (char *)malloc (len + 1)) == NULL) {
+		return record_parse_problem (prob, FIELD_NO_MEMORY, rowposn, "", 0);
+	    }
+	    block = copy;
+	}
+	STATS_START (t);
+	if (fseek (tsvp, rowposn + (long)ckpt[bb], SEEK_SET) < 0 || fread (block, 1, len, tsvp) != (size_t)len) {
+	    free (copy);
+	    return record_parse_problem (prob, FIELD_READ_ERROR, rowposn, "", 0);
+	}
+	STATS_STOP (PHASE_READ, t);
+	STATS_COUNT (STAT_SEEKS, 1);
+	STATS_COUNT (STAT_BYTES_READ, len);
+	if (ee == nckpt - 2) block[len++] = '\n'; /* Block ends the line. */
+
+	code = parse_tsv_fields (dest, rowid, block, len, bb*colstride, maxColumnWanted, columnMap, rowposn, prob);
+	if (code != FIELD_OK) {
+	    free (copy);
+	    return code;
+	}
+    }
+    free (copy);
+    return FIELD_OK;
+}
+
+
+/* Line readers (see dataset.h) read runs of lines of up to MAX_READ_RUN bytes (more if a line is
+ * longer), and prefetch the lines of the plan up to READ_AHEAD bytes beyond the current read.
+ */
+
+void
+init_line_reader (lineReader *lr, FILE *fp, const long *posn, const long *rowlen, long nposn, long gap, long meanlen)
+{
+    lr->fp = fp;
+    lr->posn = posn;
+    lr->rowlen = rowlen;
+    lr->nposn = nposn;
+    lr->gap = gap;
+    lr->meanlen = meanlen > 0 ? meanlen : 1;
+    lr->advised = 0;
+    lr->buf = NULL;
+    lr->bufsize = 0;
+    lr->start = 0;
+    lr->len = 0;
+    lr->eof = 0;
+}
+
+void
+free_line_reader (lineReader *lr)
+{
+    free (lr->buf);
+    lr->buf = NULL;
+}
+
+/* Returns the last line of the plan of lr read by the same read as line k. */
+static long
+run_end (const lineReader *lr, long k)
+{
+    long jj = k;
+
+    while (jj + 1 < lr->nposn && lr->posn[jj+1] - lr->posn[jj] <= lr->gap && lr->posn[jj+1] - lr->posn[k] < MAX_READ_RUN)
+	jj++;
+    return jj;
+}
+
+/* Make buf hold at least want bytes (fewer at end of file) starting at offset from of the file,
+ * keeping any bytes already read from there.  Returns FIELD_OK, FIELD_NO_MEMORY or FIELD_READ_ERROR.
+ */
+static int
+fill_line_reader (lineReader *lr, long from, size_t want)
+{
+    size_t keep = 0, got;
+    char *newbuf;
+
+    if (from >= lr->start && from <= lr->start + (long)lr->len) {
+	keep = lr->len - (size_t)(from - lr->start);
+	memmove (lr->buf, lr->buf + (from - lr->start), keep);
+    } else {
+	lr->eof = 0;
+    }
+    lr->start = from;
+    lr->len = keep;
+    if (want <= keep)
+	return FIELD_OK;
+
+    if (want > lr->bufsize) {
+	if ((newbuf = (char *)realloc (lr->buf, want)) == NULL)
+	    return FIELD_NO_MEMORY;
+	lr->buf = newbuf;
+	lr->bufsize = want;
+    }
+    STATS_COUNT (STAT_SEEKS, 1);
+    if (fseek (lr->fp, from + (long)keep, SEEK_SET) < 0)
+	return FIELD_READ_ERROR;
+    got = fread (lr->buf + keep, 1, want - keep, lr->fp);
+    STATS_COUNT (STAT_BYTES_READ, got);
+    if (got < want - keep) {
+	if (ferror (lr->fp))
+	    return FIELD_READ_ERROR;
+	lr->eof = 1;
+    }
+    lr->len += got;
+    return FIELD_OK;
+}
+
+/* Locate line k of the plan of lr, reading it (and the following lines of its run) if necessary.
+ * The results are as for get_data_line.
+ */
+int
+get_planned_line (lineReader *lr, long k, const char **linep, long *linelenp, char **copyp, parseProblem *prob)
+{
+    long posn = lr->posn[k];
+    long rowlen = lr->rowlen != NULL ? lr->rowlen[k] : -1L;
+    long jj, last;
+    size_t want;
+    const char *eol = NULL;
+    mappedFile view;
+    parseProblem local;
+    int code;
+
+    if (posn < lr->start || posn >= lr->start + (long)lr->len) {
+	/* Start a new read, and prefetch the following reads. */
+	jj = run_end (lr, k);
+	if (lr->advised <= jj) lr->advised = jj + 1;
+	while (lr->advised < lr->nposn && lr->posn[lr->advised] - posn < READ_AHEAD) {
+	    last = run_end (lr, lr->advised);
+	    advise_file (lr->fp, lr->posn[lr->advised], lr->posn[last] - lr->posn[lr->advised] + lr->meanlen, ADVISE_WILLNEED);
+	    lr->advised = last + 1;
+	}
+	/* Read exactly to the end of the run if the lengths of its lines are known. */
+	if (lr->rowlen != NULL && lr->rowlen[jj] >= 0)
+	    want = (size_t)(lr->posn[jj] + lr->rowlen[jj] + 1 - posn);
+	else
+	    want = (size_t)(lr->posn[jj] - posn + 2 * lr->meanlen + MIN_READ);
+	code = fill_line_reader (lr, posn, want);
+	if (code != FIELD_OK)
+	    return record_parse_problem (prob, code, posn, "", 0);
+    }
+    /* A line of known length ends at a newline at that length, unless the index is wrong. */
+    if (rowlen >= 0) {
+	if ((size_t)(posn - lr->start + rowlen) >= lr->len && !lr->eof) {
+	    code = fill_line_reader (lr, posn, (size_t)rowlen + 1);
+	    if (code != FIELD_OK)
+		return record_parse_problem (prob, code, posn, "", 0);
+	}
+	if ((size_t)(posn - lr->start + rowlen) < lr->len && lr->buf[posn - lr->start + rowlen] == '\n')
+	    eol = lr->buf + (posn - lr->start + rowlen);
+    }
+    /* Otherwise extend the read until it includes the end of the line. */
+    while (eol == NULL && (eol = memchr (lr->buf + (posn - lr->start), '\n', lr->len - (size_t)(posn - lr->start))) == NULL &&
+	   !lr->eof) {
+	code = fill_line_reader (lr, posn, 2 * (lr->len - (size_t)(posn - lr->start)) + lr->meanlen);
+	if (code != FIELD_OK)
+	    return record_parse_problem (prob, code, posn, "", 0);
+    }
+
+    /* Parse the line as part of a mapped file starting at the line. */
+    view.how = MAPPED_MMAP;
+    view.addr = lr->buf + (posn - lr->start);
+    view.size = eol != NULL ? (size_t)(eol - view.addr) + 1 : lr->len - (size_t)(posn - lr->start);
+    init_parse_problem (&local);
+    code = get_data_line (NULL, &view, NULL, 0L, eol != NULL ? (long)view.size - 1 : -1L, NULL, 0, NULL, 0, linep, linelenp, copyp, &local);
+
+    /* Report problems at their offset in the file. */
+    if (local.eofRow >= 0)
+	prob->eofRow = local.eofRow + posn;
+    if (code != FIELD_OK)
+	record_parse_problem (prob, code, local.rowposn + posn, local.text, local.len);
+    return code;
+}
+
+long
+read_data_line (FILE *tsvp, bgzfFile *bgzf, long *posnp, char *buffer, long buffersize, char **linep, char **copyp)
+{
+    size_t len;
+    long next;
+    enum status res;
+
+    if (bgzf != NULL) {
+	res = bgzf_read_line_copy (bgzf, *posnp, -1L, buffer, (size_t)buffersize, linep, &len, &next, copyp);
+    } else {
+	res = read_tsv_line (tsvp, *posnp, -1L, buffer, (size_t)buffersize, linep, &len, copyp);
+	next = ftell (tsvp);
+    }
+    if (res == EMPTY_FILE)
+	return -1L;
+    if (res != OK && res != INCOMPLETE_LAST_LINE)
+	return -2L;
+    *posnp = next;
+    return (long)len;
+}
+
+enum status
+scan_header_line (dynHashTab *dht, FILE *tsvp, bgzfFile *bgzf, int insertall, char *buffer, long buffersize)
+{
+    long rowlen, linelen, headercols, rowcols, numpats;
+    long posn;
+    char *line, *copy;
+
+    /* Determine number of columns on first and second lines. Input header line. */
+    posn = 0L;
+    if ((linelen = read_data_line (tsvp, bgzf, &posn, buffer, buffersize, &line, &copy)) < 0) {
+        return READ_ERROR;
+    }
+    free (copy);
+    if ((rowlen = read_data_line (tsvp, bgzf, &posn, buffer, buffersize, &line, &copy)) < 0) {
+	/* File contains a header only? */
+        return rowlen == -1L ? OK : READ_ERROR;
+    }
+    rowcols = num_columns (line, rowlen);
+    free (copy);
+    posn = 0L;
+    if ((linelen = read_data_line (tsvp, bgzf, &posn, buffer, buffersize, &line, &copy)) < 0) {
+        return READ_ERROR;
+    }
+    headercols = num_columns (line, linelen);
+
+    #ifdef DEBUG
+        fprintf (stderr, "> scan_header_line: headercols=%ld, rowcols=%ld, headerlen=%ld, rowlen=%ld, buffersize=%ld\n",
+	         headercols, rowcols, linelen, rowlen, buffersize);
+    #endif
+
+    numpats = scan_header_fields (dht, line, linelen, rowcols == headercols, insertall);
+    free (copy);
+
+    /* The header must name every data column. */
+    if (numpats != (rowcols-1)) {
+        return NO_LABEL_ERROR;
+    }
+    return OK;
+}
+
+
+void
+close_dataset (tsvDataset *ds)
+{
+    long ii;
+    tsvDataFile *df;
+
+    for (ii = 0; ii < ds->numFiles; ii++) {
+	df = &ds->files[ii];
+	if (df->idx) close_binary_index (df->idx);
+	if (df->cache) close_numeric_cache (df->cache);
+	if (df->indexp) fclose (df->indexp);
+	unmap_file (&df->data);
+	if (df->bgzf) bgzf_close (df->bgzf);
+	if (df->tsvp) fclose (df->tsvp);
+	if (df->rowdht) freeDynHashTab (df->rowdht);
+	if (df->coldht) freeDynHashTab (df->coldht);
+	free (df->dataName);
+    }
+    if (ds->rows) freeDynHashTab (ds->rows);
+    if (ds->cols) freeDynHashTab (ds->cols);
+    free (ds->files);
+    free (ds->buffer);
+    free (ds);
+}
+
+/* Record the size and modification time of the data file of df. */
+static void
+get_data_stamp (tsvDataFile *df, long *sizep, long *mtimep)
+{
+    struct stat sb;
+
+    if (fstat (fileno (df->tsvp), &sb) < 0) {
+	*sizep = -1L;
+	*mtimep = -1L;
+    } else {
+	*sizep = (long)sb.st_size;
+	*mtimep = (long)sb.st_mtime;
+    }
+}
+
+enum status
+open_data_file_cache (tsvDataFile *df, const char *cacheName)
+{
+    FILE *fp;
+    fileStamp stamp;
+    enum status res;
+
+    if ((fp = fopen (cacheName, "rb")) == NULL)
+	return OPEN_FAILED;
+    res = open_numeric_cache (fp, &df->cache);
+    fclose (fp);
+    if (res != OK) {
+	df->cache = NULL;
+	return res;
+    }
+    if ((res = stamp_file (df->tsvp, &stamp)) == OK)
+	res = check_numeric_cache (df->cache, &stamp);
+    if (res == OK && numeric_cache_num_cols (df->cache) != data_file_num_columns (df))
+	res = STALE_INDEX;
+    if (res != OK) {
+	close_numeric_cache (df->cache);
+	df->cache = NULL;
+	return STALE_INDEX;
+    }
+    return OK;
+}
+
+/* Returns the number of the calling thread in its team (0 outside a parallel region). */
+static int
+thread_number (void)
+{
+#ifdef _OPENMP
+    return omp_get_thread_num ();
+#else
+    return 0;
+#endif
+}
+
+/* A data file and its size, for ordering files by size. */
+typedef struct {
+    long file;
+    long size;
+} fileSize;
+
+/* Returns the position of the first of the files a and b to start: the larger one. */
+static int
+compare_fileSize (const void *a, const void *b)
+{
+    const fileSize *ap = (const fileSize *)a;
+    const fileSize *bp = (const fileSize *)b;
+
+    if (ap->size > bp->size) return -1;
+    if (ap->size < bp->size) return 1;
+    return ap->file < bp->file ? -1 : ap->file > bp->file;
+}
+
+/* Returns the numbers of the nfiles data files, largest first, or NULL if out of memory.  The result
+ * must be freed by the caller.
+ */
+static long *
+files_by_size (const tsvDataFile *files, long nfiles)
+{
+    fileSize *fs;
+    long *order, ii;
+
+    fs = (fileSize *)malloc ((nfiles + 1) * sizeof(fileSize));
+    order = (long *)malloc ((nfiles + 1) * sizeof(long));
+    if (fs == NULL || order == NULL) {
+	free (fs);
+	free (order);
+	return NULL;
+    }
+    for (ii = 0; ii < nfiles; ii++) {
+	fs[ii].file = ii;
+	fs[ii].size = files[ii].dataSize;
+    }
+    qsort (fs, nfiles, sizeof(fileSize), compare_fileSize);
+    for (ii = 0; ii < nfiles; ii++) {
+	order[ii] = fs[ii].file;
+    }
+    free (fs);
+    return order;
+}
+
+/* Open the data file dataName and index file indexName of one file of a dataset.  If the index file
+ * does not exist it is created, or if it cannot be created, a temporary index is created instead, and
+ * load->generate is set.  Returns load->openres.
+ */
+static enum status
+open_data_file (tsvDataFile *df, const char *dataName, const char *indexName, fileLoad *load)
+{
+#ifdef _WIN32
+    char tmpname[] = "tmpXXXXXX";
+    char tmpname2[10];
+    int rez;
+#else
+    char tmpname[] = "/tmp/tsvindex-XXXXXX";
+#endif
+    int tmpfd;
+    int gz;
+
+    load->indexName = indexName;
+    load->created = load->temporary = load->generate = load->grown = 0;
+    load->openres = load->genres = load->verres = load->idxres = load->hdrres = OK;
+
+    df->data.addr = "";
+    df->data.size = 0;
+    df->data.how = MAPPED_EMPTY;
+    df->dataName = (char *)malloc (strlen (dataName) + 1);
+    if (df->dataName == NULL) return load->openres = OUT_OF_MEMORY;
+    strcpy (df->dataName, dataName);
+
+    df->tsvp = fopen (dataName, "rb");
+    if (df->tsvp == NULL) {
+	return load->openres = OPEN_FAILED;
+    }
+    gz = gzip_format (df->tsvp);
+    if (gz == GZIP_PLAIN) {
+	return load->openres = NOT_BGZF;
+    }
+    if (gz == GZIP_BGZF && bgzf_open (df->tsvp, &df->bgzf) != OK) {
+	return load->openres = OUT_OF_MEMORY;
+    }
+    get_data_stamp (df, &df->dataSize, &df->dataMtime);
+
+    df->indexp = fopen (indexName, "rb");
+    if (df->indexp == NULL) {
+	load->created = 1;
+	df->indexp = fopen (indexName, "wb+");
+	if (df->indexp == NULL) {
+	    load->temporary = 1;
+#ifdef _WIN32
+	    strcpy_s (tmpname2, sizeof(tmpname2), tmpname);
+	    rez = _mktemp_s (tmpname2, sizeof(tmpname2));
+	    if (rez == 0) {
+		_sopen_s (&tmpfd, tmpname2, _O_RDWR | _O_CREAT | _O_TEMPORARY | _O_SHORT_LIVED, _SH_DENYNO, _S_IREAD|_S_IWRITE);
+	    } else {
+		tmpfd = -1;
+	    }
+#else
+	    tmpfd = mkstemp (tmpname);
+#endif
+	    if (tmpfd < 0) {
+		return load->openres = WRITE_ERROR;
+	    }
+	    df->indexp = fdopen (tmpfd, "wb+");
+#ifndef _WIN32
+	    unlink (tmpname);
+#endif
+	}
+	load->generate = 1;
+    }
+    return OK;
+}
+
+/* Generate (if necessary), check, and load the index of the data file df.  Returns OK, or the first
+ * problem found (which is recorded in load).
+ */
+static enum status
+load_data_index (tsvDataFile *df, fileLoad *load)
+{
+    if (load->generate) {
+	load->genres = generate_binary_index (df->tsvp, df->indexp);
+	if (is_fatal_error (load->genres))
+	    return load->genres;
+	rewind (df->tsvp);
+	rewind (df->indexp);
+    }
+    if ((load->verres = verify_index_file (df->tsvp, &df->indexp, load->indexName, &load->grown)) != OK)
+	return load->verres;
+
+    /* Keep a binary index mapped.  Load a text index into a hash table. */
+    if (is_binary_index (df->indexp)) {
+	load->idxres = open_binary_index (df->indexp, &df->idx);
+    } else if ((df->rowdht = newDynHashTab (1024, DHT_STRDUP)) == NULL) {
+	load->idxres = OUT_OF_MEMORY;
+    } else {
+	load->idxres = scan_index_file (df->indexp, df->rowdht, 1);
+	if (load->idxres == OK && dhtFailed (df->rowdht))
+	    load->idxres = OUT_OF_MEMORY;
+    }
+    return load->idxres;
+}
+
+/* Load the index of the data file df (see load_data_index), scan its header line into df->coldht
+ * using buffer (of LINEBUFFERSIZE bytes) unless the index records its labels, and map the data file
+ * if possible.  The first problem found is recorded in load.
+ */
+static void
+load_data_file (tsvDataFile *df, fileLoad *load, char *buffer)
+{
+    enum status res;
+    double t;
+
+    STATS_START (t);
+    res = load_data_index (df, load);
+    STATS_STOP (PHASE_INDEX, t);
+    if (res != OK)
+	return;
+
+    /* Parse the header line, unless the index records its labels. */
+    if (df->idx != NULL && binary_index_num_columns (df->idx) >= 0) {
+	load->hdrres = OK;
+    } else if (buffer == NULL || (df->coldht = newDynHashTab (1024, DHT_STRDUP)) == NULL) {
+	load->hdrres = OUT_OF_MEMORY;
+	return;
+    } else {
+	STATS_START (t);
+	load->hdrres = scan_header_line (df->coldht, df->tsvp, df->bgzf, 1, buffer, LINEBUFFERSIZE);
+	STATS_STOP (PHASE_HEADER, t);
+	if (load->hdrres == OK && dhtFailed (df->coldht))
+	    load->hdrres = OUT_OF_MEMORY;
+	if (load->hdrres != OK)
+	    return;
+    }
+
+    /* Rows are parsed directly from the mapped file where possible, otherwise read using stdio.
+     * Rows of a compressed file are decompressed a block at a time.
+     */
+    if (df->bgzf != NULL || try_map_file (df->tsvp, &df->data) != OK) {
+	df->data.how = MAPPED_EMPTY;
+    }
+}
+
+/* Returns the first problem recorded while loading the data file of load, or OK. */
+static enum status
+load_result (const fileLoad *load)
+{
+    if (load->generate && is_fatal_error (load->genres))
+	return load->genres;
+    if (load->verres != OK)
+	return load->verres;
+    if (load->idxres != OK)
+	return load->idxres;
+    return load->hdrres;
+}
+
+/* Insert the column labels of df into dht, in order of first occurrence, with their column numbers. */
+static void
+add_file_columns (dynHashTab *dht, const tsvDataFile *df)
+{
+    const char *str;
+    long ii, iter, len, value, ncols;
+
+    if (df->coldht == NULL) {
+	ncols = binary_index_num_columns (df->idx);
+	dhtReserve (dht, dhtNumStrings (dht) + ncols);
+	for (ii = 0; ii < ncols; ii++) {
+	    binary_index_column_label (df->idx, ii, &str, &len);
+	    insertStrVal (dht, str, len, binary_index_column_number (df->idx, ii));
+	}
+	return;
+    }
+    initIterator (df->coldht, &iter);
+    while (getNextStr (df->coldht, &iter, &str, &len, NULL, &value)) {
+	insertStrVal (dht, str, len, value);
+    }
+}
+
+/* The files are opened in turn, and then their indexes and header lines are loaded by up to nthreads
+ * threads, largest file first.
+ */
+enum status
+open_dataset (long nfiles, const char *const *dataNames, const char *const *indexNames, int nthreads,
+	      tsvDataset **dsp, fileLoad *loads, long *failedp)
+{
+    tsvDataset *ds;
+    long ii, kk, *order;
+    char **buffers;
+    enum status res;
+
+    *dsp = NULL;
+    *failedp = -1L;
+    ds = (tsvDataset *)calloc (1, sizeof(tsvDataset));
+    if (ds == NULL)
+	return OUT_OF_MEMORY;
+    ds->buffer = (char *)malloc(LINEBUFFERSIZE);
+    ds->files = (tsvDataFile *)calloc (nfiles + 1, sizeof(tsvDataFile));
+    ds->cols = newDynHashTab (1024, DHT_STRDUP);
+    if (ds->buffer == NULL || ds->files == NULL || ds->cols == NULL) {
+	close_dataset (ds);
+	return OUT_OF_MEMORY;
+    }
+
+    for (ii = 0; ii < nfiles; ii++) {
+	ds->numFiles = ii + 1;
+	if ((res = open_data_file (&ds->files[ii], dataNames[ii], indexNames[ii], &loads[ii])) != OK) {
+	    close_dataset (ds);
+	    *failedp = ii;
+	    return res;
+	}
+    }
+
+    /* Load the files concurrently.  Threads other than this one scan header lines into buffers
+     * of their own, allocated when first needed.
+     */
+    nthreads = resolve_threads (nthreads);
+    if (nthreads > nfiles) nthreads = (int)nfiles;
+    if (nthreads < 1) nthreads = 1;
+    order = files_by_size (ds->files, nfiles);
+    buffers = (char **)calloc (nthreads, sizeof(char *));
+    if (order == NULL || buffers == NULL) {
+	free (order);
+	free (buffers);
+	close_dataset (ds);
+	return OUT_OF_MEMORY;
+    }
+    buffers[0] = ds->buffer;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads) if(nthreads > 1)
+#endif
+    for (kk = 0; kk < nfiles; kk++) {
+	int me = thread_number ();
+
+	if (buffers[me] == NULL)
+	    buffers[me] = (char *)malloc (LINEBUFFERSIZE);
+	load_data_file (&ds->files[order[kk]], &loads[order[kk]], buffers[me]);
+    }
+    for (ii = 1; ii < nthreads; ii++) {
+	free (buffers[ii]);
+    }
+    free (buffers);
+    free (order);
+
+    /* Add the columns of each file to those of the dataset, in file order. */
+    for (ii = 0; ii < nfiles; ii++) {
+	if ((res = load_result (&loads[ii])) != OK) {
+	    close_dataset (ds);
+	    *failedp = ii;
+	    return res;
+	}
+	add_file_columns (ds->cols, &ds->files[ii]);
+    }
+    if (dhtFailed (ds->cols)) {
+	close_dataset (ds);
+	return OUT_OF_MEMORY;
+    }
+
+    *dsp = ds;
+    return OK;
+}
+
+
+enum status
+dataset_all_rows (tsvDataset *ds, dynHashTab **rowsp, long *failedp)
+{
+    long ii;
+    enum status res;
+
+    *failedp = -1L;
+    if (ds->rows == NULL) {
+	if ((ds->rows = newDynHashTab (1024, DHT_STRDUP)) == NULL)
+	    return OUT_OF_MEMORY;
+	for (ii = 0; ii < ds->numFiles; ii++) {
+	    res = scan_index_file (ds->files[ii].indexp, ds->rows, 1);
+	    if (res == OK && dhtFailed (ds->rows))
+		res = OUT_OF_MEMORY;
+	    if (res != OK) {
+		freeDynHashTab (ds->rows);
+		ds->rows = NULL;
+		*failedp = ii;
+		return res;
+	    }
+	}
+    }
+    *rowsp = ds->rows;
+    return OK;
+}
+
+long
+data_file_row (const tsvDataFile *df, const char *str, long len, const uint32_t **ckptp, long *nckptp, long *rowlenp)
+{
+    long pos;
+
+    *ckptp = NULL;
+    *nckptp = 0;
+    *rowlenp = -1L;
+    if (df->idx == NULL)
+	return getStringValue (df->rowdht, str, len);
+    if ((pos = binary_index_find (df->idx, str, len)) < 0)
+	return -1L;
+    *nckptp = binary_index_checkpoints (df->idx, pos, ckptp);
+    *rowlenp = binary_index_row_length (df->idx, pos);
+    return binary_index_offset (df->idx, pos);
+}
+
+long
+data_file_column (const tsvDataFile *df, const char *str, long len)
+{
+    long pos;
+
+    if (df->coldht != NULL)
+	return getStringValue (df->coldht, str, len);
+    if ((pos = binary_index_find_column (df->idx, str, len)) < 0)
+	return -1L;
+    return binary_index_column_number (df->idx, pos);
+}
+
+long
+data_file_column_index (const tsvDataFile *df, const char *str, long len)
+{
+    if (df->coldht != NULL)
+	return getStringIndex (df->coldht, str, len);
+    return binary_index_find_column (df->idx, str, len);
+}
+
+long
+data_file_num_columns (const tsvDataFile *df)
+{
+    if (df->coldht != NULL)
+	return dhtNumStrings (df->coldht);
+    return binary_index_num_columns (df->idx);
+}
+
+const dynHashTab *
+data_file_columns (tsvDataFile *df)
+{
+    dynHashTab *dht;
+
+    if (df->coldht == NULL) {
+	if ((dht = newDynHashTab (1024, DHT_STRDUP)) == NULL)
+	    return NULL;
+	add_file_columns (dht, df);
+	if (dhtFailed (dht)) {
+	    freeDynHashTab (dht);
+	    return NULL;
+	}
+	df->coldht = dht;
+    }
+    return df->coldht;
+}
+
+int
+dataset_has_row (const tsvDataset *ds, const char *str, long len)
+{
+    const uint32_t *ckpt;
+    long ii, nckpt, rowlen;
+
+    for (ii = 0; ii < ds->numFiles; ii++) {
+	if (data_file_row (&ds->files[ii], str, len, &ckpt, &nckpt, &rowlen) >= 0)
+	    return 1;
+    }
+    return 0;
+}
+
+
+typedef struct {
+    long rowPosn;	/* Byte offset of desired row in file. */
+    long rowLen;	/* Length of row excluding its newline, or -1L if unknown. */
+    long outputRow;	/* Row index of row in destination matrix. */
+    const uint32_t *ckpt; /* Column checkpoints of row. */
+    long nckpt;		/* Number of column checkpoints (0 if none). */
+} rowInfo_t;
+
+int
+compare_rowInfo_t (const void *a, const void *b)
+{
+    const rowInfo_t *ap = (rowInfo_t *)a;
+    const rowInfo_t *bp = (rowInfo_t *)b;
+
+    if (ap->rowPosn < bp->rowPosn) return -1;
+    if (ap->rowPosn > bp->rowPosn) return 1;
+    return 0;
+}
+
+long
+mean_row_length (const tsvDataFile *df)
+{
+    long numRows = df->idx != NULL ? binary_index_num_rows (df->idx) : dhtNumStrings (df->rowdht);
+
+    return df->dataSize / (numRows > 0 ? numRows : 1) + 1;
+}
+
+/* Tell the operating system which parts of the mapped data file of df will be read, given the
+ * wanted rows sorted by position.  If the rows cover much of the file, it is read sequentially.
+ * Otherwise read-ahead is disabled and only the pages containing the rows are prefetched.
+ * The length of a row is taken from the index if it is recorded there, and otherwise from its column
+ * checkpoints, or estimated from the mean row length.
+ */
+static void
+advise_rows (const tsvDataFile *df, const rowInfo_t *rowInfo, long nrow)
+{
+    size_t meanlen, start, end, len;
+    long ii;
+
+    if (df->data.how != MAPPED_MMAP || nrow == 0)
+	return;
+    meanlen = mean_row_length (df);
+    if ((size_t)nrow * meanlen > df->data.size / 4) {
+	advise_mapped_file (&df->data, 0, df->data.size, ADVISE_SEQUENTIAL);
+	return;
+    }
+    advise_mapped_file (&df->data, 0, df->data.size, ADVISE_RANDOM);
+
+    /* Prefetch the rows, merging rows that are close together into a single range. */
+    start = end = 0;
+    for (ii = 0; ii < nrow; ii++) {
+	if (rowInfo[ii].rowLen >= 0)
+	    len = (size_t)rowInfo[ii].rowLen + 1;
+	else
+	    len = rowInfo[ii].nckpt > 0 ? rowInfo[ii].ckpt[rowInfo[ii].nckpt-1] + 1 : meanlen;
+	if (ii > 0 && (size_t)rowInfo[ii].rowPosn <= end + PREFETCH_GAP) {
+	    if ((size_t)rowInfo[ii].rowPosn + len > end) end = (size_t)rowInfo[ii].rowPosn + len;
+	    continue;
+	}
+	if (ii > 0) advise_mapped_file (&df->data, start, end - start, ADVISE_WILLNEED);
+	start = (size_t)rowInfo[ii].rowPosn;
+	end = start + len;
+    }
+    advise_mapped_file (&df->data, start, end - start, ADVISE_WILLNEED);
+}
+
+/* Read the sorted rows of rowInfo from the data file of df, which is read via stdio, and store them
+ * in the destination matrix.  Rows separated by at most gap bytes are read together.
+ * The first problem found is recorded in prob.
+ */
+static void
+getRowsByRuns (const resultDest *dest, const tsvDataFile *df, const rowInfo_t *rowInfo, long nrow,
+	       long maxInputColumn, const long *columnMap, long gap, parseProblem *prob)
+{
+    lineReader lr;
+    long *posn, *rowlen, ii, indexp, linelen;
+    const char *line;
+    char *copy;
+    double t;
+
+    posn = (long *)malloc ((nrow + 1) * sizeof(long));
+    rowlen = (long *)malloc ((nrow + 1) * sizeof(long));
+    if (posn == NULL || rowlen == NULL) {
+	free (posn);
+	free (rowlen);
+	record_parse_problem (prob, FIELD_NO_MEMORY, rowInfo[0].rowPosn, "", 0);
+	return;
+    }
+    for (ii = 0; ii < nrow; ii++) {
+	posn[ii] = rowInfo[ii].rowPosn;
+	rowlen[ii] = rowInfo[ii].rowLen;
+    }
+    init_line_reader (&lr, df->tsvp, posn, rowlen, nrow, gap, mean_row_length (df));
+    for (ii = 0; ii < nrow; ii++) {
+	STATS_START (t);
+	if (get_planned_line (&lr, ii, &line, &linelen, &copy, prob) != FIELD_OK)
+	    break;
+	STATS_STOP (PHASE_READ, t);
+	STATS_COUNT (STAT_ROWS, 1);
+
+	/* Advance over first column (row header) and its terminator. */
+	indexp = 0;
+	while ((indexp < linelen) && line[indexp] != '\t' && line[indexp] != '\n') {
+	    indexp++;
+	}
+	if (indexp < linelen) indexp++;
+
+	parse_tsv_fields (dest, rowInfo[ii].outputRow, line+indexp, linelen-indexp, 0L, maxInputColumn, columnMap, posn[ii], prob);
+	free (copy);
+	if (prob->code != FIELD_OK)
+	    break;
+    }
+    free_line_reader (&lr);
+    free (posn);
+    free (rowlen);
+}
+
+/* The wanted rows of one data file, sorted into file order, and the mapping from the columns of
+ * the file to the columns of the result.  The plans of several files can be made concurrently.
+ */
+typedef struct {
+    const tsvDataFile *df;	/* Data file to read. */
+    rowInfo_t *rowInfo;		/* Wanted rows of the file, in file order. */
+    long rowsWanted;		/* Number of wanted rows. */
+    long maxInputColumn;	/* Largest wanted column of the file (-1L if none). */
+    long *columnMap;		/* Column of result for each column of the file, or -1L if not wanted. */
+    long colstride;		/* Number of columns between checkpoints (0 if none). */
+    char *blockWanted;		/* blockWanted[b] iff a column in checkpoint block b is wanted. */
+    enum status res;		/* OK, or OUT_OF_MEMORY if the plan could not be made. */
+} rowPlan;
+
+static void
+free_row_plan (rowPlan *plan)
+{
+    free (plan->rowInfo);
+    free (plan->columnMap);
+    free (plan->blockWanted);
+    plan->rowInfo = NULL;
+    plan->columnMap = NULL;
+    plan->blockWanted = NULL;
+}
+
+/* Plan the reading of the rows in rowdht and the columns in coldht from the data file df.
+ * If the file has none of the rows, plan->rowsWanted is 0, and if it has none of the columns,
+ * plan->maxInputColumn is -1L.
+ */
+static void
+plan_rows (rowPlan *plan, const tsvDataFile *df, const dynHashTab *rowdht, const dynHashTab *coldht)
+{
+    long ii, inputColumn, outputColumn;
+    rowInfo_t *rowInfo;
+    long *columnMap;
+    const char *str;
+    long len;
+
+    plan->df = df;
+    plan->rowInfo = NULL;
+    plan->rowsWanted = 0;
+    plan->maxInputColumn = -1L;
+    plan->columnMap = NULL;
+    plan->colstride = 0;
+    plan->blockWanted = NULL;
+    plan->res = OUT_OF_MEMORY;
+
+    /* Determine desired rows in this file, and their byte offset in this file. */
+    if ((rowInfo = plan->rowInfo = (rowInfo_t *)malloc ((dhtNumStrings (rowdht) + 1) * sizeof(rowInfo_t))) == NULL)
+	return;
+    initIterator (rowdht, &ii);
+    while (getNextStr (rowdht, &ii, &str, &len, &rowInfo[plan->rowsWanted].outputRow, NULL)) {
+	rowInfo[plan->rowsWanted].rowPosn = data_file_row (df, str, len, &rowInfo[plan->rowsWanted].ckpt, &rowInfo[plan->rowsWanted].nckpt,
+							   &rowInfo[plan->rowsWanted].rowLen);
+	if (rowInfo[plan->rowsWanted].rowPosn >= 0L) {
+	    plan->rowsWanted++;
+	}
+    }
+    plan->res = OK;
+    if (plan->rowsWanted == 0)
+	return;
+
+    /* There are three column name orders:
+     * 1. Order of names in original request list (no longer available)
+     * 2. Order of names in this tsv file (called inputColumns below)
+     * 3. Order of names in output matrix (called outputColumns below)
+     *
+     * We generate here a mapping from the order of columns in this tsv file (input columns)
+     * to the order of columns in the output matrix:  outputColumn == columnMap[inputColumn].
+     * columnMap[inputColumn] == -1L iff inputColumn is not contained in the output matrix.
+     * We make columnMap long enough to contain the largest wanted input column.
+     */
+    initIterator (coldht, &ii);
+    while (getNextStr (coldht, &ii, &str, &len, NULL, NULL)) {
+	inputColumn = data_file_column (df, str, len);
+	if (inputColumn > plan->maxInputColumn) plan->maxInputColumn = inputColumn;
+    }
+    if (plan->maxInputColumn < 0)
+	return;
+    plan->res = OUT_OF_MEMORY;
+    if ((columnMap = plan->columnMap = (long *)malloc ((plan->maxInputColumn + 1) * sizeof(long))) == NULL)
+	return;
+    for (ii = 0; ii <= plan->maxInputColumn; ii++) {
+	columnMap[ii] = -1;
+    }
+    initIterator (coldht, &ii);
+    while (getNextStr (coldht, &ii, &str, &len, &outputColumn, NULL)) {
+	inputColumn = data_file_column (df, str, len);
+	if (inputColumn >= 0) {
+	    columnMap[inputColumn] = outputColumn;
+	}
+    }
+
+    /* If the index has column checkpoints, determine which checkpoint blocks contain wanted columns. */
+    if (df->idx != NULL && (plan->colstride = binary_index_colstride (df->idx)) > 0) {
+	if ((plan->blockWanted = (char *)calloc (plan->maxInputColumn/plan->colstride + 1, sizeof(char))) == NULL)
+	    return;
+	for (ii = 0; ii <= plan->maxInputColumn; ii++) {
+	    if (columnMap[ii] >= 0) plan->blockWanted[ii/plan->colstride] = 1;
+	}
+    }
+
+    /* Sort rows into ascending positions within the input file, and tell the operating system which
+     * parts of the file will be read.
+     */
+    qsort (rowInfo, plan->rowsWanted, sizeof(rowInfo_t), compare_rowInfo_t);
+    advise_rows (df, rowInfo, plan->rowsWanted);
+    plan->res = OK;
+}
+
+/* A range of the rows of a plan that is extracted by a single thread. */
+typedef struct {
+    const rowPlan *plan;
+    long first, last;	/* Rows [first, last) of the plan are extracted. */
+    double cost;	/* Estimated number of bytes read. */
+    parseProblem prob;	/* First problem found. */
+} rowTask;
+
+/* Returns the position of the first of the tasks a and b to start: the more costly one. */
+static int
+compare_rowTask (const void *a, const void *b)
+{
+    const rowTask *ap = *(const rowTask **)a;
+    const rowTask *bp = *(const rowTask **)b;
+
+    if (ap->cost > bp->cost) return -1;
+    if (ap->cost < bp->cost) return 1;
+    return 0;
+}
+
+/* Add the tasks that extract the rows of plan to tasks, which holds ntasks tasks, and return the
+ * new number of tasks.  Rows parsed in place from a mapped file into a numeric matrix are
+ * independent, so the rows of such a file are divided into up to 4*nthreads chunks that can be
+ * parsed concurrently.  The rows of any other file are extracted by a single task, since they are
+ * read through the file's single stdio or BGZF handle.
+ */
+static long
+add_row_tasks (const resultDest *dest, const rowPlan *plan, int nthreads, rowTask *tasks, long ntasks)
+{
+    long nchunks, cc;
+    long meanlen = mean_row_length (plan->df);
+
+    nchunks = (dest->parallel && plan->df->data.how == MAPPED_MMAP && nthreads > 1) ? plan->rowsWanted / MIN_ROWS_PER_CHUNK : 1;
+    if (nchunks > 4*nthreads) nchunks = 4*nthreads;
+    if (nchunks < 1) nchunks = 1;
+    for (cc = 0; cc < nchunks; cc++) {
+	tasks[ntasks].plan = plan;
+	tasks[ntasks].first = cc*plan->rowsWanted/nchunks;
+	tasks[ntasks].last = (cc+1)*plan->rowsWanted/nchunks;
+	tasks[ntasks].cost = (double)(tasks[ntasks].last - tasks[ntasks].first) * meanlen;
+	init_parse_problem (&tasks[ntasks].prob);
+	ntasks++;
+    }
+    return ntasks;
+}
+
+/* Extract the rows of task into the destination matrix, reading lines that cannot be parsed in place
+ * into buffer.  Rows of a file that is read via stdio are read in runs of nearby rows (separated by at
+ * most gap bytes), unless the rows have column checkpoints, in which case only the wanted blocks of
+ * each row are read.
+ */
+static void
+extract_rows (const resultDest *dest, rowTask *task, char *buffer, long buffersize, long gap)
+{
+    const rowPlan *plan = task->plan;
+    const tsvDataFile *df = plan->df;
+    const rowInfo_t *ri;
+    long nrow;
+
+    if (df->data.how != MAPPED_MMAP && df->bgzf == NULL && plan->colstride == 0) {
+	getRowsByRuns (dest, df, plan->rowInfo + task->first, task->last - task->first, plan->maxInputColumn,
+		       plan->columnMap, gap, &task->prob);
+	return;
+    }
+    if (df->data.how != MAPPED_MMAP && buffer == NULL) {
+	record_parse_problem (&task->prob, FIELD_NO_MEMORY, plan->rowInfo[task->first].rowPosn, "", 0);
+	return;
+    }
+    for (nrow = task->first; nrow < task->last; nrow++) {
+	ri = &plan->rowInfo[nrow];
+	if (get_tsv_fields (dest, ri->outputRow, df->tsvp, &df->data, df->bgzf, ri->rowPosn, ri->rowLen, plan->maxInputColumn, plan->columnMap,
+			    ri->ckpt, ri->nckpt, plan->colstride, plan->blockWanted, buffer, buffersize, &task->prob) != FIELD_OK)
+	    break;
+    }
+}
+
+/* Carry out ntasks tasks using up to nthreads threads.  The most costly tasks are started first, so
+ * that the threads finish together.  Threads other than this one read lines that cannot be parsed in
+ * place into buffers of their own, allocated when first needed.  Returns OK or OUT_OF_MEMORY.
+ */
+static enum status
+run_row_tasks (const resultDest *dest, rowTask *tasks, long ntasks, int nthreads, char *buffer, long buffersize, long gap)
+{
+    rowTask **order;
+    char **buffers;
+    long tt;
+
+    if (ntasks == 0)
+	return OK;
+    if (nthreads > ntasks) nthreads = (int)ntasks;
+    order = (rowTask **)malloc (ntasks * sizeof(rowTask *));
+    buffers = (char **)calloc (nthreads, sizeof(char *));
+    if (order == NULL || buffers == NULL) {
+	free (order);
+	free (buffers);
+	return OUT_OF_MEMORY;
+    }
+    for (tt = 0; tt < ntasks; tt++) {
+	order[tt] = &tasks[tt];
+    }
+    qsort (order, ntasks, sizeof(rowTask *), compare_rowTask);
+    buffers[0] = buffer;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads) if(nthreads > 1)
+#endif
+    for (tt = 0; tt < ntasks; tt++) {
+	int me = thread_number ();
+
+	if (buffers[me] == NULL && order[tt]->plan->df->data.how != MAPPED_MMAP)
+	    buffers[me] = (char *)malloc (buffersize);
+	extract_rows (dest, order[tt], buffers[me], buffersize, gap);
+    }
+
+    for (tt = 1; tt < nthreads; tt++) {
+	free (buffers[tt]);
+    }
+    free (buffers);
+    free (order);
+    return OK;
+}
+
+/* Number of rows copied from a numeric cache at a time.  The rows of a tile are copied one
+ * column at a time, so that consecutive stores to the (column-major) result are adjacent.
+ */
+#define CACHE_TILE_ROWS	64
+
+enum status
+getDataFromCache (const resultDest *dest, /* Destination matrix. */
+		  const tsvDataFile *df,  /* Data file to read. */
+		  const dynHashTab *rowdht,/* DHT containing desired row labels. */
+		  const dynHashTab *coldht,/* DHT containing desired column labels. */
+		  int *skipp)		  /* Set to why nothing was copied, or SKIP_NONE. */
+{
+    long ii, jj, kk, row, outputColumn;
+    long *cacheColumn, *outputRow, ncols, ncached, nrows, tile, ntile;
+    const void **values;
+    const char *str;
+    long len;
+    float fvalue;
+    uint32_t bits;
+    double *dst;
+    double na = na_double ();
+    int elemSize = numeric_cache_elem_size (df->cache);
+
+    /* Map each column of the result to a column of the cache (-1L if not in this file). */
+    *skipp = SKIP_NONE;
+    ncols = dhtNumStrings (coldht);
+    if ((cacheColumn = (long *)malloc ((ncols + 1) * sizeof(long))) == NULL)
+	return OUT_OF_MEMORY;
+    ncached = 0;
+    initIterator (coldht, &ii);
+    while (getNextStr (coldht, &ii, &str, &len, &outputColumn, NULL)) {
+	cacheColumn[outputColumn] = data_file_column_index (df, str, len);
+	if (cacheColumn[outputColumn] >= 0) ncached++;
+    }
+    if (ncached == 0) {
+	free (cacheColumn);
+	*skipp = SKIP_NO_COLS;
+	return OK;
+    }
+
+    /* Locate the wanted rows in the cache. */
+    outputRow = (long *)malloc ((dhtNumStrings (rowdht) + 1) * sizeof(long));
+    values = (const void **)malloc ((dhtNumStrings (rowdht) + 1) * sizeof(const void *));
+    if (outputRow == NULL || values == NULL) {
+	free (cacheColumn);
+	free (outputRow);
+	free (values);
+	return OUT_OF_MEMORY;
+    }
+    nrows = 0;
+    initIterator (rowdht, &ii);
+    while (getNextStr (rowdht, &ii, &str, &len, &outputRow[nrows], NULL)) {
+	if ((row = numeric_cache_find_row (df->cache, str, len)) >= 0)
+	    values[nrows++] = numeric_cache_row (df->cache, row);
+    }
+    if (nrows == 0)
+	*skipp = SKIP_NO_ROWS;
+    STATS_COUNT (STAT_CELLS, nrows * ncached);
+
+    for (tile = 0; tile < nrows; tile += CACHE_TILE_ROWS) {
+	ntile = nrows - tile < CACHE_TILE_ROWS ? nrows - tile : CACHE_TILE_ROWS;
+	for (jj = 0; jj < ncols; jj++) {
+	    if (cacheColumn[jj] < 0)
+		continue;
+	    dst = dest->dvec + jj*dest->colstep;
+	    for (kk = tile; kk < tile + ntile; kk++) {
+		if (elemSize == sizeof(double)) {
+		    dst[outputRow[kk]*dest->rowstep] = ((const double *)values[kk])[cacheColumn[jj]];
+		    continue;
+		}
+		fvalue = ((const float *)values[kk])[cacheColumn[jj]];
+		memcpy (&bits, &fvalue, sizeof(bits));
+		dst[outputRow[kk]*dest->rowstep] = bits == NUMCACHE_FLOAT_NA ? na : (double)fvalue;
+	    }
+	}
+    }
+    free (cacheColumn);
+    free (outputRow);
+    free (values);
+    return OK;
+}
+
+/* Returns 1 iff no cell of the result of the rows in rowdht and the columns in coldht is in more
+ * than one of the nfiles data files: that is, iff no wanted column, or else no wanted row, is in more
+ * than one file.
+ */
+static int
+files_disjoint (const tsvDataFile *files, long nfiles, const dynHashTab *rowdht, const dynHashTab *coldht)
+{
+    const uint32_t *ckpt;
+    const char *str;
+    long ii, iter, len, nckpt, rowlen, count;
+    int shared = 0;
+
+    initIterator (coldht, &iter);
+    while (!shared && getNextStr (coldht, &iter, &str, &len, NULL, NULL)) {
+	for (ii = count = 0; ii < nfiles; ii++) {
+	    if (data_file_column_index (&files[ii], str, len) >= 0) count++;
+	}
+	shared = count > 1;
+    }
+    if (!shared)
+	return 1;
+
+    initIterator (rowdht, &iter);
+    while (getNextStr (rowdht, &iter, &str, &len, NULL, NULL)) {
+	for (ii = count = 0; ii < nfiles; ii++) {
+	    if (data_file_row (&files[ii], str, len, &ckpt, &nckpt, &rowlen) >= 0) count++;
+	}
+	if (count > 1)
+	    return 0;
+    }
+    return 1;
+}
+
+/* Record the problems of ntasks tasks in prob: the first line terminated by end of file, and the
+ * first problem (in file order).  Returns OK, or PARSE_ERROR if a problem was found.
+ */
+static enum status
+gather_parse_problems (const rowTask *tasks, long ntasks, parseProblem *prob)
+{
+    long tt;
+
+    for (tt = 0; tt < ntasks; tt++) {
+	if (prob->eofRow < 0)
+	    prob->eofRow = tasks[tt].prob.eofRow;
+	if (tasks[tt].prob.code != FIELD_OK) {
+	    *prob = tasks[tt].prob;
+	    return PARSE_ERROR;
+	}
+    }
+    return OK;
+}
+
+/* The values of a numeric matrix are copied from the numeric cache of a file, if it has one.
+ *
+ * The wanted rows of the files are located by a pool of up to nthreads threads, largest file first.
+ * If no cell of the result is in more than one file, the rows of all files are then extracted by the
+ * pool together, so that the whole query takes about as long as its share of the work rather than
+ * the sum of the times taken by each file.  Otherwise the files are read one after another, since
+ * later files overwrite the cells they share with earlier ones, and only the rows of each file are
+ * divided between the threads.  Matrices whose setter is not parallel are extracted by a single thread.
+ */
+enum status
+getDataFromFiles (const resultDest *dest, /* Destination matrix. */
+		  const tsvDataFile *files, /* Data files to read. */
+		  long nfiles,	    /* Number of data files. */
+		  const dynHashTab *rowdht,/* DHT containing desired row labels. */
+		  const dynHashTab *coldht,/* DHT containing desired column labels. */
+		  char *buffer,	    /* Buffer for (re-)use by this function. */
+		  long buffersize,  /* Number of bytes in buffer. */
+		  int nthreads,	    /* Maximum number of threads to use. */
+		  long gap,	    /* Largest gap between rows of an unmapped file read together. */
+		  char *skipped,    /* If not NULL, set to why each file was skipped. */
+		  parseProblem *prob,/* Records the problems found. */
+		  long *failedp)    /* Set to the file that could not be read for lack of memory. */
+{
+    rowPlan *plans;
+    rowTask *tasks;
+    long *order, ii, kk, first, ntasks;
+    int together, skip;
+    enum status res = OK;
+
+    init_parse_problem (prob);
+    *failedp = -1L;
+    if (skipped != NULL) memset (skipped, SKIP_NONE, nfiles);
+    nthreads = dest->parallel ? resolve_threads (nthreads) : 1;
+    together = nfiles > 1 && nthreads > 1 && files_disjoint (files, nfiles, rowdht, coldht);
+
+    /* Plan the rows of each file that is not read from its cache. */
+    plans = (rowPlan *)calloc (nfiles + 1, sizeof(rowPlan));
+    tasks = (rowTask *)malloc ((nfiles * 4 * nthreads + 1) * sizeof(rowTask));
+    order = files_by_size (files, nfiles);
+    if (plans == NULL || tasks == NULL || order == NULL) {
+	free (plans);
+	free (tasks);
+	free (order);
+	return OUT_OF_MEMORY;
+    }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads) private(ii) if(nfiles > 1 && nthreads > 1)
+#endif
+    for (kk = 0; kk < nfiles; kk++) {
+	ii = order[kk];
+	if (files[ii].cache == NULL || dest->set != set_result_num)
+	    plan_rows (&plans[ii], &files[ii], rowdht, coldht);
+    }
+    for (ii = 0; ii < nfiles && res == OK; ii++) {
+	if (plans[ii].df != NULL && plans[ii].res != OK) {
+	    *failedp = ii;
+	    res = OUT_OF_MEMORY;
+	}
+    }
+
+    /* Extract the rows, file by file or all together. */
+    ntasks = 0;
+    for (ii = 0; ii < nfiles && res == OK; ii++) {
+	skip = SKIP_NONE;
+	if (plans[ii].df == NULL) {
+	    if ((res = getDataFromCache (dest, &files[ii], rowdht, coldht, &skip)) != OK)
+		*failedp = ii;
+	} else if (plans[ii].rowsWanted == 0) {
+	    skip = SKIP_NO_ROWS;
+	} else if (plans[ii].maxInputColumn < 0) {
+	    skip = SKIP_NO_COLS;
+	} else {
+	    first = ntasks;
+	    ntasks = add_row_tasks (dest, &plans[ii], nthreads, tasks, ntasks);
+	    if (!together && (res = run_row_tasks (dest, tasks + first, ntasks - first, nthreads, buffer, buffersize, gap)) == OK)
+		res = gather_parse_problems (tasks + first, ntasks - first, prob);
+	}
+	if (skipped != NULL) skipped[ii] = (char)skip;
+    }
+    if (together && res == OK && (res = run_row_tasks (dest, tasks, ntasks, nthreads, buffer, buffersize, gap)) == OK) {
+	res = gather_parse_problems (tasks, ntasks, prob);
+    }
+
+    for (ii = 0; ii < nfiles; ii++) {
+	if (plans[ii].df != NULL) free_row_plan (&plans[ii]);
+    }
+    free (plans);
+    free (tasks);
+    free (order);
+    return res;
+}
+
+enum status
+query_dataset (const resultDest *dest, tsvDataset *ds, const dynHashTab *rowdht, const dynHashTab *coldht,
+	       int nthreads, long gap, char *skipped, parseProblem *prob, long *failedp)
+{
+    return getDataFromFiles (dest, ds->files, ds->numFiles, rowdht, coldht, ds->buffer, LINEBUFFERSIZE,
+			     nthreads, gap, skipped, prob, failedp);
+}
+
+
+enum status
+dataset_unchanged (const tsvDataset *ds, long *failedp)
+{
+    long ii, size, mtime;
+
+    for (ii = 0; ii < ds->numFiles; ii++) {
+	get_data_stamp (&ds->files[ii], &size, &mtime);
+	if (size != ds->files[ii].dataSize || mtime != ds->files[ii].dataMtime) {
+	    *failedp = ii;
+	    return STALE_INDEX;
+	}
+    }
+    return OK;
+}
@@ -0,0 +1,315 @@
+
+/* This module implements the query engine of tsvio: it opens a set of TSV data files and their
+ * indexes as a dataset, and extracts the values of selected rows and columns of the dataset into
+ * a caller-supplied matrix.
+ *
+ * The module does not call R.  Problems are reported by status codes (see tsvio.h) and parse
+ * problems (see below), which the caller turns into messages.  It is used by the R package and by
+ * the tsvio-extract command (see inst/cli), and may be linked into other programs together with
+ * the other modules of the library (all source files except tsvlib.c).
+ *
+ * It must be included after dht.h, tsvio.h, binindex.h, mapfile.h, bgzf.h, and numcache.h.
+ *
+ * Summary of operations:
+ */
+
+/* Size of per line input buffer.  Longer lines are read into copies of their own. */
+#define LINEBUFFERSIZE	(1024*1024)
+
+/* Minimum number of rows parsed by each thread when extracting rows in parallel. */
+#define MIN_ROWS_PER_CHUNK	64
+
+/* Default gap between wanted rows of an unmapped data file below which they are read by a single read. */
+#define READ_GAP	(16*1024)
+
+/* Returns 1 iff res is an error, rather than OK or a status that only merits a warning. */
+extern int is_fatal_error (enum status res);
+
+/* Returns a description of res. */
+extern const char *status_message (enum status res);
+
+/* Generate the index file indexName of the data file dataName, in format INDEX_TEXT or INDEX_BINARY,
+ * with column checkpoints every colstride columns (binary indexes only; 0 for none).
+ */
+extern enum status build_index (const char *dataName, const char *indexName, int format, long colstride, int nthreads);
+
+/* Replace the binary index indexName, open as *indexpp, with an updated index for the data
+ * file tsvp, which has grown since the index was created.  Only the new lines are scanned.
+ * On return, *indexpp is the updated index file open for reading, or NULL if it could not be opened.
+ */
+extern enum status update_index_file (FILE *tsvp, FILE **indexpp, const char *indexName, int nthreads);
+
+/* Check that the index file, open as *indexpp, was created from the current contents of
+ * the data file tsvp.  If lines have only been appended to the data file, the index is
+ * updated in place and *grownp is set.  Text indexes contain no fingerprint of the data file
+ * and are not checked.
+ */
+extern enum status verify_index_file (FILE *tsvp, FILE **indexpp, const char *indexName, int *grownp);
+
+/* Missing values, with the same representation as R's NA_integer_ and NA_real_. */
+#define NA_INT32	INT_MIN
+extern double na_double (void);
+
+/* Destination of the fields parsed from the data files: a matrix and the function used to
+ * convert a field and store it in the matrix.  Element (r,c) of the matrix is element
+ * c*colstep + r*rowstep of the vector of its type.  Result is for the use of setters that store
+ * fields elsewhere (e.g. in an R character vector).
+ */
+typedef struct _resultDest resultDest;
+typedef int (*setterFunction) (const resultDest *dest, long idx, const char *s, long n);
+
+struct _resultDest {
+    void *result;	/* Destination of a setter that does not use the vectors below. */
+    int *ivec;		/* Destination of integers. */
+    double *dvec;	/* Destination of numbers. */
+    int64_t *lvec;	/* Destination of 64-bit integers (such as REAL(result) of an integer64 matrix). */
+    float *fvec;	/* Destination array of floats, if building a cache of floats. */
+    long rowstep;	/* Distance between elements of adjacent rows (1 for a matrix). */
+    long colstep;	/* Distance between elements of adjacent columns (number of rows for a matrix). */
+    setterFunction set;	/* For setting an element of result. */
+    int parallel;	/* Iff set, set may be used by multiple threads. */
+};
+
+/* Setters of integer (NA is NA_INT32), 64-bit integer (NA is INT64_MIN), and numeric (NA is
+ * na_double()) matrices, and of float caches (NA is NUMCACHE_FLOAT_NA).
+ */
+extern int set_result_int (const resultDest *dest, long idx, const char *s, long n);
+extern int set_result_int64 (const resultDest *dest, long idx, const char *s, long n);
+extern int set_result_num (const resultDest *dest, long idx, const char *s, long n);
+extern int set_cache_float (const resultDest *dest, long idx, const char *s, long n);
+
+/* Types of the columns of a data frame, from narrowest to widest.  A column of each type can
+ * also hold every field of the narrower types.  Empty and NA fields (see is_na_field) fit all types.
+ */
+#define COLTYPE_LOGICAL		0
+#define COLTYPE_INTEGER		1	/* 32-bit integer (NA is NA_INT32). */
+#define COLTYPE_DOUBLE		2
+#define COLTYPE_CHARACTER	3
+
+/* Returns the narrowest column type that holds the n-byte field s. */
+extern int field_column_type (const char *s, long n);
+
+/* Setter that stores nothing, but widens the type of the column of each field (column c of the
+ * destination matrix has type dest->ivec[c]) to hold it.  Used to infer the types of columns from
+ * a sample of rows.
+ */
+extern int set_column_type (const resultDest *dest, long idx, const char *s, long n);
+
+/* Results of setter functions and get_tsv_fields. */
+#define FIELD_OK		0
+#define FIELD_NON_INTEGER	1	/* Field is not an integer. */
+#define FIELD_INTEGER_TRAILING	2	/* Integer field is followed by other data. */
+#define FIELD_NON_NUMERIC	3	/* Field is not a number. */
+#define FIELD_NUMERIC_TRAILING	4	/* Numeric field is followed by other data. */
+#define FIELD_BEYOND_EOF	5	/* Row extends beyond the end of the (mapped) data file. */
+#define FIELD_INTEGER_OVERFLOW	6	/* Integer field is too large for the result type. */
+#define FIELD_READ_ERROR	7	/* Row could not be read from the (unmapped) data file. */
+#define FIELD_NO_MEMORY		9	/* Unable to allocate memory to read row. */
+
+/* The first problem found while extracting rows.  Problems are recorded and reported afterwards,
+ * since rows may be extracted by several threads.
+ */
+typedef struct {
+    int code;		/* FIELD_OK, or the first problem found. */
+    long rowposn;	/* Offset of the row containing the problem. */
+    char text[256];	/* Start of the offending field. */
+    int len;		/* Number of bytes in text. */
+    long eofRow;	/* Offset of a row terminated by end of file instead of newline, or -1L. */
+} parseProblem;
+
+extern void init_parse_problem (parseProblem *prob);
+
+/* Record a problem in prob, unless one has already been recorded.  Returns code. */
+extern int record_parse_problem (parseProblem *prob, int code, long rowposn, const char *s, long n);
+
+/* Write the message describing the problem recorded in prob (other than its eofRow) to msg,
+ * which holds size bytes.
+ */
+extern void parse_problem_message (const parseProblem *prob, char *msg, size_t size);
+
+/* Save the tab-separated fields in buffer into row rowid of the destination matrix.  The first
+ * field in buffer is input column firstColumn, and fields after lastColumn are ignored.  Input
+ * column c is stored in column columnMap[c] of the result, unless that is -1L.  Returns FIELD_OK,
+ * or the problem (recorded in prob) with the first field that could not be stored.
+ */
+extern int parse_tsv_fields (const resultDest *dest, long rowid, const char *buffer, long buflen, long firstColumn,
+			     long lastColumn, const long *columnMap, long rowposn, parseProblem *prob);
+
+/* Locate the line of a data file starting at rowposn: see dataset.c. */
+extern int get_data_line (FILE *tsvp, const mappedFile *data, bgzfFile *bgzf, long rowposn, long rowlen, const uint32_t *ckpt,
+			  long nckpt, char *buffer, long buffer_size, const char **linep, long *linelenp, char **copyp,
+			  parseProblem *prob);
+
+/* Read the fields of one row of a data file and store them in the destination matrix: see dataset.c. */
+extern int get_tsv_fields (const resultDest *dest, long rowid, FILE *tsvp, const mappedFile *data, bgzfFile *bgzf,
+			   long rowposn, long rowlen, long maxColumnWanted, const long *columnMap, const uint32_t *ckpt,
+			   long nckpt, long colstride, const char *blockWanted, char *buffer, long buffer_size,
+			   parseProblem *prob);
+
+/* Reads a plan of lines, at ascending offsets, from a data file that is neither mapped nor compressed.
+ * Instead of reading each line separately, lines separated by at most gap bytes are read by a single
+ * read, and the operating system is asked to prefetch the following lines of the plan.  If the lengths
+ * of the lines are known, each read is of exactly the lines it covers.
+ */
+typedef struct {
+    FILE *fp;		/* File to read. */
+    const long *posn;	/* Offsets of the lines of the plan. */
+    const long *rowlen;	/* Lengths of the lines excluding their newlines (-1L if unknown), or NULL. */
+    long nposn;		/* Number of lines in the plan. */
+    long gap;		/* Largest gap between lines read together. */
+    long meanlen;	/* Estimated length of a line. */
+    long advised;	/* Lines of the plan before this one have been prefetched. */
+    char *buf;		/* Bytes read. */
+    size_t bufsize;	/* Number of bytes allocated for buf. */
+    long start;		/* Offset in the file of buf[0]. */
+    size_t len;		/* Number of bytes in buf. */
+    int eof;		/* Iff set, buf extends to the end of the file. */
+} lineReader;
+
+extern void init_line_reader (lineReader *lr, FILE *fp, const long *posn, const long *rowlen, long nposn, long gap,
+			      long meanlen);
+extern void free_line_reader (lineReader *lr);
+
+/* Locate line k of the plan of lr, reading it if necessary.  The results are as for get_data_line. */
+extern int get_planned_line (lineReader *lr, long k, const char **linep, long *linelenp, char **copyp, parseProblem *prob);
+
+/* Read the line at *posnp of the data file tsvp (or of bgzf, if it is compressed) into buffer, or
+ * into a copy (*copyp, else NULL) to be freed by the caller if it does not fit, set *linep to the
+ * line, and advance *posnp to the following line.  Returns the length of the line, -1L at end of
+ * file, or -2L if the line could not be read.
+ */
+extern long read_data_line (FILE *tsvp, bgzfFile *bgzf, long *posnp, char *buffer, long buffersize, char **linep,
+			    char **copyp);
+
+/* Insert the labels of the data columns of the header line of the data file tsvp (or of bgzf, if it
+ * is compressed) into dht, with their column numbers, using buffer to read lines that fit.  Returns OK,
+ * READ_ERROR if the header cannot be read, or NO_LABEL_ERROR if it does not label every data column.
+ */
+extern enum status scan_header_line (dynHashTab *dht, FILE *tsvp, bgzfFile *bgzf, int insertall, char *buffer, long buffersize);
+
+/* An open dataset: a set of TSV data files and their indexes, together with the parsed
+ * row and column dictionaries of each file (read from the index where it records them).
+ * A dataset is opened once and can then be queried repeatedly without re-opening the files,
+ * re-scanning the indexes, or re-parsing the header lines.
+ */
+typedef struct {
+    char *dataName;	/* Name of data file (for messages). */
+    FILE *tsvp;		/* Open data file. */
+    FILE *indexp;	/* Open index file. */
+    binIndex *idx;	/* Mapped binary index, or NULL if the index is in text format. */
+    dynHashTab *rowdht;	/* Text index only: row label -> byte offset of row. */
+    dynHashTab *coldht;	/* Column label -> column number in this file, or NULL if the binary index
+			 * records the column labels (see data_file_columns). */
+    long dataSize;	/* Size of data file when opened. */
+    long dataMtime;	/* Modification time of data file when opened. */
+    mappedFile data;	/* Contents of data file, if it can be memory mapped. */
+    bgzfFile *bgzf;	/* Handle for reading the data file, if it is BGZF compressed. */
+    numCache *cache;	/* Numeric cache of the data file, or NULL if none. */
+} tsvDataFile;
+
+typedef struct {
+    long numFiles;
+    tsvDataFile *files;
+    dynHashTab *rows;	/* All row labels in all files, in order of first occurrence (created when first needed). */
+    dynHashTab *cols;	/* All column labels in all files, in order of first occurrence. */
+    char *buffer;	/* Line buffer of LINEBUFFERSIZE bytes. */
+} tsvDataset;
+
+/* What happened while opening one data file of a dataset, so that the caller can report it. */
+typedef struct {
+    const char *indexName;	/* Name of index file. */
+    int created;		/* Iff set, the index file did not exist, and was created. */
+    int temporary;		/* Iff set, the index file could not be created, so a temporary index was used. */
+    int generate;		/* Iff set, the index file has just been created, and must be generated. */
+    int grown;			/* Iff set, the data file had grown, and its index has been updated. */
+    enum status openres;	/* Result of opening the data and index files: OK, OPEN_FAILED (data file),
+				 * NOT_BGZF, WRITE_ERROR (temporary index), or OUT_OF_MEMORY. */
+    enum status genres;		/* Result of generating the index. */
+    enum status verres;		/* Result of checking the index. */
+    enum status idxres;		/* Result of loading the index. */
+    enum status hdrres;		/* Result of scanning the header line. */
+} fileLoad;
+
+/* Open the nfiles data files dataNames and their index files indexNames as a dataset.  A missing
+ * index file is generated.  The indexes and header lines of the files are loaded by up to nthreads
+ * threads.  What happened to each file is recorded in loads (which holds nfiles elements).
+ * On success, *dsp is set to the dataset, to be released by close_dataset.  Otherwise *dsp is NULL,
+ * *failedp is set to the file that could not be opened (-1L if the dataset could not be allocated),
+ * and the result of that file in loads (and of the earlier files) describes the problem.
+ */
+extern enum status open_dataset (long nfiles, const char *const *dataNames, const char *const *indexNames, int nthreads,
+				 tsvDataset **dsp, fileLoad *loads, long *failedp);
+
+/* Release the dataset ds. */
+extern void close_dataset (tsvDataset *ds);
+
+/* Open the numeric cache cacheName of the data file df of a dataset.  Returns OK, OPEN_FAILED,
+ * STALE_INDEX if the cache does not match the data file, or the i/o or format error found, in
+ * which case the file has no cache.
+ */
+extern enum status open_data_file_cache (tsvDataFile *df, const char *cacheName);
+
+/* Returns OK, or STALE_INDEX (setting *failedp) if any data file of ds has changed since it was opened. */
+extern enum status dataset_unchanged (const tsvDataset *ds, long *failedp);
+
+/* Set *rowsp to all row labels in all files of ds, in order of first occurrence.  The table
+ * belongs to ds.  If an index cannot be scanned, *failedp is set to the file.
+ */
+extern enum status dataset_all_rows (tsvDataset *ds, dynHashTab **rowsp, long *failedp);
+
+/* Returns the byte offset in the data file of df of the row with label str, or -1L if the
+ * file has no such row.  If the row has column checkpoints, *ckptp and *nckptp are set to them.
+ * *Rowlenp is set to the length of the row excluding its newline if the index records it, else -1L.
+ */
+extern long data_file_row (const tsvDataFile *df, const char *str, long len, const uint32_t **ckptp, long *nckptp,
+			   long *rowlenp);
+
+/* Returns the number of the data column of df labelled str, or -1L if the file has no such column. */
+extern long data_file_column (const tsvDataFile *df, const char *str, long len);
+
+/* Returns the number of distinct column labels of df preceding the label str in its header line,
+ * or -1L if the file has no such column.
+ */
+extern long data_file_column_index (const tsvDataFile *df, const char *str, long len);
+
+/* Returns the number of distinct column labels of df. */
+extern long data_file_num_columns (const tsvDataFile *df);
+
+/* Returns the column labels of df, in order of first occurrence, with their column numbers.  If
+ * the labels are recorded in the binary index, the table is built when first needed (and kept
+ * in df).  Returns NULL if memory cannot be allocated.
+ */
+extern const dynHashTab *data_file_columns (tsvDataFile *df);
+
+/* Returns 1 iff any file of ds contains a row with label str. */
+extern int dataset_has_row (const tsvDataset *ds, const char *str, long len);
+
+/* Returns the mean length of the rows of the data file of df. */
+extern long mean_row_length (const tsvDataFile *df);
+
+/* Why a data file contributed nothing to a query. */
+#define SKIP_NONE	0
+#define SKIP_NO_ROWS	1	/* The file has none of the wanted rows. */
+#define SKIP_NO_COLS	2	/* The file has none of the wanted columns. */
+
+/* Copy the values of the rows in rowdht and the columns in coldht from the numeric cache of df
+ * into the numeric destination matrix.  *Skipp is set to SKIP_NONE, or why nothing was copied.
+ */
+extern enum status getDataFromCache (const resultDest *dest, const tsvDataFile *df, const dynHashTab *rowdht,
+				     const dynHashTab *coldht, int *skipp);
+
+/* Extract the rows in rowdht and the columns in coldht of nfiles data files into the destination
+ * matrix, where the rows and columns of the matrix are in the insertion order of the tables.  Cells
+ * in no file are not changed, and later files overwrite the cells they share with earlier ones.
+ * Up to nthreads threads are used, and rows of unmapped data files separated by at most gap bytes
+ * are read together.  If skipped is not NULL, skipped[ii] is set to why file ii (if any) was skipped.
+ * Returns OK, OUT_OF_MEMORY (setting *failedp to the file, or -1L), or PARSE_ERROR.  Problems are
+ * recorded in prob, including the first line terminated by end of file, even if the result is OK.
+ */
+extern enum status getDataFromFiles (const resultDest *dest, const tsvDataFile *files, long nfiles,
+				     const dynHashTab *rowdht, const dynHashTab *coldht, char *buffer, long buffersize,
+				     int nthreads, long gap, char *skipped, parseProblem *prob, long *failedp);
+
+/* As getDataFromFiles, for all files of the dataset ds. */
+extern enum status query_dataset (const resultDest *dest, tsvDataset *ds, const dynHashTab *rowdht, const dynHashTab *coldht,
+				  int nthreads, long gap, char *skipped, parseProblem *prob, long *failedp);
@@ -1,8 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "dht.h"
-
-#include <R.h>
+#include "stats.h"
 
 /* #### #### #### #### #### #### ####
  * #### #### #### #### #### #### ####
@@ -75,76 +74,201 @@ int rem;
     return hash;
 }
 
-/* This function further modifies an initial hash with a hash of the input data.
- * The parameters are:
- * 1. A pointer to the start of the data to hash.
- * 2. The number of bytes in that data.
- * 3. The initial hash value.
- */
-static inline unsigned long rehash (const char *str, long len, unsigned long h)
-{
-    return SuperFastHashModified (str, len, h);
-}
-
 /* This function computes a hash of the input data.
  * The parameters are:
  * 1. A pointer to the start of the data to hash.
  * 2. The number of bytes in that data.
+ * The result is further mixed (as in MurmurHash3) so that its low bits, which select the
+ * initial slot, depend on every bit of the hash.
  */
-static inline unsigned long hash (const char *str, long len)
+static inline uint32_t hash (const char *str, long len)
 {
-    return SuperFastHashModified (str, len, len);
+    uint32_t h = SuperFastHashModified (str, len, (uint32_t)len);
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
 }
 
 
-/* For each hash table slot, we maintain 4 fields.
+/* Each string inserted into the table is recorded in an entry.  Entries are stored in
+ * insertion order, so the insertion index of a string is the index of its entry, and
+ * iteration visits the strings in insertion order.
  */
 typedef struct {
-    long order;		/* Number of strings inserted before this one. */
-    const char *str;	/* Address of string in this slot (needed for rehashing). */
-    long len;		/* Length of string in this slot. */
+    const char *str;	/* Address of string. */
+    long len;		/* Length of string. */
     long value;		/* User value attached to this string. */
+} dhtEntry;
+
+/* The hash table proper is an array of compact slots, probed linearly.  Each slot records the
+ * full hash of its string, so that probing and growing the table compare and move slots without
+ * touching the entries or the strings (other than to confirm a match).
+ */
+typedef struct {
+    uint32_t hash;	/* Hash of string. */
+    uint32_t entry;	/* Index of entry plus one, or FREESLOT. */
 } dhtSlot;
 
-/* A free slot is indicated by a special value of the order field. */
-#define FREESLOT	-1
+/* A free slot is indicated by a special value of the entry field. */
+#define FREESLOT	0
+
+/* Maximum number of strings in a table. */
+#define MAXENTRIES	(UINT32_MAX - 1)
+
+/* Duplicated strings are allocated from blocks of at least ARENA_MIN_BLOCK bytes, doubling in
+ * size up to ARENA_MAX_BLOCK bytes.
+ */
+#define ARENA_MIN_BLOCK	4096
+#define ARENA_MAX_BLOCK	(1024*1024)
+
+typedef struct _dhtBlock {
+    struct _dhtBlock *next;	/* Previously allocated block. */
+    size_t size;		/* Number of bytes in data. */
+    size_t used;		/* Number of bytes of data allocated. */
+    char data[1];
+} dhtBlock;
 
 /* This structure maintains the representation of a dynamic hash table.
  */
 struct _dynhashtab {
     /* Standard dynamic hash table fields: */
-    long size;		/* Number of slots in hash table. */
+    long size;		/* Number of slots in hash table (a power of two). */
     long count;		/* Number of slots in use. */
     long loadLimit;	/* When count reaches this limit, we grow the table. */
     dhtSlot *slot;	/* Hash table slots. */
+    dhtEntry *entry;	/* Entries, in insertion order. */
+    long entryAlloc;	/* Number of entries allocated. */
+    dhtBlock *arena;	/* Most recent block of duplicated strings (if DHT_STRDUP). */
     long flags;		/* Hash table specific options. */
+    int failed;		/* Iff set, a string could not be inserted. */
 };
 
 
-/* This function allocates a DHT with an initial size given by the parameter.
+/* Returns a pointer to a copy of the len bytes at str, followed by a NUL, allocated from the arena of dht. */
+static const char *
+arena_strdup (dynHashTab *dht, const char *str, long len)
+{
+    dhtBlock *block = dht->arena;
+    size_t bsize;
+    char *copy;
+
+    if (block == NULL || block->size - block->used < (size_t)len + 1) {
+	bsize = block == NULL ? ARENA_MIN_BLOCK : block->size * 2;
+	if (bsize > ARENA_MAX_BLOCK) bsize = ARENA_MAX_BLOCK;
+	if (bsize < (size_t)len + 1) bsize = (size_t)len + 1;
+	if ((block = malloc (sizeof(dhtBlock) + bsize)) == NULL)
+	    return NULL;
+	block->next = dht->arena;
+	block->size = bsize;
+	block->used = 0;
+	dht->arena = block;
+    }
+    copy = block->data + block->used;
+    memcpy (copy, str, len);
+    copy[len] = '\0';
+    block->used += (size_t)len + 1;
+    return copy;
+}
+
+/* Allocate a table of newsize (a power of two) slots for dht, and move the existing slots into it. */
+static int
+resize_table (dynHashTab *dht, long newsize)
+{
+    dhtSlot *newslot;
+    unsigned long mask = (unsigned long)newsize - 1;
+    long ii, idx;
+
+    if ((newslot = malloc (sizeof(dhtSlot) * newsize)) == NULL)
+	return 0;
+    for (ii = 0; ii < newsize; ii++) {
+	newslot[ii].entry = FREESLOT;
+    }
+    /* Copy existing slots to new locations, using the stored hashes. */
+    for (ii = 0; ii < dht->size; ii++) {
+	if (dht->slot[ii].entry != FREESLOT) {
+	    idx = dht->slot[ii].hash & mask;
+	    while (newslot[idx].entry != FREESLOT) {
+		idx = (idx + 1) & mask;
+	    }
+	    newslot[idx] = dht->slot[ii];
+	}
+    }
+    /* Release old slots and replace with the new ones. */
+    free (dht->slot);
+    dht->slot = newslot;
+    /* Set new DHT size and load limit. */
+    dht->size = newsize;
+    dht->loadLimit = (newsize * 3) / 4;
+    return 1;
+}
+
+/* Ensure that the entries of dht have room for nstrings strings. */
+static int
+reserve_entries (dynHashTab *dht, long nstrings)
+{
+    dhtEntry *newentry;
+
+    if (nstrings > dht->entryAlloc) {
+	if ((newentry = realloc (dht->entry, sizeof(dhtEntry) * nstrings)) == NULL)
+	    return 0;
+	dht->entry = newentry;
+	dht->entryAlloc = nstrings;
+    }
+    return 1;
+}
+
+/* This function allocates a DHT with room for at least the given number of slots.
  */
 dynHashTab *
 newDynHashTab (long isize, long flags)
 {
     dynHashTab *dht = malloc (sizeof (*dht));
-    long ii;
+    long size;
+
+    if (dht == NULL)
+	return NULL;
+    /* Round the initial size up to a power of two. */
+    for (size = 8; size < isize; size *= 2)
+	;
 
     /* Set initial DHT size, load limit, and number of entries. */
-    dht->size = isize;
-    dht->loadLimit = (isize * 3) / 4;
+    dht->size = 0;
+    dht->loadLimit = 0;
     dht->count = 0;
     dht->flags = flags;
+    dht->slot = NULL;
+    dht->entry = NULL;
+    dht->entryAlloc = 0;
+    dht->arena = NULL;
+    dht->failed = 0;
 
     /* Allocate and initialize slots. */
-    dht->slot = malloc (sizeof(dhtSlot) * isize);
-    for (ii = 0; ii < isize; ii++) {
-        dht->slot[ii].order = FREESLOT;
-        dht->slot[ii].str = NULL;
-        dht->slot[ii].len = 0;
+    if (!resize_table (dht, size)) {
+	free (dht);
+	return NULL;
     }
     return dht;
 }
 
+void
+dhtReserve (dynHashTab *dht, long nstrings)
+{
+    long newsize;
+
+    if (nstrings >= dht->loadLimit) {
+	for (newsize = dht->size; (newsize * 3) / 4 <= nstrings; newsize *= 2)
+	    ;
+	if (!resize_table (dht, newsize))
+	    return;
+	STATS_COUNT (STAT_HASH_GROWS, 1);
+    }
+    reserve_entries (dht, nstrings);
+}
+
 #define DOINSERT  0x01
 #define CHANGEVAL 0x02
 
@@ -174,83 +298,88 @@ dhtNumStrings (const dynHashTab *dht)
     return dht->count;
 }
 
+int
+dhtFailed (const dynHashTab *dht)
+{
+    return dht->failed;
+}
+
+/* Returns the index of the slot of dht containing string, or of the free slot at which
+ * it would be inserted.
+ */
+static inline long
+find_slot (const dynHashTab *dht, const char *str, long len, uint32_t h)
+{
+    unsigned long mask = (unsigned long)dht->size - 1;
+    long idx = h & mask, probes = 1;
+    const dhtEntry *ep;
+
+    while (dht->slot[idx].entry != FREESLOT) {
+	if (dht->slot[idx].hash == h) {
+	    ep = &dht->entry[dht->slot[idx].entry - 1];
+	    if (ep->len == len && memcmp (ep->str, str, len) == 0)
+		break;
+	}
+	idx = (idx + 1) & mask;
+	probes++;
+    }
+    STATS_COUNT (STAT_HASH_PROBES, probes);
+    return idx;
+}
+
 static void
 hashTabOp (dynHashTab *dht, const char *str, long len, long value, long flags)
 {
-    unsigned long h = hash (str, len);
-    dhtSlot *newslot;
-    long newsize;
-    long ii, idx, iters;
+    uint32_t h = hash (str, len);
+    const char *copy;
+    dhtEntry *ep;
+    long idx;
 
     /* Search hash table until we encounter either the desired string
      * or an empty slot.
      */
-    iters = 0;
-    while (dht->slot[idx = (h % dht->size)].order != FREESLOT) {
-	if ((dht->slot[idx].len == len) && (strncmp (dht->slot[idx].str, str, len) == 0)) {
-	    if (flags & CHANGEVAL) {
-		dht->slot[idx].value = value;
-	    }
-	    return;
-	}
-        h = rehash (str, len, h);
-	if (iters++ > 1000) {
-	    warning ("dht.insertStr: excessive looping in hash.\n");
-	    return;
+    idx = find_slot (dht, str, len, h);
+    if (dht->slot[idx].entry != FREESLOT) {
+	if (flags & CHANGEVAL) {
+	    dht->entry[dht->slot[idx].entry - 1].value = value;
 	}
+	return;
     }
     if (!(flags & DOINSERT))
        return;
 
+    /* Make room for the new entry.  The slot table is only grown after the insertion,
+     * so the free slot found above remains valid.
+     */
+    if (dht->count >= MAXENTRIES) {
+	dht->failed = 1;
+	return;
+    }
+    if (dht->count == dht->entryAlloc && !reserve_entries (dht, dht->entryAlloc < 16 ? 16 : dht->entryAlloc * 2)) {
+	dht->failed = 1;
+	return;
+    }
+    copy = str;
+    if ((dht->flags & DHT_STRDUP) && (copy = arena_strdup (dht, str, len)) == NULL) {
+	dht->failed = 1;
+	return;
+    }
+
     /* Put new entry into empty slot and increment number of entries. */
-    dht->slot[idx].order = dht->count++;
-#ifdef _WIN32
-    if (dht->flags & DHT_STRDUP) {
-        if ((dht->slot[idx].str = malloc (len)) != NULL)
-            memcpy (dht->slot[idx].str, str, len);
-    } else
-        dht->slot[idx].str = str;
-#else
-    dht->slot[idx].str = dht->flags & DHT_STRDUP ? strndup (str, len) : str;
-#endif
-    dht->slot[idx].len = len;
-    dht->slot[idx].value = value;
+    ep = &dht->entry[dht->count];
+    ep->str = copy;
+    ep->len = len;
+    ep->value = value;
+    dht->slot[idx].hash = h;
+    dht->slot[idx].entry = (uint32_t)(++dht->count);
 
     /* Check load and grow DHT if required. */
     if (dht->count >= dht->loadLimit) {
 	/* We will double the number of slots. */
-        newsize = dht->size * 2;
-	/* Create stores for remapped slots. */
-	newslot = malloc (sizeof(dhtSlot) * newsize);
-	for (ii = 0; ii < newsize; ii++) {
-	    newslot[ii].order = FREESLOT;
-	    newslot[ii].str = NULL;
-	    newslot[ii].len = 0;
-	}
-	/* Copy existing slots to new locations. */
-	for (ii = 0; ii < dht->size; ii++) {
-	    if (dht->slot[ii].order != FREESLOT) {
-		/* Find new location. */
-		h = hash (dht->slot[ii].str, dht->slot[ii].len);
-		iters = 0;
-		while (newslot[idx = (h % newsize)].order != FREESLOT) {
-		    h = rehash (dht->slot[ii].str, dht->slot[ii].len, h);
-		    if (iters++ > 1000) {
-			warning ("dht.insertStr: excessive looping in hash.\n");
-			return;
-		    }
-		}
-		/* Copy element to new location. */
-		newslot[idx] = dht->slot[ii];
-	    }
-	}
-	/* Release old slots and replace with the new ones. */
-	free (dht->slot);
-	dht->slot = newslot;
-	/* Set new DHT size and load limit. */
-	dht->size = newsize;
-	dht->loadLimit = (newsize * 3) / 4;
-    };
+	if (!resize_table (dht, dht->size * 2))
+	    dht->failed = 1;
+	STATS_COUNT (STAT_HASH_GROWS, 1);
+    }
 }
 
 /* This function returns the insertion index of the string given as a parameter.
@@ -263,20 +392,11 @@ hashTabOp (dynHashTab *dht, const char *str, long len, long value, long flags)
 long
 getStringIndex (const dynHashTab *dht, const char *str, long len)
 {
-    unsigned long h = hash (str, len);
-    long iters = 0;
-    long idx;
+    long idx = find_slot (dht, str, len, hash (str, len));
 
-    while (dht->slot[idx = (h % dht->size)].order != FREESLOT) {
-	if ((dht->slot[idx].len == len) && (strncmp (dht->slot[idx].str, str, len) == 0))
-	    return dht->slot[idx].order;
-        h = rehash (str, len, h);
-	if (iters++ > 1000) {
-	    warning ("dht.getStringIndex: excessive looping in hash.\n");
-	    return -1L;
-	}
-    }
-    return -1L;
+    if (dht->slot[idx].entry == FREESLOT)
+	return -1L;
+    return (long)dht->slot[idx].entry - 1;
 }
 
 void
@@ -284,10 +404,8 @@ setAllValues (dynHashTab *dht, long value)
 {
     long ii;
 
-    for (ii = 0; ii < dht->size; ii++) {
-	if (dht->slot[ii].order != FREESLOT) {
-	    dht->slot[ii].value = value;
-	}
+    for (ii = 0; ii < dht->count; ii++) {
+	dht->entry[ii].value = value;
     }
 }
 
@@ -297,8 +415,8 @@ countValues (const dynHashTab *dht, long value)
     long ii;
     long n = 0L;
 
-    for (ii = 0; ii < dht->size; ii++) {
-	if (dht->slot[ii].order != FREESLOT && dht->slot[ii].value == value) {
+    for (ii = 0; ii < dht->count; ii++) {
+	if (dht->entry[ii].value == value) {
 	    n++;
 	}
     }
@@ -308,81 +426,61 @@ countValues (const dynHashTab *dht, long value)
 long
 countNotValues (const dynHashTab *dht, long value)
 {
-    long ii;
-    long n = 0L;
-
-    for (ii = 0; ii < dht->size; ii++) {
-	if (dht->slot[ii].order != FREESLOT && dht->slot[ii].value != value) {
-	    n++;
-	}
-    }
-    return n;
+    return dht->count - countValues (dht, value);
 }
 
 void
 initIterator (const dynHashTab *dht, long *iter)
 {
+    (void)dht;
     *iter = -1L;
 }
 
 int
 getNextStr (const dynHashTab *dht, long *iter, const char **strp, long *lenp, long *orderp, long *valuep)
 {
-    dhtSlot *sp;
-    long next = *iter;
-    while (++next < dht->size) {
-	sp = &dht->slot[next];
-        if (sp->order != FREESLOT) {
-	    if (strp) *strp = sp->str;
-	    if (lenp) *lenp = sp->len;
-	    if (orderp) *orderp = sp->order;
-	    if (valuep) *valuep = sp->value;
-	    *iter = next;
-	    return 1;
-	}
-    }
+    const dhtEntry *ep;
+    long next = *iter + 1;
+
     *iter = next;
-    return 0;
+    if (next >= dht->count)
+	return 0;
+    ep = &dht->entry[next];
+    if (strp) *strp = ep->str;
+    if (lenp) *lenp = ep->len;
+    if (orderp) *orderp = next;
+    if (valuep) *valuep = ep->value;
+    return 1;
 }
 
 long
 getStringValue (const dynHashTab *dht, const char *str, long len)
 {
-    unsigned long h = hash (str, len);
-    long iters = 0;
-    long idx;
+    long idx = find_slot (dht, str, len, hash (str, len));
 
-    while (dht->slot[idx = (h % dht->size)].order != FREESLOT) {
-	if ((dht->slot[idx].len == len) && (strncmp (dht->slot[idx].str, str, len) == 0))
-	    return dht->slot[idx].value;
-        h = rehash (str, len, h);
-	if (iters++ > 1000) {
-	    warning ("dht.getStringValue: excessive looping in hash.\n");
-	    return -1L;
-	}
-    }
-    return -1L;
+    if (dht->slot[idx].entry == FREESLOT)
+	return -1L;
+    return dht->entry[dht->slot[idx].entry - 1].value;
 }
 
 /* This function destroys the DHT and releases any storage allocated for it by this module.
  * If DHT_STRDUP is not set, releasing backing storage for the strings
  * inserted into the table is the responsibility of the caller.
  *
- * After this function returns, the DHT and any memory associated with it is not valid. 
+ * After this function returns, the DHT and any memory associated with it is not valid.
  *
- * NB: If DHT_STRDUP is set, these are all strings we allocated are at liberty to free.
+ * NB: If DHT_STRDUP is set, the duplicated strings are all in the arena, which is freed.
  */
 void
 freeDynHashTab (dynHashTab *dht)
 {
-    long ii;
-    if (dht->flags & DHT_STRDUP) {
-	for (ii = 0; ii < dht->size; ii++) {
-	    if (dht->slot[ii].order != FREESLOT) {
-	        free ((char *)(dht->slot[ii].str));
-	    }
-	}
+    dhtBlock *block, *next;
+
+    for (block = dht->arena; block != NULL; block = next) {
+	next = block->next;
+	free (block);
     }
+    free (dht->entry);
     free (dht->slot);
     free (dht);
 }
@@ -10,7 +10,7 @@
  * length.  Shorter strings are NUL-terminated.
  *
  * If flag DHT_STRDUP is specified when the DHT is created, all strings will be duplicated on
- * insertion and freed when the DHT is destroyed.
+ * insertion (NUL-terminated, into blocks owned by the DHT) and freed when the DHT is destroyed.
  * Otherwise, the memory backing the strings inserted into the hash table must be maintained
  * by the caller(s) until the table is destroyed (at least).
  *
@@ -24,6 +24,11 @@ extern dynHashTab *newDynHashTab (long initial_size, long flags);
 extern void freeDynHashTab (dynHashTab *dht);
 			/* Iff DHT_STRDUP is set, all inserted strings will also be freed. */
 
+/* Presize dht so that a total of nstrings strings can be inserted without growing it.
+ * Used before inserting many strings whose number is known in advance.
+ */
+extern void dhtReserve (dynHashTab *dht, long nstrings);
+
 /* If string is not in dht, insert it with initial value 0. */
 extern void insertStr (dynHashTab *dht, const char *str, long len);
 
@@ -39,6 +44,12 @@ extern void setAllValues (dynHashTab *dht, long value);
 /* Returns the number of strings in dht. */
 extern long dhtNumStrings (const dynHashTab *dht);
 
+/* Returns 1 iff a string could not be inserted into dht (because there were too many strings, or
+ * memory could not be allocated), in which case the table is incomplete.  Dht does not call R, so
+ * it is up to its user to report the failure.
+ */
+extern int dhtFailed (const dynHashTab *dht);
+
 /* Returns the number of strings in dht associated with value. */
 extern long countValues (const dynHashTab *dht, long value);
 
@@ -56,7 +67,7 @@ extern long getStringIndex (const dynHashTab *dht, const char *str, long len);
 /* Initializes an iterator for iterating over the strings contained in the dht. */
 extern void initIterator (const dynHashTab *dht, long *iter);
 
-/* Advances the iterator to the next string in dht.
+/* Advances the iterator to the next string in dht.  Strings are visited in insertion order.
  *
  * If there is no next string, the function returns 0 and the iterator is invalidated.
  *
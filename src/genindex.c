@@ -1,58 +1,428 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "dht.h"
 #include "tsvio.h"
+#include "mapfile.h"
+#include "binindex.h"
+#include "bgzf.h"
 
-enum status
-generate_index (FILE *ip, FILE *op)
+/* Data files are scanned in chunks of about this many bytes, so that both large files and many
+ * small files can be divided evenly between threads.
+ */
+#define MIN_CHUNK_SIZE	(4L*1024*1024)
+
+/* A contiguous range of one data file, scanned by a single thread. */
+typedef struct {
+	long	job;		/* Index of data file in jobs array. */
+	size_t	start, end;	/* Nominal byte range of chunk. */
+	rowEntry *row;		/* Rows that start within the chunk. */
+	long	count, alloc;
+	uint32_t *ckpt;		/* Column checkpoints of those rows. */
+	long	nckpt, ckptAlloc;
+	enum status res;
+} scanChunk;
+
+int
+resolve_threads (int nthreads)
+{
+#ifdef _OPENMP
+	if (nthreads <= 0)
+		nthreads = omp_get_max_threads ();
+#else
+	nthreads = 1;
+#endif
+	return nthreads < 1 ? 1 : nthreads;
+}
+
+/* Return the offset of the first line that starts at or after posn. */
+size_t
+align_to_line (const char *data, size_t size, size_t posn)
 {
-	long	position = 0L;	/* Number of bytes read. */
-	int	ch;		/* Current input byte. */
+	const char *nl;
 
-	/* Skip header line. */
-	while ((ch = getc (ip)) != EOF) {
-	    position++;
-	    if (ch == '\n')
-	        break;
+	if (posn == 0 || posn >= size || data[posn-1] == '\n')
+		return posn < size ? posn : size;
+	nl = memchr (data + posn, '\n', size - posn);
+	return nl == NULL ? size : (size_t)(nl - data) + 1;
+}
+
+static int
+add_checkpoint (scanChunk *chunk, size_t offset)
+{
+	if (chunk->nckpt == chunk->ckptAlloc) {
+		long newalloc = chunk->ckptAlloc == 0 ? 4096 : chunk->ckptAlloc * 2;
+		uint32_t *newckpt = realloc (chunk->ckpt, newalloc * sizeof(uint32_t));
+		if (newckpt == NULL)
+			return 0;
+		chunk->ckpt = newckpt;
+		chunk->ckptAlloc = newalloc;
 	}
-	if (ch == EOF) {
-	    return position == 0L ? EMPTY_FILE : INCOMPLETE_LAST_LINE;
+	chunk->ckpt[chunk->nckpt++] = (uint32_t)offset;
+	return 1;
+}
+
+/* Record the column checkpoints of the line of linelen bytes at line, whose label ends at tab.
+ * Sets the row's nckpt to 0 if the line is too long to checkpoint.
+ */
+static int
+add_checkpoints (scanChunk *chunk, rowEntry *row, long colstride, const char *line, size_t linelen, const char *tab)
+{
+	const char *p, *end = line + linelen;
+	long	col;
+
+	row->ckpt = chunk->nckpt;
+	row->nckpt = 0;
+	if (tab == NULL || linelen > UINT32_MAX)
+		return 1;
+
+	p = tab + 1;
+	if (!add_checkpoint (chunk, p - line))
+		return 0;
+	col = 0;
+	while ((p = memchr (p, '\t', end - p)) != NULL) {
+		p++;
+		if (++col % colstride == 0 && !add_checkpoint (chunk, p - line))
+			return 0;
 	}
+	if (!add_checkpoint (chunk, linelen))
+		return 0;
+	row->nckpt = chunk->nckpt - row->ckpt;
+	return 1;
+}
+
+/* Find the label and starting offset of every line that starts within chunk.
+ * Blank lines are ignored, and every other line must start with a non-empty label.
+ */
+static void
+scan_chunk (const char *data, size_t size, long colstride, scanChunk *chunk)
+{
+	size_t	posn = align_to_line (data, size, chunk->start);
+	size_t	end = align_to_line (data, size, chunk->end);
+	const char *nl, *tab;
+	size_t	linelen;
+
+	chunk->res = OK;
+	while (posn < end) {
+		if (data[posn] == '\n') {	/* Quietly ignore blank lines. */
+			posn++;
+			continue;
+		}
+		if (data[posn] == '\t') {
+			chunk->res = NO_LABEL_ERROR;
+			return;
+		}
 
-	/* Assert: ip is positioned just before either EOF or an input line. */
-	while ((ch = getc (ip)) != EOF) {
-	    long start = position++;
-	    if (ch != '\n') {	/* Quietly ignore blank lines. */
+		nl = memchr (data + posn, '\n', size - posn);
+		linelen = nl == NULL ? size - posn : (size_t)(nl - (data + posn));
+		tab = memchr (data + posn, '\t', linelen);
 
-		if (ch == '\t')
-		    return NO_LABEL_ERROR;
+		if (chunk->count == chunk->alloc) {
+			long newalloc = chunk->alloc == 0 ? 1024 : chunk->alloc * 2;
+			rowEntry *newrow = realloc (chunk->row, newalloc * sizeof(rowEntry));
+			if (newrow == NULL) {
+				chunk->res = OUT_OF_MEMORY;
+				return;
+			}
+			chunk->row = newrow;
+			chunk->alloc = newalloc;
+		}
+		chunk->row[chunk->count].key = data + posn;
+		chunk->row[chunk->count].keylen = tab == NULL ? (long)linelen : (long)(tab - (data + posn));
+		chunk->row[chunk->count].offset = (long)posn;
+		chunk->row[chunk->count].length = (long)linelen;
+		chunk->row[chunk->count].ckpt = 0;
+		chunk->row[chunk->count].nckpt = 0;
+		if (colstride > 0 && !add_checkpoints (chunk, &chunk->row[chunk->count], colstride, data + posn, linelen, tab)) {
+			chunk->res = OUT_OF_MEMORY;
+			return;
+		}
+		chunk->count++;
 
-		/* Read label and write to output. */
-		if (putc(ch,op) < 0) return WRITE_ERROR;
-		while ((ch = getc (ip)) != EOF) {
-		    position++;
-		    if (ch == '\t' || ch == '\n')
-		        break;
-		    if (putc(ch,op) < 0) return WRITE_ERROR;
+		if (nl == NULL) {
+			chunk->res = INCOMPLETE_LAST_LINE;
+			return;
 		}
+		posn += linelen + 1;
+	}
+}
 
-		/* Skip over what remains of current line. */
-		if (ch == '\t') {
-		    while ((ch = getc (ip)) != EOF) {
-			position++;
-		        if (ch == '\n')
-			    break;
-		    }
+/* Find every data line in each of the files described by jobs.
+ * Scanning starts at each job's start offset.  If that is zero, the first line of the file is
+ * a header and is skipped.  If a job's colstride is positive,
+ * column checkpoints are also recorded for each row.  The files are divided into
+ * line-aligned chunks which are scanned concurrently by up to nthreads threads
+ * (nthreads <= 0 means use the default number of threads).
+ */
+void
+collect_rows (indexJob *jobs, long njobs, int nthreads)
+{
+	scanChunk *chunks;
+	size_t	*bodyStart;
+	size_t	total, chunksize, posn;
+	long	nchunks, ii, jj, cc;
+	const char *nl;
+
+	nthreads = resolve_threads (nthreads);
+	if ((bodyStart = malloc ((njobs + 1) * sizeof(size_t))) == NULL) {
+		for (ii = 0; ii < njobs; ii++) jobs[ii].res = OUT_OF_MEMORY;
+		return;
+	}
+
+	/* Skip header lines. */
+	total = 0;
+	for (ii = 0; ii < njobs; ii++) {
+		jobs[ii].row = NULL;
+		jobs[ii].count = 0;
+		jobs[ii].ckpt = NULL;
+		jobs[ii].nckpt = 0;
+		if (jobs[ii].start > 0) {
+			/* Resume scanning at a line boundary. */
+			jobs[ii].res = OK;
+			bodyStart[ii] = jobs[ii].start < jobs[ii].size ? jobs[ii].start : jobs[ii].size;
+			total += jobs[ii].size - bodyStart[ii];
+			continue;
+		}
+		nl = memchr (jobs[ii].data, '\n', jobs[ii].size);
+		if (nl == NULL) {
+			jobs[ii].res = jobs[ii].size == 0 ? EMPTY_FILE : INCOMPLETE_LAST_LINE;
+			bodyStart[ii] = jobs[ii].size;
+		} else {
+			jobs[ii].res = OK;
+			bodyStart[ii] = (size_t)(nl - jobs[ii].data) + 1;
+			total += jobs[ii].size - bodyStart[ii];
 		}
+	}
 
-		if (fprintf (op, "\t%ld\n", start) < 0)
-		    return WRITE_ERROR;
+	/* Divide files into chunks. */
+	chunksize = total / (4 * (size_t)nthreads);
+	if (chunksize < MIN_CHUNK_SIZE) chunksize = MIN_CHUNK_SIZE;
+	nchunks = 0;
+	for (ii = 0; ii < njobs; ii++) {
+		nchunks += (long)((jobs[ii].size - bodyStart[ii] + chunksize - 1) / chunksize);
+	}
+	if ((chunks = calloc (nchunks + 1, sizeof(scanChunk))) == NULL) {
+		free (bodyStart);
+		for (ii = 0; ii < njobs; ii++) jobs[ii].res = OUT_OF_MEMORY;
+		return;
+	}
+	cc = 0;
+	for (ii = 0; ii < njobs; ii++) {
+		for (posn = bodyStart[ii]; posn < jobs[ii].size; posn += chunksize) {
+			chunks[cc].job = ii;
+			chunks[cc].start = posn;
+			chunks[cc].end = jobs[ii].size - posn > chunksize ? posn + chunksize : jobs[ii].size;
+			cc++;
+		}
+	}
 
-		if (ch == EOF)
-		    return INCOMPLETE_LAST_LINE;
-	    }
+	/* Scan all chunks concurrently. */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+#endif
+	for (cc = 0; cc < nchunks; cc++) {
+		indexJob *job = &jobs[chunks[cc].job];
+		scan_chunk (job->data, job->size, job->colstride, &chunks[cc]);
+	}
+
+	/* Concatenate the rows found in each chunk of each file. */
+	for (cc = 0; cc < nchunks; ) {
+		indexJob *job = &jobs[chunks[cc].job];
+		long	first = cc;
+		long	nrows = 0, nckpt = 0;
+
+		for (; cc < nchunks && &jobs[chunks[cc].job] == job; cc++) {
+			nrows += chunks[cc].count;
+			nckpt += chunks[cc].nckpt;
+		}
+		job->row = malloc ((nrows + 1) * sizeof(rowEntry));
+		job->ckpt = malloc ((nckpt + 1) * sizeof(uint32_t));
+		if (job->row == NULL || job->ckpt == NULL) {
+			job->res = OUT_OF_MEMORY;
+		}
+		for (jj = first; jj < cc; jj++) {
+			/* Stop at the first problem in the file. */
+			if (job->res == OK) {
+				memcpy (job->row + job->count, chunks[jj].row, chunks[jj].count * sizeof(rowEntry));
+				memcpy (job->ckpt + job->nckpt, chunks[jj].ckpt, chunks[jj].nckpt * sizeof(uint32_t));
+				for (ii = job->count; ii < job->count + chunks[jj].count; ii++)
+					job->row[ii].ckpt += job->nckpt;
+				job->count += chunks[jj].count;
+				job->nckpt += chunks[jj].nckpt;
+				job->res = chunks[jj].res;
+			}
+			free (chunks[jj].row);
+			free (chunks[jj].ckpt);
+		}
+		if (job->row != NULL) {
+			for (ii = 0; ii < job->count; ii++) job->row[ii].ordinal = ii;
+		}
+	}
+
+	free (chunks);
+	free (bodyStart);
+}
+
+/* Write rows to op as a text index: one "label\toffset\n" line per row. */
+static enum status
+write_text_index (FILE *op, const rowEntry *rows, long nrows)
+{
+	char	buffer[64*1024];
+	char	digits[32];
+	size_t	used = 0;
+	long	ii, nd, offset;
+
+	for (ii = 0; ii < nrows; ii++) {
+		/* Flush buffer if this line might not fit. */
+		if (used + rows[ii].keylen + sizeof(digits) + 2 > sizeof(buffer)) {
+			if (used > 0 && fwrite (buffer, 1, used, op) != used)
+				return WRITE_ERROR;
+			used = 0;
+			if (rows[ii].keylen + sizeof(digits) + 2 > sizeof(buffer)) {
+				if (fwrite (rows[ii].key, 1, rows[ii].keylen, op) != (size_t)rows[ii].keylen)
+					return WRITE_ERROR;
+			} else {
+				memcpy (buffer, rows[ii].key, rows[ii].keylen);
+				used = rows[ii].keylen;
+			}
+		} else {
+			memcpy (buffer + used, rows[ii].key, rows[ii].keylen);
+			used += rows[ii].keylen;
+		}
+
+		/* Format offset. */
+		offset = rows[ii].offset;
+		nd = 0;
+		do {
+			digits[nd++] = '0' + (char)(offset % 10);
+			offset /= 10;
+		} while (offset > 0);
+		buffer[used++] = '\t';
+		while (nd > 0)
+			buffer[used++] = digits[--nd];
+		buffer[used++] = '\n';
+	}
+	if (used > 0 && fwrite (buffer, 1, used, op) != used)
+		return WRITE_ERROR;
+	return fflush (op) == 0 ? OK : WRITE_ERROR;
+}
+
+/* Replace the row offsets of job, which is the decompressed contents bc of a BGZF file,
+ * by the corresponding virtual offsets.
+ */
+static enum status
+use_virtual_offsets (indexJob *job, const bgzfContents *bc)
+{
+	long	ii;
+
+	for (ii = 0; ii < job->count; ii++) {
+		if ((job->row[ii].offset = bgzf_virtual_offset (bc, (size_t)job->row[ii].offset)) < 0)
+			return INDEX_TOO_LONG;
 	}
 	return OK;
 }
 
+/* Generate an index for each of the nfiles data files ip[ii], writing it to op[ii] in the
+ * specified format (INDEX_TEXT or INDEX_BINARY).  The result for each file is stored in res[ii].
+ * If colstride is positive, column checkpoints are included in (binary) indexes.
+ * BGZF compressed data files are decompressed in memory, and indexed by virtual offset.
+ * Up to nthreads threads are used (nthreads <= 0 means use the default number of threads).
+ */
+void
+generate_indexes (long nfiles, FILE **ip, FILE **op, int format, long colstride, int nthreads, enum status *res)
+{
+	mappedFile *data;
+	bgzfContents *bc;
+	indexJob *jobs;
+	long	ii;
+	int	gz;
+
+	data = malloc ((nfiles + 1) * sizeof(mappedFile));
+	bc = calloc (nfiles + 1, sizeof(bgzfContents));
+	jobs = malloc ((nfiles + 1) * sizeof(indexJob));
+	if (data == NULL || bc == NULL || jobs == NULL) {
+		for (ii = 0; ii < nfiles; ii++) res[ii] = OUT_OF_MEMORY;
+		free (data);
+		free (bc);
+		free (jobs);
+		return;
+	}
+
+	for (ii = 0; ii < nfiles; ii++) {
+		data[ii].addr = "";
+		data[ii].size = 0;
+		data[ii].how = MAPPED_EMPTY;
+		gz = gzip_format (ip[ii]);
+		if (gz == GZIP_NONE) {
+			if ((res[ii] = map_file (ip[ii], &data[ii])) != OK) {
+				data[ii].addr = "";
+				data[ii].size = 0;
+				data[ii].how = MAPPED_EMPTY;
+			}
+			jobs[ii].data = data[ii].addr;
+			jobs[ii].size = data[ii].size;
+		} else {
+			res[ii] = gz == GZIP_BGZF ? bgzf_decompress_file (ip[ii], &bc[ii]) : BAD_COMPRESSION;
+			jobs[ii].data = res[ii] == OK ? bc[ii].data : "";
+			jobs[ii].size = res[ii] == OK ? bc[ii].size : 0;
+		}
+		jobs[ii].bgzf = gz != GZIP_NONE;
+		jobs[ii].start = 0;
+		jobs[ii].colstride = format == INDEX_BINARY ? colstride : 0;
+	}
+
+	collect_rows (jobs, nfiles, nthreads);
+
+	/* Sort (for binary indexes) and write each index.  Files are independent. */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(resolve_threads (nthreads))
+#endif
+	for (ii = 0; ii < nfiles; ii++) {
+		enum status wres;
+		if (res[ii] != OK) continue;	/* Could not read data file. */
+		res[ii] = jobs[ii].res;
+		if (res[ii] == OK || res[ii] == INCOMPLETE_LAST_LINE || res[ii] == EMPTY_FILE || res[ii] == NO_LABEL_ERROR) {
+			if (jobs[ii].bgzf && (wres = use_virtual_offsets (&jobs[ii], &bc[ii])) != OK)
+				res[ii] = wres;
+			else if (format == INDEX_BINARY)
+				wres = write_binary_index (op[ii], ip[ii], &jobs[ii]);
+			else
+				wres = write_text_index (op[ii], jobs[ii].row, jobs[ii].count);
+			if (wres != OK)
+				res[ii] = wres;
+		}
+	}
+
+	for (ii = 0; ii < nfiles; ii++) {
+		free (jobs[ii].row);
+		free (jobs[ii].ckpt);
+		unmap_file (&data[ii]);
+		bgzf_free_contents (&bc[ii]);
+	}
+	free (jobs);
+	free (bc);
+	free (data);
+}
+
+enum status
+generate_index (FILE *ip, FILE *op)
+{
+	enum status res;
+
+	generate_indexes (1, &ip, &op, INDEX_TEXT, 0L, 0, &res);
+	return res;
+}
+
+enum status
+generate_binary_index (FILE *ip, FILE *op)
+{
+	enum status res;
+
+	generate_indexes (1, &ip, &op, INDEX_BINARY, 0L, 0, &res);
+	return res;
+}
@@ -2,10 +2,14 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
 #include <ctype.h>
+#include <limits.h>
 
 #include "dht.h"
 #include "tsvio.h"
+#include "binindex.h"
+#include "stats.h"
 
 enum status
 scan_index_file (FILE *indexp, dynHashTab *dht, long insertall)
@@ -14,6 +18,16 @@ scan_index_file (FILE *indexp, dynHashTab *dht, long insertall)
 	char label[1024]; 
 	long lablen, len;
 	char posn[64]; 
+	binIndex *idx;
+	enum status res;
+
+	if (is_binary_index (indexp)) {
+	    if ((res = open_binary_index (indexp, &idx)) != OK)
+		return res;
+	    res = scan_binary_index (idx, dht, insertall);
+	    close_binary_index (idx);
+	    return res;
+	}
 
 	fseek (indexp, 0L, SEEK_SET);
 
@@ -44,6 +58,7 @@ scan_index_file (FILE *indexp, dynHashTab *dht, long insertall)
 		posn[len++] = (unsigned char)ch;
 	    }
 	    posn[len] = '\0';
+	    STATS_COUNT (STAT_INDEX_LINES, 1);
 
 	    /* Update label position. */
 	    if (insertall) {
@@ -63,7 +78,7 @@ scan_index_file (FILE *indexp, dynHashTab *dht, long insertall)
  * So, an empty line has 1 column (the empty string).
  */
 long
-num_columns (char *buffer, long buflen)
+num_columns (const char *buffer, long buflen)
 {
     long n = 1;
     long ii;
@@ -74,6 +89,38 @@ num_columns (char *buffer, long buflen)
     return n;
 }
 
+long
+scan_header_fields (dynHashTab *dht, const char *buffer, long buflen, int skipfirst, int insertall)
+{
+    long indexp, fstart, numpats;
+
+    numpats = 0;
+    indexp = 0;
+    /* Assert: numpats fields have been inserted into the dht this call. */
+    /* Assert: indexp is positioned at start of a field or immediately following buffer contents. */
+    while (indexp < buflen) {
+
+	/* Read field (aka pattern). */
+	fstart = indexp;
+	while ((indexp < buflen) && buffer[indexp] != '\t' && buffer[indexp] != '\n') {
+	    indexp++;
+	}
+
+	/* Insert field into dht unless it labels the column of row labels. */
+	if ((fstart > 0) || !skipfirst) {
+	    if (insertall) {
+		insertStrVal (dht, buffer+fstart, indexp-fstart, numpats);
+	    } else {
+		changeStrVal (dht, buffer+fstart, indexp-fstart, numpats);
+	    }
+	    numpats++;
+	}
+
+	if (indexp < buflen) indexp++; /* Advance over field-terminator, if any. */
+    }
+    return numpats;
+}
+
 enum status
 find_col_indices (char *buffer, long buflen, long findany, long nindex, const char *labels[], long *index, void (*warn)(char *msg,...))
 {
@@ -106,7 +153,7 @@ find_col_indices (char *buffer, long buflen, long findany, long nindex, const ch
 	    }
 	    *ptr = '\0';
 #ifdef DEBUG
-	    Rprintf ("Found column header start=%ld indexp=%ld len=%ld: %s\n", fstart, indexp, indexp-fstart, label);
+	    fprintf (stderr, "Found column header start=%ld indexp=%ld len=%ld: %s\n", fstart, indexp, indexp-fstart, label);
 #endif
 	    if (indexp < buflen) indexp++; /* Advance over field-terminator, if any. */
 
@@ -137,3 +184,96 @@ find_col_indices (char *buffer, long buflen, long findany, long nindex, const ch
 	return OK;
 }
 
+
+/* Read the line starting at posn of the data file tsvp.  If rowlen is not negative, it is the length
+ * of the line excluding its newline (as recorded by a binary index), and the line is read by a single
+ * read of exactly that size; otherwise (or if the line does not end where expected) it is read in pieces.
+ * The line is read into buffer, which holds bufsize bytes, if it fits, otherwise into a copy allocated
+ * with malloc, which is returned in *copyp (else NULL) and must be freed by the caller.
+ * *Linep is set to the line and *lenp to its length including its terminating newline, which is
+ * supplied if the line is terminated by end of file instead.  Returns OK, INCOMPLETE_LAST_LINE if the
+ * newline was supplied, EMPTY_FILE if there is no data at posn, SEEK_FAILED, READ_ERROR or OUT_OF_MEMORY.
+ */
+enum status
+read_tsv_line (FILE *tsvp, long posn, long rowlen, char *buffer, size_t bufsize, char **linep, size_t *lenp, char **copyp)
+{
+	char	*line = buffer, *copy = NULL, *newcopy;
+	size_t	size = bufsize, len = 0, got;
+	int	piece;
+
+	*linep = NULL;
+	*lenp = 0;
+	*copyp = NULL;
+	STATS_COUNT (STAT_SEEKS, 1);
+	if (fseek (tsvp, posn, SEEK_SET) < 0)
+	    return SEEK_FAILED;
+
+	if (rowlen >= 0) {
+	    if ((size_t)rowlen + 1 > size) {
+		if ((copy = malloc ((size_t)rowlen + 1)) == NULL)
+		    return OUT_OF_MEMORY;
+		line = copy;
+		size = (size_t)rowlen + 1;
+	    }
+	    got = fread (line, 1, (size_t)rowlen + 1, tsvp);
+	    STATS_COUNT (STAT_BYTES_READ, got);
+	    if (got > (size_t)rowlen && line[rowlen] == '\n') {
+		*linep = line;
+		*lenp = got;
+		*copyp = copy;
+		return OK;
+	    }
+	    if (got == (size_t)rowlen && rowlen > 0 && feof (tsvp)) {
+		line[got++] = '\n';
+		*linep = line;
+		*lenp = got;
+		*copyp = copy;
+		return INCOMPLETE_LAST_LINE;
+	    }
+	    /* The recorded length is wrong: find the end of the line instead. */
+	    STATS_COUNT (STAT_SEEKS, 1);
+	    if (ferror (tsvp) || fseek (tsvp, posn, SEEK_SET) < 0) {
+		free (copy);
+		return READ_ERROR;
+	    }
+	}
+
+	/* Read pieces of the line until its newline, doubling the space for it (in copy) as needed. */
+	for (;;) {
+	    if (size - len < 2) {
+		size = size < 1024 ? 1024 : 2 * size;
+		if ((newcopy = realloc (copy, size)) == NULL) {
+		    free (copy);
+		    return OUT_OF_MEMORY;
+		}
+		if (copy == NULL && len > 0)
+		    memcpy (newcopy, line, len);
+		line = copy = newcopy;
+	    }
+	    piece = size - len > INT_MAX ? INT_MAX : (int)(size - len);
+	    if (fgets (line + len, piece, tsvp) == NULL)
+		break;
+	    got = strlen (line + len);
+	    len += got;
+	    if (got == 0 || line[len-1] == '\n')
+		break;
+	}
+	STATS_COUNT (STAT_BYTES_READ, len);
+	if (ferror (tsvp)) {
+	    free (copy);
+	    return READ_ERROR;
+	}
+	if (len == 0) {
+	    free (copy);
+	    return EMPTY_FILE;
+	}
+	*linep = line;
+	*copyp = copy;
+	if (line[len-1] == '\n') {
+	    *lenp = len;
+	    return OK;
+	}
+	line[len++] = '\n'; /* The loop above ensures space for this. */
+	*lenp = len;
+	return INCOMPLETE_LAST_LINE;
+}
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#include "dht.h"
+#include "tsvio.h"
+#include "mapfile.h"
+
+/* Read the entire contents of fp into an allocated buffer.
+ * Used when the file cannot be memory mapped.
+ */
+static enum status
+read_whole_file (FILE *fp, size_t size, mappedFile *mf)
+{
+    fpos_t saved;
+    char *buf;
+    size_t got;
+
+    if (fgetpos (fp, &saved) != 0)
+	return READ_ERROR;
+    if ((buf = malloc (size)) == NULL)
+	return OUT_OF_MEMORY;
+    rewind (fp);
+    got = fread (buf, 1, size, fp);
+    fsetpos (fp, &saved);
+    if (got != size) {
+	free (buf);
+	return READ_ERROR;
+    }
+    mf->addr = buf;
+    mf->size = size;
+    mf->how = MAPPED_MALLOC;
+    return OK;
+}
+
+#ifdef _WIN32
+
+/* Map the contents of fp.  If the file cannot be mapped and canRead is set,
+ * its contents are read into an allocated buffer instead.
+ */
+static enum status
+map_file_contents (FILE *fp, mappedFile *mf, int canRead)
+{
+    HANDLE fh, mh;
+    LARGE_INTEGER size;
+    void *addr;
+
+    mf->addr = "";
+    mf->size = 0;
+    mf->how = MAPPED_EMPTY;
+    mf->handle = NULL;
+
+    fflush (fp);
+    fh = (HANDLE)_get_osfhandle (_fileno (fp));
+    if (fh == INVALID_HANDLE_VALUE || !GetFileSizeEx (fh, &size))
+	return READ_ERROR;
+    if (size.QuadPart == 0)
+	return OK;
+    if ((ULONGLONG)size.QuadPart > (ULONGLONG)(SIZE_MAX))
+	return OUT_OF_MEMORY;
+
+    mh = CreateFileMapping (fh, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mh != NULL) {
+	addr = MapViewOfFile (mh, FILE_MAP_READ, 0, 0, 0);
+	if (addr != NULL) {
+	    mf->addr = addr;
+	    mf->size = (size_t)size.QuadPart;
+	    mf->how = MAPPED_MMAP;
+	    mf->handle = mh;
+	    return OK;
+	}
+	CloseHandle (mh);
+    }
+    if (!canRead)
+	return READ_ERROR;
+    return read_whole_file (fp, (size_t)size.QuadPart, mf);
+}
+
+void
+unmap_file (mappedFile *mf)
+{
+    if (mf->how == MAPPED_MMAP) {
+	UnmapViewOfFile ((void *)mf->addr);
+	CloseHandle (mf->handle);
+    } else if (mf->how == MAPPED_MALLOC) {
+	free ((void *)mf->addr);
+    }
+    mf->addr = "";
+    mf->size = 0;
+    mf->how = MAPPED_EMPTY;
+}
+
+void
+advise_mapped_file (const mappedFile *mf, size_t offset, size_t len, int advice)
+{
+    /* Windows has no equivalent of madvise for mapped views. */
+}
+
+void
+advise_file (FILE *fp, size_t offset, size_t len, int advice)
+{
+    /* Windows has no equivalent of posix_fadvise. */
+}
+
+#else
+
+/* Map the contents of fp.  If the file cannot be mapped and canRead is set,
+ * its contents are read into an allocated buffer instead.
+ */
+static enum status
+map_file_contents (FILE *fp, mappedFile *mf, int canRead)
+{
+    struct stat sb;
+    void *addr;
+
+    mf->addr = "";
+    mf->size = 0;
+    mf->how = MAPPED_EMPTY;
+
+    fflush (fp);
+    if (fstat (fileno (fp), &sb) < 0)
+	return READ_ERROR;
+    if (sb.st_size == 0)
+	return OK;
+    if ((unsigned long long)sb.st_size > (unsigned long long)(SIZE_MAX))
+	return OUT_OF_MEMORY;
+
+    addr = mmap (NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fileno (fp), 0);
+    if (addr != MAP_FAILED) {
+	mf->addr = addr;
+	mf->size = (size_t)sb.st_size;
+	mf->how = MAPPED_MMAP;
+	return OK;
+    }
+    if (!canRead)
+	return READ_ERROR;
+    return read_whole_file (fp, (size_t)sb.st_size, mf);
+}
+
+void
+unmap_file (mappedFile *mf)
+{
+    if (mf->how == MAPPED_MMAP) {
+	munmap ((void *)mf->addr, mf->size);
+    } else if (mf->how == MAPPED_MALLOC) {
+	free ((void *)mf->addr);
+    }
+    mf->addr = "";
+    mf->size = 0;
+    mf->how = MAPPED_EMPTY;
+}
+
+void
+advise_mapped_file (const mappedFile *mf, size_t offset, size_t len, int advice)
+{
+#ifdef POSIX_MADV_NORMAL
+    static const int madv[] = { POSIX_MADV_NORMAL, POSIX_MADV_RANDOM, POSIX_MADV_SEQUENTIAL, POSIX_MADV_WILLNEED };
+    size_t page, start;
+
+    if (mf->how != MAPPED_MMAP || offset >= mf->size)
+	return;
+    if (len > mf->size - offset)
+	len = mf->size - offset;
+    page = (size_t)sysconf (_SC_PAGESIZE);
+    start = offset - offset % page;
+    posix_madvise ((void *)(mf->addr + start), len + (offset - start), madv[advice]);
+#endif
+}
+
+void
+advise_file (FILE *fp, size_t offset, size_t len, int advice)
+{
+#ifdef POSIX_FADV_NORMAL
+    static const int fadv[] = { POSIX_FADV_NORMAL, POSIX_FADV_RANDOM, POSIX_FADV_SEQUENTIAL, POSIX_FADV_WILLNEED };
+
+    posix_fadvise (fileno (fp), (off_t)offset, (off_t)len, fadv[advice]);
+#endif
+}
+
+#endif
+
+enum status
+map_file (FILE *fp, mappedFile *mf)
+{
+    return map_file_contents (fp, mf, 1);
+}
+
+enum status
+try_map_file (FILE *fp, mappedFile *mf)
+{
+    return map_file_contents (fp, mf, 0);
+}
+
+int
+mapped_range_fits (const mappedFile *mf, uint64_t offset, uint64_t size)
+{
+    return offset <= mf->size && size <= mf->size - offset;
+}
@@ -0,0 +1,54 @@
+
+/* This module provides read-only access to the entire contents of an open file
+ * as a single contiguous block of memory.
+ *
+ * Where possible the file is memory mapped, so that only the pages actually
+ * touched are read from disk.  If the file cannot be mapped (e.g. on some network
+ * or special file systems) its contents are read into an allocated buffer instead.
+ *
+ * Summary of operations:
+ */
+
+typedef struct {
+    const char *addr;	/* Address of the first byte of the file contents. */
+    size_t size;	/* Number of bytes of file contents available at addr. */
+    int how;		/* How the contents were obtained (see below). */
+#ifdef _WIN32
+    void *handle;	/* Windows file mapping object. */
+#endif
+} mappedFile;
+
+#define MAPPED_EMPTY	0	/* Empty file: nothing was mapped or allocated. */
+#define MAPPED_MMAP	1	/* Contents are memory mapped. */
+#define MAPPED_MALLOC	2	/* Contents were read into an allocated buffer. */
+
+/* Make the contents of the open file fp available at mf->addr.
+ * Any buffered output on fp is flushed first.  The file position of fp is not changed.
+ */
+extern enum status map_file (FILE *fp, mappedFile *mf);
+
+/* As map_file, but fails (with READ_ERROR) rather than reading the contents into memory
+ * if the file cannot be memory mapped.
+ */
+extern enum status try_map_file (FILE *fp, mappedFile *mf);
+
+/* Returns 1 iff the size bytes at offset lie within the contents of mf. */
+extern int mapped_range_fits (const mappedFile *mf, uint64_t offset, uint64_t size);
+
+/* Release the memory obtained by map_file.  The file itself is not closed. */
+extern void unmap_file (mappedFile *mf);
+
+/* Advise the operating system how the bytes [offset, offset+len) of a memory mapped file
+ * will be accessed.  Does nothing if the contents of mf are not memory mapped.
+ */
+extern void advise_mapped_file (const mappedFile *mf, size_t offset, size_t len, int advice);
+
+/* As advise_mapped_file, but for the bytes [offset, offset+len) of the open file fp, which
+ * will be read (rather than mapped).  Does nothing where not supported.
+ */
+extern void advise_file (FILE *fp, size_t offset, size_t len, int advice);
+
+#define ADVISE_NORMAL	  0	/* No special treatment. */
+#define ADVISE_RANDOM	  1	/* Pages will be accessed in random order: little read-ahead. */
+#define ADVISE_SEQUENTIAL 2	/* Pages will be accessed sequentially: aggressive read-ahead. */
+#define ADVISE_WILLNEED	  3	/* Pages will be accessed soon: start reading them now. */
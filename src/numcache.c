@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "dht.h"
+#include "tsvio.h"
+#include "mapfile.h"
+#include "binindex.h"
+#include "numcache.h"
+
+/* On-disk layout of a numeric cache.
+ *
+ * The file starts with a fixed size header, followed by the sections it describes, each aligned
+ * on an 8 byte boundary.  As for binary indexes, integers and values are stored in the byte order
+ * of the writing machine, which is recorded in the header.
+ *   rowKeys      concatenation of all row labels, in ascending (memcmp) order.
+ *   rowKeyStart  uint64_t[numRows+1]: offset in rowKeys of the start of each row label.
+ *   colKeys      concatenation of all column labels, in column order.
+ *   colKeyStart  uint64_t[numCols+1]: offset in colKeys of the start of each column label.
+ *   values       numRows x numCols elements of elemSize bytes, in row-major order.
+ */
+#define NUMCACHE_MAGIC		"\211TSVNUM\n"
+#define NUMCACHE_VERSION	1
+#define NUMCACHE_BYTEORDER	0x01020304
+
+typedef struct {
+    char magic[8];	/* NUMCACHE_MAGIC. */
+    uint32_t version;	/* NUMCACHE_VERSION of writer. */
+    uint32_t byteorder;	/* NUMCACHE_BYTEORDER in writer's byte order. */
+    uint32_t elemSize;	/* sizeof(double) or sizeof(float). */
+    uint32_t reserved;
+    uint64_t numRows;
+    uint64_t numCols;
+    fileStamp stamp;	/* Stamp of the data file the cache was created from. */
+    uint64_t rowKeys, rowKeyStart, colKeys, colKeyStart, values;	/* Offsets of sections. */
+} numCacheHeader;
+
+/* In-memory representation of an open numeric cache. */
+struct _numcache {
+    mappedFile map;	/* Contents of the cache file. */
+    const numCacheHeader *hdr;
+    long numRows, numCols;
+    const char *rowKeys;
+    const uint64_t *rowKeyStart;
+    const char *colKeys;
+    const uint64_t *colKeyStart;
+    const char *values;
+    size_t rowBytes;	/* Number of bytes in each row of values. */
+};
+
+/* A row label and its row number in the values written by write_numeric_cache. */
+typedef struct {
+    const char *str;
+    long len;
+    long row;
+} cacheRow;
+
+static int
+compare_cacheRow (const void *a, const void *b)
+{
+    const cacheRow *ap = (const cacheRow *)a;
+    const cacheRow *bp = (const cacheRow *)b;
+
+    return compare_labels (ap->str, ap->len, bp->str, bp->len);
+}
+
+/* Write nlabels labels, in order, as a key section followed by a key start section, and set
+ * *keysp and *startp to the offsets of the sections.
+ */
+static enum status
+write_labels (FILE *op, const cacheRow *labels, long nlabels, uint64_t *keysp, uint64_t *startp)
+{
+    uint64_t *start;
+    long ii, posn;
+    enum status res = WRITE_ERROR;
+
+    if ((start = malloc ((nlabels + 1) * sizeof(uint64_t))) == NULL)
+	return OUT_OF_MEMORY;
+    if ((posn = align_output (op)) < 0)
+	goto done;
+    *keysp = (uint64_t)posn;
+    start[0] = 0;
+    for (ii = 0; ii < nlabels; ii++) {
+	if (fwrite (labels[ii].str, 1, labels[ii].len, op) != (size_t)labels[ii].len)
+	    goto done;
+	start[ii+1] = start[ii] + labels[ii].len;
+    }
+    if ((posn = align_output (op)) < 0 || fwrite (start, sizeof(uint64_t), nlabels + 1, op) != (size_t)(nlabels + 1))
+	goto done;
+    *startp = (uint64_t)posn;
+    res = OK;
+
+done:
+    free (start);
+    return res;
+}
+
+/* Returns the labels of dht, in insertion order, with their insertion index as row number. */
+static cacheRow *
+get_labels (const dynHashTab *dht)
+{
+    cacheRow *labels;
+    const char *str;
+    long iter, len, order;
+
+    if ((labels = malloc ((dhtNumStrings (dht) + 1) * sizeof(cacheRow))) == NULL)
+	return NULL;
+    initIterator (dht, &iter);
+    while (getNextStr (dht, &iter, &str, &len, &order, NULL)) {
+	labels[order].str = str;
+	labels[order].len = len;
+	labels[order].row = order;
+    }
+    return labels;
+}
+
+enum status
+write_numeric_cache (FILE *op, const fileStamp *stamp, const dynHashTab *rows, const dynHashTab *cols,
+		     int elemSize, const void *values)
+{
+    numCacheHeader hdr;
+    cacheRow *rowLabels, *colLabels;
+    long nrows = dhtNumStrings (rows), ncols = dhtNumStrings (cols);
+    size_t rowBytes = (size_t)ncols * elemSize;
+    long ii, posn;
+    enum status res = OUT_OF_MEMORY;
+
+    rowLabels = get_labels (rows);
+    colLabels = get_labels (cols);
+    if (rowLabels == NULL || colLabels == NULL)
+	goto done;
+    qsort (rowLabels, nrows, sizeof(cacheRow), compare_cacheRow);
+
+    memset (&hdr, 0, sizeof(hdr));
+    memcpy (hdr.magic, NUMCACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = NUMCACHE_VERSION;
+    hdr.byteorder = NUMCACHE_BYTEORDER;
+    hdr.elemSize = (uint32_t)elemSize;
+    hdr.numRows = (uint64_t)nrows;
+    hdr.numCols = (uint64_t)ncols;
+    hdr.stamp = *stamp;
+
+    res = WRITE_ERROR;
+    if (fseek (op, 0L, SEEK_SET) < 0 || fwrite (&hdr, sizeof(hdr), 1, op) != 1)
+	goto done;
+    if ((res = write_labels (op, rowLabels, nrows, &hdr.rowKeys, &hdr.rowKeyStart)) != OK ||
+	(res = write_labels (op, colLabels, ncols, &hdr.colKeys, &hdr.colKeyStart)) != OK)
+	goto done;
+
+    /* Write the rows of values in label order. */
+    res = WRITE_ERROR;
+    if ((posn = align_output (op)) < 0)
+	goto done;
+    hdr.values = (uint64_t)posn;
+    for (ii = 0; ii < nrows; ii++) {
+	if (rowBytes > 0 && fwrite ((const char *)values + rowLabels[ii].row * rowBytes, 1, rowBytes, op) != rowBytes)
+	    goto done;
+    }
+
+    /* Rewrite header now that the section offsets are known. */
+    if (fseek (op, 0L, SEEK_SET) < 0 || fwrite (&hdr, sizeof(hdr), 1, op) != 1 || fflush (op) != 0)
+	goto done;
+    res = OK;
+
+done:
+    free (rowLabels);
+    free (colLabels);
+    return res;
+}
+
+enum status
+open_numeric_cache (FILE *fp, numCache **cachep)
+{
+    numCache *cache;
+    const numCacheHeader *hdr;
+    uint64_t nrows, ncols;
+    enum status res;
+
+    if ((cache = malloc (sizeof(*cache))) == NULL)
+	return OUT_OF_MEMORY;
+    if ((res = map_file (fp, &cache->map)) != OK) {
+	free (cache);
+	return res;
+    }
+
+    hdr = cache->hdr = (const numCacheHeader *)cache->map.addr;
+    if (cache->map.size < sizeof(numCacheHeader) ||
+	memcmp (hdr->magic, NUMCACHE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	hdr->byteorder != NUMCACHE_BYTEORDER ||
+	hdr->version > NUMCACHE_VERSION ||
+	(hdr->elemSize != sizeof(double) && hdr->elemSize != sizeof(float)))
+	goto fail;
+
+    nrows = hdr->numRows;
+    ncols = hdr->numCols;
+    if (!mapped_range_fits (&cache->map, hdr->rowKeyStart, (nrows + 1) * sizeof(uint64_t)) ||
+	!mapped_range_fits (&cache->map, hdr->colKeyStart, (ncols + 1) * sizeof(uint64_t)) ||
+	!mapped_range_fits (&cache->map, hdr->values, nrows * ncols * hdr->elemSize))
+	goto fail;
+    cache->rowKeyStart = (const uint64_t *)(cache->map.addr + hdr->rowKeyStart);
+    cache->colKeyStart = (const uint64_t *)(cache->map.addr + hdr->colKeyStart);
+    if (!mapped_range_fits (&cache->map, hdr->rowKeys, cache->rowKeyStart[nrows]) ||
+	!mapped_range_fits (&cache->map, hdr->colKeys, cache->colKeyStart[ncols]))
+	goto fail;
+
+    cache->numRows = (long)nrows;
+    cache->numCols = (long)ncols;
+    cache->rowKeys = cache->map.addr + hdr->rowKeys;
+    cache->colKeys = cache->map.addr + hdr->colKeys;
+    cache->values = cache->map.addr + hdr->values;
+    cache->rowBytes = (size_t)ncols * hdr->elemSize;
+    *cachep = cache;
+    return OK;
+
+fail:
+    unmap_file (&cache->map);
+    free (cache);
+    return BAD_INDEX_FORMAT;
+}
+
+void
+close_numeric_cache (numCache *cache)
+{
+    unmap_file (&cache->map);
+    free (cache);
+}
+
+enum status
+check_numeric_cache (const numCache *cache, const fileStamp *stamp)
+{
+    return stamps_equal (&cache->hdr->stamp, stamp) ? OK : STALE_INDEX;
+}
+
+long
+numeric_cache_num_rows (const numCache *cache)
+{
+    return cache->numRows;
+}
+
+long
+numeric_cache_num_cols (const numCache *cache)
+{
+    return cache->numCols;
+}
+
+int
+numeric_cache_elem_size (const numCache *cache)
+{
+    return (int)cache->hdr->elemSize;
+}
+
+long
+numeric_cache_find_row (const numCache *cache, const char *str, long len)
+{
+    const uint64_t *ks = cache->rowKeyStart;
+    long lo = 0, hi = cache->numRows;
+    long mid;
+
+    /* Find first label not less than str. */
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (compare_labels (cache->rowKeys + ks[mid], (long)(ks[mid+1] - ks[mid]), str, len) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo < cache->numRows && compare_labels (cache->rowKeys + ks[lo], (long)(ks[lo+1] - ks[lo]), str, len) == 0)
+	return lo;
+    return -1L;
+}
+
+const void *
+numeric_cache_row (const numCache *cache, long row)
+{
+    return cache->values + (size_t)row * cache->rowBytes;
+}
+
+void
+numeric_cache_col_label (const numCache *cache, long col, const char **strp, long *lenp)
+{
+    *strp = cache->colKeys + cache->colKeyStart[col];
+    *lenp = (long)(cache->colKeyStart[col+1] - cache->colKeyStart[col]);
+}
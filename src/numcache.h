@@ -0,0 +1,53 @@
+
+/* This module implements a binary, memory-mappable cache of the numeric contents of a TSV file.
+ *
+ * A numeric cache holds every field of every data row of a TSV file, already converted to
+ * binary (double or float) form, so that numeric queries need not re-read and re-parse the
+ * text of the file.  The values are stored as a row-major matrix, with the rows in ascending
+ * order of their labels so that a row can be located by binary search, and the data columns in
+ * the order of the file.  The cache also records the row and column labels, and a stamp (see
+ * binindex.h) of the TSV file from which it was created.  The TSV file remains the source of
+ * truth: a cache whose stamp no longer matches its TSV file must not be used.
+ *
+ * Summary of operations:
+ */
+
+typedef struct _numcache numCache;
+
+/* Write a numeric cache of the data file with the given stamp to op.  The column labels are
+ * given by cols and the row labels by rows, in the order in which they were inserted.  Values is
+ * a row-major matrix with a row for each label in rows and a column for each label in cols, whose
+ * elements are elemSize bytes (sizeof(double) or sizeof(float)).
+ */
+extern enum status write_numeric_cache (FILE *op, const fileStamp *stamp, const dynHashTab *rows, const dynHashTab *cols,
+					int elemSize, const void *values);
+
+/* Map the numeric cache file fp into memory.  On success, *cachep is set to the new cache.
+ * The file may be closed once the cache has been opened.
+ */
+extern enum status open_numeric_cache (FILE *fp, numCache **cachep);
+
+/* Release a cache opened by open_numeric_cache. */
+extern void close_numeric_cache (numCache *cache);
+
+/* Returns OK if cache was created from the data file with the given stamp, else STALE_INDEX. */
+extern enum status check_numeric_cache (const numCache *cache, const fileStamp *stamp);
+
+/* Returns the number of rows, the number of columns, and the size of each element (sizeof(double)
+ * or sizeof(float)) of cache.
+ */
+extern long numeric_cache_num_rows (const numCache *cache);
+extern long numeric_cache_num_cols (const numCache *cache);
+extern int numeric_cache_elem_size (const numCache *cache);
+
+/* Returns the row number of the row with label str in cache, or -1L if there is no such row. */
+extern long numeric_cache_find_row (const numCache *cache, const char *str, long len);
+
+/* Returns the address of the first value of row number row of cache. */
+extern const void *numeric_cache_row (const numCache *cache, long row);
+
+/* Sets *strp and *lenp to the label of column col of cache. */
+extern void numeric_cache_col_label (const numCache *cache, long col, const char **strp, long *lenp);
+
+/* The bit pattern of a missing value in a cache of floats, which cannot represent R's NA. */
+#define NUMCACHE_FLOAT_NA	0x7fc207a2U
@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+
+#include "parsenum.h"
+
+/* Fields that do not have the simple form [+-]digits[.digits][(e|E)[+-]digits] with at most
+ * MAX_FAST_DIGITS significant digits, or whose value cannot be computed exactly by the fast
+ * path, are converted by strtod.
+ */
+#define MAX_FAST_DIGITS	19
+
+/* Exact powers of ten representable as doubles. */
+static const double pow10tab[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int
+is_little_endian (void)
+{
+    const uint16_t one = 1;
+    return *(const unsigned char *)&one == 1;
+}
+
+/* Returns 1 iff the 8 bytes in val (loaded little-endian) are all ASCII digits. */
+static int
+all_eight_digits (uint64_t val)
+{
+    return (((val & 0xF0F0F0F0F0F0F0F0ULL) |
+	     (((val + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) == 0x3333333333333333ULL);
+}
+
+/* Returns the value of the 8 ASCII digits in val (loaded little-endian; first digit in the low byte). */
+static uint32_t
+eight_digits_value (uint64_t val)
+{
+    const uint64_t mask = 0x000000FF000000FFULL;
+    const uint64_t mul1 = 100 + (1000000ULL << 32);
+    const uint64_t mul2 = 1 + (10000ULL << 32);
+
+    val -= 0x3030303030303030ULL;
+    val = (val * 10) + (val >> 8);
+    val = (((val & mask) * mul1) + (((val >> 16) & mask) * mul2)) >> 32;
+    return (uint32_t)val;
+}
+
+/* Accumulate the decimal digits starting at s[*ip] into *wp, stopping at the first non-digit.
+ * At most MAX_FAST_DIGITS significant digits are accumulated; further digits are counted in *extrap.
+ * Returns the number of digits consumed.
+ */
+static long
+scan_digits (const char *s, long n, long *ip, uint64_t *wp, int *ndigitsp, long *extrap, int swar)
+{
+    long i = *ip;
+    uint64_t w = *wp;
+    int nd = *ndigitsp;
+    uint64_t val;
+
+    if (swar) {
+	while (n - i >= 8 && nd + 8 <= MAX_FAST_DIGITS) {
+	    memcpy (&val, s + i, 8);
+	    if (!all_eight_digits (val))
+		break;
+	    if (nd == 0 && w == 0 && val == 0x3030303030303030ULL) {
+		/* Eight leading zeros are not significant. */
+		i += 8;
+		continue;
+	    }
+	    w = w * 100000000ULL + eight_digits_value (val);
+	    nd += 8;
+	    i += 8;
+	}
+    }
+    while (i < n && (unsigned)(s[i] - '0') < 10) {
+	if (nd < MAX_FAST_DIGITS) {
+	    w = w * 10 + (uint64_t)(s[i] - '0');
+	    if (w != 0) nd++;
+	} else {
+	    (*extrap)++;
+	}
+	i++;
+    }
+    *wp = w;
+    *ndigitsp = nd;
+    i -= *ip;
+    *ip += i;
+    return i;
+}
+
+/* Convert a field using strtod on a NUL-terminated copy. */
+static int
+parse_double_slow (const char *s, long n, double *value)
+{
+    char local[128];
+    char *scopy, *end;
+    double v;
+    int res = NUM_OK;
+
+    scopy = n < (long)sizeof(local) ? local : (char *)malloc (n + 1);
+    if (scopy == NULL)
+	return NUM_INVALID;
+    memcpy (scopy, s, n);
+    scopy[n] = '\0';
+
+    v = strtod (scopy, &end);
+    if (end == scopy) {
+	if (scopy[0] == '\0' || strncmp (scopy, "NA", 2) == 0) {
+	    res = NUM_NA;
+	} else if (strncmp (scopy, "-Inf", 4) == 0) {
+	    v = -HUGE_VAL;
+	} else if (strncmp (scopy, "Inf", 3) == 0) {
+	    v = HUGE_VAL;
+	} else {
+	    res = NUM_INVALID;
+	}
+    } else if (*end != '\t' && *end != '\n' && *end != '\r' && *end != '\0') {
+	res = NUM_TRAILING;
+    }
+    if (scopy != local)
+	free (scopy);
+    *value = v;
+    return res;
+}
+
+int
+parse_double (const char *s, long n, double *value)
+{
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+    long i = 0, fracStart, extra = 0, exp10 = 0, e;
+    uint64_t w = 0;
+    int nd = 0, neg = 0, eneg = 0;
+    int swar = is_little_endian ();
+    double v;
+
+    if (n == 0)
+	return NUM_NA;
+    if (s[0] == '-' || s[0] == '+') {
+	neg = s[0] == '-';
+	i++;
+    }
+
+    /* Integer part, then fraction.  E counts the digits. */
+    e = scan_digits (s, n, &i, &w, &nd, &extra, swar);
+    if (i < n && s[i] == '.') {
+	i++;
+	fracStart = i;
+	e += scan_digits (s, n, &i, &w, &nd, &extra, swar);
+	exp10 = -(i - fracStart);
+    }
+    if (e == 0 || extra > 0)
+	return parse_double_slow (s, n, value);
+
+    /* Exponent. */
+    if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+	i++;
+	if (i < n && (s[i] == '-' || s[i] == '+')) {
+	    eneg = s[i] == '-';
+	    i++;
+	}
+	if (i == n || (unsigned)(s[i] - '0') >= 10)
+	    return parse_double_slow (s, n, value);
+	e = 0;
+	while (i < n && (unsigned)(s[i] - '0') < 10) {
+	    if (e < 100000) e = e * 10 + (s[i] - '0');
+	    i++;
+	}
+	exp10 += eneg ? -e : e;
+    }
+
+    /* The number must end the field (or be followed by a carriage return). */
+    if (i < n && s[i] != '\r')
+	return parse_double_slow (s, n, value);
+
+    /* Both w and 10^|exp10| are exact doubles, so a single multiplication or
+     * division gives the correctly rounded result.
+     */
+    if (w == 0) {
+	v = 0.0;
+    } else if (w <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+	v = (double)w;
+	v = exp10 < 0 ? v / pow10tab[-exp10] : v * pow10tab[exp10];
+    } else {
+	return parse_double_slow (s, n, value);
+    }
+    *value = neg ? -v : v;
+    return NUM_OK;
+#else
+    /* Intermediate results may be computed in extended precision: the fast path could
+     * round twice, so always use strtod.
+     */
+    return parse_double_slow (s, n, value);
+#endif
+}
+
+/* Convert a field using strtoll on a NUL-terminated copy. */
+static int
+parse_int64_slow (const char *s, long n, int64_t *value)
+{
+    char local[128];
+    char *scopy, *end;
+    long long v;
+    int res = NUM_OK;
+
+    scopy = n < (long)sizeof(local) ? local : (char *)malloc (n + 1);
+    if (scopy == NULL)
+	return NUM_INVALID;
+    memcpy (scopy, s, n);
+    scopy[n] = '\0';
+
+    errno = 0;
+    v = strtoll (scopy, &end, 10);
+    if (end == scopy) {
+	if (scopy[0] == '\0' || strncmp (scopy, "NA", 2) == 0) {
+	    res = NUM_NA;
+	} else {
+	    res = NUM_INVALID;
+	}
+    } else if (*end != '\t' && *end != '\n' && *end != '\r' && *end != '\0') {
+	res = NUM_TRAILING;
+    } else if (errno == ERANGE) {
+	res = NUM_OVERFLOW;
+    }
+    if (scopy != local)
+	free (scopy);
+    *value = (int64_t)v;
+    return res;
+}
+
+int
+parse_int64 (const char *s, long n, int64_t *value)
+{
+    long i = 0, extra = 0;
+    uint64_t w = 0;
+    int nd = 0, neg = 0;
+
+    if (n == 0)
+	return NUM_NA;
+    if (s[0] == '-' || s[0] == '+') {
+	neg = s[0] == '-';
+	i++;
+    }
+
+    /* Up to 18 significant digits cannot overflow; longer numbers are checked by strtoll. */
+    if (scan_digits (s, n, &i, &w, &nd, &extra, is_little_endian ()) == 0 || extra > 0 || nd > 18)
+	return parse_int64_slow (s, n, value);
+    if (i < n && s[i] != '\r')
+	return parse_int64_slow (s, n, value);
+
+    *value = neg ? -(int64_t)w : (int64_t)w;
+    return NUM_OK;
+}
+
+int
+is_na_field (const char *s, long n)
+{
+    if (n > 0 && s[n-1] == '\r')
+	n--;
+    return n == 0 || (n == 2 && s[0] == 'N' && s[1] == 'A');
+}
+
+int
+parse_logical (const char *s, long n, int *value)
+{
+    static const char *const spellings[] = { "F", "T", "FALSE", "TRUE", "False", "True", "false", "true" };
+    int ii;
+
+    if (is_na_field (s, n))
+	return NUM_NA;
+    if (s[n-1] == '\r')
+	n--;
+    for (ii = 0; ii < (int)(sizeof(spellings) / sizeof(spellings[0])); ii++) {
+	if ((long)strlen (spellings[ii]) == n && memcmp (s, spellings[ii], n) == 0) {
+	    *value = ii % 2;
+	    return NUM_OK;
+	}
+    }
+    return NUM_INVALID;
+}
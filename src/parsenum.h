@@ -0,0 +1,39 @@
+
+/* This module converts the text of a TSV field to a number.
+ *
+ * Fields are specified by a pointer to their first character and their length; they need
+ * not be NUL-terminated and are never copied unless they fall outside the fast path below.
+ * The conversion does not depend on the current locale: the decimal point is always '.'.
+ *
+ * The functions do not call R and may be used concurrently by multiple threads.
+ *
+ * Summary of operations:
+ */
+
+/* Results of the conversion functions. */
+#define NUM_OK		0	/* Field is a number. */
+#define NUM_NA		1	/* Field is empty or NA. */
+#define NUM_INVALID	2	/* Field does not start with a number. */
+#define NUM_TRAILING	3	/* Number is followed by other data. */
+#define NUM_OVERFLOW	4	/* Integer is outside the range of int64_t. */
+
+/* Convert the n-byte field s to a correctly rounded double.  On NUM_OK, *value is set.
+ * Accepts everything that strtod accepts, including NaN, Inf and -Inf.
+ * A number may be followed by a carriage return (and anything after it).
+ */
+extern int parse_double (const char *s, long n, double *value);
+
+/* Convert the n-byte field s to a 64-bit integer.  On NUM_OK, *value is set.
+ * Accepts everything that strtoll (base 10) accepts.
+ * A number may be followed by a carriage return (and anything after it).
+ */
+extern int parse_int64 (const char *s, long n, int64_t *value);
+
+/* Returns 1 iff the n-byte field s is empty or NA (optionally followed by a carriage return). */
+extern int is_na_field (const char *s, long n);
+
+/* Convert the n-byte field s to a logical (1 or 0).  On NUM_OK, *value is set.
+ * Accepts the spellings accepted by R's type.convert: T, F, TRUE, FALSE, True, False, true and false.
+ * A value may be followed by a carriage return.  Returns NUM_NA iff is_na_field.
+ */
+extern int parse_logical (const char *s, long n, int *value);
@@ -0,0 +1,82 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "stats.h"
+
+int statsEnabled = 0;
+
+/* The profile of the query in progress, and of the most recent query to finish. */
+static queryStats current, last;
+static double startTime;
+
+void
+stats_enable (int on)
+{
+    statsEnabled = on != 0;
+}
+
+void
+stats_begin (const char *query)
+{
+    if (!statsEnabled)
+	return;
+    memset (&current, 0, sizeof(current));
+    current.query = query;
+    startTime = stats_clock ();
+}
+
+void
+stats_end (void)
+{
+    if (!statsEnabled || current.query == NULL)
+	return;
+    current.elapsed = stats_clock () - startTime;
+    last = current;
+    current.query = NULL;
+}
+
+const queryStats *
+stats_last (void)
+{
+    return &last;
+}
+
+double
+stats_clock (void)
+{
+#ifdef _OPENMP
+    return omp_get_wtime ();
+#else
+    struct timeval tv;
+
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+void
+stats_add (enum statsCounter counter, double n)
+{
+    double *p = &current.counter[counter];
+
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+    *p += n;
+}
+
+void
+stats_add_time (enum statsPhase phase, double secs)
+{
+    double *p = &current.phase[phase];
+
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+    *p += secs;
+}
@@ -0,0 +1,76 @@
+
+/* This module collects an optional profile of the most recent query (see tsvStats): the wall
+ * time spent in each of its phases, and counters of the work done by the other modules.
+ *
+ * Collection is off by default.  While it is off, recording a counter or a time costs a test of
+ * statsEnabled, so the instrumentation is always compiled in.  While it is on, counters and times
+ * may be recorded concurrently by multiple threads.  The functions do not call R.
+ *
+ * Summary of operations:
+ */
+
+/* Phases of a query.  The times of the phases marked (threads) are summed over all threads that
+ * worked in them, so may exceed the elapsed time of the query.
+ */
+enum statsPhase {
+    PHASE_OPEN,		/* Opening data and index files, and loading indexes and header lines. */
+    PHASE_INDEX,	/* Loading indexes, including generating missing ones (threads). */
+    PHASE_HEADER,	/* Scanning header lines (threads). */
+    PHASE_SELECT,	/* Matching the requested labels against the indexes. */
+    PHASE_EXTRACT,	/* Extracting the wanted cells from the data files or caches. */
+    PHASE_READ,		/* Seeking and reading or decompressing lines while extracting (threads). */
+    PHASE_PARSE,	/* Splitting lines into fields and converting the fields (threads). */
+    PHASE_RESULT,	/* Building the result. */
+    NUM_PHASES
+};
+
+/* Counters of a query. */
+enum statsCounter {
+    STAT_BYTES_READ,	/* Bytes read from data files by read calls (compressed bytes, if compressed). */
+    STAT_BYTES_MAPPED,	/* Bytes of lines parsed in place from memory mapped data files. */
+    STAT_SEEKS,		/* Seeks within data files. */
+    STAT_INDEX_LINES,	/* Lines of text indexes parsed. */
+    STAT_HASH_PROBES,	/* Slots of hash tables (dynHashTab) examined by lookups and insertions. */
+    STAT_HASH_GROWS,	/* Times a hash table was grown. */
+    STAT_ROWS,		/* Lines of data files read. */
+    STAT_CELLS,		/* Cells of the result filled from data files or numeric caches. */
+    NUM_COUNTERS
+};
+
+typedef struct {
+    const char *query;		/* Name of the profiled query, or NULL if none has been profiled. */
+    double elapsed;		/* Wall time of the whole query, in seconds. */
+    double phase[NUM_PHASES];	/* Time of each phase, in seconds. */
+    double counter[NUM_COUNTERS];
+} queryStats;
+
+/* Iff set, statistics are collected.  Set by stats_enable. */
+extern int statsEnabled;
+
+/* Turn collection on (if on is non-zero) or off. */
+extern void stats_enable (int on);
+
+/* Start profiling the query named query (a string constant), discarding the previous profile. */
+extern void stats_begin (const char *query);
+
+/* Finish profiling the current query. */
+extern void stats_end (void);
+
+/* Returns the profile of the most recent query. */
+extern const queryStats *stats_last (void);
+
+/* Returns a wall clock time in seconds. */
+extern double stats_clock (void);
+
+/* Add n to counter, or secs to the time of phase. */
+extern void stats_add (enum statsCounter counter, double n);
+extern void stats_add_time (enum statsPhase phase, double secs);
+
+/* Count n (when collecting statistics). */
+#define STATS_COUNT(counter, n)	do { if (statsEnabled) stats_add ((counter), (double)(n)); } while (0)
+
+/* Time a phase: STATS_START sets the double t to the start time, and STATS_STOP adds the time since
+ * then to phase (when collecting statistics).
+ */
+#define STATS_START(t)		((t) = statsEnabled ? stats_clock () : 0.0)
+#define STATS_STOP(phase, t)	do { if (statsEnabled) stats_add_time ((phase), stats_clock () - (t)); } while (0)
@@ -0,0 +1,411 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "dht.h"
+#include "tsvio.h"
+#include "mapfile.h"
+#include "binindex.h"
+#include "tiles.h"
+
+/* On-disk layout of a tile file.
+ *
+ * The file starts with a fixed size header, followed by the sections it describes, each aligned
+ * on an 8 byte boundary.  As for binary indexes, integers and values are stored in the byte order
+ * of the writing machine, which is recorded in the header.
+ *   rowKeys      concatenation of all row labels, in file order.
+ *   rowKeyStart  uint64_t[numRows+1]: offset in rowKeys of the start of each row label.
+ *   rowOrder     uint64_t[numRows]: positions of the rows in ascending (memcmp) order of their labels.
+ *   colKeys, colKeyStart, colOrder: as above, for the column labels.
+ *   tiles        the compressed tiles, in row-major order of tiles.
+ *   directory    tileEntry[numTileRows*numTileCols]: location of each compressed tile.
+ */
+#define TILEFILE_MAGIC		"\211TSVTIL\n"
+#define TILEFILE_VERSION	1
+#define TILEFILE_BYTEORDER	0x01020304
+
+typedef struct {
+    char magic[8];	/* TILEFILE_MAGIC. */
+    uint32_t version;	/* TILEFILE_VERSION of writer. */
+    uint32_t byteorder;	/* TILEFILE_BYTEORDER in writer's byte order. */
+    uint32_t elemSize;	/* sizeof(double). */
+    uint32_t reserved;
+    uint64_t numRows, numCols;
+    uint64_t tileRows, tileCols;	/* Size of a full tile. */
+    fileStamp stamp;	/* Stamp of the data file the tile file was created from. */
+    uint64_t rowKeys, rowKeyStart, rowOrder;	/* Offsets of sections. */
+    uint64_t colKeys, colKeyStart, colOrder;
+    uint64_t directory;
+} tileHeader;
+
+/* Location of a compressed tile. */
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+} tileEntry;
+
+/* The labels of the rows or columns of an open tile file. */
+typedef struct {
+    long num;
+    const char *keys;
+    const uint64_t *keyStart;
+    const uint64_t *order;
+} tileLabels;
+
+/* In-memory representation of an open tile file. */
+struct _tilefile {
+    mappedFile map;	/* Contents of the tile file. */
+    const tileHeader *hdr;
+    tileLabels rows, cols;
+    long tileRows, tileCols;
+    long numTileCols;
+    const tileEntry *directory;
+};
+
+/* State of a tile file being written. */
+struct _tilewriter {
+    FILE *op;
+    tileHeader hdr;
+    long numRows, numCols, tileRows, tileCols;
+    long numTileCols;
+    long band;		/* Number of bands written so far. */
+    tileEntry *directory;
+    unsigned char *cbuf;	/* Compression buffer. */
+    uLong cbufSize;
+};
+
+/* A label and its position in the file. */
+typedef struct {
+    const char *str;
+    long len;
+    long pos;
+} tileLabel;
+
+static int
+compare_tileLabel (const void *a, const void *b)
+{
+    const tileLabel *ap = (const tileLabel *)a;
+    const tileLabel *bp = (const tileLabel *)b;
+
+    return compare_labels (ap->str, ap->len, bp->str, bp->len);
+}
+
+/* Write the labels of dht, in insertion order, as key, key start and sorted order sections,
+ * and set *keysp, *startp and *orderp to the offsets of the sections.
+ */
+static enum status
+write_labels (FILE *op, const dynHashTab *dht, uint64_t *keysp, uint64_t *startp, uint64_t *orderp)
+{
+    tileLabel *labels;
+    uint64_t *start;
+    const char *str;
+    long nlabels = dhtNumStrings (dht);
+    long ii, iter, len, order, posn;
+    enum status res = OUT_OF_MEMORY;
+
+    labels = malloc ((nlabels + 1) * sizeof(tileLabel));
+    start = malloc ((nlabels + 1) * sizeof(uint64_t));
+    if (labels == NULL || start == NULL)
+	goto done;
+    initIterator (dht, &iter);
+    while (getNextStr (dht, &iter, &str, &len, &order, NULL)) {
+	labels[order].str = str;
+	labels[order].len = len;
+	labels[order].pos = order;
+    }
+
+    res = WRITE_ERROR;
+    if ((posn = align_output (op)) < 0)
+	goto done;
+    *keysp = (uint64_t)posn;
+    start[0] = 0;
+    for (ii = 0; ii < nlabels; ii++) {
+	if (fwrite (labels[ii].str, 1, labels[ii].len, op) != (size_t)labels[ii].len)
+	    goto done;
+	start[ii+1] = start[ii] + labels[ii].len;
+    }
+    if ((posn = align_output (op)) < 0 || fwrite (start, sizeof(uint64_t), nlabels + 1, op) != (size_t)(nlabels + 1))
+	goto done;
+    *startp = (uint64_t)posn;
+
+    /* Reuse start for the sorted order. */
+    qsort (labels, nlabels, sizeof(tileLabel), compare_tileLabel);
+    for (ii = 0; ii < nlabels; ii++)
+	start[ii] = (uint64_t)labels[ii].pos;
+    if ((posn = align_output (op)) < 0 || fwrite (start, sizeof(uint64_t), nlabels, op) != (size_t)nlabels)
+	goto done;
+    *orderp = (uint64_t)posn;
+    res = OK;
+
+done:
+    free (labels);
+    free (start);
+    return res;
+}
+
+enum status
+start_tile_file (FILE *op, const fileStamp *stamp, const dynHashTab *rows, const dynHashTab *cols,
+		 long tileRows, long tileCols, tileWriter **twp)
+{
+    tileWriter *tw;
+    long numTileRows;
+    enum status res;
+
+    if (tileRows < 1 || tileCols < 1)
+	return BAD_INDEX_FORMAT;
+    if ((tw = calloc (1, sizeof(tileWriter))) == NULL)
+	return OUT_OF_MEMORY;
+    tw->op = op;
+    tw->numRows = dhtNumStrings (rows);
+    tw->numCols = dhtNumStrings (cols);
+    tw->tileRows = tileRows;
+    tw->tileCols = tileCols;
+    numTileRows = (tw->numRows + tileRows - 1) / tileRows;
+    tw->numTileCols = (tw->numCols + tileCols - 1) / tileCols;
+    tw->cbufSize = compressBound ((uLong)(tileRows * tileCols * sizeof(double)));
+    tw->directory = malloc ((numTileRows * tw->numTileCols + 1) * sizeof(tileEntry));
+    tw->cbuf = malloc (tw->cbufSize);
+    if (tw->directory == NULL || tw->cbuf == NULL) {
+	res = OUT_OF_MEMORY;
+	goto fail;
+    }
+
+    memcpy (tw->hdr.magic, TILEFILE_MAGIC, sizeof(tw->hdr.magic));
+    tw->hdr.version = TILEFILE_VERSION;
+    tw->hdr.byteorder = TILEFILE_BYTEORDER;
+    tw->hdr.elemSize = sizeof(double);
+    tw->hdr.numRows = (uint64_t)tw->numRows;
+    tw->hdr.numCols = (uint64_t)tw->numCols;
+    tw->hdr.tileRows = (uint64_t)tileRows;
+    tw->hdr.tileCols = (uint64_t)tileCols;
+    tw->hdr.stamp = *stamp;
+
+    res = WRITE_ERROR;
+    if (fseek (op, 0L, SEEK_SET) < 0 || fwrite (&tw->hdr, sizeof(tw->hdr), 1, op) != 1)
+	goto fail;
+    if ((res = write_labels (op, rows, &tw->hdr.rowKeys, &tw->hdr.rowKeyStart, &tw->hdr.rowOrder)) != OK ||
+	(res = write_labels (op, cols, &tw->hdr.colKeys, &tw->hdr.colKeyStart, &tw->hdr.colOrder)) != OK)
+	goto fail;
+    *twp = tw;
+    return OK;
+
+fail:
+    free (tw->directory);
+    free (tw->cbuf);
+    free (tw);
+    return res;
+}
+
+enum status
+write_tile_band (tileWriter *tw, const double *band)
+{
+    long nrows = tw->numRows - tw->band * tw->tileRows;
+    long tc, ncols;
+    uLongf clen;
+    tileEntry *entry;
+
+    if (nrows > tw->tileRows) nrows = tw->tileRows;
+    for (tc = 0; tc < tw->numTileCols; tc++) {
+	ncols = tw->numCols - tc * tw->tileCols;
+	if (ncols > tw->tileCols) ncols = tw->tileCols;
+	/* In a column-major band, the columns of a tile are adjacent. */
+	clen = tw->cbufSize;
+	if (compress2 (tw->cbuf, &clen, (const Bytef *)(band + tc * tw->tileCols * nrows),
+		       (uLong)(nrows * ncols * sizeof(double)), Z_BEST_SPEED) != Z_OK)
+	    return OUT_OF_MEMORY;
+	entry = &tw->directory[tw->band * tw->numTileCols + tc];
+	if ((entry->offset = (uint64_t)ftell (tw->op)) == (uint64_t)-1 || fwrite (tw->cbuf, 1, clen, tw->op) != clen)
+	    return WRITE_ERROR;
+	entry->size = (uint64_t)clen;
+    }
+    tw->band++;
+    return OK;
+}
+
+enum status
+finish_tile_file (tileWriter *tw)
+{
+    long ntiles = tw->band * tw->numTileCols;
+    long posn;
+    enum status res = WRITE_ERROR;
+
+    if (tw->band * tw->tileRows < tw->numRows)
+	res = BAD_INDEX_FORMAT;
+    else if ((posn = align_output (tw->op)) >= 0 && fwrite (tw->directory, sizeof(tileEntry), ntiles, tw->op) == (size_t)ntiles) {
+	tw->hdr.directory = (uint64_t)posn;
+	/* Rewrite header now that the section offsets are known. */
+	if (fseek (tw->op, 0L, SEEK_SET) == 0 && fwrite (&tw->hdr, sizeof(tw->hdr), 1, tw->op) == 1 && fflush (tw->op) == 0)
+	    res = OK;
+    }
+    free (tw->directory);
+    free (tw->cbuf);
+    free (tw);
+    return res;
+}
+
+/* Locate the num labels whose sections start at the given offsets.  Returns 0 if they do not fit. */
+static int
+map_labels (tiledFile *tf, tileLabels *labels, uint64_t num, uint64_t keys, uint64_t keyStart, uint64_t order)
+{
+    if (!mapped_range_fits (&tf->map, keyStart, (num + 1) * sizeof(uint64_t)) ||
+	!mapped_range_fits (&tf->map, order, num * sizeof(uint64_t)))
+	return 0;
+    labels->num = (long)num;
+    labels->keyStart = (const uint64_t *)(tf->map.addr + keyStart);
+    labels->order = (const uint64_t *)(tf->map.addr + order);
+    labels->keys = tf->map.addr + keys;
+    return mapped_range_fits (&tf->map, keys, labels->keyStart[num]);
+}
+
+enum status
+open_tile_file (FILE *fp, tiledFile **tfp)
+{
+    tiledFile *tf;
+    const tileHeader *hdr;
+    uint64_t ntiles, ii;
+    enum status res;
+
+    if ((tf = malloc (sizeof(*tf))) == NULL)
+	return OUT_OF_MEMORY;
+    if ((res = map_file (fp, &tf->map)) != OK) {
+	free (tf);
+	return res;
+    }
+
+    hdr = tf->hdr = (const tileHeader *)tf->map.addr;
+    if (tf->map.size < sizeof(tileHeader) ||
+	memcmp (hdr->magic, TILEFILE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	hdr->byteorder != TILEFILE_BYTEORDER ||
+	hdr->version > TILEFILE_VERSION ||
+	hdr->elemSize != sizeof(double) ||
+	hdr->tileRows < 1 || hdr->tileCols < 1)
+	goto fail;
+    if (!map_labels (tf, &tf->rows, hdr->numRows, hdr->rowKeys, hdr->rowKeyStart, hdr->rowOrder) ||
+	!map_labels (tf, &tf->cols, hdr->numCols, hdr->colKeys, hdr->colKeyStart, hdr->colOrder))
+	goto fail;
+
+    tf->tileRows = (long)hdr->tileRows;
+    tf->tileCols = (long)hdr->tileCols;
+    tf->numTileCols = (long)((hdr->numCols + hdr->tileCols - 1) / hdr->tileCols);
+    ntiles = ((hdr->numRows + hdr->tileRows - 1) / hdr->tileRows) * tf->numTileCols;
+    if (!mapped_range_fits (&tf->map, hdr->directory, ntiles * sizeof(tileEntry)))
+	goto fail;
+    tf->directory = (const tileEntry *)(tf->map.addr + hdr->directory);
+    for (ii = 0; ii < ntiles; ii++) {
+	if (!mapped_range_fits (&tf->map, tf->directory[ii].offset, tf->directory[ii].size))
+	    goto fail;
+    }
+    *tfp = tf;
+    return OK;
+
+fail:
+    unmap_file (&tf->map);
+    free (tf);
+    return BAD_INDEX_FORMAT;
+}
+
+void
+close_tile_file (tiledFile *tf)
+{
+    unmap_file (&tf->map);
+    free (tf);
+}
+
+enum status
+check_tile_file (const tiledFile *tf, const fileStamp *stamp)
+{
+    return stamps_equal (&tf->hdr->stamp, stamp) ? OK : STALE_INDEX;
+}
+
+long
+tile_file_num_rows (const tiledFile *tf)
+{
+    return tf->rows.num;
+}
+
+long
+tile_file_num_cols (const tiledFile *tf)
+{
+    return tf->cols.num;
+}
+
+void
+tile_file_tile_size (const tiledFile *tf, long *rowsp, long *colsp)
+{
+    *rowsp = tf->tileRows;
+    *colsp = tf->tileCols;
+}
+
+static void
+get_label (const tileLabels *labels, long pos, const char **strp, long *lenp)
+{
+    *strp = labels->keys + labels->keyStart[pos];
+    *lenp = (long)(labels->keyStart[pos+1] - labels->keyStart[pos]);
+}
+
+static long
+find_label (const tileLabels *labels, const char *str, long len)
+{
+    const char *key;
+    long lo = 0, hi = labels->num;
+    long mid, keylen;
+
+    /* Find first label not less than str. */
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	get_label (labels, (long)labels->order[mid], &key, &keylen);
+	if (compare_labels (key, keylen, str, len) < 0)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    if (lo < labels->num) {
+	get_label (labels, (long)labels->order[lo], &key, &keylen);
+	if (compare_labels (key, keylen, str, len) == 0)
+	    return (long)labels->order[lo];
+    }
+    return -1L;
+}
+
+long
+tile_file_find_row (const tiledFile *tf, const char *str, long len)
+{
+    return find_label (&tf->rows, str, len);
+}
+
+long
+tile_file_find_col (const tiledFile *tf, const char *str, long len)
+{
+    return find_label (&tf->cols, str, len);
+}
+
+void
+tile_file_row_label (const tiledFile *tf, long pos, const char **strp, long *lenp)
+{
+    get_label (&tf->rows, pos, strp, lenp);
+}
+
+void
+tile_file_col_label (const tiledFile *tf, long pos, const char **strp, long *lenp)
+{
+    get_label (&tf->cols, pos, strp, lenp);
+}
+
+enum status
+read_tile (const tiledFile *tf, long trow, long tcol, double *out)
+{
+    const tileEntry *entry = &tf->directory[trow * tf->numTileCols + tcol];
+    long nrows = tf->rows.num - trow * tf->tileRows;
+    long ncols = tf->cols.num - tcol * tf->tileCols;
+    uLongf len;
+
+    if (nrows > tf->tileRows) nrows = tf->tileRows;
+    if (ncols > tf->tileCols) ncols = tf->tileCols;
+    len = (uLongf)(nrows * ncols * sizeof(double));
+    if (uncompress ((Bytef *)out, &len, (const Bytef *)(tf->map.addr + entry->offset), (uLong)entry->size) != Z_OK ||
+	len != (uLongf)(nrows * ncols * sizeof(double)))
+	return BAD_COMPRESSION;
+    return OK;
+}
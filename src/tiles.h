@@ -0,0 +1,71 @@
+
+/* This module implements a tiled, memory-mappable store of the numeric contents of a TSV file.
+ *
+ * A tile file holds every field of every data row of a TSV file, converted to double, divided
+ * into fixed size two dimensional tiles of tileRows rows by tileCols columns.  Each tile is
+ * compressed individually (with zlib), and a directory records the location of every tile, so
+ * that a rectangular window of the matrix can be extracted by decompressing only the tiles it
+ * overlaps.  Unlike row-oriented access to the TSV file, the cost of a query therefore depends
+ * on the number of rows and columns wanted, rather than on the width of the file.
+ *
+ * Rows and columns are stored in the order of the TSV file, so that windows of adjacent rows
+ * or columns share tiles.  The row and column labels are recorded too, with their sorted order
+ * so that labels can be located by binary search, as is a stamp (see binindex.h) of the TSV file
+ * from which the tile file was created.  The TSV file remains the source of truth: a tile file
+ * whose stamp no longer matches its TSV file must not be used.
+ *
+ * Summary of operations:
+ */
+
+typedef struct _tilefile tiledFile;
+typedef struct _tilewriter tileWriter;
+
+/* Begin writing to op a tile file of the data file with the given stamp.  The row and column
+ * labels are given by rows and cols, in the order in which they were inserted.  On success,
+ * *twp is set to a writer to which the rows must then be written by write_tile_band.
+ */
+extern enum status start_tile_file (FILE *op, const fileStamp *stamp, const dynHashTab *rows, const dynHashTab *cols,
+				    long tileRows, long tileCols, tileWriter **twp);
+
+/* Write the next band of tileRows rows (fewer for the last band) to the tile file of tw.
+ * Band is a column-major matrix with a row for each row of the band and a column for each
+ * column of the file.
+ */
+extern enum status write_tile_band (tileWriter *tw, const double *band);
+
+/* Complete the tile file of tw once all bands have been written, and release tw.
+ * Tw is released even if an error is returned.
+ */
+extern enum status finish_tile_file (tileWriter *tw);
+
+/* Map the tile file fp into memory.  On success, *tfp is set to the new tile file.
+ * The file may be closed once the tile file has been opened.
+ */
+extern enum status open_tile_file (FILE *fp, tiledFile **tfp);
+
+/* Release a tile file opened by open_tile_file. */
+extern void close_tile_file (tiledFile *tf);
+
+/* Returns OK if tf was created from the data file with the given stamp, else STALE_INDEX. */
+extern enum status check_tile_file (const tiledFile *tf, const fileStamp *stamp);
+
+/* Returns the number of rows and the number of columns of tf. */
+extern long tile_file_num_rows (const tiledFile *tf);
+extern long tile_file_num_cols (const tiledFile *tf);
+
+/* Sets *rowsp and *colsp to the number of rows and columns in each (full) tile of tf. */
+extern void tile_file_tile_size (const tiledFile *tf, long *rowsp, long *colsp);
+
+/* Returns the position of the row (column) with label str in tf, or -1L if there is no such row (column). */
+extern long tile_file_find_row (const tiledFile *tf, const char *str, long len);
+extern long tile_file_find_col (const tiledFile *tf, const char *str, long len);
+
+/* Sets *strp and *lenp to the label of the row (column) at position pos of tf. */
+extern void tile_file_row_label (const tiledFile *tf, long pos, const char **strp, long *lenp);
+extern void tile_file_col_label (const tiledFile *tf, long pos, const char **strp, long *lenp);
+
+/* Decompress the tile in tile row trow and tile column tcol of tf into out, which must have room for
+ * a full tile.  The tile is stored in column-major order, with as many rows as the tile actually has
+ * (fewer than a full tile in the last tile row).
+ */
+extern enum status read_tile (const tiledFile *tf, long trow, long tcol, double *out);
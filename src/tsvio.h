@@ -1,10 +1,66 @@
 
 
-enum status { OK, EMPTY_FILE, WRITE_ERROR, INCOMPLETE_LAST_LINE, NO_LABEL_ERROR, LABEL_NOT_FOUND, NO_INDEX, LABEL_TOO_LONG, INDEX_TOO_LONG, NON_NUMERIC_IN_INDEX, SEEK_FAILED };
+enum status { OK, EMPTY_FILE, WRITE_ERROR, INCOMPLETE_LAST_LINE, NO_LABEL_ERROR, LABEL_NOT_FOUND, NO_INDEX, LABEL_TOO_LONG, INDEX_TOO_LONG, NON_NUMERIC_IN_INDEX, SEEK_FAILED,
+	      READ_ERROR, BAD_INDEX_FORMAT, OUT_OF_MEMORY, STALE_INDEX, GROWN_DATA, BAD_COMPRESSION, LINE_TOO_LONG,
+	      OPEN_FAILED, NOT_BGZF, PARSE_ERROR };
 
+/* One data line of a TSV file, as found by collect_rows. */
+typedef struct {
+    const char *key;	/* Row label (points into the mapped data file). */
+    long keylen;	/* Number of bytes in label. */
+    long offset;	/* Byte offset of row in data file. */
+    long length;	/* Number of bytes in row, excluding its newline. */
+    long ordinal;	/* Number of data lines preceding this one in the data file. */
+    long ckpt;		/* Index of this row's first column checkpoint in indexJob.ckpt. */
+    long nckpt;		/* Number of column checkpoints for this row (0 if none). */
+} rowEntry;
+
+/* One data file to be scanned by collect_rows. */
+typedef struct {
+    const char *data;	/* Contents of the data file. */
+    size_t size;	/* Number of bytes in data. */
+    size_t start;	/* Offset of first line to scan.  If 0, the first line is a header and is skipped. */
+    long colstride;	/* If > 0, record a checkpoint every colstride data columns. */
+    int bgzf;		/* If set, data is the decompressed contents of a BGZF file (see bgzf.h). */
+    rowEntry *row;	/* Rows found (allocated by collect_rows, freed by caller). */
+    long count;		/* Number of rows found. */
+    uint32_t *ckpt;	/* Column checkpoints of all rows (allocated by collect_rows, freed by caller). */
+    long nckpt;		/* Number of column checkpoints. */
+    enum status res;	/* Result of scanning the file. */
+} indexJob;
+
+/* Column checkpoints.
+ * If a row has checkpoints, checkpoint k (k >= 0) is the offset from the start of the row
+ * to the first byte of data column k*colstride, where the first data column (column 0)
+ * immediately follows the row label.  The final checkpoint is the length of the row,
+ * excluding its terminating newline.
+ */
+
+#define INDEX_TEXT	0
+#define INDEX_BINARY	1
+
+/* Returns the number of threads to use given a requested number (<= 0 for the OpenMP default). */
+extern int resolve_threads (int nthreads);
+
+/* Returns the offset of the first line of the size bytes at data that starts at or after posn. */
+extern size_t align_to_line (const char *data, size_t size, size_t posn);
+
+extern void collect_rows (indexJob *jobs, long njobs, int nthreads);
+extern void generate_indexes (long nfiles, FILE **ip, FILE **op, int format, long colstride, int nthreads, enum status *res);
 extern enum status generate_index (FILE *ip, FILE *op);
+extern enum status generate_binary_index (FILE *ip, FILE *op);
 extern enum status scan_index_file (FILE *indexp, dynHashTab *dht, long insertall);
 extern enum status find_col_indices (char *buffer, long buflen, long findany, long nindex, const char *labels[], long *index, void (*warn)(char *msg,...));
-extern int get_tsv_line_buffer (char *buffer, size_t bufsize, FILE *tsvp, long posn);
-extern long num_columns (char *buffer, long buflen);
+extern enum status read_tsv_line (FILE *tsvp, long posn, long rowlen, char *buffer, size_t bufsize, char **linep, size_t *lenp,
+				  char **copyp);
+extern long num_columns (const char *buffer, long buflen);
+
+/* Insert the fields of the header line buffer (of buflen bytes, including its newline) into dht,
+ * each with its data column number.  If skipfirst, the first field labels the column of row labels,
+ * and is skipped; otherwise (an R-style header) every field labels a data column.  A label that
+ * occurs more than once keeps its first position in dht, with the number of its last column.
+ * If insertall is not set, only labels already in dht are updated.  Returns the number of fields
+ * that label data columns.
+ */
+extern long scan_header_fields (dynHashTab *dht, const char *buffer, long buflen, int skipfirst, int insertall);
 
@@ -3,21 +3,27 @@
  * Author : Bradley Broom
  */
 
-/* This is the C language component of the R tsvio library.
+/* This is the C language component of the R tsvio library: the R interface to the query engine
+ * in dataset.c and the other modules, which do not call R.
  */
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #ifdef _WIN32
 #include <io.h>
 #include <fcntl.h>
 #include <share.h>
-#include <sys/stat.h>
 #else
 #include <unistd.h>  /* For unlink */
 #endif
 #include <math.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include <R.h>
 #include <Rdefines.h>
@@ -26,9 +32,14 @@
 
 #include "dht.h"
 #include "tsvio.h"
-
-/* Size of per line input buffer. */
-#define LINEBUFFERSIZE	(10*1024*1024)
+#include "binindex.h"
+#include "mapfile.h"
+#include "parsenum.h"
+#include "bgzf.h"
+#include "numcache.h"
+#include "tiles.h"
+#include "dataset.h"
+#include "stats.h"
 
 static SEXP
 add_dims (SEXP svec, long nrows, long ncols)
@@ -46,111 +57,427 @@ add_dims (SEXP svec, long nrows, long ncols)
     return svec;
 }
 
-int
-is_fatal_error (enum status res)
+void
+closeTsvFiles (long numFiles, FILE **tsvpp, FILE **indexpp)
 {
-    return (res != OK) && (res != EMPTY_FILE) && (res != INCOMPLETE_LAST_LINE);
+    long ii;
+    if (tsvpp) {
+        for (ii = 0; ii < numFiles; ii++)
+	    if (tsvpp[ii])
+	        fclose (tsvpp[ii]);
+	free (tsvpp);
+    }
+    if (indexpp) {
+        for (ii = 0; ii < numFiles; ii++)
+	    if (indexpp[ii])
+	        fclose (indexpp[ii]);
+	free (indexpp);
+    }
 }
 
+/* Report problems generating an index.  DataFile and indexFile are the file names (CHARSXPs).
+ */
 void
 report_genindex_errors (enum status res, char *name, SEXP dataFile, SEXP indexFile)
 {
     if (res == EMPTY_FILE)
-	warning ("%s: Warning: tsvfile '%s' is empty\n", name, CHAR(STRING_ELT(dataFile,0)));
+	warning ("%s: Warning: tsvfile '%s' is empty\n", name, CHAR(dataFile));
     else if (res != OK) {
 	if (res == WRITE_ERROR)
-	    error ("%s: error writing to indexfile '%s'\n", name, CHAR(STRING_ELT(indexFile,0)));
+	    error ("%s: error writing to indexfile '%s'\n", name, CHAR(indexFile));
 	else if (res == INCOMPLETE_LAST_LINE)
-	    warning ("%s: last line of tsvfile '%s' is incomplete\n", name, CHAR(STRING_ELT(dataFile,0)));
+	    warning ("%s: last line of tsvfile '%s' is incomplete\n", name, CHAR(dataFile));
 	else if (res == NO_LABEL_ERROR)
-	    error ("%s: line of tsvfile '%s' does not contain a label\n", name, CHAR(STRING_ELT(dataFile,0)));
+	    error ("%s: line of tsvfile '%s' does not contain a label\n", name, CHAR(dataFile));
+	else if (res == READ_ERROR)
+	    error ("%s: error reading tsvfile '%s'\n", name, CHAR(dataFile));
+	else if (res == OUT_OF_MEMORY)
+	    error ("%s: insufficient memory to index tsvfile '%s'\n", name, CHAR(dataFile));
+	else if (res == BAD_COMPRESSION)
+	    error ("%s: tsvfile '%s' is corrupt or is not compressed in BGZF format (use bgzip)\n", name, CHAR(dataFile));
+	else if (res == INDEX_TOO_LONG)
+	    error ("%s: compressed tsvfile '%s' is too large to index on this platform\n", name, CHAR(dataFile));
 	else
 	    error ("%s: unknown internal error\n", name);
     }
 }
 
+/* Report a problem found by verify_index_file.  DataFile and indexFile are the file names (CHARSXPs).
+ */
+static void
+report_verify_errors (enum status res, char *name, SEXP dataFile, SEXP indexFile)
+{
+    if (res == STALE_INDEX)
+	error ("%s: indexfile '%s' does not match datafile '%s': regenerate it using tsvGenIndex\n", name, CHAR(indexFile), CHAR(dataFile));
+    else if (res == WRITE_ERROR)
+	error ("%s: unable to update indexfile '%s'\n", name, CHAR(indexFile));
+    else if (res != OK)
+	error ("%s: i/o or format error %d checking indexfile '%s'\n", name, res, CHAR(indexFile));
+}
+
 SEXP
-tsvGenIndex (SEXP dataFile, SEXP indexFile)
+tsvGenIndex (SEXP dataFile, SEXP indexFile, SEXP format, SEXP colstride, SEXP update, SEXP threads)
 {
-    FILE *tsvp, *indexp;
-    enum status res;
+    long numFiles, numGen;
+    FILE **tsvpp = NULL, **indexpp = NULL;
+    enum status *res;
+    long *fileNum;
     long ii;
+    int binary = 1;
 
     PROTECT (dataFile = AS_CHARACTER(dataFile));
     PROTECT (indexFile = AS_CHARACTER(indexFile));
+    PROTECT (format = AS_CHARACTER(format));
+    PROTECT (colstride = AS_INTEGER(colstride));
+    PROTECT (update = AS_LOGICAL(update));
+    PROTECT (threads = AS_INTEGER(threads));
 
     if (length(dataFile) == 0 || length(indexFile) == 0) {
         error ("parameter cannot be NULL");
     }
 
+    if (length(format) != 1) {
+        error ("parameter format must be a single string");
+    }
+    if (strcmp (CHAR(STRING_ELT(format,0)), "binary") == 0) {
+	binary = 1;
+    } else if (strcmp (CHAR(STRING_ELT(format,0)), "text") == 0) {
+	binary = 0;
+    } else {
+        error ("unknown index format '%s'", CHAR(STRING_ELT(format,0)));
+    }
+
     if (length(dataFile) != length(indexFile)) {
         error ("parameters dataFile and indexFile must have the same length");
     }
 
-    for (ii = 0; ii < length(dataFile); ii++) {
+    if (length(colstride) != 1 || INTEGER(colstride)[0] == NA_INTEGER || INTEGER(colstride)[0] < 0) {
+        error ("parameter colstride must be a single non-negative integer");
+    }
+    if (INTEGER(colstride)[0] > 0 && !binary) {
+        error ("column checkpoints require a binary index");
+    }
+
+    if (length(threads) != 1 || INTEGER(threads)[0] == NA_INTEGER) {
+        error ("parameter threads must be a single integer");
+    }
+
+    if (length(update) != 1 || LOGICAL(update)[0] == NA_LOGICAL) {
+        error ("parameter update must be TRUE or FALSE");
+    }
+
+    numFiles = length(dataFile);
+    res = (enum status *)R_alloc (numFiles, sizeof(enum status));
+    fileNum = (long *)R_alloc (numFiles, sizeof(long));
+    tsvpp = (FILE **)calloc(numFiles, sizeof(FILE *));
+    indexpp = (FILE **)calloc(numFiles, sizeof(FILE *));
+    if (tsvpp == NULL || indexpp == NULL) {
+	free (tsvpp);
+	free (indexpp);
+	error ("unable to allocate file handles for %ld files\n", numFiles);
+    }
+
+    /* Open all files before starting, so that all indexes can be generated concurrently.
+     * If updating, existing binary indexes that match their data file are kept, and those
+     * whose data file has only grown are extended.  The remaining indexes are regenerated.
+     */
+    numGen = 0;
+    for (ii = 0; ii < numFiles; ii++) {
+	FILE *tsvp, *indexp;
+	binIndex *idx;
+	enum status check = STALE_INDEX;
+
 	tsvp = fopen (CHAR(STRING_ELT(dataFile,ii)), "rb");
 	if (tsvp == NULL) {
+	    closeTsvFiles (numGen, tsvpp, indexpp);
 	    error ("unable to open datafile '%s' for reading", CHAR(STRING_ELT(dataFile,ii)));
 	}
-	indexp = fopen (CHAR(STRING_ELT(indexFile,ii)), "wb");
-	if (indexp == NULL) {
-	    fclose (tsvp);
+	if (LOGICAL(update)[0] && binary && (indexp = fopen (CHAR(STRING_ELT(indexFile,ii)), "rb")) != NULL) {
+	    if (is_binary_index (indexp) && open_binary_index (indexp, &idx) == OK) {
+		if (binary_index_colstride (idx) == INTEGER(colstride)[0])
+		    check = check_binary_index (idx, tsvp);
+		close_binary_index (idx);
+	    }
+	    if (check == GROWN_DATA) {
+		check = update_index_file (tsvp, &indexp, CHAR(STRING_ELT(indexFile,ii)), INTEGER(threads)[0]);
+		/* Close all files before an error is signalled. */
+		if (is_fatal_error (check)) {
+		    if (indexp != NULL)
+			fclose (indexp);
+		    fclose (tsvp);
+		    closeTsvFiles (numGen, tsvpp, indexpp);
+		}
+		report_genindex_errors (check, "tsvGenIndex", STRING_ELT(dataFile,ii), STRING_ELT(indexFile,ii));
+	    }
+	    if (indexp != NULL)
+		fclose (indexp);
+	    if (check == OK || check == INCOMPLETE_LAST_LINE) {
+		fclose (tsvp);
+		continue;
+	    }
+	}
+	tsvpp[numGen] = tsvp;
+	indexpp[numGen] = fopen (CHAR(STRING_ELT(indexFile,ii)), "wb");
+	if (indexpp[numGen] == NULL) {
+	    closeTsvFiles (numGen+1, tsvpp, indexpp);
 	    error ("unable to open indexfile '%s' for writing", CHAR(STRING_ELT(indexFile,ii)));
 	}
-	res = generate_index (tsvp, indexp);
-	fclose (tsvp);
-	fclose (indexp);
-	report_genindex_errors (res, "tsvGenIndex", dataFile, indexFile);
+	fileNum[numGen++] = ii;
     }
-    UNPROTECT (2);
+
+    generate_indexes (numGen, tsvpp, indexpp, binary ? INDEX_BINARY : INDEX_TEXT, INTEGER(colstride)[0], INTEGER(threads)[0], res);
+    closeTsvFiles (numGen, tsvpp, indexpp);
+
+    for (ii = 0; ii < numGen; ii++) {
+	report_genindex_errors (res[ii], "tsvGenIndex", STRING_ELT(dataFile,fileNum[ii]), STRING_ELT(indexFile,fileNum[ii]));
+    }
+    UNPROTECT (6);
     return R_NilValue;
 }
 
-int
-get_tsv_line_buffer (char *buffer, size_t bufsize, FILE *tsvp, long posn)
+/* Read the line at posn of the data file tsvp (or at virtual offset posn of bgzf, if it is BGZF
+ * compressed) into buffer, or into a copy if it does not fit, signalling an error if it cannot be read.
+ * Rowlen is the length of the line excluding its newline, or -1L if unknown.  Returns the line.
+ */
+static SEXP
+get_line_SEXP (char *buffer, size_t bufsize, FILE *tsvp, bgzfFile *bgzf, long posn, long rowlen)
 {
-    int	ch, len;
+    char *line, *copy;
+    size_t len;
+    long next;
+    enum status res;
+    SEXP str;
 
 #ifdef DEBUG
-    Rprintf ("> get_tsv_line_buffer (posn=%ld)\n", posn);
+    Rprintf ("> get_line_SEXP (posn=%ld, rowlen=%ld)\n", posn, rowlen);
 #endif
-    if (fseek (tsvp, posn, SEEK_SET) < 0)
+    if (bgzf != NULL)
+	res = bgzf_read_line_copy (bgzf, posn, rowlen, buffer, bufsize, &line, &len, &next, &copy);
+    else
+	res = read_tsv_line (tsvp, posn, rowlen, buffer, bufsize, &line, &len, &copy);
+    if (res == EMPTY_FILE || res == SEEK_FAILED)
 	error ("get_tsv_line: error seeking to line starting at %ld\n", posn);
-
-    len = 0;
-    while ((ch = getc (tsvp)) != EOF && ch != '\n') {
-	if (len >= (bufsize-1)) {
-	    error ("get_tsv_line: line starting at %ld longer than buffer length (%d bytes)\n", posn, bufsize);
-	}
-	buffer[len++] = ch;
-    }
-
-    if (ch == EOF) {
+    else if (res == OUT_OF_MEMORY)
+	error ("get_tsv_line: unable to allocate memory for line starting at %ld\n", posn);
+    else if (res != OK && res != INCOMPLETE_LAST_LINE)
+	error ("get_tsv_line: error reading %sline starting at %ld\n", bgzf != NULL ? "compressed " : "", posn);
+    PROTECT (str = mkCharLen (line, (int)len));
+    free (copy);
+    if (res == INCOMPLETE_LAST_LINE)
 	warning ("get_tsv_line: line starting at %ld is prematurely terminated by EOF\n", posn);
-    }
-	
-    buffer[len++] = '\n'; /* Check above ensures space for this. */
 #ifdef DEBUG
-    Rprintf ("< get_tsv_line_buffer (len=%d)\n", len);
+    Rprintf ("< get_line_SEXP (len=%ld)\n", (long)len);
 #endif
-    return len;
+    UNPROTECT (1);
+    return str;
 }
 
-SEXP
-get_tsv_line_buffer_SEXP (char *buffer, size_t bufsize, FILE *tsvp, long posn)
+/* As get_line_SEXP, but takes the line directly from the memory mapped data file. */
+static SEXP
+get_mapped_line_SEXP (const mappedFile *data, long posn, long rowlen)
 {
-    int len;
-    len = get_tsv_line_buffer (buffer, bufsize, tsvp, posn);
-    return mkCharLen(buffer,len);
+    const char *line, *eol;
+    char *copy;
+    long len;
+
+    if (posn < 0 || (size_t)posn >= data->size)
+	error ("get_tsv_line: error seeking to line starting at %ld\n", posn);
+    line = data->addr + posn;
+    if (rowlen >= 0 && (size_t)rowlen < data->size - posn && line[rowlen] == '\n')
+	eol = line + rowlen;
+    else
+	eol = memchr (line, '\n', data->size - posn);
+    if (eol != NULL)
+	return mkCharLen (line, (int)(eol - line + 1));
+
+    warning ("get_tsv_line: line starting at %ld is prematurely terminated by EOF\n", posn);
+    len = (long)(data->size - posn);
+    copy = R_alloc (len + 1, sizeof(char));
+    memcpy (copy, line, len);
+    copy[len] = '\n';
+    return mkCharLen (copy, len + 1);
 }
 
 void
 warn (char *msg, ...)
 {
+    char buf[1024];
     va_list argptr;
+
     va_start (argptr, msg);
-    warning (msg, argptr);
+    vsnprintf (buf, sizeof(buf), msg, argptr);
     va_end (argptr);
+    warning ("%s", buf);
+}
+
+/* A selector of row labels created by tsvKeyPrefix or tsvKeyRange: an R list of class
+ * "tsvKeySelector" with elements prefix, from, and to.  It selects the labels that start with
+ * any of prefix, or else the labels between from and to inclusive (in memcmp order), where a
+ * NULL bound is unlimited.
+ */
+#define KEYSEL_PREFIX	0
+#define KEYSEL_FROM	1
+#define KEYSEL_TO	2
+
+typedef struct {
+    SEXP prefix;		/* Character vector of prefixes, or R_NilValue for a range. */
+    const char *from, *to;	/* Bounds of range (NULL if unlimited). */
+    long fromlen, tolen;
+} keySelector;
+
+/* Returns 1 and sets *ks if sel is a key selector, otherwise returns 0. */
+static int
+get_key_selector (SEXP sel, keySelector *ks)
+{
+    SEXP bound;
+
+    if (TYPEOF(sel) != VECSXP || !inherits (sel, "tsvKeySelector"))
+	return 0;
+    if (length(sel) != 3)
+	error ("malformed tsvKeySelector\n");
+    ks->prefix = VECTOR_ELT (sel, KEYSEL_PREFIX);
+    if (ks->prefix != R_NilValue && !IS_CHARACTER(ks->prefix))
+	error ("malformed tsvKeySelector\n");
+    bound = VECTOR_ELT (sel, KEYSEL_FROM);
+    if (bound != R_NilValue && (!isString(bound) || length(bound) != 1))
+	error ("malformed tsvKeySelector\n");
+    ks->from = bound == R_NilValue ? NULL : CHAR(STRING_ELT(bound,0));
+    ks->fromlen = ks->from == NULL ? 0 : strlen (ks->from);
+    bound = VECTOR_ELT (sel, KEYSEL_TO);
+    if (bound != R_NilValue && (!isString(bound) || length(bound) != 1))
+	error ("malformed tsvKeySelector\n");
+    ks->to = bound == R_NilValue ? NULL : CHAR(STRING_ELT(bound,0));
+    ks->tolen = ks->to == NULL ? 0 : strlen (ks->to);
+    return 1;
+}
+
+/* Returns 1 iff the label str is selected by ks. */
+static int
+key_selected (const keySelector *ks, const char *str, long len)
+{
+    const char *pfx;
+    long ii, plen;
+
+    if (ks->prefix != R_NilValue) {
+	for (ii = 0; ii < length(ks->prefix); ii++) {
+	    pfx = CHAR(STRING_ELT(ks->prefix,ii));
+	    plen = strlen (pfx);
+	    if (plen <= len && memcmp (str, pfx, plen) == 0)
+		return 1;
+	}
+	return 0;
+    }
+    return (ks->from == NULL || compare_labels (str, len, ks->from, ks->fromlen) >= 0) &&
+	   (ks->to == NULL || compare_labels (str, len, ks->to, ks->tolen) <= 0);
+}
+
+/* Insert into keys the labels of a data file selected by ks.  The labels are taken from the
+ * sorted table of the binary index idx, if not NULL, so that only the matching labels are visited.
+ * Otherwise every label of rowdht (loaded from a text index) is tested.
+ */
+static void
+select_keys (const keySelector *ks, const binIndex *idx, const dynHashTab *rowdht, dynHashTab *keys)
+{
+    const char *str, *pfx;
+    long ii, pos, len, plen, nrows, iter;
+
+    if (idx == NULL) {
+	initIterator (rowdht, &iter);
+	while (getNextStr (rowdht, &iter, &str, &len, NULL, NULL)) {
+	    if (key_selected (ks, str, len))
+		insertStr (keys, str, len);
+	}
+	return;
+    }
+    nrows = binary_index_num_rows (idx);
+    if (ks->prefix != R_NilValue) {
+	for (ii = 0; ii < length(ks->prefix); ii++) {
+	    pfx = CHAR(STRING_ELT(ks->prefix,ii));
+	    plen = strlen (pfx);
+	    for (pos = binary_index_lower_bound (idx, pfx, plen); pos < nrows; pos++) {
+		binary_index_label (idx, pos, &str, &len);
+		if (len < plen || memcmp (str, pfx, plen) != 0)
+		    break;
+		insertStr (keys, str, len);
+	    }
+	}
+    } else {
+	pos = ks->from == NULL ? 0 : binary_index_lower_bound (idx, ks->from, ks->fromlen);
+	for (; pos < nrows; pos++) {
+	    binary_index_label (idx, pos, &str, &len);
+	    if (ks->to != NULL && compare_labels (str, len, ks->to, ks->tolen) > 0)
+		break;
+	    insertStr (keys, str, len);
+	}
+    }
+}
+
+typedef struct {
+    const char *str;
+    long len;
+} keyLabel;
+
+static int
+compare_keyLabel (const void *a, const void *b)
+{
+    const keyLabel *ap = (const keyLabel *)a;
+    const keyLabel *bp = (const keyLabel *)b;
+
+    return compare_labels (ap->str, ap->len, bp->str, bp->len);
+}
+
+/* Returns a character vector of the labels in keys, in ascending (memcmp) order.  Keys is freed. */
+static SEXP
+sorted_keys (dynHashTab *keys)
+{
+    SEXP result;
+    keyLabel *labels;
+    long ii, iter, n = dhtNumStrings (keys);
+
+    labels = (keyLabel *)malloc ((n + 1) * sizeof(keyLabel));
+    if (labels == NULL) {
+	freeDynHashTab (keys);
+	error ("unable to allocate memory for selected keys\n");
+    }
+    ii = 0;
+    initIterator (keys, &iter);
+    while (getNextStr (keys, &iter, &labels[ii].str, &labels[ii].len, NULL, NULL))
+	ii++;
+    qsort (labels, n, sizeof(keyLabel), compare_keyLabel);
+
+    result = allocVector (STRSXP, n);
+    for (ii = 0; ii < n; ii++) {
+	SET_STRING_ELT (result, ii, mkCharLen (labels[ii].str, labels[ii].len));
+    }
+    free (labels);
+    freeDynHashTab (keys);
+    return result;
+}
+
+/* Returns the keys selected by ks from the index file indexp, or NULL on error. */
+static dynHashTab *
+index_file_keys (FILE *indexp, const keySelector *ks, enum status *resp)
+{
+    dynHashTab *keys, *all = NULL;
+    binIndex *idx = NULL;
+
+    if (is_binary_index (indexp)) {
+	*resp = open_binary_index (indexp, &idx);
+    } else if ((all = newDynHashTab (1024, DHT_STRDUP)) == NULL) {
+	*resp = OUT_OF_MEMORY;
+    } else {
+	*resp = scan_index_file (indexp, all, 1);
+    }
+    keys = NULL;
+    if (*resp == OK) {
+	if ((keys = newDynHashTab (1024, DHT_STRDUP)) == NULL)
+	    *resp = OUT_OF_MEMORY;
+	else
+	    select_keys (ks, idx, all, keys);
+    }
+    if (idx != NULL) close_binary_index (idx);
+    if (all != NULL) freeDynHashTab (all);
+    return keys;
 }
 
 SEXP
@@ -161,31 +488,79 @@ tsvGetLines (SEXP dataFile, SEXP indexFile, SEXP patterns, SEXP findany)
     long Npattern, Nresult;
     SEXP results;
     long posn;
-    long ii;
+    long ii, len, order, pos, *rowlen;
+    const char *str;
     enum status res;
     dynHashTab *dht;
-    char *buffer;
+    binIndex *idx;
+    char *buffer = NULL;
+    mappedFile data;
+    bgzfFile *bgzf = NULL;
+    int gz, selector, grown;
+    keySelector ks;
+    double t;
     
 #ifdef DEBUG
     Rprintf ("> tsvGetLines\n");
 #endif
+    stats_begin ("tsvGetLines");
 
     /* Convert, if necessary, data into expected format. */
     PROTECT (dataFile = AS_CHARACTER(dataFile));
     PROTECT (indexFile = AS_CHARACTER(indexFile));
-    PROTECT (patterns = AS_CHARACTER(patterns));
+    if (!(selector = get_key_selector (patterns, &ks))) patterns = AS_CHARACTER(patterns);
+    PROTECT (patterns);
     PROTECT (findany = AS_LOGICAL(findany));
     nprotect += 4;
 
-    if (length(dataFile) == 0 || length(indexFile) == 0 || length(patterns) == 0) {
+    if (length(dataFile) == 0 || length(indexFile) == 0 || (!selector && length(patterns) == 0)) {
         error ("tsvGetLines: parameter cannot be NULL\n");
     }
 
+    STATS_START (t);
     indexp = fopen (CHAR(STRING_ELT(indexFile,0)), "rb");
     if (indexp == NULL) {
         error ("tsvGetLines: unable to open indexfile '%s' for reading\n", CHAR(STRING_ELT(indexFile,0)));
     }
 
+    tsvp = fopen (CHAR(STRING_ELT(dataFile,0)), "rb");
+    if (tsvp == NULL) {
+	fclose (indexp);
+	error ("tsvGetLines: unable to open datafile '%s' for reading\n", CHAR(STRING_ELT(dataFile,0)));
+    }
+    if ((gz = gzip_format (tsvp)) == GZIP_PLAIN) {
+	fclose (indexp);
+	fclose (tsvp);
+	error ("tsvGetLines: datafile '%s' is not compressed in BGZF format (use bgzip)\n", CHAR(STRING_ELT(dataFile,0)));
+    }
+
+    res = verify_index_file (tsvp, &indexp, CHAR(STRING_ELT(indexFile,0)), &grown);
+    if (res != OK) {
+	fclose (tsvp);
+	if (indexp != NULL) fclose (indexp);
+	report_verify_errors (res, "tsvGetLines", STRING_ELT(dataFile,0), STRING_ELT(indexFile,0));
+    }
+    if (grown) {
+	warning ("tsvGetLines: datafile '%s' has grown: updated indexfile '%s'\n", CHAR(STRING_ELT(dataFile,0)), CHAR(STRING_ELT(indexFile,0)));
+    }
+    STATS_STOP (PHASE_OPEN, t);
+
+    /* Replace a key selector by the labels it selects. */
+    if (selector) {
+	if ((dht = index_file_keys (indexp, &ks, &res)) == NULL) {
+	    fclose (tsvp);
+	    fclose (indexp);
+	    error ("I/O or format problem scanning index file");
+	}
+	PROTECT (patterns = sorted_keys (dht));
+	nprotect++;
+	if (length(patterns) == 0) {
+	    fclose (tsvp);
+	    fclose (indexp);
+	    error ("tsvGetLines: match not found");
+	}
+    }
+
     Npattern = length(patterns);
 #ifdef DEBUG
     Rprintf ("  tsvGetLines: received %d patterns\n", Npattern);
@@ -197,10 +572,26 @@ tsvGetLines (SEXP dataFile, SEXP indexFile, SEXP patterns, SEXP findany)
 	const char *str = CHAR(STRING_ELT(patterns,ii));
 	insertStrVal (dht, str, strlen (str), -1L);
     }
+    STATS_START (t);
     res = scan_index_file (indexp, dht, Npattern == 0);
+    /* A binary index also records the length of each row, so that it can be read exactly. */
+    rowlen = (long *)R_alloc (dhtNumStrings (dht) + 1, sizeof(long));
+    for (ii = 0; ii < dhtNumStrings (dht); ii++) {
+	rowlen[ii] = -1L;
+    }
+    if (res == OK && is_binary_index (indexp) && open_binary_index (indexp, &idx) == OK) {
+	initIterator (dht, &ii);
+	while (getNextStr (dht, &ii, &str, &len, &order, NULL)) {
+	    if ((pos = binary_index_find (idx, str, len)) >= 0)
+		rowlen[order] = binary_index_row_length (idx, pos);
+	}
+	close_binary_index (idx);
+    }
     fclose (indexp);
+    STATS_STOP (PHASE_INDEX, t);
 
     if (res != OK) {
+	fclose (tsvp);
 	error ("I/O or format problem scanning index file");
     }
 
@@ -213,6 +604,7 @@ tsvGetLines (SEXP dataFile, SEXP indexFile, SEXP patterns, SEXP findany)
 #ifdef DEBUG
 	Rprintf ("  tsvGetLines: error finding matches\n");
 #endif
+	fclose (tsvp);
 	freeDynHashTab (dht);
 	error ("tsvGetLines: match not found");
     }
@@ -222,22 +614,39 @@ tsvGetLines (SEXP dataFile, SEXP indexFile, SEXP patterns, SEXP findany)
     PROTECT (results = allocVector(STRSXP, Nresult+1)); /* Includes header. */
     nprotect++;
 
-    tsvp = fopen (CHAR(STRING_ELT(dataFile,0)), "rb");
-    if (tsvp == NULL) {
-	freeDynHashTab (dht);
-	error ("tsvGetLines: unable to open datafile '%s' for reading\n", CHAR(STRING_ELT(dataFile,0)));
+    /* Take lines directly from the mapped data file if possible, otherwise allocate a line buffer.
+     * Lines of a compressed data file are decompressed into the buffer.
+     */
+    data.how = MAPPED_EMPTY;
+    if (gz == GZIP_BGZF || try_map_file (tsvp, &data) != OK || data.how != MAPPED_MMAP) {
+	data.how = MAPPED_EMPTY;
+	buffer = (char *)malloc(LINEBUFFERSIZE);
+	if (buffer == NULL || (gz == GZIP_BGZF && bgzf_open (tsvp, &bgzf) != OK)) {
+	    free (buffer);
+	    fclose (tsvp);
+	    freeDynHashTab (dht);
+	    error ("unable to allocate line buffer\n");
+	}
     }
-
-    /* Allocate line buffer. */
-    buffer = (char *)malloc(LINEBUFFERSIZE);
-    if (buffer == NULL) error ("unable to allocate line buffer\n");
-    SET_STRING_ELT (results, 0, get_tsv_line_buffer_SEXP (buffer, LINEBUFFERSIZE, tsvp, 0L));
-    Nresult = 1;
+    STATS_START (t);
+    Nresult = 0;
+    posn = 0L; /* Header. */
+    len = -1L;
     initIterator (dht, &ii);
-    while (getNextStr (dht, &ii, NULL, NULL, NULL, &posn)) {
-	SET_STRING_ELT (results, Nresult, get_tsv_line_buffer_SEXP (buffer, LINEBUFFERSIZE, tsvp, posn));
+    for (;;) {
+	if (data.how == MAPPED_MMAP)
+	    SET_STRING_ELT (results, Nresult, get_mapped_line_SEXP (&data, posn, len));
+	else
+	    SET_STRING_ELT (results, Nresult, get_line_SEXP (buffer, LINEBUFFERSIZE, tsvp, bgzf, posn, len));
 	Nresult++;
+	if (!getNextStr (dht, &ii, NULL, NULL, &order, &posn))
+	    break;
+	len = rowlen[order];
     }
+    STATS_STOP (PHASE_READ, t);
+    STATS_COUNT (STAT_ROWS, Nresult);
+    unmap_file (&data);
+    if (bgzf != NULL) bgzf_close (bgzf);
     free (buffer);
     fclose (tsvp);
     freeDynHashTab (dht);
@@ -245,185 +654,177 @@ tsvGetLines (SEXP dataFile, SEXP indexFile, SEXP patterns, SEXP findany)
 #ifdef DEBUG
     Rprintf ("< tsvGetLines\n");
 #endif
+    stats_end ();
     UNPROTECT (nprotect);
     return results;
 }
 
-static void set_result_str (SEXP result, long idx, char *s, long n)
+/* Signal the R warning and/or error (if any) corresponding to prob. */
+static void
+report_parse_problem (const parseProblem *prob)
 {
-    SET_STRING_ELT (result, idx, mkCharLen(s, n));
-}
-
-static void set_result_int (SEXP result, long idx, char *s, long n)
-{
-    long value;
-    char *end;
-    char *scopy = (char *)alloca(n+1);
-
-    strncpy (scopy, s, n);
-    scopy[n] = '\0';
+    char msg[512];
 
-    value = strtol (scopy, &end, 10);
-    if (end == scopy) {
-        if (scopy[0] == '\0' || strncmp (scopy, "NA", 2) == 0) {
-	    value = NA_INTEGER;
-	} else {
-	    error ("Non-integer field '%.*s' encountered", n, scopy);
-	}
-    } else if (*end != '\t' && *end != '\n' && *end != '\r' && *end != '\0') {
-	error ("unexpected non-numeric data following integer field: '%.*s'", n, scopy);
+    if (prob->eofRow >= 0)
+	warning ("get_tsv_line: line starting at %ld is prematurely terminated by EOF\n", prob->eofRow);
+    if (prob->code != FIELD_OK) {
+	parse_problem_message (prob, msg, sizeof(msg));
+	error ("%s", msg);
     }
-    INTEGER(result)[idx] = value;
 }
 
-static void set_result_num (SEXP result, long idx, char *s, long n)
+/* Store a field in a character matrix.  This setter calls R, so is not parallel. */
+static int set_result_str (const resultDest *dest, long idx, const char *s, long n)
 {
-    double value;
-    char *end;
-    char *scopy = (char *)alloca(n+1);
-
-    strncpy (scopy, s, n);
-    scopy[n] = '\0';
-    value = strtod (scopy, &end);
-    if (end == scopy) {
-        if (scopy[0] == '\0' || strncmp (scopy, "NA", 2) == 0) {
-	    value = NA_REAL;
-        } else if (strncmp (scopy, "-Inf", 4) == 0) {
-	    value = R_NegInf;
-        } else if (strncmp (scopy, "Inf", 3) == 0) {
-	    value = R_PosInf;
-	} else {
-	    error ("Non-numeric field '%.*s' encountered", n, scopy);
-	}
-    } else if (*end != '\t' && *end != '\n' && *end != '\r' && *end != '\0') {
-	error ("unexpected non-numeric data following numeric field: '%.*s'", n, scopy);
-    }
-    REAL(result)[idx] = value;
+    SET_STRING_ELT ((SEXP)dest->result, idx, mkCharLen(s, n));
+    return FIELD_OK;
 }
 
-typedef void (*setterFunction) (SEXP, long, char *, long);
-
 setterFunction
 get_result_setter (SEXP dtype)
 {
     if (IS_CHARACTER(dtype)) return set_result_str;
     if (IS_INTEGER(dtype)) return set_result_int;
+    if (IS_NUMERIC(dtype) && inherits (dtype, "integer64")) return set_result_int64;
     if (IS_NUMERIC(dtype)) return set_result_num;
     return NULL;
 }
 
-/* R matrix is laid out in column-major order.
- */
-void
-get_tsv_fields (SEXP result,	     /* Destination R 'matrix' */
-		setterFunction setResult, /* For setting an element of result */
-		long nrows,	     /* Number of rows in result. */
-		long rowid,	     /* Row of result in which to save fields from this line. */
-		FILE *tsvp,	     /* Open file from which to read data. */
-		long rowposn,	     /* Offset in bytes from start of file to this row's data. */
-		long maxColumnWanted,/* Largest column we need. */
-		long *columnMap,     /* Col of result in which to save field, or -1L if not wanted. */
-		char *buffer,	     /* Line buffer for (re-)use by this function. */
-		long buffer_size)    /* Number of bytes in buffer. */
-{
-    long linelen;
-    long indexp;
-    long fstart;
-    long inputColumn, outputColumn;
-
-    /* Read line into buffer. */
-    linelen = get_tsv_line_buffer (buffer, buffer_size, tsvp, rowposn);
-
-    indexp = 0;
-    /* Advance over first column (row header) and its terminator. */
-    while ((indexp < linelen) && buffer[indexp] != '\t' && buffer[indexp] != '\n') {
-	indexp++;
-    }
-    if (indexp < linelen) indexp++; /* Advance over field-terminator, if any. */
+/* Initialize dest for storing fields into the nrows-row R matrix result, of the same type as dtype. */
+static void
+init_result_dest (resultDest *dest, SEXP result, SEXP dtype, long nrows)
+{
+    dest->result = result;
+    dest->ivec = TYPEOF(result) == INTSXP ? INTEGER(result) : NULL;
+    dest->dvec = TYPEOF(result) == REALSXP ? REAL(result) : NULL;
+    dest->lvec = TYPEOF(result) == REALSXP ? (int64_t *)REAL(result) : NULL;
+    dest->fvec = NULL;
+    dest->rowstep = 1;
+    dest->colstep = nrows;
+    dest->set = get_result_setter (dtype);
+    dest->parallel = dest->set != set_result_str;
+}
 
-    inputColumn = 0;
-    /* Assert: inputColumn data columns in the buffer have been processed. */
-    /* Assert: indexp is positioned at start of a field or immediately following buffer contents. */
-    while ((inputColumn <= maxColumnWanted) && (indexp < linelen)) {
+/* Returns 1 iff dtype is a data frame, which requests a data frame result with a type for each column. */
+static int
+is_frame_dtype (SEXP dtype)
+{
+    return inherits (dtype, "data.frame");
+}
 
-	/* Read field. */
-	fstart = indexp;
-	while ((indexp < linelen) && buffer[indexp] != '\t' && buffer[indexp] != '\n') {
-	    indexp++;
-	}
+/* Number of rows sampled to infer the types of the columns of a data frame result. */
+#define FRAME_SAMPLE_ROWS	1000
 
-	/* Insert inputColumn into output matrix if required. */
-	if (inputColumn <= maxColumnWanted) {
-	    outputColumn = columnMap[inputColumn];
-	    if (outputColumn >= 0) {
-		setResult (result, outputColumn*nrows+rowid, buffer+fstart, indexp-fstart);
-	    }
-	}
+/* The R vector type of each column type. */
+static const SEXPTYPE frame_sexptype[] = { LGLSXP, INTSXP, REALSXP, STRSXP };
 
-	if (indexp < linelen) indexp++; /* Advance over field-terminator, if any. */
-	inputColumn++;
-    }
-}
+/* A data frame result (see extract_frame): its column vectors, and the type and state of each column. */
+typedef struct {
+    SEXP columns;	/* List of the column vectors. */
+    int *type;		/* COLTYPE_* of each column. */
+    char *state;	/* COLUMN_* state of each column. */
+} frameResult;
+
+#define COLUMN_READING	0	/* Fields are stored in the column. */
+#define COLUMN_PROMOTED	1	/* The column has been promoted, and must be read again. */
+#define COLUMN_DONE	2	/* The column is complete, and its fields are ignored. */
 
-enum status
-scan_header_line (dynHashTab *dht, FILE *tsvp, int insertall, char *buffer, long buffersize)
+/* Returns a new data frame column of nrows NAs, of type COLTYPE_* type. */
+static SEXP
+new_frame_column (int type, long nrows)
 {
-    long rowlen, linelen, headercols, rowcols, numpats;
-    long indexp;
-    long fstart;
-    char *s;
+    SEXP vec = allocVector (frame_sexptype[type], nrows);
+    long ii;
 
-    /* Determine number of columns on first and second lines. Input header line. */
-    fseek (tsvp, 0L, SEEK_SET);
-    if (!fgets (buffer, buffersize, tsvp)) {
-        error ("unable to read data file header line");
-    }
-    if (!fgets (buffer, buffersize, tsvp)) {
-	/* File contains a header only? */
-        return OK;
-    }
-    rowlen = strlen(buffer);
-    rowcols = num_columns (buffer, rowlen);
-    fseek (tsvp, 0L, SEEK_SET);
-    if (!(s = fgets (buffer, buffersize, tsvp))) {
-        error ("unable to re-read data file header line");
+    for (ii = 0; ii < nrows; ii++) {
+	switch (type) {
+	case COLTYPE_LOGICAL:	LOGICAL(vec)[ii] = NA_LOGICAL; break;
+	case COLTYPE_INTEGER:	INTEGER(vec)[ii] = NA_INTEGER; break;
+	case COLTYPE_DOUBLE:	REAL(vec)[ii] = NA_REAL; break;
+	default:		SET_STRING_ELT (vec, ii, NA_STRING); break;
+	}
     }
-    linelen = strlen (buffer);
-    headercols = num_columns (buffer, linelen);
-
-    #ifdef DEBUG
-        Rprintf ("> scan_header_line: headercols=%ld, rowcols=%d, headerlen=%ld, rowlen=%ld, buffersize=%ld\n",
-	         headercols, rowcols, linelen, rowlen, buffersize);
-    #endif
-
-    numpats = 0;
-    indexp = 0;
-    /* Assert: numpats fields have been inserted into the dht this call. */
-    /* Assert: indexp is positioned at start of a field or immediately following buffer contents. */
-    while (indexp < linelen) {
+    return vec;
+}
 
-	/* Read field (aka pattern). */
-	fstart = indexp;
-	while ((indexp < linelen) && buffer[indexp] != '\t' && buffer[indexp] != '\n') {
-	    indexp++;
+/* Store a field in a data frame.  A field that does not fit the type of its column promotes the
+ * column to the narrowest type that holds it, and the rest of the column's fields are ignored
+ * until it is read again.  This setter calls R, so is not parallel.
+ */
+static int set_result_frame (const resultDest *dest, long idx, const char *s, long n)
+{
+    frameResult *fr = (frameResult *)dest->result;
+    long col = idx / dest->colstep, row = idx % dest->colstep;
+    SEXP vec = VECTOR_ELT (fr->columns, col);
+    int64_t ivalue;
+    int lvalue, type;
+
+    if (fr->state[col] != COLUMN_READING)
+	return FIELD_OK;
+    switch (fr->type[col]) {
+    case COLTYPE_LOGICAL:
+	switch (parse_logical (s, n, &lvalue)) {
+	case NUM_OK:
+	    LOGICAL(vec)[row] = lvalue;
+	    return FIELD_OK;
+	case NUM_NA:
+	    LOGICAL(vec)[row] = NA_LOGICAL;
+	    return FIELD_OK;
 	}
-
-	/* Insert field into dht if not first non-R-style column header. */
-	if ((fstart > 0) || (rowcols != headercols)) {
-	    if (insertall) {
-		insertStrVal (dht, buffer+fstart, indexp-fstart, numpats);
-	    } else {
-		changeStrVal (dht, buffer+fstart, indexp-fstart, numpats);
-	    }
-	    numpats++;
+	break;
+    case COLTYPE_INTEGER:
+	switch (parse_int64 (s, n, &ivalue)) {
+	case NUM_OK:
+	    if (ivalue <= INT_MIN || ivalue > INT_MAX)
+		break;
+	    INTEGER(vec)[row] = (int)ivalue;
+	    return FIELD_OK;
+	case NUM_NA:
+	    if (!is_na_field (s, n))
+		break;
+	    INTEGER(vec)[row] = NA_INTEGER;
+	    return FIELD_OK;
 	}
-
-	if (indexp < linelen) indexp++; /* Advance over field-terminator, if any. */
-    }
-    if (numpats != (rowcols-1)) {
-        error ("scan_header_line: program bug detected: number of patterns (%ld) differs from number of data columns (%ld)\n", numpats, rowcols-1);
+	break;
+    case COLTYPE_DOUBLE:
+	switch (parse_double (s, n, &REAL(vec)[row])) {
+	case NUM_OK:
+	    return FIELD_OK;
+	case NUM_NA:
+	    if (!is_na_field (s, n))
+		break;
+	    REAL(vec)[row] = NA_REAL;
+	    return FIELD_OK;
+	}
+	break;
+    default:
+	/* As read.table does, only NA is NA in a character column: an empty field is an empty string. */
+	SET_STRING_ELT (vec, row, n > 0 && is_na_field (s, n) ? NA_STRING : mkCharLen (s, n));
+	return FIELD_OK;
     }
-    return OK;
+
+    /* Every field fits a character column, so a column is promoted at most three times. */
+    type = field_column_type (s, n);
+    fr->type[col] = type > fr->type[col] ? type : fr->type[col] + 1;
+    fr->state[col] = COLUMN_PROMOTED;
+    return FIELD_OK;
+}
+
+/* Returns the gap between wanted rows of an unmapped data file below which they are read by a single
+ * read: the value of the R option tsvio.readgap if it is set, otherwise READ_GAP.
+ */
+static long
+read_gap (void)
+{
+    SEXP opt = GetOption1 (install ("tsvio.readgap"));
+    double gap;
+
+    if (opt == R_NilValue || length(opt) != 1)
+	return READ_GAP;
+    gap = asReal (opt);
+    if (ISNAN(gap) || gap < 0)
+	return READ_GAP;
+    return gap > LONG_MAX / 2 ? LONG_MAX / 2 : (long)gap;
 }
 
 SEXP
@@ -464,24 +865,6 @@ autoRowPatterns (FILE *indexfile)
     return pats;
 }
 
-void
-closeTsvFiles (long numFiles, FILE **tsvpp, FILE **indexpp)
-{
-    long ii;
-    if (tsvpp) {
-        for (ii = 0; ii < numFiles; ii++)
-	    if (tsvpp[ii])
-	        fclose (tsvpp[ii]);
-	free (tsvpp);
-    }
-    if (indexpp) {
-        for (ii = 0; ii < numFiles; ii++)
-	    if (indexpp[ii])
-	        fclose (indexpp[ii]);
-	free (indexpp);
-    }
-}
-
 SEXP
 dhtToStringVec (const dynHashTab *dht)
 {
@@ -500,357 +883,1846 @@ dhtToStringVec (const dynHashTab *dht)
     return names;
 }
 
-typedef struct {
-    long rowPosn;	/* Byte offset of desired row in file. */
-    long outputRow;	/* Row index of row in destination matrix. */
-} rowInfo_t;
-
-int
-compare_rowInfo_t (const void *a, const void *b)
+static void
+dataset_finalizer (SEXP ptr)
 {
-    const rowInfo_t *ap = (rowInfo_t *)a;
-    const rowInfo_t *bp = (rowInfo_t *)b;
+    tsvDataset *ds = (tsvDataset *)R_ExternalPtrAddr (ptr);
 
-    if (ap->rowPosn < bp->rowPosn) return -1;
-    if (ap->rowPosn > bp->rowPosn) return 1;
-    return 0;
+    if (ds != NULL) {
+	close_dataset (ds);
+	R_ClearExternalPtr (ptr);
+    }
 }
 
-/* Read the contents of one data file and store the results in the destination matrix results.
+/* Returns the dataset referenced by the external pointer ptr.  Signals an error if ptr
+ * is not an open dataset handle.
  */
-void
-getDataFromFile (SEXP results,	    /* Destination matrix. */
-		 setterFunction setResult, /* For setting an element of results */
-		 long NrowResult,   /* Number of rows in destination matrix. */
-		 FILE *indexp,	    /* File descriptor for index file. */
-		 FILE *tsvp,	    /* File descriptor for data file. */
-		 dynHashTab *rowdht,/* DHT containing desired row labels. */
-		 dynHashTab *coldht,/* DHT containing desired column labels. */
-		 char *buffer,	    /* Buffer for (re-)use by this function. */
-		 long buffersize)   /* Number of bytes in buffer. */
+static tsvDataset *
+get_dataset (SEXP ptr, const char *caller)
 {
-    enum status res;
-    long ii, inputColumn, outputColumn;
-    long maxInputColumn, *columnMap;
-    rowInfo_t *rowInfo;
-    long rowsWanted, nrow;
-
-    /* Determine desired rows in this file, and their byte offset in this file. */
-    setAllValues (rowdht, -1L);
-    res = scan_index_file (indexp, rowdht, 0);
-    if (res != OK) {
-	warn ("problem scanning index file, skipping\n");
-	return;
-    }
-    rowsWanted = countNotValues (rowdht, -1L);
-    if (rowsWanted == 0) {
-	warn ("input file matches no desired row labels, skipping\n");
-	return;
-    }
+    tsvDataset *ds = NULL;
 
-    /* Determine desired columns in this file, and their column number in this file. */
-    setAllValues (coldht, -1L);
-    res = scan_header_line (coldht, tsvp, 0, buffer, buffersize);
-    if (res != OK || countNotValues (coldht, -1L) == 0) {
-	warn ("input file matches no desired column labels, skipping\n");
-	return;
-    }
+    if (TYPEOF(ptr) == EXTPTRSXP && R_ExternalPtrTag (ptr) == install ("tsvioDataset"))
+	ds = (tsvDataset *)R_ExternalPtrAddr (ptr);
+    if (ds == NULL)
+        error ("%s: handle is not an open tsvio dataset\n", caller);
+    return ds;
+}
 
-    // That are three column name orders:
-    // 1. Order of names in original request list (no longer available)
-    // 2. Order of names in this tsv file (called inputColumns below)
-    // 3. Order of names in output matrix (called outputColumns below)
+/* Report the problems recorded while opening the data files dataFile of a dataset: the
+ * result res of open_dataset, the file failed that could not be opened, and loads.
+ */
+static void
+report_open_problems (enum status res, long failed, SEXP dataFile, SEXP indexFile, const char *caller, const fileLoad *loads)
+{
+    const fileLoad *load;
+    long ii, numFiles = length(dataFile);
 
-    // We generate here a mapping from the order of columns in this tsv file (input columns)
-    // to the order of columns in the output matrix:  outputColumn == columnMap[inputColumn].
-    // columnMap[inputColumn] == -1L iff inputColumn is not contained in the output matrix.
-    // We make columnMap long enough to contain the largest wanted input column.
-    maxInputColumn = -1L;
-    initIterator (coldht, &ii);
-    while (getNextStr (coldht, &ii, NULL, NULL, NULL, &inputColumn)) {
-	if (inputColumn > maxInputColumn) maxInputColumn = inputColumn;
+    if (res != OK && failed < 0) {
+	error ("%s: unable to allocate dataset\n", caller);
     }
-    columnMap = (long *)R_alloc (maxInputColumn+1, sizeof(long));
-    for (ii = 0; ii <= maxInputColumn; ii++) {
-	columnMap[ii] = -1;
-    }
-    initIterator (coldht, &ii);
-    while (getNextStr (coldht, &ii, NULL, NULL, &outputColumn, &inputColumn)) {
-	if (inputColumn >= 0) {
-	    columnMap[inputColumn] = outputColumn;
-	}
+
+    /* Problems opening the files. */
+    for (ii = 0; ii < numFiles && (res == OK || ii <= failed); ii++) {
+	load = &loads[ii];
+	if (load->created)
+	    warning ("unable to read index file '%s': attempting to create\n", CHAR(STRING_ELT(indexFile,ii)));
+	if (load->temporary)
+	    warning ("unable to create indexfile '%s': try to create a temp file\n", CHAR(STRING_ELT(indexFile,ii)));
+	if (load->openres == OPEN_FAILED)
+	    error ("unable to open datafile '%s' for reading\n", CHAR(STRING_ELT(dataFile,ii)));
+	else if (load->openres == NOT_BGZF)
+	    error ("%s: datafile '%s' is not compressed in BGZF format (use bgzip)\n", caller, CHAR(STRING_ELT(dataFile,ii)));
+	else if (load->openres == WRITE_ERROR)
+	    error ("%s: unable to create even a temporary indexfile\n", caller);
+	else if (load->openres != OK)
+	    error ("%s: unable to allocate memory\n", caller);
     }
 
-    // Scan rows present in this tsv file.
-    // First sort rows into ascending positions within the input file.
-    rowInfo = (rowInfo_t *)R_alloc (rowsWanted, sizeof(rowInfo_t));
-    nrow = 0;
-    initIterator (rowdht, &ii);
-    while (nrow < rowsWanted && getNextStr (rowdht, &ii, NULL, NULL, &rowInfo[nrow].outputRow, &rowInfo[nrow].rowPosn)) {
-	if (rowInfo[nrow].rowPosn >= 0L) {
-	    nrow++;
+    /* Problems loading their indexes and header lines. */
+    for (ii = 0; ii < numFiles && (res == OK || ii <= failed); ii++) {
+	load = &loads[ii];
+	if (load->generate) {
+	    report_genindex_errors (load->genres, (char *)caller, STRING_ELT(dataFile,ii), STRING_ELT(indexFile,ii));
+	}
+	if (load->grown) {
+	    warning ("%s: datafile '%s' has grown: updated indexfile '%s'\n", caller, CHAR(STRING_ELT(dataFile,ii)), CHAR(STRING_ELT(indexFile,ii)));
+	}
+	report_verify_errors (load->verres, (char *)caller, STRING_ELT(dataFile,ii), STRING_ELT(indexFile,ii));
+	if (load->idxres != OK) {
+	    error ("i/o or syntax error %d processing indexfile '%s'\n", load->idxres, CHAR(STRING_ELT(indexFile,ii)));
+	}
+	if (load->hdrres != OK) {
+	    error ("i/o or syntax error scanning header of datafile '%s'\n", CHAR(STRING_ELT(dataFile,ii)));
 	}
     }
-    qsort (rowInfo, rowsWanted, sizeof(rowInfo_t), compare_rowInfo_t);
-    for (nrow = 0; nrow < rowsWanted; nrow++) {
-	get_tsv_fields (results, setResult, NrowResult, rowInfo[nrow].outputRow, tsvp, rowInfo[nrow].rowPosn, maxInputColumn, columnMap, buffer, buffersize);
+    if (res != OK) {
+	error ("%s: unable to allocate memory\n", caller);
     }
 }
 
-SEXP
-tsvGetData (SEXP dataFile, SEXP indexFile, SEXP rowpatterns, SEXP colpatterns, SEXP dtype, SEXP findany)
+/* Open the numeric cache cacheFile of the data file dataFile of df.  A cache that cannot be opened or
+ * that does not match the data file is ignored (with a warning), since the data file can still be parsed.
+ */
+static void
+open_cache_file (tsvDataFile *df, SEXP dataFile, SEXP cacheFile, const char *caller)
 {
-    /* Local variables that must have a defined value before jumping to the exit. */
-    long nprotect = 0;
-    long numFiles = 0;
-    FILE **tsvpp = NULL, **indexpp = NULL;
-    SEXP results = R_NilValue;
-    setterFunction setResult;
+    enum status res = open_data_file_cache (df, CHAR(cacheFile));
+
+    if (res == OPEN_FAILED)
+	warning ("%s: unable to open cachefile '%s': parsing datafile '%s' instead\n", caller, CHAR(cacheFile), CHAR(dataFile));
+    else if (res == STALE_INDEX)
+	warning ("%s: cachefile '%s' does not match datafile '%s': regenerate it using tsvBuildNumericCache\n", caller, CHAR(cacheFile), CHAR(dataFile));
+    else if (res != OK)
+	warning ("%s: i/o or format error %d reading cachefile '%s': parsing datafile '%s' instead\n", caller, res, CHAR(cacheFile), CHAR(dataFile));
+}
+
+/* Open the data files and corresponding index files and return an external pointer to the
+ * resulting dataset.  CacheFile is either R_NilValue or the names of numeric caches of the data
+ * files.  The indexes and header lines of the files are loaded by up to nthreads threads (see
+ * open_dataset).  The dataset is released by close_dataset_SEXP or when the pointer is garbage
+ * collected, including if an error is signalled after it is opened.
+ */
+static SEXP
+open_dataset_SEXP (SEXP dataFile, SEXP indexFile, SEXP cacheFile, int nthreads, const char *caller)
+{
+    SEXP ptr;
+    tsvDataset *ds;
+    fileLoad *loads;
+    const char **dataNames, **indexNames;
+    long numFiles, ii, failed;
+    enum status res;
+    double t;
+
+    numFiles = length(dataFile);
+    if (numFiles == 0) {
+        error ("parameter dataFile cannot be NULL\n");
+    }
+    if (length (dataFile) != length(indexFile)) {
+        error ("parameters dataFile and indexFile must have the same length\n");
+    }
+    if (cacheFile != R_NilValue && length (cacheFile) != length(dataFile)) {
+        error ("parameters dataFile and cacheFile must have the same length\n");
+    }
+
+    dataNames = (const char **)R_alloc (numFiles, sizeof(const char *));
+    indexNames = (const char **)R_alloc (numFiles, sizeof(const char *));
+    for (ii = 0; ii < numFiles; ii++) {
+	dataNames[ii] = CHAR(STRING_ELT(dataFile,ii));
+	indexNames[ii] = CHAR(STRING_ELT(indexFile,ii));
+    }
+    loads = (fileLoad *)R_alloc (numFiles, sizeof(fileLoad));
+    STATS_START (t);
+    res = open_dataset (numFiles, dataNames, indexNames, nthreads, &ds, loads, &failed);
+    STATS_STOP (PHASE_OPEN, t);
+
+    /* Once opened, the dataset belongs to the pointer, so the problems can be reported safely. */
+    PROTECT (ptr = R_MakeExternalPtr (ds, install ("tsvioDataset"), R_NilValue));
+    R_RegisterCFinalizerEx (ptr, dataset_finalizer, TRUE);
+    report_open_problems (res, failed, dataFile, indexFile, caller, loads);
+
+    if (cacheFile != R_NilValue) {
+	for (ii = 0; ii < numFiles; ii++) {
+	    open_cache_file (&ds->files[ii], STRING_ELT(dataFile,ii), STRING_ELT(cacheFile,ii), caller);
+	}
+    }
+
+    UNPROTECT (1);
+    return ptr;
+}
+
+/* Release the dataset referenced by ptr. */
+static void
+close_dataset_SEXP (SEXP ptr)
+{
+    dataset_finalizer (ptr);
+}
+
+/* Returns all row labels in all files of ds, in order of first occurrence. */
+static dynHashTab *
+get_all_rows (tsvDataset *ds)
+{
+    dynHashTab *rows;
+    long failed;
+    enum status res;
+
+    if ((res = dataset_all_rows (ds, &rows, &failed)) != OK) {
+	error ("i/o or syntax error %d processing indexfile %ld\n", res, failed+1);
+    }
+    return rows;
+}
+
+/* Returns the row patterns of a query of ds: if rowpatterns is a key selector, the labels in any
+ * file of ds that it selects, in ascending order, otherwise rowpatterns as a character vector.
+ */
+static SEXP
+row_patterns (const tsvDataset *ds, SEXP rowpatterns)
+{
+    keySelector ks;
+    dynHashTab *keys;
+    long ii;
 
-    /* Other local variables (exit code will not clean up). */
+    if (!get_key_selector (rowpatterns, &ks))
+	return AS_CHARACTER(rowpatterns);
+    if ((keys = newDynHashTab (1024, DHT_STRDUP)) == NULL)
+	error ("unable to allocate memory for selected keys\n");
+    for (ii = 0; ii < ds->numFiles; ii++) {
+	select_keys (&ks, ds->files[ii].idx, ds->files[ii].rowdht, keys);
+    }
+    /* An empty result would otherwise select every row. */
+    if (dhtNumStrings (keys) == 0) {
+	freeDynHashTab (keys);
+	error ("no matching rows found\n");
+    }
+    return sorted_keys (keys);
+}
+
+/* Extract the rows in rowdht and the columns in coldht of nfiles data files into dest (see
+ * getDataFromFiles), and signal the warnings and error (if any) corresponding to the problems found.
+ */
+static void
+extract_files (const resultDest *dest, const tsvDataFile *files, long nfiles, const dynHashTab *rowdht,
+	       const dynHashTab *coldht, char *buffer, int nthreads)
+{
+    parseProblem prob;
+    char *skipped;
+    long ii, failed;
+    enum status res;
+    double t;
+
+    skipped = R_alloc (nfiles, sizeof(char));
+    STATS_START (t);
+    res = getDataFromFiles (dest, files, nfiles, rowdht, coldht, buffer, LINEBUFFERSIZE, nthreads, read_gap (),
+			    skipped, &prob, &failed);
+    STATS_STOP (PHASE_EXTRACT, t);
+    if (res == OUT_OF_MEMORY) {
+	if (failed >= 0)
+	    error ("unable to allocate memory to read datafile '%s'\n", files[failed].dataName);
+	error ("unable to allocate memory to read datafiles\n");
+    }
+    for (ii = 0; ii < nfiles; ii++) {
+	if (skipped[ii] == SKIP_NO_ROWS)
+	    warn ("input file matches no desired row labels, skipping\n");
+	else if (skipped[ii] == SKIP_NO_COLS)
+	    warn ("input file matches no desired column labels, skipping\n");
+    }
+    report_parse_problem (&prob);
+}
+
+/* Create a hash table of the labels in patterns that are also in all, in pattern order.
+ * The strings in the new table belong to patterns.
+ */
+static dynHashTab *
+matching_labels (SEXP patterns, const tsvDataset *ds, const dynHashTab *all)
+{
+    dynHashTab *dht;
+    const char *str;
+    long ii, len;
+
+    dht = newDynHashTab (length(patterns)*2 + 1, 0);
+    for (ii = 0; ii < length(patterns); ii++) {
+	str = CHAR(STRING_ELT(patterns,ii));
+	len = strlen (str);
+	if (all ? getStringIndex (all, str, len) >= 0 : dataset_has_row (ds, str, len)) {
+	    insertStr (dht, str, len);
+	}
+    }
+    if (dhtFailed (dht)) {
+	freeDynHashTab (dht);
+	error ("unable to allocate memory for labels\n");
+    }
+    return dht;
+}
+
+/* Signal an error if any data file of ds has changed since it was opened. */
+static void
+check_dataset_unchanged (tsvDataset *ds, const char *caller)
+{
+    long failed;
+
+    if (dataset_unchanged (ds, &failed) != OK) {
+	error ("%s: datafile '%s' has changed since it was opened\n", caller, ds->files[failed].dataName);
+    }
+}
+
+/* Determine the rows and columns of a query of ds.  *Rowdhtp is set to the labels matching
+ * rowpatterns, or to all rows of ds if rowpatterns is empty, and *coldhtp likewise.  The tables
+ * must be freed by the caller iff the corresponding patterns are not empty.  The strings in
+ * the tables belong to the patterns or to ds.
+ */
+static void
+select_labels (tsvDataset *ds, SEXP rowpatterns, SEXP colpatterns, SEXP findany, const char *caller,
+	       dynHashTab **rowdhtp, dynHashTab **coldhtp)
+{
     long NrowPattern, NrowResult;
     long NcolPattern, NcolResult;
+    dynHashTab *rowdht, *coldht;
+    double t;
+
+    /* Determine the rows of the result. */
+    STATS_START (t);
+    NrowPattern = length(rowpatterns);
+    rowdht = NrowPattern == 0 ? get_all_rows (ds) : matching_labels (rowpatterns, ds, NULL);
+    NrowResult = dhtNumStrings (rowdht);
+#ifdef DEBUG
+    Rprintf ("  %s: found %d row matches\n", caller, NrowResult);
+#endif
+    if (NrowResult == 0 || (NrowResult != NrowPattern && NrowPattern > 0 && !LOGICAL(findany)[0])) {
+	if (NrowPattern > 0) freeDynHashTab (rowdht);
+	if (NrowResult == 0)
+	    error ("%s: no matching rows found\n", caller);
+	else
+	    error ("%s: not all required row patterns were matched\n", caller);
+    }
+
+    /* Determine the columns of the result. */
+    NcolPattern = length(colpatterns);
+    coldht = NcolPattern == 0 ? ds->cols : matching_labels (colpatterns, ds, ds->cols);
+    NcolResult = dhtNumStrings (coldht);
+#ifdef DEBUG
+    Rprintf ("  %s: found %d col matches\n", caller, NcolResult);
+#endif
+    if (NcolResult == 0 || (NcolResult != NcolPattern && NcolPattern > 0 && !LOGICAL(findany)[0])) {
+	if (NrowPattern > 0) freeDynHashTab (rowdht);
+	if (NcolPattern > 0) freeDynHashTab (coldht);
+	if (NcolResult == 0)
+	    error ("%s: no matching cols found\n", caller);
+	else
+	    error ("%s: not all required col patterns were matched\n", caller);
+    }
+
+    *rowdhtp = rowdht;
+    *coldhtp = coldht;
+    STATS_STOP (PHASE_SELECT, t);
+}
+
+/* Add dimensions and the row and column names in rowdht and coldht to the result of dest. */
+static SEXP
+label_matrix (SEXP results, const dynHashTab *rowdht, const dynHashTab *coldht, const resultDest *dest)
+{
     SEXP dimnames;
-    long ii;
+    double t;
+
+    STATS_START (t);
+    PROTECT (results = add_dims (results, dhtNumStrings (rowdht), dhtNumStrings (coldht)));
+    PROTECT (dimnames = allocVector (VECSXP, 2));
+    SET_VECTOR_ELT(dimnames, 0, dhtToStringVec (rowdht));
+    SET_VECTOR_ELT(dimnames, 1, dhtToStringVec (coldht));
+    setAttrib (results, R_DimNamesSymbol, dimnames);
+    if (dest->set == set_result_int64) {
+	setAttrib (results, R_ClassSymbol, mkString ("integer64"));
+    }
+    STATS_STOP (PHASE_RESULT, t);
+    UNPROTECT (2);
+    return results;
+}
+
+/* Extract the rows in rowdht and the columns in coldht from an open dataset as a data frame.
+ * The type of each column is first inferred from a sample of up to FRAME_SAMPLE_ROWS rows, spread
+ * evenly through the result, and the fields are then parsed straight into column vectors of those
+ * types.  A column with a field that does not fit its type is promoted to a wider type, and read again
+ * in full, so that it holds the fields' text (if character) rather than values converted from its
+ * narrower type, and treats empty fields alike wherever they occur.
+ */
+static SEXP
+extract_frame (tsvDataset *ds, const dynHashTab *rowdht, const dynHashTab *coldht, int nthreads)
+{
+    SEXP results;
+    resultDest dest;
+    frameResult fr;
+    dynHashTab *sample;
+    parseProblem prob;
+    const char *str;
+    long NrowResult = dhtNumStrings (rowdht);
+    long NcolResult = dhtNumStrings (coldht);
+    long jj, iter, len, order, stride, failed, npromoted;
     enum status res;
-    char *buffer;
-#ifdef _WIN32
-    char tmpname[] = "tmpXXXXXX";
-    char tmpname2[10];
-    int rez;
-#else
-    char tmpname[] = "/tmp/tsvindex-XXXXXX";
+    double t;
+
+    fr.type = (int *)R_alloc (NcolResult + 1, sizeof(int));
+    fr.state = R_alloc (NcolResult + 1, sizeof(char));
+    for (jj = 0; jj < NcolResult; jj++) {
+	fr.type[jj] = COLTYPE_LOGICAL;
+	fr.state[jj] = COLUMN_READING;
+    }
+
+    /* Infer the column types from the sample. */
+    stride = (NrowResult + FRAME_SAMPLE_ROWS - 1) / FRAME_SAMPLE_ROWS;
+    sample = newDynHashTab (2 * (NrowResult / stride) + 3, 0);
+    initIterator (rowdht, &iter);
+    while (getNextStr (rowdht, &iter, &str, &len, &order, NULL)) {
+	if (order % stride == 0)
+	    insertStr (sample, str, len);
+    }
+    if (dhtFailed (sample)) {
+	freeDynHashTab (sample);
+	error ("unable to allocate memory for labels\n");
+    }
+    dest.result = NULL;
+    dest.ivec = fr.type;
+    dest.dvec = NULL;
+    dest.lvec = NULL;
+    dest.fvec = NULL;
+    dest.rowstep = 1;
+    dest.colstep = dhtNumStrings (sample);
+    dest.set = set_column_type;
+    dest.parallel = 0;
+    STATS_START (t);
+    res = getDataFromFiles (&dest, ds->files, ds->numFiles, sample, coldht, ds->buffer, LINEBUFFERSIZE, nthreads,
+			    read_gap (), NULL, &prob, &failed);
+    STATS_STOP (PHASE_EXTRACT, t);
+    freeDynHashTab (sample);
+    if (res == OUT_OF_MEMORY)
+	error ("unable to allocate memory to read datafiles\n");
+    /* Problems reading the sample are reported when the rows are read again below. */
+
+    /* Allocate the columns, all NA, since cells in no file are not set. */
+    PROTECT (fr.columns = allocVector (VECSXP, NcolResult));
+    for (jj = 0; jj < NcolResult; jj++) {
+	SET_VECTOR_ELT (fr.columns, jj, new_frame_column (fr.type[jj], NrowResult));
+    }
+    dest.result = &fr;
+    dest.ivec = NULL;
+    dest.colstep = NrowResult;
+    dest.set = set_result_frame;
+    extract_files (&dest, ds->files, ds->numFiles, rowdht, coldht, ds->buffer, nthreads);
+
+    /* Read the promoted columns again, until no column is promoted.  Only the promoted columns are
+     * stored, and the warnings were given when the rows were first read.
+     */
+    do {
+	npromoted = 0;
+	for (jj = 0; jj < NcolResult; jj++) {
+	    if (fr.state[jj] == COLUMN_PROMOTED) {
+		SET_VECTOR_ELT (fr.columns, jj, new_frame_column (fr.type[jj], NrowResult));
+		fr.state[jj] = COLUMN_READING;
+		npromoted++;
+	    } else {
+		fr.state[jj] = COLUMN_DONE;
+	    }
+	}
+	if (npromoted > 0) {
+	    STATS_START (t);
+	    res = getDataFromFiles (&dest, ds->files, ds->numFiles, rowdht, coldht, ds->buffer, LINEBUFFERSIZE, nthreads,
+				    read_gap (), NULL, &prob, &failed);
+	    STATS_STOP (PHASE_EXTRACT, t);
+	    if (res == OUT_OF_MEMORY)
+		error ("unable to allocate memory to read datafiles\n");
+	    prob.eofRow = -1L;
+	    report_parse_problem (&prob);
+	}
+    } while (npromoted > 0);
+
+    STATS_START (t);
+    results = fr.columns;
+    setAttrib (results, R_NamesSymbol, dhtToStringVec (coldht));
+    setAttrib (results, R_RowNamesSymbol, dhtToStringVec (rowdht));
+    setAttrib (results, R_ClassSymbol, mkString ("data.frame"));
+    STATS_STOP (PHASE_RESULT, t);
+    UNPROTECT (1);
+    return results;
+}
+
+/* Extract the matrix of the rows in rowdht and the columns in coldht from an open dataset,
+ * as a matrix of the same type as dtype, or as a data frame if dtype is a data frame.
+ */
+static SEXP
+extract_matrix (tsvDataset *ds, const dynHashTab *rowdht, const dynHashTab *coldht, SEXP dtype, int nthreads)
+{
+    SEXP results;
+    resultDest dest;
+    long NrowResult = dhtNumStrings (rowdht);
+    long NcolResult = dhtNumStrings (coldht);
+
+    if (is_frame_dtype (dtype))
+	return extract_frame (ds, rowdht, coldht, nthreads);
+
+    /* Allocate space for result. */
+    PROTECT (results = allocVector(TYPEOF(dtype), NrowResult*NcolResult));
+    init_result_dest (&dest, results, dtype, NrowResult);
+    extract_files (&dest, ds->files, ds->numFiles, rowdht, coldht, ds->buffer, nthreads);
+
+    results = label_matrix (results, rowdht, coldht, &dest);
+    UNPROTECT (1);
+    return results;
+}
+
+/* Extract the matrix of the given rows and columns from an open dataset. */
+static SEXP
+query_dataset_SEXP (tsvDataset *ds, SEXP rowpatterns, SEXP colpatterns, SEXP dtype, SEXP findany, SEXP threads, const char *caller)
+{
+    SEXP results;
+    dynHashTab *rowdht, *coldht;
+
+    PROTECT (rowpatterns = row_patterns (ds, rowpatterns));
+    PROTECT (colpatterns = AS_CHARACTER(colpatterns));
+    PROTECT (findany = AS_LOGICAL(findany));
+    PROTECT (threads = AS_INTEGER(threads));
+
+    if (get_result_setter (dtype) == NULL && !is_frame_dtype (dtype)) {
+        error ("unable to directly load data matrices of type dtype");
+    }
+    if (length(threads) != 1 || INTEGER(threads)[0] == NA_INTEGER) {
+        error ("parameter threads must be a single integer");
+    }
+
+    check_dataset_unchanged (ds, caller);
+    select_labels (ds, rowpatterns, colpatterns, findany, caller, &rowdht, &coldht);
+    PROTECT (results = extract_matrix (ds, rowdht, coldht, dtype, INTEGER(threads)[0]));
+
+    if (length(rowpatterns) > 0) freeDynHashTab (rowdht);
+    if (length(colpatterns) > 0) freeDynHashTab (coldht);
+    UNPROTECT (5);
+    return results;
+}
+
+SEXP
+tsvGetData (SEXP dataFile, SEXP indexFile, SEXP rowpatterns, SEXP colpatterns, SEXP dtype, SEXP findany, SEXP threads, SEXP cacheFile)
+{
+    SEXP ds, results;
+
+#ifdef DEBUG
+    Rprintf ("> tsvGetData\n");
+#endif
+    stats_begin ("tsvGetData");
+
+    /* Convert, if necessary, data into expected format. */
+    PROTECT (dataFile = AS_CHARACTER(dataFile));
+    PROTECT (indexFile = AS_CHARACTER(indexFile));
+    if (cacheFile != R_NilValue) cacheFile = AS_CHARACTER(cacheFile);
+    PROTECT (cacheFile);
+
+    if (get_result_setter (dtype) == NULL && !is_frame_dtype (dtype)) {
+        error ("unable to directly load data matrices of type dtype");
+    }
+
+    PROTECT (ds = open_dataset_SEXP (dataFile, indexFile, cacheFile, asInteger (threads), "tsvGetData"));
+    PROTECT (results = query_dataset_SEXP (get_dataset (ds, "tsvGetData"), rowpatterns, colpatterns, dtype, findany, threads, "tsvGetData"));
+    close_dataset_SEXP (ds);
+
+#ifdef DEBUG
+    Rprintf ("< tsvGetData\n");
+#endif
+    stats_end ();
+    UNPROTECT (5);
+    return results;
+}
+
+SEXP
+tsvOpen (SEXP dataFile, SEXP indexFile, SEXP cacheFile, SEXP threads)
+{
+    SEXP ds;
+
+    PROTECT (dataFile = AS_CHARACTER(dataFile));
+    PROTECT (indexFile = AS_CHARACTER(indexFile));
+    if (cacheFile != R_NilValue) cacheFile = AS_CHARACTER(cacheFile);
+    PROTECT (cacheFile);
+    PROTECT (threads = AS_INTEGER(threads));
+    if (length(threads) != 1 || INTEGER(threads)[0] == NA_INTEGER) {
+        error ("parameter threads must be a single integer");
+    }
+    stats_begin ("tsvOpen");
+    ds = open_dataset_SEXP (dataFile, indexFile, cacheFile, INTEGER(threads)[0], "tsvOpen");
+    stats_end ();
+    UNPROTECT (4);
+    return ds;
+}
+
+SEXP
+tsvQuery (SEXP handle, SEXP rowpatterns, SEXP colpatterns, SEXP dtype, SEXP findany, SEXP threads)
+{
+    SEXP results;
+
+    stats_begin ("tsvQuery");
+    results = query_dataset_SEXP (get_dataset (handle, "tsvQuery"), rowpatterns, colpatterns, dtype, findany, threads, "tsvQuery");
+    stats_end ();
+    return results;
+}
+
+/* A query of a batch (see batch_query_dataset): its labels, its result, and its wanted columns in
+ * the data file being read.
+ */
+typedef struct {
+    dynHashTab *rowdht, *coldht;	/* Labels of result, as returned by select_labels. */
+    int ownRows, ownCols;		/* Iff set, rowdht (coldht) must be freed. */
+    resultDest dest;			/* Result of query. */
+    long ncols;				/* Number of wanted columns in current data file. */
+    long *inputColumn;			/* Input column of each wanted column. */
+    long *outputColumn;			/* Result column of each wanted column. */
+} batchQuery;
+
+/* A row of the result of a query of a batch, and its location in the data file being read. */
+typedef struct {
+    long rowPosn;	/* Byte offset of row in file. */
+    long rowLen;	/* Length of row excluding its newline, or -1L if unknown. */
+    long query;		/* Index of query. */
+    long outputRow;	/* Row index of row in result of query. */
+} batchRow;
+
+static int
+compare_batchRow (const void *a, const void *b)
+{
+    const batchRow *ap = (const batchRow *)a;
+    const batchRow *bp = (const batchRow *)b;
+
+    if (ap->rowPosn != bp->rowPosn) return ap->rowPosn < bp->rowPosn ? -1 : 1;
+    if (ap->query != bp->query) return ap->query < bp->query ? -1 : 1;
+    return 0;
+}
+
+/* Find the fields of input columns 0 to maxColumn of a data line (which starts with its label).
+ * Field c is from line+start[c] up to line+end[c].  Returns the number of fields found.
+ */
+static long
+split_fields (const char *line, long linelen, long maxColumn, long *start, long *end)
+{
+    long indexp = 0;
+    long nfields = 0;
+
+    /* Advance over first column (row header) and its terminator. */
+    while ((indexp < linelen) && line[indexp] != '\t' && line[indexp] != '\n') {
+	indexp++;
+    }
+    if (indexp < linelen) indexp++;
+
+    while ((nfields <= maxColumn) && (indexp < linelen)) {
+	start[nfields] = indexp;
+	while ((indexp < linelen) && line[indexp] != '\t' && line[indexp] != '\n') {
+	    indexp++;
+	}
+	end[nfields++] = indexp;
+	if (indexp < linelen) indexp++; /* Advance over field-terminator, if any. */
+    }
+    return nfields;
+}
+
+/* Store the wanted fields of a line, split by split_fields, in row outputRow of the result of q.
+ * Returns FIELD_OK, or the problem (recorded in prob) with the first field that could not be stored.
+ */
+static int
+scatter_fields (const batchQuery *q, long outputRow, const char *line, const long *start, const long *end,
+		long nfields, long rowposn, parseProblem *prob)
+{
+    long kk, col, ncells = 0;
+    int code;
+
+    for (kk = 0; kk < q->ncols; kk++) {
+	col = q->inputColumn[kk];
+	if (col >= nfields)
+	    continue;
+	code = q->dest.set (&q->dest, q->outputColumn[kk]*q->dest.colstep + outputRow*q->dest.rowstep, line+start[col], end[col]-start[col]);
+	if (code != FIELD_OK)
+	    return record_parse_problem (prob, code, rowposn, line+start[col], end[col]-start[col]);
+	ncells++;
+    }
+    STATS_COUNT (STAT_CELLS, ncells);
+    return FIELD_OK;
+}
+
+/* Read the rows of one data file wanted by any query of a batch, and store their fields in the
+ * results of all the queries that want them.  Allrows contains the row labels of every query.
+ * Each wanted row is located and read once, in file order, however many queries want it.
+ */
+static void
+getBatchFromFile (batchQuery *queries, long nqueries, const tsvDataFile *df, const dynHashTab *allrows,
+		  char *buffer, long buffersize, int nthreads)
+{
+    batchQuery *q;
+    batchRow *rows;
+    long *rowPosn, *rowLen, *group, *start, *end, *plan, *planLen;
+    long ii, qq, gg, tt, iter, len, order, inputColumn, outputColumn;
+    long nrows, ngroups, maxInputColumn, nfields, linelen, nckpt;
+    long nchunks, cc;
+    const uint32_t *ckpt;
+    const char *str, *line;
+    char *copy;
+    int parallel, byRuns, code, skip, found;
+    lineReader lr;
+    parseProblem *prob;
+    double t;
+
+    /* Locate each wanted row in this file once. */
+    rowPosn = (long *)R_alloc (dhtNumStrings (allrows) + 1, sizeof(long));
+    rowLen = (long *)R_alloc (dhtNumStrings (allrows) + 1, sizeof(long));
+    initIterator (allrows, &iter);
+    while (getNextStr (allrows, &iter, &str, &len, &order, NULL)) {
+	rowPosn[order] = data_file_row (df, str, len, &ckpt, &nckpt, &rowLen[order]);
+    }
+
+    /* Map the wanted columns of each query to the columns of this file.  Numeric queries are
+     * answered from the numeric cache of the file, if it has one.
+     */
+    maxInputColumn = -1L;
+    parallel = df->data.how == MAPPED_MMAP;
+    nrows = 0;
+    for (qq = 0; qq < nqueries; qq++) {
+	q = &queries[qq];
+	q->ncols = 0;
+	if (q->dest.set == NULL) /* A data frame query is answered separately. */
+	    continue;
+	if (df->cache != NULL && q->dest.set == set_result_num) {
+	    if (getDataFromCache (&q->dest, df, q->rowdht, q->coldht, &skip) != OK)
+		error ("unable to allocate memory to read datafile '%s'\n", df->dataName);
+	    if (skip == SKIP_NO_ROWS)
+		warn ("input file matches no desired row labels, skipping\n");
+	    else if (skip == SKIP_NO_COLS)
+		warn ("input file matches no desired column labels, skipping\n");
+	    continue;
+	}
+	/* Warn of a file that contributes nothing to a query, as extract_files does. */
+	found = 0;
+	initIterator (q->rowdht, &iter);
+	while (!found && getNextStr (q->rowdht, &iter, &str, &len, NULL, NULL)) {
+	    found = rowPosn[getStringIndex (allrows, str, len)] >= 0;
+	}
+	if (!found) {
+	    warn ("input file matches no desired row labels, skipping\n");
+	    continue;
+	}
+	q->inputColumn = (long *)R_alloc (dhtNumStrings (q->coldht) + 1, sizeof(long));
+	q->outputColumn = (long *)R_alloc (dhtNumStrings (q->coldht) + 1, sizeof(long));
+	initIterator (q->coldht, &iter);
+	while (getNextStr (q->coldht, &iter, &str, &len, &outputColumn, NULL)) {
+	    if ((inputColumn = data_file_column (df, str, len)) >= 0) {
+		q->inputColumn[q->ncols] = inputColumn;
+		q->outputColumn[q->ncols++] = outputColumn;
+		if (inputColumn > maxInputColumn) maxInputColumn = inputColumn;
+	    }
+	}
+	if (q->ncols == 0) {
+	    warn ("input file matches no desired column labels, skipping\n");
+	} else {
+	    nrows += dhtNumStrings (q->rowdht);
+	    if (!q->dest.parallel) parallel = 0;
+	}
+    }
+    if (maxInputColumn < 0)
+	return;
+
+    /* Gather the rows of all queries in this file, and sort them into file order. */
+    rows = (batchRow *)R_alloc (nrows + 1, sizeof(batchRow));
+    nrows = 0;
+    for (qq = 0; qq < nqueries; qq++) {
+	q = &queries[qq];
+	if (q->ncols == 0)
+	    continue;
+	initIterator (q->rowdht, &iter);
+	while (getNextStr (q->rowdht, &iter, &str, &len, &order, NULL)) {
+	    ii = getStringIndex (allrows, str, len);
+	    rows[nrows].rowPosn = rowPosn[ii];
+	    rows[nrows].rowLen = rowLen[ii];
+	    if (rows[nrows].rowPosn >= 0) {
+		rows[nrows].query = qq;
+		rows[nrows++].outputRow = order;
+	    }
+	}
+    }
+    if (nrows == 0)
+	return;
+    qsort (rows, nrows, sizeof(batchRow), compare_batchRow);
+
+    /* Group the rows by their position in the file: group[g] is the first row of the g'th line read. */
+    group = (long *)R_alloc (nrows + 1, sizeof(long));
+    ngroups = 0;
+    for (ii = 0; ii < nrows; ii++) {
+	if (ii == 0 || rows[ii].rowPosn != rows[ii-1].rowPosn)
+	    group[ngroups++] = ii;
+    }
+    group[ngroups] = nrows;
+
+    /* As in add_row_tasks, lines parsed in place from a mapped file into numeric matrices are
+     * divided into chunks that are parsed concurrently.
+     */
+    nthreads = parallel ? resolve_threads (nthreads) : 1;
+    nchunks = nthreads > 1 ? ngroups / MIN_ROWS_PER_CHUNK : 1;
+    if (nchunks > 4*nthreads) nchunks = 4*nthreads;
+    if (nchunks < 1) nchunks = 1;
+    prob = (parseProblem *)R_alloc (nchunks, sizeof(parseProblem));
+    start = (long *)R_alloc (nchunks * (maxInputColumn + 1), sizeof(long));
+    end = (long *)R_alloc (nchunks * (maxInputColumn + 1), sizeof(long));
+
+    /* Lines of a file read via stdio are read in runs of nearby lines, as in getRowsByRuns. */
+    byRuns = df->data.how != MAPPED_MMAP && df->bgzf == NULL;
+    if (byRuns) {
+	plan = (long *)R_alloc (ngroups + 1, sizeof(long));
+	planLen = (long *)R_alloc (ngroups + 1, sizeof(long));
+	for (gg = 0; gg < ngroups; gg++) {
+	    plan[gg] = rows[group[gg]].rowPosn;
+	    planLen[gg] = rows[group[gg]].rowLen;
+	}
+	init_line_reader (&lr, df->tsvp, plan, planLen, ngroups, read_gap (), mean_row_length (df));
+    }
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads) private(gg, tt, line, linelen, copy, nfields, code, t) if(nchunks > 1)
 #endif
-    int tmpfd;
+    for (cc = 0; cc < nchunks; cc++) {
+	long *cstart = start + cc * (maxInputColumn + 1);
+	long *cend = end + cc * (maxInputColumn + 1);
+
+	init_parse_problem (&prob[cc]);
+	for (gg = cc*ngroups/nchunks; gg < (cc+1)*ngroups/nchunks; gg++) {
+	    STATS_START (t);
+	    if (byRuns)
+		code = get_planned_line (&lr, gg, &line, &linelen, &copy, &prob[cc]);
+	    else
+		code = get_data_line (df->tsvp, &df->data, df->bgzf, rows[group[gg]].rowPosn, rows[group[gg]].rowLen,
+				      NULL, 0, buffer, buffersize, &line, &linelen, &copy, &prob[cc]);
+	    if (code != FIELD_OK)
+		break;
+	    STATS_STOP (PHASE_READ, t);
+	    STATS_COUNT (STAT_ROWS, 1);
+	    STATS_START (t);
+	    nfields = split_fields (line, linelen, maxInputColumn, cstart, cend);
+	    for (tt = group[gg]; tt < group[gg+1] && code == FIELD_OK; tt++) {
+		code = scatter_fields (&queries[rows[tt].query], rows[tt].outputRow, line, cstart, cend, nfields,
+				       rows[tt].rowPosn, &prob[cc]);
+	    }
+	    STATS_STOP (PHASE_PARSE, t);
+	    free (copy);
+	    if (code != FIELD_OK)
+		break;
+	}
+    }
+    if (byRuns) free_line_reader (&lr);
+
+    /* Report the first problem (in file order). */
+    for (cc = 0; cc < nchunks; cc++) {
+	report_parse_problem (&prob[cc]);
+    }
+}
+
+/* The tables of a batch (see batch_query_dataset).  They are held by an external pointer, so that
+ * its finalizer frees them if the batch is interrupted by an error.
+ */
+typedef struct {
+    batchQuery *queries;	/* Queries of the batch. */
+    long nqueries;		/* Number of queries whose labels have been selected. */
+    dynHashTab *allrows;	/* Rows of all queries, or NULL. */
+} batchTables;
+
+static void
+batch_finalizer (SEXP ptr)
+{
+    batchTables *bt = (batchTables *)R_ExternalPtrAddr (ptr);
+    long qq;
+
+    if (bt != NULL) {
+	for (qq = 0; qq < bt->nqueries; qq++) {
+	    if (bt->queries[qq].ownRows) freeDynHashTab (bt->queries[qq].rowdht);
+	    if (bt->queries[qq].ownCols) freeDynHashTab (bt->queries[qq].coldht);
+	}
+	if (bt->allrows) freeDynHashTab (bt->allrows);
+	free (bt->queries);
+	free (bt);
+	R_ClearExternalPtr (ptr);
+    }
+}
+
+/* Answer a batch of queries of an open dataset with a single pass over each data file.  Queries is a
+ * list whose elements are lists of rowpatterns, colpatterns (default all columns), and dtype (default
+ * string), as for query_dataset.  Queries with a data frame dtype are answered separately, after the
+ * pass, since their column types are inferred from their own rows.  Returns a list of the results of
+ * the queries, with the names of queries.
+ */
+static SEXP
+batch_query_dataset (tsvDataset *ds, SEXP queries, SEXP findany, SEXP threads, const char *caller)
+{
+    SEXP results, prot, ptr, query, rowpatterns, colpatterns, dtype;
+    batchTables *bt;
+    batchQuery *bq;
+    dynHashTab *allrows;
+    const char *str;
+    long nqueries, qq, ii, iter, len;
+    double t;
+
+    PROTECT (findany = AS_LOGICAL(findany));
+    PROTECT (threads = AS_INTEGER(threads));
+    if (TYPEOF(queries) != VECSXP) {
+        error ("%s: queries must be a list\n", caller);
+    }
+    if (length(threads) != 1 || INTEGER(threads)[0] == NA_INTEGER) {
+        error ("parameter threads must be a single integer");
+    }
+    check_dataset_unchanged (ds, caller);
+
+    /* Check every query before selecting the labels of any. */
+    nqueries = length(queries);
+    PROTECT (prot = allocVector (VECSXP, 3 * nqueries));
+    for (qq = 0; qq < nqueries; qq++) {
+	query = VECTOR_ELT (queries, qq);
+	if (TYPEOF(query) != VECSXP || length(query) < 1 || length(query) > 3) {
+	    error ("%s: query %ld must be a list of rowpatterns, colpatterns and dtype\n", caller, qq+1);
+	}
+	SET_VECTOR_ELT (prot, 3*qq, row_patterns (ds, VECTOR_ELT (query, 0)));
+	SET_VECTOR_ELT (prot, 3*qq+1, length(query) > 1 ? AS_CHARACTER(VECTOR_ELT (query, 1)) : allocVector (STRSXP, 0));
+	SET_VECTOR_ELT (prot, 3*qq+2, dtype = length(query) > 2 ? VECTOR_ELT (query, 2) : mkString (""));
+	if (get_result_setter (dtype) == NULL && !is_frame_dtype (dtype)) {
+	    error ("%s: unable to directly load data matrices of the dtype of query %ld\n", caller, qq+1);
+	}
+    }
+
+    /* Determine the labels of each query, and allocate its result. */
+    bt = (batchTables *)calloc (1, sizeof(batchTables));
+    if (bt == NULL) error ("%s: unable to allocate memory for queries\n", caller);
+    PROTECT (ptr = R_MakeExternalPtr (bt, install ("tsvioBatch"), R_NilValue));
+    R_RegisterCFinalizerEx (ptr, batch_finalizer, TRUE);
+    bt->queries = bq = (batchQuery *)calloc (nqueries + 1, sizeof(batchQuery));
+    if (bq == NULL) error ("%s: unable to allocate memory for queries\n", caller);
+    PROTECT (results = allocVector (VECSXP, nqueries));
+    for (qq = 0; qq < nqueries; qq++) {
+	rowpatterns = VECTOR_ELT (prot, 3*qq);
+	colpatterns = VECTOR_ELT (prot, 3*qq+1);
+	dtype = VECTOR_ELT (prot, 3*qq+2);
+	select_labels (ds, rowpatterns, colpatterns, findany, caller, &bq[qq].rowdht, &bq[qq].coldht);
+	bq[qq].ownRows = length(rowpatterns) > 0;
+	bq[qq].ownCols = length(colpatterns) > 0;
+	bt->nqueries = qq + 1;
+	if (is_frame_dtype (dtype))
+	    continue;
+	SET_VECTOR_ELT (results, qq, allocVector (TYPEOF(dtype), dhtNumStrings (bq[qq].rowdht) * dhtNumStrings (bq[qq].coldht)));
+	init_result_dest (&bq[qq].dest, VECTOR_ELT (results, qq), dtype, dhtNumStrings (bq[qq].rowdht));
+    }
+
+    /* Collect the union of the rows of all queries, then read each file once. */
+    bt->allrows = allrows = newDynHashTab (1024, 0);
+    for (qq = 0; qq < nqueries; qq++) {
+	if (bq[qq].dest.set == NULL)
+	    continue;
+	dhtReserve (allrows, dhtNumStrings (allrows) + dhtNumStrings (bq[qq].rowdht));
+	initIterator (bq[qq].rowdht, &iter);
+	while (getNextStr (bq[qq].rowdht, &iter, &str, &len, NULL, NULL)) {
+	    insertStr (allrows, str, len);
+	}
+    }
+    STATS_START (t);
+    for (ii = 0; ii < ds->numFiles; ii++) {
+	getBatchFromFile (bq, nqueries, &ds->files[ii], allrows, ds->buffer, LINEBUFFERSIZE, INTEGER(threads)[0]);
+    }
+    STATS_STOP (PHASE_EXTRACT, t);
+
+    for (qq = 0; qq < nqueries; qq++) {
+	if (bq[qq].dest.set == NULL)
+	    SET_VECTOR_ELT (results, qq, extract_frame (ds, bq[qq].rowdht, bq[qq].coldht, INTEGER(threads)[0]));
+	else
+	    SET_VECTOR_ELT (results, qq, label_matrix (VECTOR_ELT (results, qq), bq[qq].rowdht, bq[qq].coldht, &bq[qq].dest));
+    }
+    batch_finalizer (ptr);
+    setAttrib (results, R_NamesSymbol, getAttrib (queries, R_NamesSymbol));
+    UNPROTECT (5);
+    return results;
+}
+
+SEXP
+tsvGetDataBatch (SEXP dataFile, SEXP indexFile, SEXP queries, SEXP findany, SEXP threads, SEXP cacheFile)
+{
+    SEXP ds, results;
+
+    PROTECT (dataFile = AS_CHARACTER(dataFile));
+    PROTECT (indexFile = AS_CHARACTER(indexFile));
+    if (cacheFile != R_NilValue) cacheFile = AS_CHARACTER(cacheFile);
+    PROTECT (cacheFile);
+
+    stats_begin ("tsvGetDataBatch");
+    PROTECT (ds = open_dataset_SEXP (dataFile, indexFile, cacheFile, asInteger (threads), "tsvGetDataBatch"));
+    PROTECT (results = batch_query_dataset (get_dataset (ds, "tsvGetDataBatch"), queries, findany, threads, "tsvGetDataBatch"));
+    close_dataset_SEXP (ds);
+    stats_end ();
+    UNPROTECT (5);
+    return results;
+}
+
+SEXP
+tsvQueryBatch (SEXP handle, SEXP queries, SEXP findany, SEXP threads)
+{
+    SEXP results;
+
+    stats_begin ("tsvQueryBatch");
+    results = batch_query_dataset (get_dataset (handle, "tsvQueryBatch"), queries, findany, threads, "tsvQueryBatch");
+    stats_end ();
+    return results;
+}
+
+SEXP
+tsvClose (SEXP handle)
+{
+    get_dataset (handle, "tsvClose");
+    close_dataset_SEXP (handle);
+    return R_NilValue;
+}
+
+/* Returns a numeric vector of the n values, named by names. */
+static SEXP
+named_values (const double *values, const char *const *names, int n)
+{
+    SEXP vec, vnames;
+    int ii;
+
+    PROTECT (vec = allocVector (REALSXP, n));
+    PROTECT (vnames = allocVector (STRSXP, n));
+    for (ii = 0; ii < n; ii++) {
+	REAL(vec)[ii] = values[ii];
+	SET_STRING_ELT (vnames, ii, mkChar (names[ii]));
+    }
+    setAttrib (vec, R_NamesSymbol, vnames);
+    UNPROTECT (2);
+    return vec;
+}
+
+/* Turn the collection of query statistics on or off, if enable is TRUE or FALSE, and return the
+ * profile of the most recent query (see stats.h), or NULL if no query has been profiled.
+ */
+SEXP
+tsvStats (SEXP enable)
+{
+    static const char *const phaseNames[NUM_PHASES] = { "open", "index", "header", "select", "extract", "read", "parse", "result" };
+    static const char *const counterNames[NUM_COUNTERS] = { "bytesRead", "bytesMapped", "seeks", "indexLines",
+							     "hashProbes", "hashGrows", "rows", "cells" };
+    static const char *const fieldNames[] = { "query", "enabled", "elapsed", "time", "counts", "cellsPerSecond" };
+    const queryStats *qs;
+    SEXP results, names;
+    int ii;
+
+    if (enable != R_NilValue) {
+	if (length(enable) != 1 || asLogical (enable) == NA_LOGICAL) {
+	    error ("tsvStats: parameter enable must be TRUE or FALSE\n");
+	}
+	stats_enable (asLogical (enable));
+    }
+    qs = stats_last ();
+    if (qs->query == NULL)
+	return R_NilValue;
+
+    PROTECT (results = allocVector (VECSXP, 6));
+    SET_VECTOR_ELT (results, 0, mkString (qs->query));
+    SET_VECTOR_ELT (results, 1, ScalarLogical (statsEnabled));
+    SET_VECTOR_ELT (results, 2, ScalarReal (qs->elapsed));
+    SET_VECTOR_ELT (results, 3, named_values (qs->phase, phaseNames, NUM_PHASES));
+    SET_VECTOR_ELT (results, 4, named_values (qs->counter, counterNames, NUM_COUNTERS));
+    SET_VECTOR_ELT (results, 5, ScalarReal (qs->elapsed > 0 ? qs->counter[STAT_CELLS] / qs->elapsed : 0.0));
+    PROTECT (names = allocVector (STRSXP, 6));
+    for (ii = 0; ii < 6; ii++) {
+	SET_STRING_ELT (names, ii, mkChar (fieldNames[ii]));
+    }
+    setAttrib (results, R_NamesSymbol, names);
+    UNPROTECT (2);
+    return results;
+}
+
+/* An iterator over the rows of a query of an open dataset, which extracts the result in
+ * chunks of at most chunkSize rows, so that only one chunk of the result is in memory at a time.
+ * The iterator's external pointer protects a list of the dataset handle, the row and column
+ * patterns (which own the strings in rowdht and coldht), and dtype.
+ */
+typedef struct {
+    dynHashTab *rowdht;	/* Rows of the query, or NULL if all rows of the dataset. */
+    dynHashTab *coldht;	/* Columns of the query, or NULL if all columns of the dataset. */
+    dynHashTab *chunkdht;/* Rows of the current chunk, or NULL. */
+    const char **labels;/* Labels of the rows of the query, in order. */
+    long *lens;		/* Lengths of the labels. */
+    long numRows;	/* Number of rows of the query. */
+    long nextRow;	/* First row of the next chunk. */
+    long chunkSize;	/* Maximum number of rows in each chunk. */
+    int nthreads;	/* Maximum number of threads used to extract each chunk. */
+} tsvIterator;
+
+#define ITERATOR_HANDLE	0
+#define ITERATOR_DTYPE	3
+
+static void
+iterator_finalizer (SEXP ptr)
+{
+    tsvIterator *it = (tsvIterator *)R_ExternalPtrAddr (ptr);
+
+    if (it != NULL) {
+	if (it->rowdht) freeDynHashTab (it->rowdht);
+	if (it->coldht) freeDynHashTab (it->coldht);
+	if (it->chunkdht) freeDynHashTab (it->chunkdht);
+	free (it->labels);
+	free (it->lens);
+	free (it);
+	R_ClearExternalPtr (ptr);
+    }
+}
+
+SEXP
+tsvIterate (SEXP handle, SEXP rowpatterns, SEXP colpatterns, SEXP dtype, SEXP findany, SEXP chunkSize, SEXP threads)
+{
+    SEXP ptr, prot;
+    tsvDataset *ds;
+    tsvIterator *it;
     dynHashTab *rowdht, *coldht;
-    
-#ifdef DEBUG
-    Rprintf ("> tsvGetData\n");
-#endif
+    const char *str;
+    long iter, len, order;
 
-    /* Convert, if necessary, data into expected format. */
-    PROTECT (dataFile = AS_CHARACTER(dataFile));
-    PROTECT (indexFile = AS_CHARACTER(indexFile));
-    PROTECT (rowpatterns = AS_CHARACTER(rowpatterns));
+    ds = get_dataset (handle, "tsvIterate");
+    PROTECT (rowpatterns = row_patterns (ds, rowpatterns));
     PROTECT (colpatterns = AS_CHARACTER(colpatterns));
     PROTECT (findany = AS_LOGICAL(findany));
-    nprotect += 5;
+    PROTECT (chunkSize = AS_INTEGER(chunkSize));
+    PROTECT (threads = AS_INTEGER(threads));
 
-    setResult = get_result_setter (dtype);
-    if (setResult == NULL) {
+    if (get_result_setter (dtype) == NULL && !is_frame_dtype (dtype)) {
         error ("unable to directly load data matrices of type dtype");
     }
+    if (length(chunkSize) != 1 || INTEGER(chunkSize)[0] == NA_INTEGER || INTEGER(chunkSize)[0] < 1) {
+        error ("parameter chunkSize must be a single positive integer");
+    }
+    if (length(threads) != 1 || INTEGER(threads)[0] == NA_INTEGER) {
+        error ("parameter threads must be a single integer");
+    }
 
-    numFiles = length(dataFile);
-    if (numFiles == 0) {
-        error ("parameter dataFile cannot be NULL\n");
+    PROTECT (prot = allocVector (VECSXP, 4));
+    SET_VECTOR_ELT (prot, ITERATOR_HANDLE, handle);
+    SET_VECTOR_ELT (prot, 1, rowpatterns);
+    SET_VECTOR_ELT (prot, 2, colpatterns);
+    SET_VECTOR_ELT (prot, ITERATOR_DTYPE, dtype);
+
+    it = (tsvIterator *)calloc (1, sizeof(tsvIterator));
+    if (it == NULL) error ("tsvIterate: unable to allocate iterator\n");
+    PROTECT (ptr = R_MakeExternalPtr (it, install ("tsvioIterator"), prot));
+    R_RegisterCFinalizerEx (ptr, iterator_finalizer, TRUE);
+
+    select_labels (ds, rowpatterns, colpatterns, findany, "tsvIterate", &rowdht, &coldht);
+    if (length(rowpatterns) > 0) it->rowdht = rowdht;
+    if (length(colpatterns) > 0) it->coldht = coldht;
+    it->numRows = dhtNumStrings (rowdht);
+    it->chunkSize = INTEGER(chunkSize)[0];
+    it->nthreads = INTEGER(threads)[0];
+    it->labels = (const char **)malloc ((it->numRows + 1) * sizeof(const char *));
+    it->lens = (long *)malloc ((it->numRows + 1) * sizeof(long));
+    if (it->labels == NULL || it->lens == NULL) error ("tsvIterate: unable to allocate iterator\n");
+    initIterator (rowdht, &iter);
+    while (getNextStr (rowdht, &iter, &str, &len, &order, NULL)) {
+	it->labels[order] = str;
+	it->lens[order] = len;
     }
 
-    if (length (dataFile) != length(indexFile)) {
-        error ("parameters dataFile and indexFile must have the same length\n");
+    UNPROTECT (7);
+    return ptr;
+}
+
+SEXP
+tsvNextChunk (SEXP iterator)
+{
+    SEXP prot, results;
+    tsvIterator *it = NULL;
+    tsvDataset *ds;
+    long ii, nrows;
+
+    if (TYPEOF(iterator) == EXTPTRSXP && R_ExternalPtrTag (iterator) == install ("tsvioIterator"))
+	it = (tsvIterator *)R_ExternalPtrAddr (iterator);
+    if (it == NULL)
+        error ("tsvNextChunk: iterator is not a tsvio iterator\n");
+    prot = R_ExternalPtrProtected (iterator);
+
+    /* The labels of an iterator over all rows or columns belong to its dataset. */
+    ds = get_dataset (VECTOR_ELT (prot, ITERATOR_HANDLE), "tsvNextChunk");
+    if (it->nextRow >= it->numRows)
+	return R_NilValue;
+    stats_begin ("tsvNextChunk");
+    check_dataset_unchanged (ds, "tsvNextChunk");
+
+    /* The rows of a chunk are extracted in order of their offsets in each data file,
+     * so iterating over all rows reads each file sequentially.  The chunk's table belongs to
+     * the iterator until the chunk is extracted, so that it is freed if extraction fails.
+     */
+    if (it->chunkdht) freeDynHashTab (it->chunkdht);
+    nrows = it->numRows - it->nextRow < it->chunkSize ? it->numRows - it->nextRow : it->chunkSize;
+    it->chunkdht = newDynHashTab (nrows*2 + 1, 0);
+    for (ii = it->nextRow; ii < it->nextRow + nrows; ii++) {
+	insertStr (it->chunkdht, it->labels[ii], it->lens[ii]);
     }
+    PROTECT (results = extract_matrix (ds, it->chunkdht, it->coldht ? it->coldht : ds->cols,
+				       VECTOR_ELT (prot, ITERATOR_DTYPE), it->nthreads));
+    freeDynHashTab (it->chunkdht);
+    it->chunkdht = NULL;
+    it->nextRow += nrows;
+    stats_end ();
+    UNPROTECT (1);
+    return results;
+}
 
-    buffer = (char *)malloc(LINEBUFFERSIZE);
-    if (buffer == NULL) error ("unable to allocate line buffer\n");
-    tsvpp = (FILE **)malloc(sizeof(FILE *) * numFiles);
-    if (tsvpp == NULL) error ("unable to allocate file handles for %ld tsv files\n", numFiles);
-    for (ii = 0; ii < numFiles; ii++) tsvpp[ii] = NULL;
-    indexpp = (FILE **)malloc(sizeof(FILE *) * numFiles);
-    if (indexpp == NULL) error ("unable to allocate file handles for %ld index files\n", numFiles);
-    for (ii = 0; ii < numFiles; ii++) indexpp[ii] = NULL;
-
-    /* Open all data files. */
-    for (ii = 0; ii < numFiles; ii++) {
-	tsvpp[ii] = fopen (CHAR(STRING_ELT(dataFile,ii)), "rb");
-	if (tsvpp[ii] == NULL) {
-	    free (buffer);
-	    closeTsvFiles (numFiles, tsvpp, indexpp);
-	    error ("unable to open datafile '%s' for reading\n", CHAR(STRING_ELT(dataFile,ii)));
-	}
+SEXP
+tsvBuildNumericCache (SEXP dataFile, SEXP indexFile, SEXP cacheFile, SEXP type, SEXP threads)
+{
+    SEXP ptr;
+    tsvDataset *ds;
+    tsvDataFile *df;
+    resultDest dest;
+    dynHashTab *rowdht;
+    const dynHashTab *coldht;
+    fileStamp stamp;
+    FILE *op;
+    void *values;
+    long ii, jj, nrows, ncols;
+    int elemSize = sizeof(double);
+    enum status res;
+
+    PROTECT (dataFile = AS_CHARACTER(dataFile));
+    PROTECT (indexFile = AS_CHARACTER(indexFile));
+    PROTECT (cacheFile = AS_CHARACTER(cacheFile));
+    PROTECT (type = AS_CHARACTER(type));
+    PROTECT (threads = AS_INTEGER(threads));
+
+    if (length(cacheFile) != length(dataFile)) {
+        error ("parameters dataFile and cacheFile must have the same length");
+    }
+    if (length(type) != 1) {
+        error ("parameter type must be a single string");
+    }
+    if (strcmp (CHAR(STRING_ELT(type,0)), "double") == 0) {
+	elemSize = sizeof(double);
+    } else if (strcmp (CHAR(STRING_ELT(type,0)), "float") == 0) {
+	elemSize = sizeof(float);
+    } else {
+        error ("unknown cache type '%s'", CHAR(STRING_ELT(type,0)));
+    }
+    if (length(threads) != 1 || INTEGER(threads)[0] == NA_INTEGER) {
+        error ("parameter threads must be a single integer");
     }
 
-    /* Open all index files. */
-    for (ii = 0; ii < numFiles; ii++) {
-	indexpp[ii] = fopen (CHAR(STRING_ELT(indexFile,ii)), "rb");
-	if (indexpp[ii] == NULL) {
-	    warning ("unable to read index file '%s': attempting to create\n", CHAR(STRING_ELT(indexFile,ii)));
-	    indexpp[ii] = fopen (CHAR(STRING_ELT(indexFile,ii)), "wb+");
-	    if (indexpp[ii] == NULL) {
-		warning ("unable to create indexfile '%s': try to create a temp file\n", CHAR(STRING_ELT(indexFile,ii)));
-#ifdef _WIN32
-                strcpy_s (tmpname2, sizeof(tmpname2), tmpname);
-		rez = _mktemp_s (tmpname2, sizeof(tmpname2));
-                if (rez == 0) {
-                    _sopen_s (&tmpfd, tmpname2, _O_RDWR | _O_CREAT | _O_TEMPORARY | _O_SHORT_LIVED, _SH_DENYNO, _S_IREAD|_S_IWRITE);
-                } else {
-                    tmpfd = -1;
-                }
-#else
-		tmpfd = mkstemp (tmpname);
-#endif
-		if (tmpfd < 0) {
-		    free (buffer);
-		    closeTsvFiles (numFiles, tsvpp, indexpp);
-		    error ("tsvGetData: unable to create even a temporary indexfile\n");
-		}
-		indexpp[ii] = fdopen (tmpfd, "wb+");
-#ifndef _WIN32
-		unlink (tmpname);
-#endif
-	    }
-	    res = generate_index (tsvpp[ii], indexpp[ii]);
-	    if (is_fatal_error (res)) {
-		free (buffer);
-		closeTsvFiles (numFiles, tsvpp, indexpp);
+    PROTECT (ptr = open_dataset_SEXP (dataFile, indexFile, R_NilValue, INTEGER(threads)[0], "tsvBuildNumericCache"));
+    ds = get_dataset (ptr, "tsvBuildNumericCache");
+
+    for (ii = 0; ii < ds->numFiles; ii++) {
+	df = &ds->files[ii];
+
+	/* Parse every field of every row of this file into a row-major array, initially all NA. */
+	rowdht = newDynHashTab (1024, DHT_STRDUP);
+	if ((res = scan_index_file (df->indexp, rowdht, 1)) != OK) {
+	    freeDynHashTab (rowdht);
+	    error ("i/o or syntax error %d processing indexfile '%s'\n", res, CHAR(STRING_ELT(indexFile,ii)));
+	}
+	if ((coldht = data_file_columns (df)) == NULL) {
+	    freeDynHashTab (rowdht);
+	    error ("unable to allocate memory to read datafile '%s'\n", df->dataName);
+	}
+	nrows = dhtNumStrings (rowdht);
+	ncols = dhtNumStrings (coldht);
+	values = R_alloc ((size_t)nrows * ncols + 1, elemSize);
+	memset (&dest, 0, sizeof(dest));
+	dest.result = NULL;
+	dest.rowstep = ncols;
+	dest.colstep = 1;
+	dest.parallel = 1;
+	if (elemSize == sizeof(double)) {
+	    dest.dvec = (double *)values;
+	    dest.set = set_result_num;
+	    for (jj = 0; jj < nrows * ncols; jj++) dest.dvec[jj] = NA_REAL;
+	} else {
+	    static const uint32_t na = NUMCACHE_FLOAT_NA;
+	    dest.fvec = (float *)values;
+	    dest.set = set_cache_float;
+	    for (jj = 0; jj < nrows * ncols; jj++) memcpy (&dest.fvec[jj], &na, sizeof(float));
+	}
+	if (nrows > 0 && ncols > 0) {
+	    extract_files (&dest, df, 1, rowdht, coldht, ds->buffer, INTEGER(threads)[0]);
+	}
+
+	res = stamp_file (df->tsvp, &stamp);
+	if (res == OK) {
+	    if ((op = fopen (CHAR(STRING_ELT(cacheFile,ii)), "wb")) == NULL) {
+		freeDynHashTab (rowdht);
+		error ("unable to open cachefile '%s' for writing", CHAR(STRING_ELT(cacheFile,ii)));
 	    }
-	    report_genindex_errors (res, "tsvGetData", dataFile, indexFile);
-	    rewind (tsvpp[ii]);
-	    rewind (indexpp[ii]);
+	    res = write_numeric_cache (op, &stamp, rowdht, coldht, elemSize, values);
+	    if (fclose (op) != 0 && res == OK)
+		res = WRITE_ERROR;
+	}
+	freeDynHashTab (rowdht);
+	if (res != OK) {
+	    remove (CHAR(STRING_ELT(cacheFile,ii)));
+	    if (res == WRITE_ERROR)
+		error ("tsvBuildNumericCache: error writing to cachefile '%s'\n", CHAR(STRING_ELT(cacheFile,ii)));
+	    else
+		error ("tsvBuildNumericCache: i/o error %d reading datafile '%s'\n", res, CHAR(STRING_ELT(dataFile,ii)));
 	}
     }
 
-    /* Insert explicitly specified row patterns. */
-    NrowPattern = length(rowpatterns);
-    rowdht = newDynHashTab (1024, NrowPattern == 0 ? DHT_STRDUP : 0);
-#ifdef DEBUG
-    Rprintf ("  tsvGetData: received %d explicitly specified rowpatterns\n", NrowPattern);
-#endif
-    if (NrowPattern > 0) {
-	for (ii = 0; ii < NrowPattern; ii++) {
-	    const char *str = CHAR(STRING_ELT(rowpatterns,ii));
-	    insertStrVal (rowdht, str, strlen (str), -1L);
-	}
+    close_dataset_SEXP (ptr);
+    UNPROTECT (6);
+    return R_NilValue;
+}
+
+SEXP
+tsvBuildTiles (SEXP dataFile, SEXP indexFile, SEXP tileFile, SEXP tileSize, SEXP threads)
+{
+    SEXP ptr;
+    tsvDataset *ds;
+    tsvDataFile *df;
+    resultDest dest;
+    dynHashTab *rowdht, *banddht;
+    const dynHashTab *coldht;
+    const char **labels, *str;
+    long *lens, len, order;
+    fileStamp stamp;
+    tileWriter *tw;
+    FILE *op;
+    double *band;
+    long ii, jj, iter, nrows, ncols, tileRows, tileCols, first, nband;
+    void *vmax;
+    enum status res;
+
+    PROTECT (dataFile = AS_CHARACTER(dataFile));
+    PROTECT (indexFile = AS_CHARACTER(indexFile));
+    PROTECT (tileFile = AS_CHARACTER(tileFile));
+    PROTECT (tileSize = AS_INTEGER(tileSize));
+    PROTECT (threads = AS_INTEGER(threads));
+
+    if (length(tileFile) != length(dataFile)) {
+        error ("parameters dataFile and tileFile must have the same length");
+    }
+    if (length(tileSize) < 1 || length(tileSize) > 2) {
+        error ("parameter tileSize must contain one or two integers");
+    }
+    tileRows = INTEGER(tileSize)[0];
+    tileCols = INTEGER(tileSize)[length(tileSize)-1];
+    if (tileRows == NA_INTEGER || tileCols == NA_INTEGER || tileRows < 1 || tileCols < 1) {
+        error ("parameter tileSize must be positive");
+    }
+    if (length(threads) != 1 || INTEGER(threads)[0] == NA_INTEGER) {
+        error ("parameter threads must be a single integer");
     }
 
-    /* Scan all index files for matching row labels. */
-    for (ii = 0; ii < numFiles; ii++) {
-	res = scan_index_file (indexpp[ii], rowdht, NrowPattern == 0);
-	if (res != OK) {
-	    free (buffer);
-	    closeTsvFiles (numFiles, tsvpp, indexpp);
+    PROTECT (ptr = open_dataset_SEXP (dataFile, indexFile, R_NilValue, INTEGER(threads)[0], "tsvBuildTiles"));
+    ds = get_dataset (ptr, "tsvBuildTiles");
+
+    for (ii = 0; ii < ds->numFiles; ii++) {
+	df = &ds->files[ii];
+
+	/* Rows are stored in file order, which is the order scan_index_file inserts them. */
+	rowdht = newDynHashTab (1024, DHT_STRDUP);
+	if ((res = scan_index_file (df->indexp, rowdht, 1)) != OK) {
 	    freeDynHashTab (rowdht);
-	    error ("i/o or syntax error %d processing indexfile %d\n", res, ii+1);
+	    error ("i/o or syntax error %d processing indexfile '%s'\n", res, CHAR(STRING_ELT(indexFile,ii)));
+	}
+	if ((coldht = data_file_columns (df)) == NULL) {
+	    freeDynHashTab (rowdht);
+	    error ("unable to allocate memory to read datafile '%s'\n", df->dataName);
+	}
+	nrows = dhtNumStrings (rowdht);
+	ncols = dhtNumStrings (coldht);
+	labels = (const char **)R_alloc (nrows + 1, sizeof(const char *));
+	lens = (long *)R_alloc (nrows + 1, sizeof(long));
+	initIterator (rowdht, &iter);
+	while (getNextStr (rowdht, &iter, &str, &len, &order, NULL)) {
+	    labels[order] = str;
+	    lens[order] = len;
 	}
-    }
 
-    NrowResult = countNotValues (rowdht, -1L);
-#ifdef DEBUG
-    Rprintf ("  tsvGetData: found %d row matches\n", NrowResult);
-#endif
-    if (NrowResult == 0) {
-	free (buffer);
-	closeTsvFiles (numFiles, tsvpp, indexpp);
-	freeDynHashTab (rowdht);
-        error ("no matching rows found\n");
-    }
-    if (NrowResult != NrowPattern && NrowPattern > 0 && !LOGICAL(findany)[0]) {
-	free (buffer);
-	closeTsvFiles (numFiles, tsvpp, indexpp);
+	if ((res = stamp_file (df->tsvp, &stamp)) != OK) {
+	    freeDynHashTab (rowdht);
+	    error ("tsvBuildTiles: i/o error %d reading datafile '%s'\n", res, CHAR(STRING_ELT(dataFile,ii)));
+	}
+	if ((op = fopen (CHAR(STRING_ELT(tileFile,ii)), "wb")) == NULL) {
+	    freeDynHashTab (rowdht);
+	    error ("unable to open tilefile '%s' for writing", CHAR(STRING_ELT(tileFile,ii)));
+	}
+	tw = NULL;
+	res = start_tile_file (op, &stamp, rowdht, coldht, tileRows, tileCols, &tw);
+
+	/* Parse one band of tileRows rows at a time, so that only a band is held in memory. */
+	band = (double *)R_alloc ((size_t)tileRows * ncols + 1, sizeof(double));
+	for (first = 0; res == OK && first < nrows; first += nband) {
+	    nband = nrows - first < tileRows ? nrows - first : tileRows;
+	    for (jj = 0; jj < nband * ncols; jj++) band[jj] = NA_REAL;
+	    if (ncols > 0) {
+		vmax = vmaxget ();
+		banddht = newDynHashTab (nband*2 + 1, 0);
+		for (jj = 0; jj < nband; jj++) {
+		    insertStr (banddht, labels[first+jj], lens[first+jj]);
+		}
+		memset (&dest, 0, sizeof(dest));
+		dest.result = NULL;
+		dest.dvec = band;
+		dest.set = set_result_num;
+		dest.rowstep = 1;
+		dest.colstep = nband;
+		dest.parallel = 1;
+		extract_files (&dest, df, 1, banddht, coldht, ds->buffer, INTEGER(threads)[0]);
+		freeDynHashTab (banddht);
+		vmaxset (vmax);
+	    }
+	    res = write_tile_band (tw, band);
+	}
+	if (tw != NULL && finish_tile_file (tw) != OK && res == OK)
+	    res = WRITE_ERROR;
+	if (fclose (op) != 0 && res == OK)
+	    res = WRITE_ERROR;
 	freeDynHashTab (rowdht);
-        error ("not all required row patterns were matched\n");
+	if (res != OK) {
+	    remove (CHAR(STRING_ELT(tileFile,ii)));
+	    error ("tsvBuildTiles: error %d writing tilefile '%s'\n", res, CHAR(STRING_ELT(tileFile,ii)));
+	}
     }
 
-    if (NrowPattern > 0) {
-	/* Create new hashtab containing only found row patterns */
-        dynHashTab *tmpdht = newDynHashTab (NrowResult*2, 0);
-	const char *str;
-	long posn, len;
-	for (ii = 0; ii < NrowPattern; ii++) {
-	    str = CHAR(STRING_ELT(rowpatterns,ii));
+    close_dataset_SEXP (ptr);
+    UNPROTECT (6);
+    return R_NilValue;
+}
+
+/* Position of a wanted row or column in a tile file, and in the result. */
+typedef struct {
+    long pos;
+    long out;
+} tilePos;
+
+static int
+compare_tilePos (const void *a, const void *b)
+{
+    const tilePos *ap = (const tilePos *)a;
+    const tilePos *bp = (const tilePos *)b;
+
+    if (ap->pos < bp->pos) return -1;
+    if (ap->pos > bp->pos) return 1;
+    return 0;
+}
+
+/* Resolve the selection sel of rows (byrow) or columns of tf: all of them if sel is empty, those
+ * with the labels in sel if it is a character vector, else the 1-based positions in sel.  Sets *posp to
+ * the positions and returns their number, or -1L if sel contains an invalid position.
+ * Labels not in tf are skipped.
+ */
+static long
+tile_selection (SEXP sel, const tiledFile *tf, int byrow, long **posp)
+{
+    long num = byrow ? tile_file_num_rows (tf) : tile_file_num_cols (tf);
+    long *pos, ii, nsel, len;
+    const char *str;
+
+    nsel = length(sel) == 0 ? num : length(sel);
+    pos = *posp = (long *)R_alloc (nsel + 1, sizeof(long));
+    if (length(sel) == 0) {
+	for (ii = 0; ii < num; ii++) pos[ii] = ii;
+	return num;
+    }
+    if (TYPEOF(sel) == STRSXP) {
+	nsel = 0;
+	for (ii = 0; ii < length(sel); ii++) {
+	    str = CHAR(STRING_ELT(sel,ii));
 	    len = strlen (str);
-	    posn = getStringValue (rowdht, str, len);
-	    if (posn >= 0) {
-	        insertStrVal (tmpdht, str, len, posn);
-	    }
+	    pos[nsel] = byrow ? tile_file_find_row (tf, str, len) : tile_file_find_col (tf, str, len);
+	    if (pos[nsel] >= 0) nsel++;
 	}
-	free (rowdht);
-	rowdht = tmpdht;
+	return nsel;
+    }
+    for (ii = 0; ii < nsel; ii++) {
+	if (INTEGER(sel)[ii] == NA_INTEGER || INTEGER(sel)[ii] < 1 || INTEGER(sel)[ii] > num)
+	    return -1L;
+	pos[ii] = INTEGER(sel)[ii] - 1;
     }
+    return nsel;
+}
 
-    /* Scan all header lines for matching column labels. */
+/* Sort the n wanted positions in pos by position, and divide them into groups that lie in the
+ * same tile row (or column) of size tileSize.  Sets *sortedp to the sorted positions and *groupp
+ * to the start of each group in them, followed by n, and returns the number of groups.
+ */
+static long
+group_by_tile (const long *pos, long n, long tileSize, tilePos **sortedp, long **groupp)
+{
+    tilePos *sorted;
+    long *group, ii, ngroup;
+
+    sorted = *sortedp = (tilePos *)R_alloc (n + 1, sizeof(tilePos));
+    group = *groupp = (long *)R_alloc (n + 1, sizeof(long));
+    for (ii = 0; ii < n; ii++) {
+	sorted[ii].pos = pos[ii];
+	sorted[ii].out = ii;
+    }
+    qsort (sorted, n, sizeof(tilePos), compare_tilePos);
+    ngroup = 0;
+    for (ii = 0; ii < n; ii++) {
+	if (ii == 0 || sorted[ii].pos / tileSize != sorted[ii-1].pos / tileSize)
+	    group[ngroup++] = ii;
+    }
+    group[ngroup] = n;
+    return ngroup;
+}
 
-    NcolPattern = length(colpatterns);
-#ifdef DEBUG
-    Rprintf ("  tsvGetData: received %d explicitly specified column patterns\n", NcolPattern);
+/* Copy the values of the nrow x ncol window of tf with the given row and column positions into the
+ * column-major matrix result.  Each tile overlapped by the window is decompressed once; tiles are
+ * decompressed concurrently.
+ */
+static enum status
+getDataFromTiles (const tiledFile *tf, const long *rowpos, long nrow, const long *colpos, long ncol,
+		  double *result, int nthreads)
+{
+    tilePos *rows, *cols;
+    long *rowGroup, *colGroup, nrowGroup, ncolGroup, ntask, tt;
+    long tileRows, tileCols, numRows;
+    enum status *res;
+
+    tile_file_tile_size (tf, &tileRows, &tileCols);
+    numRows = tile_file_num_rows (tf);
+    nrowGroup = group_by_tile (rowpos, nrow, tileRows, &rows, &rowGroup);
+    ncolGroup = group_by_tile (colpos, ncol, tileCols, &cols, &colGroup);
+    ntask = nrowGroup * ncolGroup;
+    res = (enum status *)R_alloc (ntask + 1, sizeof(enum status));
+    nthreads = resolve_threads (nthreads);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads) if(ntask > 1)
 #endif
-    coldht = newDynHashTab (1024, NcolPattern == 0 ? DHT_STRDUP : 0);
-    for (ii = 0; ii < NcolPattern; ii++) {
-	const char *str = CHAR(STRING_ELT(colpatterns,ii));
-	insertStrVal (coldht, str, strlen (str), -1L);
+    for (tt = 0; tt < ntask; tt++) {
+	long rg = tt / ncolGroup, cg = tt % ncolGroup;
+	long trow = rows[rowGroup[rg]].pos / tileRows, tcol = cols[colGroup[cg]].pos / tileCols;
+	long tileNrows = numRows - trow * tileRows < tileRows ? numRows - trow * tileRows : tileRows;
+	long ii, jj, base;
+	double *dst, *tile;
+
+	if ((tile = (double *)malloc ((size_t)tileRows * tileCols * sizeof(double))) == NULL) {
+	    res[tt] = OUT_OF_MEMORY;
+	    continue;
+	}
+	if ((res[tt] = read_tile (tf, trow, tcol, tile)) == OK) {
+	    for (jj = colGroup[cg]; jj < colGroup[cg+1]; jj++) {
+		base = (cols[jj].pos - tcol * tileCols) * tileNrows - trow * tileRows;
+		dst = result + cols[jj].out * nrow;
+		for (ii = rowGroup[rg]; ii < rowGroup[rg+1]; ii++) {
+		    dst[rows[ii].out] = tile[base + rows[ii].pos];
+		}
+	    }
+	}
+	free (tile);
     }
-    for (ii = 0; ii < numFiles; ii++) {
-	res = scan_header_line (coldht, tsvpp[ii], NcolPattern == 0, buffer, LINEBUFFERSIZE);
-	if (res != OK) {
-	    free (buffer);
-	    closeTsvFiles (numFiles, tsvpp, indexpp);
-	    freeDynHashTab (rowdht);
-	    freeDynHashTab (coldht);
-	    error ("i/o or syntax error scanning header of datafile %d\n", ii+1);
+
+    for (tt = 0; tt < ntask; tt++) {
+	if (res[tt] != OK) return res[tt];
+    }
+    return OK;
+}
+
+SEXP
+tsvGetTiles (SEXP dataFile, SEXP tileFile, SEXP rows, SEXP cols, SEXP threads)
+{
+    SEXP results, dimnames, names;
+    tiledFile *tf;
+    fileStamp stamp;
+    FILE *fp;
+    long *rowpos, *colpos, nrow, ncol, ii, len;
+    const char *str;
+    enum status res;
+
+    PROTECT (dataFile = AS_CHARACTER(dataFile));
+    PROTECT (tileFile = AS_CHARACTER(tileFile));
+    if (TYPEOF(rows) != STRSXP) rows = AS_INTEGER(rows);
+    PROTECT (rows);
+    if (TYPEOF(cols) != STRSXP) cols = AS_INTEGER(cols);
+    PROTECT (cols);
+    PROTECT (threads = AS_INTEGER(threads));
+
+    if (length(dataFile) != 1 || length(tileFile) != 1) {
+        error ("parameters dataFile and tileFile must be single strings");
+    }
+    if (length(threads) != 1 || INTEGER(threads)[0] == NA_INTEGER) {
+        error ("parameter threads must be a single integer");
+    }
+
+    /* The tile file must still match the data file it was created from. */
+    if ((fp = fopen (CHAR(STRING_ELT(dataFile,0)), "rb")) == NULL) {
+	error ("unable to open datafile '%s' for reading\n", CHAR(STRING_ELT(dataFile,0)));
+    }
+    res = stamp_file (fp, &stamp);
+    fclose (fp);
+    if (res != OK) {
+	error ("tsvGetTiles: i/o error %d reading datafile '%s'\n", res, CHAR(STRING_ELT(dataFile,0)));
+    }
+    if ((fp = fopen (CHAR(STRING_ELT(tileFile,0)), "rb")) == NULL) {
+	error ("unable to open tilefile '%s' for reading\n", CHAR(STRING_ELT(tileFile,0)));
+    }
+    res = open_tile_file (fp, &tf);
+    fclose (fp);
+    if (res != OK) {
+	error ("tsvGetTiles: i/o or format error %d reading tilefile '%s'\n", res, CHAR(STRING_ELT(tileFile,0)));
+    }
+    if (check_tile_file (tf, &stamp) != OK) {
+	close_tile_file (tf);
+	error ("tsvGetTiles: tilefile '%s' does not match datafile '%s': regenerate it using tsvBuildTiles\n",
+	       CHAR(STRING_ELT(tileFile,0)), CHAR(STRING_ELT(dataFile,0)));
+    }
+
+    nrow = tile_selection (rows, tf, 1, &rowpos);
+    ncol = tile_selection (cols, tf, 0, &colpos);
+    if (nrow <= 0 || ncol <= 0) {
+	close_tile_file (tf);
+	if (nrow < 0 || ncol < 0)
+	    error ("tsvGetTiles: row or column position out of range\n");
+	error ("no matching %s found\n", nrow == 0 ? "rows" : "cols");
+    }
+
+    PROTECT (results = allocVector(REALSXP, nrow*ncol));
+    res = getDataFromTiles (tf, rowpos, nrow, colpos, ncol, REAL(results), INTEGER(threads)[0]);
+    if (res != OK) {
+	close_tile_file (tf);
+	error ("tsvGetTiles: error %d reading tilefile '%s'\n", res, CHAR(STRING_ELT(tileFile,0)));
+    }
+
+    /* Add dimensions and row/column names to the results matrix. */
+    PROTECT (results = add_dims (results, nrow, ncol));
+    PROTECT (dimnames = allocVector (VECSXP, 2));
+    SET_VECTOR_ELT (dimnames, 0, names = allocVector (STRSXP, nrow));
+    for (ii = 0; ii < nrow; ii++) {
+	tile_file_row_label (tf, rowpos[ii], &str, &len);
+	SET_STRING_ELT (names, ii, mkCharLen (str, len));
+    }
+    SET_VECTOR_ELT (dimnames, 1, names = allocVector (STRSXP, ncol));
+    for (ii = 0; ii < ncol; ii++) {
+	tile_file_col_label (tf, colpos[ii], &str, &len);
+	SET_STRING_ELT (names, ii, mkCharLen (str, len));
+    }
+    setAttrib (results, R_DimNamesSymbol, dimnames);
+    close_tile_file (tf);
+
+    UNPROTECT (8);
+    return results;
+}
+
+/* Data files read by tsvReadMatrix are divided between threads in chunks of at least this many bytes. */
+#define MIN_MATRIX_CHUNK	(1024*1024)
+
+/* A range of complete lines of a data file read by tsvReadMatrix. */
+typedef struct {
+    size_t start, end;	/* Byte range of chunk. */
+    long firstRow;	/* Row of result of the first line of the chunk. */
+    long nrows;		/* Number of (non-blank) lines in the chunk. */
+    parseProblem prob;
+} matrixChunk;
+
+/* Returns the number of non-blank lines of data that start in the range [start, end). */
+static long
+count_lines (const char *data, size_t start, size_t end)
+{
+    const char *nl;
+    long nrows = 0;
+
+    while (start < end) {
+	if (data[start] != '\n') nrows++;
+	nl = memchr (data + start, '\n', end - start);
+	start = nl == NULL ? end : (size_t)(nl - data) + 1;
+    }
+    return nrows;
+}
+
+/* Parse the lines of chunk into rows chunk->firstRow onwards of dest, and record the offset and
+ * length of the label of each row.  Blank lines are ignored, as when indexing.
+ */
+static void
+parse_matrix_chunk (const resultDest *dest, const char *data, matrixChunk *chunk, long maxInputColumn,
+		    const long *columnMap, size_t *labelStart, long *labelLen)
+{
+    const char *line, *nl;
+    size_t posn = chunk->start;
+    long row = chunk->firstRow;
+    long linelen, indexp;
+
+    init_parse_problem (&chunk->prob);
+    while (posn < chunk->end) {
+	line = data + posn;
+	nl = memchr (line, '\n', chunk->end - posn);
+	linelen = nl != NULL ? (long)(nl - line) + 1 : (long)(chunk->end - posn);
+	posn += linelen;
+	if (line[0] == '\n')
+	    continue;
+
+	/* Record the row label, and advance over it and its terminator. */
+	indexp = 0;
+	while (indexp < linelen && line[indexp] != '\t' && line[indexp] != '\n') {
+	    indexp++;
 	}
+	labelStart[row] = (size_t)(line - data);
+	labelLen[row] = indexp;
+	if (indexp < linelen) indexp++;
+
+	if (parse_tsv_fields (dest, row, line+indexp, linelen-indexp, 0L, maxInputColumn, columnMap,
+			      (long)(line - data), &chunk->prob) != FIELD_OK)
+	    return;
+	row++;
     }
+}
 
-    NcolResult = countNotValues (coldht, -1L);
-#ifdef DEBUG
-    Rprintf ("  tsvGetData: found %d col matches\n", NcolResult);
-#endif
-    if (NcolResult == 0) {
-	free (buffer);
-	closeTsvFiles (numFiles, tsvpp, indexpp);
-	freeDynHashTab (rowdht);
+/* Set every element of the nelem element matrix of dest to NA, so that fields missing from short
+ * rows are NA.  The elements of string matrices are already empty strings.
+ */
+static void
+fill_result_na (const resultDest *dest, long nelem)
+{
+    long ii;
+
+    for (ii = 0; ii < nelem; ii++) {
+	if (dest->set == set_result_int)
+	    dest->ivec[ii] = NA_INTEGER;
+	else if (dest->set == set_result_int64)
+	    dest->lvec[ii] = INT64_MIN;
+	else if (dest->set == set_result_num)
+	    dest->dvec[ii] = NA_REAL;
+    }
+}
+
+SEXP
+tsvReadMatrix (SEXP dataFile, SEXP dtype, SEXP threads)
+{
+    SEXP results, dimnames, rownames;
+    FILE *tsvp;
+    bgzfFile *bgzf = NULL;
+    bgzfContents bc;
+    mappedFile map;
+    const char *data, *str;
+    size_t size, start, *labelStart;
+    dynHashTab *coldht;
+    resultDest dest;
+    matrixChunk *chunks;
+    long nchunks, cc, ii, nrows, ncols, len, order, value;
+    long maxInputColumn, *columnMap, *labelLen;
+    int nthreads, gz;
+    enum status res;
+
+    PROTECT (dataFile = AS_CHARACTER(dataFile));
+    PROTECT (threads = AS_INTEGER(threads));
+
+    if (length(dataFile) != 1) {
+        error ("parameter dataFile must be a single string");
+    }
+    if (get_result_setter (dtype) == NULL) {
+        error ("unable to directly load data matrices of type dtype");
+    }
+    if (length(threads) != 1 || INTEGER(threads)[0] == NA_INTEGER) {
+        error ("parameter threads must be a single integer");
+    }
+
+    if ((tsvp = fopen (CHAR(STRING_ELT(dataFile,0)), "rb")) == NULL) {
+	error ("unable to open datafile '%s' for reading\n", CHAR(STRING_ELT(dataFile,0)));
+    }
+    gz = gzip_format (tsvp);
+    if (gz == GZIP_PLAIN) {
+	fclose (tsvp);
+	error ("tsvReadMatrix: datafile '%s' is not compressed in BGZF format (use bgzip)\n", CHAR(STRING_ELT(dataFile,0)));
+    }
+    if (gz == GZIP_BGZF && bgzf_open (tsvp, &bgzf) != OK) {
+	fclose (tsvp);
+	error ("tsvReadMatrix: unable to allocate memory\n");
+    }
+
+    /* Parse the header line, following the same rules as every other query. */
+    coldht = newDynHashTab (1024, DHT_STRDUP);
+    res = scan_header_line (coldht, tsvp, bgzf, 1, R_alloc (LINEBUFFERSIZE, sizeof(char)), LINEBUFFERSIZE);
+    if (bgzf != NULL) bgzf_close (bgzf);
+    if (res != OK) {
+	fclose (tsvp);
 	freeDynHashTab (coldht);
-        error ("no matching cols found\n");
+	error ("i/o or syntax error scanning header of datafile '%s'\n", CHAR(STRING_ELT(dataFile,0)));
     }
-    if (NcolResult != NcolPattern && NcolPattern > 0 && !LOGICAL(findany)[0]) {
-	free (buffer);
-	closeTsvFiles (numFiles, tsvpp, indexpp);
-	freeDynHashTab (rowdht);
+
+    /* The whole file is read in place: a compressed file is decompressed into memory. */
+    if (gz == GZIP_BGZF) {
+	res = bgzf_decompress_file (tsvp, &bc);
+	data = bc.data;
+	size = bc.size;
+    } else {
+	res = map_file (tsvp, &map);
+	data = map.addr;
+	size = map.size;
+    }
+    if (res != OK) {
+	fclose (tsvp);
 	freeDynHashTab (coldht);
-        error ("not all required col patterns were matched\n");
+	error ("tsvReadMatrix: i/o error %d reading datafile '%s'\n", res, CHAR(STRING_ELT(dataFile,0)));
     }
+    start = align_to_line (data, size, 1);
 
-    if (NcolPattern > 0) {
-	/* Create new hashtab containing only found col patterns */
-        dynHashTab *tmpdht = newDynHashTab (NcolResult*2, 0);
-	const char *str;
-	long posn, len;
-	for (ii = 0; ii < NcolPattern; ii++) {
-	    str = CHAR(STRING_ELT(colpatterns,ii));
-	    len = strlen (str);
-	    posn = getStringValue (coldht, str, len);
-	    if (posn >= 0) {
-	        insertStrVal (tmpdht, str, len, posn);
-	    }
-	}
-	free (coldht);
-	coldht = tmpdht;
+    /* Map each column of the file to the column of the result with the same label. */
+    ncols = dhtNumStrings (coldht);
+    maxInputColumn = -1L;
+    initIterator (coldht, &ii);
+    while (getNextStr (coldht, &ii, &str, &len, &order, &value)) {
+	if (value > maxInputColumn) maxInputColumn = value;
+    }
+    columnMap = (long *)R_alloc (maxInputColumn + 2, sizeof(long));
+    for (ii = 0; ii <= maxInputColumn; ii++) columnMap[ii] = -1L;
+    initIterator (coldht, &ii);
+    while (getNextStr (coldht, &ii, &str, &len, &order, &value)) {
+	columnMap[value] = order;
+    }
+
+    /* Divide the data lines into chunks, and count the rows in each chunk to size the result. */
+    init_result_dest (&dest, R_NilValue, dtype, 0);
+    nthreads = dest.parallel ? resolve_threads (INTEGER(threads)[0]) : 1;
+    nchunks = nthreads > 1 ? 4*nthreads : 1;
+    if ((size_t)nchunks > (size - start) / MIN_MATRIX_CHUNK + 1) nchunks = (size - start) / MIN_MATRIX_CHUNK + 1;
+    chunks = (matrixChunk *)R_alloc (nchunks, sizeof(matrixChunk));
+    for (cc = 0; cc < nchunks; cc++) {
+	chunks[cc].start = align_to_line (data, size, start + (size - start) / nchunks * cc);
+    }
+    for (cc = 0; cc < nchunks; cc++) {
+	chunks[cc].end = cc + 1 < nchunks ? chunks[cc+1].start : size;
+    }
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads) if(nchunks > 1)
+#endif
+    for (cc = 0; cc < nchunks; cc++) {
+	chunks[cc].nrows = count_lines (data, chunks[cc].start, chunks[cc].end);
+    }
+    nrows = 0;
+    for (cc = 0; cc < nchunks; cc++) {
+	chunks[cc].firstRow = nrows;
+	nrows += chunks[cc].nrows;
     }
 
+    /* Allocate the result and parse the chunks into it. */
+    PROTECT (results = allocVector(TYPEOF(dtype), nrows*ncols));
+    init_result_dest (&dest, results, dtype, nrows);
+    fill_result_na (&dest, nrows*ncols);
+    labelStart = (size_t *)R_alloc (nrows + 1, sizeof(size_t));
+    labelLen = (long *)R_alloc (nrows + 1, sizeof(long));
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(nthreads) if(nchunks > 1)
+#endif
+    for (cc = 0; cc < nchunks; cc++) {
+	parse_matrix_chunk (&dest, data, &chunks[cc], maxInputColumn, columnMap, labelStart, labelLen);
+    }
 
-    /* Allocate space for result. */
-    PROTECT (results = allocVector(TYPEOF(dtype), NrowResult*NcolResult)); nprotect++;
-    for (ii = 0; ii < numFiles; ii++) {
-	getDataFromFile (results, setResult, NrowResult,
-	                 indexpp[ii], tsvpp[ii],
-			 rowdht, coldht,
-			 buffer, LINEBUFFERSIZE);
+    /* A chunk stops at its first problem, leaving its later rows without labels, so the first
+     * problem (in file order) is reported before the labels are used.
+     */
+    for (cc = 0; cc < nchunks && chunks[cc].prob.code == FIELD_OK; cc++)
+	;
+    if (cc < nchunks) {
+	if (gz == GZIP_BGZF)
+	    bgzf_free_contents (&bc);
+	else
+	    unmap_file (&map);
+	fclose (tsvp);
+	freeDynHashTab (coldht);
+	for (ii = 0; ii <= cc; ii++) {
+	    report_parse_problem (&chunks[ii].prob);
+	}
     }
 
     /* Add dimensions and row/column names to the results matrix. */
-    PROTECT (results = add_dims (results, NrowResult, NcolResult));
-    nprotect++;
-    PROTECT (dimnames = allocVector (VECSXP, 2)); nprotect++;
-    SET_VECTOR_ELT(dimnames, 0, dhtToStringVec (rowdht));
-    SET_VECTOR_ELT(dimnames, 1, dhtToStringVec (coldht));
+    PROTECT (results = add_dims (results, nrows, ncols));
+    PROTECT (dimnames = allocVector (VECSXP, 2));
+    SET_VECTOR_ELT (dimnames, 0, rownames = allocVector (STRSXP, nrows));
+    for (ii = 0; ii < nrows; ii++) {
+	SET_STRING_ELT (rownames, ii, mkCharLen (data + labelStart[ii], labelLen[ii]));
+    }
+    SET_VECTOR_ELT (dimnames, 1, dhtToStringVec (coldht));
     setAttrib (results, R_DimNamesSymbol, dimnames);
+    if (dest.set == set_result_int64) {
+	setAttrib (results, R_ClassSymbol, mkString ("integer64"));
+    }
 
-#ifdef DEBUG
-    Rprintf ("< tsvGetData\n");
-#endif
-    free (buffer);
-    closeTsvFiles (numFiles, tsvpp, indexpp);
-    freeDynHashTab (rowdht);
+    if (gz == GZIP_BGZF)
+	bgzf_free_contents (&bc);
+    else
+	unmap_file (&map);
+    fclose (tsvp);
     freeDynHashTab (coldht);
-    UNPROTECT (nprotect);
+
+    /* Warn of a line terminated by end of file. */
+    for (cc = 0; cc < nchunks; cc++) {
+	report_parse_problem (&chunks[cc].prob);
+    }
+    UNPROTECT (5);
     return results;
 }
-